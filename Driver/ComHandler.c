@@ -49,7 +49,7 @@ void ComHandler_init(void)
 	/* It's not possible to use a VMExit handler for comms as if we rely on API it will cause blue screens.
 	 * Instead we do this by sending a VMCALL to the HV to EPT hook a specified windows API for us. */
 #pragma warning(disable:4054)
-	VMHook_queueHook((PVOID)NtCreateFile, (PVOID)hookNtCreateFile, (PVOID*)&origNtCreateFile);
+	VMHook_install((PVOID)NtCreateFile, (PVOID)hookNtCreateFile, (PVOID*)&origNtCreateFile);
 }
 
 #define DebugPrint( X, ... )                                                                                           \
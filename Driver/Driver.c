@@ -71,7 +71,7 @@ NTSTATUS DriverEntry(
 		PsCreateSystemThread(&threadHandle, (ACCESS_MASK)0, NULL, (HANDLE)0, NULL, (PKSTART_ROUTINE)KernelThread, NULL);
 	
 		void* stub = 0;
-		VMHook_queueHook((PVOID)Original, (PVOID)Hook, (PVOID*)&stub);
+		VMHook_install((PVOID)Original, (PVOID)Hook, (PVOID*)&stub);
 	
 	}
 
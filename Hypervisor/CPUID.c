@@ -1,4 +1,6 @@
+#include <intrin.h>
 #include "CPUID.h"
+#include "ia32.h"
 
 /******************** External API ********************/
 
@@ -15,56 +17,430 @@ typedef enum
 	CPUID_REGISTER_COUNT /* Used for calculating number of ID registers*/
 } CPUID_REGISTER_INDEX;
 
+/* Action that a policy entry applies to a leaf. */
+typedef enum
+{
+	/* Apply the AND and then OR masks to the real result. */
+	CPUID_POLICY_MASK = 0,
+
+	/* Leaf does not exist on the processor, the result is the OR mask only. */
+	CPUID_POLICY_SYNTHETIC,
+
+	/* Result is dynamic (depends on guest state), never cache it. */
+	CPUID_POLICY_PASSTHROUGH
+} CPUID_POLICY_ACTION;
+
+/* Declarative override of a CPUID (leaf, subleaf) result. */
+typedef struct _CPUID_POLICY
+{
+	UINT32 leaf;
+	UINT32 subleaf;
+	CPUID_POLICY_ACTION action;
+	UINT32 andMask[CPUID_REGISTER_COUNT];
+	UINT32 orMask[CPUID_REGISTER_COUNT];
+} CPUID_POLICY, *PCPUID_POLICY;
+
+/* How the subleaves of a leaf are enumerated when building the cache. */
+typedef enum
+{
+	/* Cache every subleaf up to the maximum. */
+	CPUID_SUBLEAF_END_NONE = 0,
+
+	/* Stop when the cache type field (EAX[4:0]) is null. */
+	CPUID_SUBLEAF_END_CACHE_TYPE,
+
+	/* Stop when the level type field (ECX[15:8]) is invalid. */
+	CPUID_SUBLEAF_END_LEVEL_TYPE,
+
+	/* Subleaf 0 EAX reports the highest valid subleaf. */
+	CPUID_SUBLEAF_END_EAX_COUNT
+} CPUID_SUBLEAF_END;
+
+typedef struct _CPUID_SUBLEAF_RULE
+{
+	UINT32 leaf;
+	UINT32 maxSubleaves;
+	CPUID_SUBLEAF_END endCondition;
+} CPUID_SUBLEAF_RULE, *PCPUID_SUBLEAF_RULE;
+
 /******************** Module Constants ********************/
 
 /* CPUID processor info bits */
 #define CPUID_VI_BIT_VMX_EXTENSION 0x20
 #define CPUID_VI_BIT_HYPERVISOR_PRESENT 0x80000000
 
+/* Matches every subleaf of a leaf in the policy table. */
+#define CPUID_SUBLEAF_ANY 0xFFFFFFFF
+
+/* Leaves that are not named within ia32.h. */
+#define CPUID_RDT_ALLOCATION_INFORMATION 0x00000010
+#define CPUID_SGX_INFORMATION 0x00000012
+#define CPUID_PROCESSOR_TRACE_INFORMATION 0x00000014
+#define CPUID_SOC_VENDOR_INFORMATION 0x00000017
+#define CPUID_TLB_INFORMATION 0x00000018
+#define CPUID_PCONFIG_INFORMATION 0x0000001B
+#define CPUID_TILE_INFORMATION 0x0000001D
+#define CPUID_TMUL_INFORMATION 0x0000001E
+#define CPUID_V2_EXTENDED_TOPOLOGY 0x0000001F
+#define CPUID_HRESET_INFORMATION 0x00000020
+#define CPUID_PERFMON_EXTENDED_INFORMATION 0x00000023
+#define CPUID_AVX10_INFORMATION 0x00000024
+
+/* Leaves whose result depends on the subleaf index in ECX. */
+static const CPUID_SUBLEAF_RULE SUBLEAF_RULES[] =
+{
+	{ CPUID_CACHE_PARAMETERS, 8, CPUID_SUBLEAF_END_CACHE_TYPE },
+	{ CPUID_STRUCTURED_EXTENDED_FEATURE_FLAGS, 4, CPUID_SUBLEAF_END_EAX_COUNT },
+	{ CPUID_EXTENDED_TOPOLOGY, 8, CPUID_SUBLEAF_END_LEVEL_TYPE },
+	{ CPUID_EXTENDED_STATE_INFORMATION, 32, CPUID_SUBLEAF_END_NONE },
+	{ CPUID_INTEL_RESOURCE_DIRECTOR_TECHNOLOGY_MONITORING_INFORMATION, 2, CPUID_SUBLEAF_END_NONE },
+	{ CPUID_RDT_ALLOCATION_INFORMATION, 4, CPUID_SUBLEAF_END_NONE },
+	{ CPUID_SGX_INFORMATION, 4, CPUID_SUBLEAF_END_NONE },
+	{ CPUID_PROCESSOR_TRACE_INFORMATION, 2, CPUID_SUBLEAF_END_EAX_COUNT },
+	{ CPUID_SOC_VENDOR_INFORMATION, 4, CPUID_SUBLEAF_END_EAX_COUNT },
+	{ CPUID_TLB_INFORMATION, 8, CPUID_SUBLEAF_END_EAX_COUNT },
+	{ CPUID_PCONFIG_INFORMATION, 4, CPUID_SUBLEAF_END_NONE },
+	{ CPUID_TILE_INFORMATION, 4, CPUID_SUBLEAF_END_EAX_COUNT },
+	{ CPUID_TMUL_INFORMATION, 2, CPUID_SUBLEAF_END_NONE },
+	{ CPUID_V2_EXTENDED_TOPOLOGY, 8, CPUID_SUBLEAF_END_LEVEL_TYPE },
+	{ CPUID_HRESET_INFORMATION, 2, CPUID_SUBLEAF_END_EAX_COUNT },
+	{ CPUID_PERFMON_EXTENDED_INFORMATION, 8, CPUID_SUBLEAF_END_NONE },
+	{ CPUID_AVX10_INFORMATION, 2, CPUID_SUBLEAF_END_EAX_COUNT },
+};
+
+/* Overrides applied on top of the real processor results. */
+static const CPUID_POLICY POLICY_TABLE[] =
+{
+	/* Replace the vendor string with ours. */
+	//{ CPUID_SIGNATURE, CPUID_SUBLEAF_ANY, CPUID_POLICY_MASK, { ~0U, 0, 0, 0 }, { 0, 'ekaF', '!!!l', 'etnI' } },
+
+	/* Hide the presence of the hypervisor and support for it. */
+	//{ CPUID_VERSION_INFORMATION, CPUID_SUBLEAF_ANY, CPUID_POLICY_MASK, { ~0U, ~0U, ~CPUID_VI_BIT_VMX_EXTENSION, ~0U }, { 0 } },
+	{ CPUID_VERSION_INFORMATION, CPUID_SUBLEAF_ANY, CPUID_POLICY_MASK, { ~0U, ~0U, ~CPUID_VI_BIT_HYPERVISOR_PRESENT, ~0U }, { 0 } },
+
+	/* The XSAVE area sizes reported here follow XCR0 and IA32_XSS, which the guest changes at runtime. */
+	{ CPUID_EXTENDED_STATE_INFORMATION, 0, CPUID_POLICY_PASSTHROUGH, { 0 }, { 0 } },
+	{ CPUID_EXTENDED_STATE_INFORMATION, 1, CPUID_POLICY_PASSTHROUGH, { 0 }, { 0 } },
+
+	/* Hypervisor interface leaf, only discoverable by callers that know to query it
+	 * as the hypervisor present bit is hidden above. EBX:ECX:EDX = "VMIntrospect". */
+	{ CPUID_LEAF_HV_INTERFACE, CPUID_SUBLEAF_ANY, CPUID_POLICY_SYNTHETIC, { 0 }, { CPUID_LEAF_HV_INTERFACE, 'nIMV', 'sort', 'tcep' } },
+};
+
 /******************** Module Variables ********************/
 
 
 /******************** Module Prototypes ********************/
-
+static void cacheLeafRange(PCPUID_CACHE cpuidCache, UINT32 firstLeaf, UINT32 lastLeaf);
+static void cacheLeaf(PCPUID_CACHE cpuidCache, UINT32 leaf);
+static BOOLEAN addEntry(PCPUID_CACHE cpuidCache, UINT32 leaf, UINT32 subleaf, BOOLEAN subleafIndexed, INT32 registers[CPUID_REGISTER_COUNT]);
+static void sortEntries(PCPUID_CACHE cpuidCache);
+static PCPUID_CACHE_ENTRY findEntry(PCPUID_CACHE cpuidCache, UINT32 leaf, UINT32 subleaf);
+static const CPUID_SUBLEAF_RULE* findSubleafRule(UINT32 leaf);
+static BOOLEAN isPassthrough(UINT32 leaf, UINT32 subleaf);
+static void applyPolicy(UINT32 leaf, UINT32 subleaf, INT32 registers[CPUID_REGISTER_COUNT]);
+static void applyGuestCR4(UINT32 leaf, UINT32 subleaf, INT32 registers[CPUID_REGISTER_COUNT]);
 
 /******************** Public Code ********************/
 
-BOOLEAN CPUID_handle(PVMM_DATA lpData)
+void CPUID_initialise(PCPUID_CACHE cpuidCache)
 {
-	UNREFERENCED_PARAMETER(lpData);
+	/* This must be called on the logical processor the cache belongs to, as some leaves
+	 * (such as the APIC ID's in leaf 1 and the topology leaves) are unique per processor.
+	 * All of the work is done here so that CPUID exits do not have to execute CPUID in root. */
+	INT32 cpuInfo[CPUID_REGISTER_COUNT];
+
+	cpuidCache->entryCount = 0;
+
+	/* Cache all of the basic leaves. */
+	__cpuid(cpuInfo, CPUID_SIGNATURE);
+	cacheLeafRange(cpuidCache, CPUID_SIGNATURE, (UINT32)cpuInfo[CPUID_REGISTER_EAX]);
 
-	/* Call CPUID instruction based on the indexes in the logical processors RAX and RCX registers.*/
+	/* Cache all of the extended leaves. */
+	__cpuid(cpuInfo, CPUID_EXTENDED_FUNCTION_INFORMATION);
+	cacheLeafRange(cpuidCache, CPUID_EXTENDED_FUNCTION_INFORMATION, (UINT32)cpuInfo[CPUID_REGISTER_EAX]);
+
+	/* Add the synthetic leaves, these do not exist on the processor. */
+	for (SIZE_T i = 0; i < ARRAYSIZE(POLICY_TABLE); i++)
+	{
+		const CPUID_POLICY* policy = &POLICY_TABLE[i];
+
+		if (CPUID_POLICY_SYNTHETIC == policy->action)
+		{
+			INT32 synthetic[CPUID_REGISTER_COUNT] = { 0 };
+			applyPolicy(policy->leaf, 0, synthetic);
+
+			(void)addEntry(cpuidCache, policy->leaf, 0, (CPUID_SUBLEAF_ANY != policy->subleaf), synthetic);
+		}
+	}
+
+	/* Sort so that lookups can be done with a binary search. */
+	sortEntries(cpuidCache);
+}
+
+BOOLEAN CPUID_handle(PCPUID_CACHE cpuidCache, PCONTEXT guestContext)
+{
+	UINT32 leaf = (UINT32)guestContext->Rax;
+	UINT32 subleaf = (UINT32)guestContext->Rcx;
+
+	INT32 cpuInfo[CPUID_REGISTER_COUNT];
+
+	/* Most leaves are resolved from the cache built at launch. */
+	PCPUID_CACHE_ENTRY cacheEntry = findEntry(cpuidCache, leaf, subleaf);
+	if (NULL != cacheEntry)
+	{
+		cpuInfo[CPUID_REGISTER_EAX] = cacheEntry->registers[CPUID_REGISTER_EAX];
+		cpuInfo[CPUID_REGISTER_EBX] = cacheEntry->registers[CPUID_REGISTER_EBX];
+		cpuInfo[CPUID_REGISTER_ECX] = cacheEntry->registers[CPUID_REGISTER_ECX];
+		cpuInfo[CPUID_REGISTER_EDX] = cacheEntry->registers[CPUID_REGISTER_EDX];
+	}
+	else
+	{
+		/* Dynamic or unknown leaf, call CPUID instruction based on the indexes in the
+		 * logical processors RAX and RCX registers and then apply our overrides. */
+		__cpuidex(cpuInfo, (INT32)leaf, (INT32)subleaf);
+		applyPolicy(leaf, subleaf, cpuInfo);
+	}
+
+	/* Some bits mirror CR4 as it is now, rather than as it was when the cache was built. */
+	applyGuestCR4(leaf, subleaf, cpuInfo);
+
+	/* Copy the modified CPU info into the guests registers. */
+	guestContext->Rax = (UINT32)cpuInfo[CPUID_REGISTER_EAX];
+	guestContext->Rbx = (UINT32)cpuInfo[CPUID_REGISTER_EBX];
+	guestContext->Rcx = (UINT32)cpuInfo[CPUID_REGISTER_ECX];
+	guestContext->Rdx = (UINT32)cpuInfo[CPUID_REGISTER_EDX];
+
+	return TRUE;
+}
+
+/******************** Module Code ********************/
+
+static void cacheLeafRange(PCPUID_CACHE cpuidCache, UINT32 firstLeaf, UINT32 lastLeaf)
+{
+	for (UINT32 leaf = firstLeaf; leaf <= lastLeaf; leaf++)
+	{
+		/* Stop once the cache has been filled, the remaining leaves will be executed directly. */
+		if (cpuidCache->entryCount >= CPUID_CACHE_MAX_ENTRIES)
+		{
+			break;
+		}
+
+		cacheLeaf(cpuidCache, leaf);
+	}
+}
+
+static void cacheLeaf(PCPUID_CACHE cpuidCache, UINT32 leaf)
+{
 	INT32 cpuInfo[CPUID_REGISTER_COUNT];
-	__cpuidex(cpuInfo, (INT32)lpData->guestContext.Rax, (INT32)lpData->guestContext.Rcx);
 
-	/* Override certain conditions. */
-	switch (lpData->guestContext.Rax)
+	const CPUID_SUBLEAF_RULE* rule = findSubleafRule(leaf);
+	if (NULL == rule)
+	{
+		/* The leaf doesn't take a subleaf, a single entry describes it. */
+		if (FALSE == isPassthrough(leaf, 0))
+		{
+			__cpuidex(cpuInfo, (INT32)leaf, 0);
+			applyPolicy(leaf, 0, cpuInfo);
+
+			(void)addEntry(cpuidCache, leaf, 0, FALSE, cpuInfo);
+		}
+	}
+	else
+	{
+		UINT32 subleafCount = rule->maxSubleaves;
+
+		for (UINT32 subleaf = 0; subleaf < subleafCount; subleaf++)
+		{
+			__cpuidex(cpuInfo, (INT32)leaf, (INT32)subleaf);
+
+			/* Check to see if we have gone past the last valid subleaf. */
+			if ((CPUID_SUBLEAF_END_CACHE_TYPE == rule->endCondition) &&
+				(0 == (cpuInfo[CPUID_REGISTER_EAX] & 0x1F)))
+			{
+				break;
+			}
+
+			if ((CPUID_SUBLEAF_END_LEVEL_TYPE == rule->endCondition) &&
+				(0 == ((cpuInfo[CPUID_REGISTER_ECX] >> 8) & 0xFF)))
+			{
+				break;
+			}
+
+			if ((CPUID_SUBLEAF_END_EAX_COUNT == rule->endCondition) && (0 == subleaf) &&
+				((UINT32)cpuInfo[CPUID_REGISTER_EAX] + 1 < subleafCount))
+			{
+				subleafCount = (UINT32)cpuInfo[CPUID_REGISTER_EAX] + 1;
+			}
+
+			if (FALSE == isPassthrough(leaf, subleaf))
+			{
+				applyPolicy(leaf, subleaf, cpuInfo);
+
+				if (FALSE == addEntry(cpuidCache, leaf, subleaf, TRUE, cpuInfo))
+				{
+					break;
+				}
+			}
+		}
+	}
+}
+
+static BOOLEAN addEntry(PCPUID_CACHE cpuidCache, UINT32 leaf, UINT32 subleaf, BOOLEAN subleafIndexed, INT32 registers[CPUID_REGISTER_COUNT])
+{
+	BOOLEAN result = FALSE;
+
+	if (cpuidCache->entryCount < CPUID_CACHE_MAX_ENTRIES)
 	{
-		case CPUID_SIGNATURE:
+		PCPUID_CACHE_ENTRY newEntry = &cpuidCache->entries[cpuidCache->entryCount];
+
+		newEntry->leaf = leaf;
+		newEntry->subleaf = subleaf;
+		newEntry->subleafIndexed = subleafIndexed;
+		RtlCopyMemory(newEntry->registers, registers, sizeof(newEntry->registers));
+
+		cpuidCache->entryCount++;
+		result = TRUE;
+	}
+
+	return result;
+}
+
+static void sortEntries(PCPUID_CACHE cpuidCache)
+{
+	/* Insertion sort, the table is small and almost entirely in order already. */
+	for (UINT32 i = 1; i < cpuidCache->entryCount; i++)
+	{
+		CPUID_CACHE_ENTRY current = cpuidCache->entries[i];
+		UINT32 j = i;
+
+		while ((j > 0) &&
+			((cpuidCache->entries[j - 1].leaf > current.leaf) ||
+			((cpuidCache->entries[j - 1].leaf == current.leaf) && (cpuidCache->entries[j - 1].subleaf > current.subleaf))))
 		{
-			/* Replace the vendor string with ours. */
-			//cpuInfo[CPUID_REGISTER_EBX] = 'ekaF';
-			//cpuInfo[CPUID_REGISTER_EDX] = 'etnI';
-			//cpuInfo[CPUID_REGISTER_ECX] = '!!!l';
+			cpuidCache->entries[j] = cpuidCache->entries[j - 1];
+			j--;
+		}
+
+		cpuidCache->entries[j] = current;
+	}
+}
+
+static PCPUID_CACHE_ENTRY findEntry(PCPUID_CACHE cpuidCache, UINT32 leaf, UINT32 subleaf)
+{
+	PCPUID_CACHE_ENTRY result = NULL;
+
+	/* Binary search for the first entry of the leaf. */
+	UINT32 low = 0;
+	UINT32 high = cpuidCache->entryCount;
+
+	while (low < high)
+	{
+		UINT32 middle = low + ((high - low) / 2);
+
+		if (cpuidCache->entries[middle].leaf < leaf)
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+
+	/* Walk the subleaves of the leaf (if any) to find the match. */
+	for (UINT32 i = low; (i < cpuidCache->entryCount) && (cpuidCache->entries[i].leaf == leaf); i++)
+	{
+		PCPUID_CACHE_ENTRY currentEntry = &cpuidCache->entries[i];
+
+		if ((FALSE == currentEntry->subleafIndexed) || (currentEntry->subleaf == subleaf))
+		{
+			result = currentEntry;
 			break;
 		}
+	}
 
-		case CPUID_VERSION_INFORMATION:
+	return result;
+}
+
+static const CPUID_SUBLEAF_RULE* findSubleafRule(UINT32 leaf)
+{
+	const CPUID_SUBLEAF_RULE* result = NULL;
+
+	for (SIZE_T i = 0; i < ARRAYSIZE(SUBLEAF_RULES); i++)
+	{
+		if (SUBLEAF_RULES[i].leaf == leaf)
 		{
-			/* Hide the presence of the hypervisor and support for it. */
-			//cpuInfo[CPUID_REGISTER_ECX] = (cpuInfo[CPUID_REGISTER_ECX] & ~CPUID_VI_BIT_VMX_EXTENSION);
-			cpuInfo[CPUID_REGISTER_ECX] = (cpuInfo[CPUID_REGISTER_ECX] & ~CPUID_VI_BIT_HYPERVISOR_PRESENT);
+			result = &SUBLEAF_RULES[i];
 			break;
 		}
 	}
 
-	/* Copy the modified CPU info into the guests registers. */
-	lpData->guestContext.Rax = cpuInfo[CPUID_REGISTER_EAX];
-	lpData->guestContext.Rbx = cpuInfo[CPUID_REGISTER_EBX];
-	lpData->guestContext.Rcx = cpuInfo[CPUID_REGISTER_ECX];
-	lpData->guestContext.Rdx = cpuInfo[CPUID_REGISTER_EDX];
+	return result;
+}
 
-	return TRUE;
+static BOOLEAN isPassthrough(UINT32 leaf, UINT32 subleaf)
+{
+	BOOLEAN result = FALSE;
+
+	for (SIZE_T i = 0; i < ARRAYSIZE(POLICY_TABLE); i++)
+	{
+		const CPUID_POLICY* policy = &POLICY_TABLE[i];
+
+		if ((CPUID_POLICY_PASSTHROUGH == policy->action) && (policy->leaf == leaf) &&
+			((CPUID_SUBLEAF_ANY == policy->subleaf) || (policy->subleaf == subleaf)))
+		{
+			result = TRUE;
+			break;
+		}
+	}
+
+	return result;
+}
+
+static void applyPolicy(UINT32 leaf, UINT32 subleaf, INT32 registers[CPUID_REGISTER_COUNT])
+{
+	for (SIZE_T i = 0; i < ARRAYSIZE(POLICY_TABLE); i++)
+	{
+		const CPUID_POLICY* policy = &POLICY_TABLE[i];
+
+		if ((policy->leaf == leaf) && ((CPUID_SUBLEAF_ANY == policy->subleaf) || (policy->subleaf == subleaf)))
+		{
+			if (CPUID_POLICY_PASSTHROUGH != policy->action)
+			{
+				for (UINT32 j = 0; j < CPUID_REGISTER_COUNT; j++)
+				{
+					registers[j] = (INT32)(((UINT32)registers[j] & policy->andMask[j]) | policy->orMask[j]);
+				}
+			}
+		}
+	}
 }
 
-/******************** Module Code ********************/
\ No newline at end of file
+static void applyGuestCR4(UINT32 leaf, UINT32 subleaf, INT32 registers[CPUID_REGISTER_COUNT])
+{
+	/* OSXSAVE and OSPKE report CR4.OSXSAVE and CR4.PKE, which the guest can change at any time.
+	 * Both the cache and CPUID executed in root would otherwise report the wrong CR4. */
+	if ((CPUID_VERSION_INFORMATION == leaf) || ((CPUID_STRUCTURED_EXTENDED_FEATURE_FLAGS == leaf) && (0 == subleaf)))
+	{
+		size_t guestCR4 = 0;
+		__vmx_vmread(VMCS_GUEST_CR4, &guestCR4);
+
+		if (CPUID_VERSION_INFORMATION == leaf)
+		{
+			registers[CPUID_REGISTER_ECX] &= ~CPUID_FEATURE_INFORMATION_ECX_OSX_SAVE_FLAG;
+			if (0 != (guestCR4 & CR4_OS_XSAVE_FLAG))
+			{
+				registers[CPUID_REGISTER_ECX] |= CPUID_FEATURE_INFORMATION_ECX_OSX_SAVE_FLAG;
+			}
+		}
+		else
+		{
+			registers[CPUID_REGISTER_ECX] &= ~CPUID_ECX_OSPKE_FLAG;
+			if (0 != (guestCR4 & CR4_PROTECTION_KEY_ENABLE_FLAG))
+			{
+				registers[CPUID_REGISTER_ECX] |= CPUID_ECX_OSPKE_FLAG;
+			}
+		}
+	}
+}
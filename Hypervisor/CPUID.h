@@ -1,15 +1,41 @@
 #pragma once
 #include <ntifs.h>
-#include "VMM.h"
 
 /******************** Public Defines ********************/
 
+/* Maximum number of (leaf, subleaf) results that can be cached per logical processor. */
+#define CPUID_CACHE_MAX_ENTRIES 256
+
+/* Leaf that is used for exposing the hypervisor interface. */
+#define CPUID_LEAF_HV_INTERFACE 0x40000000
+
 /******************** Public Typedefs ********************/
 
+/* A single cached result of the CPUID instruction. */
+typedef struct _CPUID_CACHE_ENTRY
+{
+	UINT32 leaf;
+	UINT32 subleaf;
+
+	/* Whether the leaf result depends on the subleaf (ECX) index. */
+	BOOLEAN subleafIndexed;
+
+	/* Registers returned for this leaf, EAX, EBX, ECX, EDX. */
+	INT32 registers[4];
+} CPUID_CACHE_ENTRY, *PCPUID_CACHE_ENTRY;
+
+/* Per logical processor cache of CPUID results, sorted by (leaf, subleaf). */
+typedef struct _CPUID_CACHE
+{
+	UINT32 entryCount;
+	CPUID_CACHE_ENTRY entries[CPUID_CACHE_MAX_ENTRIES];
+} CPUID_CACHE, *PCPUID_CACHE;
+
 /******************** Public Constants ********************/
 
 /******************** Public Variables ********************/
 
 /******************** Public Prototypes ********************/
 
-BOOLEAN CPUID_handle(PVMM_DATA lpData);
+void CPUID_initialise(PCPUID_CACHE cpuidCache);
+BOOLEAN CPUID_handle(PCPUID_CACHE cpuidCache, PCONTEXT guestContext);
\ No newline at end of file
@@ -0,0 +1,511 @@
+#include <ntifs.h>
+#include <intrin.h>
+#include "CommandRing.h"
+#include "VMCALL.h"
+#include "MemManage.h"
+#include "GuestShim.h"
+#include "Scheduler.h"
+#include "Debug.h"
+
+/******************** External API ********************/
+
+
+/******************** Module Typedefs ********************/
+
+/* Snapshot of the ring indexes, read from the shared header. */
+typedef struct _RING_INDEXES
+{
+	ULONG commandHead;
+	ULONG commandTail;
+	ULONG completionHead;
+	ULONG completionTail;
+} RING_INDEXES, *PRING_INDEXES;
+
+/* A ring that has been registered by the guest. The physical pages are resolved once
+ * at registration, so draining never has to walk the guest page tables. */
+typedef struct _REGISTERED_RING
+{
+	/* Set whilst the slot holds a registered ring. */
+	volatile LONG inUse;
+
+	/* Set whilst a processor is draining the ring (or has a continuation scheduled),
+	 * this makes the hypervisor the single consumer of the command ring. */
+	volatile LONG drainLock;
+
+	/* Set once the owner is exiting, the ring is no longer drained from then on. */
+	volatile LONG closing;
+
+	/* Address space of the process that registered the ring, used for the commands. Only
+	 * that process can ring its doorbell or unregister it. */
+	CR3 ownerCR3;
+	GUEST_VIRTUAL_ADDRESS ringVA;
+
+	HOST_PHYS_ADDRESS pages[COMMAND_RING_PAGES];
+} REGISTERED_RING, *PREGISTERED_RING;
+
+/******************** Module Constants ********************/
+
+/* Maximum number of commands executed within a single exit, anything left over
+ * is picked up by a continuation on the scheduler so the guest isn't starved. */
+#define DRAIN_BUDGET_COMMANDS 64
+
+/* Number of commands (and completions) transferred with each access of the ring. */
+#define DRAIN_CHUNK_ENTRIES 16
+
+/* Delay before a continuation of a drain that ran out of budget or completion space. */
+#define DRAIN_CONTINUATION_CYCLES 20000
+
+/* Address bits of CR3, the PCID (or the cache control bits) are ignored. */
+#define RING_CR3_MASK (~(UINT64)0xFFF)
+
+/* How often an exiting owner checks whether its rings have stopped being drained. */
+#define RING_CLOSE_INTERVAL_MS 1
+
+C_ASSERT((COMMAND_RING_ENTRIES & COMMAND_RING_MASK) == 0);
+C_ASSERT((COMMAND_RING_ENTRIES % DRAIN_CHUNK_ENTRIES) == 0);
+
+/******************** Module Variables ********************/
+
+/* Registered rings, these are shared between all logical processors
+ * as a doorbell can be rung on any of them. */
+static REGISTERED_RING registeredRings[COMMAND_RING_MAX_REGISTERED] = { 0 };
+
+/* Set once the process exit notification has been registered. */
+static BOOLEAN notifyRegistered = FALSE;
+
+/******************** Module Prototypes ********************/
+static void onProcessNotify(PEPROCESS process, HANDLE processId, PPS_CREATE_NOTIFY_INFO createInfo);
+static NTSTATUS removeRing(UINT32 ringId);
+static BOOLEAN isOwner(UINT32 ringId, CR3 cr3);
+static void drainRing(PVMM_DATA lpData, UINT32 ringId);
+static BOOLEAN drainCommands(PVMM_DATA lpData, UINT32 ringId);
+static void continueDrain(PSCHEDULER_CONFIG schedulerConfig, PVOID userParameter);
+static NTSTATUS copyRing(PMM_CONTEXT mmContext, UINT32 ringId, SIZE_T offset, PVOID buffer, SIZE_T size, BOOLEAN write);
+static BOOLEAN readIndexes(PMM_CONTEXT mmContext, UINT32 ringId, PRING_INDEXES indexes);
+static BOOLEAN publishIndexes(PMM_CONTEXT mmContext, UINT32 ringId, ULONG commandTail, ULONG completionHead);
+static BOOLEAN setConsumerIdle(PMM_CONTEXT mmContext, UINT32 ringId, LONG exchange, LONG comparand, PLONG previous);
+
+/******************** Public Code ********************/
+
+NTSTATUS CommandRing_init(void)
+{
+	/* Called at PASSIVE_LEVEL before any ring can be registered. Rings live in the pages of the
+	 * process that registered them, so they are torn down as the process exits, before those
+	 * pages are freed and reused. */
+	NTSTATUS status = PsSetCreateProcessNotifyRoutineEx(onProcessNotify, FALSE);
+
+	if (NT_SUCCESS(status))
+	{
+		notifyRegistered = TRUE;
+	}
+	else
+	{
+		DEBUG_ERROR("[CommandRing_init] Unable to register the process notification: 0x%X\n", status);
+	}
+
+	return status;
+}
+
+void CommandRing_uninit(void)
+{
+	/* Called at PASSIVE_LEVEL when the hypervisor fails to start, so nothing can have registered a ring. */
+	if (TRUE == notifyRegistered)
+	{
+		PsSetCreateProcessNotifyRoutineEx(onProcessNotify, TRUE);
+		notifyRegistered = FALSE;
+	}
+}
+
+NTSTATUS CommandRing_register(PVMM_DATA lpData, CR3 guestCR3, GUEST_VIRTUAL_ADDRESS ringVA, SIZE_T ringSize, PUINT32 ringId)
+{
+	NTSTATUS status;
+
+	/* The ring must be page aligned, so that the header sits at the start of the
+	 * first page and interlocked operations on it never span two pages. */
+	if ((0 != ringVA) && (0 == (ringVA & (PAGE_SIZE - 1))) && (ringSize >= sizeof(COMMAND_RING)))
+	{
+		HOST_PHYS_ADDRESS pages[COMMAND_RING_PAGES];
+
+		status = STATUS_SUCCESS;
+
+		/* Resolve every page of the ring now, the caller must keep it locked in memory
+		 * until it has been unregistered. */
+		for (SIZE_T i = 0; (i < COMMAND_RING_PAGES) && (NT_SUCCESS(status)); i++)
+		{
+			pages[i] = GuestShim_GuestUVAToHPA(&lpData->mmContext, guestCR3, ringVA + (i * PAGE_SIZE));
+			if (0 == pages[i])
+			{
+				status = STATUS_INVALID_ADDRESS;
+			}
+		}
+
+		/* Each ring of a process can only be registered once. */
+		for (UINT32 i = 0; (i < COMMAND_RING_MAX_REGISTERED) && (NT_SUCCESS(status)); i++)
+		{
+			if ((0 != registeredRings[i].inUse) && (TRUE == isOwner(i, guestCR3)) && (ringVA == registeredRings[i].ringVA))
+			{
+				status = STATUS_ALREADY_REGISTERED;
+			}
+		}
+
+		if (NT_SUCCESS(status))
+		{
+			status = STATUS_INSUFFICIENT_RESOURCES;
+
+			for (UINT32 i = 0; i < COMMAND_RING_MAX_REGISTERED; i++)
+			{
+				/* Claim the slot, holding the drain lock until it has been filled in
+				 * so a doorbell can't see a half registered ring. */
+				if (0 == InterlockedCompareExchange(&registeredRings[i].inUse, 1, 0))
+				{
+					InterlockedExchange(&registeredRings[i].drainLock, 1);
+
+					RtlCopyMemory(registeredRings[i].pages, pages, sizeof(pages));
+					registeredRings[i].ownerCR3.Flags = guestCR3.Flags;
+					registeredRings[i].ringVA = ringVA;
+					InterlockedExchange(&registeredRings[i].closing, 0);
+
+					InterlockedExchange(&registeredRings[i].drainLock, 0);
+
+					*ringId = i;
+					status = STATUS_SUCCESS;
+					break;
+				}
+			}
+		}
+	}
+	else
+	{
+		status = STATUS_INVALID_PARAMETER;
+	}
+
+	return status;
+}
+
+NTSTATUS CommandRing_unregister(CR3 guestCR3, UINT32 ringId)
+{
+	NTSTATUS status;
+
+	if ((ringId < COMMAND_RING_MAX_REGISTERED) && (0 != registeredRings[ringId].inUse) && (TRUE == isOwner(ringId, guestCR3)))
+	{
+		status = removeRing(ringId);
+	}
+	else
+	{
+		status = STATUS_INVALID_PARAMETER;
+	}
+
+	return status;
+}
+
+NTSTATUS CommandRing_doorbell(PVMM_DATA lpData, CR3 guestCR3, UINT32 ringId)
+{
+	NTSTATUS status;
+
+	if ((ringId < COMMAND_RING_MAX_REGISTERED) && (0 != registeredRings[ringId].inUse) && (TRUE == isOwner(ringId, guestCR3)))
+	{
+		/* If another processor is already draining the ring, it will see
+		 * the new commands before it goes idle. */
+		if (0 == InterlockedCompareExchange(&registeredRings[ringId].drainLock, 1, 0))
+		{
+			drainRing(lpData, ringId);
+		}
+
+		status = STATUS_SUCCESS;
+	}
+	else
+	{
+		status = STATUS_INVALID_PARAMETER;
+	}
+
+	return status;
+}
+
+/******************** Module Code ********************/
+
+static void onProcessNotify(PEPROCESS process, HANDLE processId, PPS_CREATE_NOTIFY_INFO createInfo)
+{
+	/* Called at PASSIVE_LEVEL as a process is created or exits, only exits are of interest.
+	 * The address space of the process is still intact, so a drain in progress can finish. */
+	UNREFERENCED_PARAMETER(processId);
+
+	if (NULL == createInfo)
+	{
+		KAPC_STATE apcState;
+		CR3 kernelCR3;
+		CR3 userCR3 = MemManage_getPageTableBase(process);
+
+		/* The ring may have been registered from either mode, which differ under KVA shadowing. */
+		KeStackAttachProcess(process, &apcState);
+		kernelCR3.Flags = __readcr3();
+		KeUnstackDetachProcess(&apcState);
+
+		LARGE_INTEGER closeInterval;
+		closeInterval.QuadPart = -10000LL * RING_CLOSE_INTERVAL_MS;
+
+		for (UINT32 i = 0; i < COMMAND_RING_MAX_REGISTERED; i++)
+		{
+			if ((0 != registeredRings[i].inUse) && ((TRUE == isOwner(i, userCR3)) || (TRUE == isOwner(i, kernelCR3))))
+			{
+				/* Stops any continuation being scheduled, so the drain lock is released promptly. */
+				InterlockedExchange(&registeredRings[i].closing, 1);
+
+				while (STATUS_DEVICE_BUSY == removeRing(i))
+				{
+					KeDelayExecutionThread(KernelMode, FALSE, &closeInterval);
+				}
+			}
+		}
+	}
+}
+
+static NTSTATUS removeRing(UINT32 ringId)
+{
+	NTSTATUS status;
+
+	/* The ring can't be removed whilst it is being drained, or whilst a continuation
+	 * is scheduled, the guest has to wait for its outstanding commands to complete. */
+	if (0 == InterlockedCompareExchange(&registeredRings[ringId].drainLock, 1, 0))
+	{
+		RtlZeroMemory(registeredRings[ringId].pages, sizeof(registeredRings[ringId].pages));
+		registeredRings[ringId].ownerCR3.Flags = 0;
+		registeredRings[ringId].ringVA = 0;
+
+		InterlockedExchange(&registeredRings[ringId].inUse, 0);
+		InterlockedExchange(&registeredRings[ringId].drainLock, 0);
+
+		status = STATUS_SUCCESS;
+	}
+	else
+	{
+		status = STATUS_DEVICE_BUSY;
+	}
+
+	return status;
+}
+
+static BOOLEAN isOwner(UINT32 ringId, CR3 cr3)
+{
+	return ((registeredRings[ringId].ownerCR3.Flags & RING_CR3_MASK) == (cr3.Flags & RING_CR3_MASK));
+}
+
+static void drainRing(PVMM_DATA lpData, UINT32 ringId)
+{
+	/* Called with the drain lock held. The commands were posted from the address space
+	 * of the owner, so share the page walks of their parameters between all of them. */
+	MemManage_enableTranslationCache(&lpData->mmContext, registeredRings[ringId].ownerCR3);
+
+	BOOLEAN draining = TRUE;
+	while (TRUE == draining)
+	{
+		draining = FALSE;
+
+		BOOLEAN recheck = (0 == registeredRings[ringId].closing);
+		if ((FALSE == drainCommands(lpData, ringId)) && (TRUE == recheck))
+		{
+			/* Ran out of budget, or the guest hasn't consumed the completions yet.
+			 * Keep hold of the drain lock and carry on from a later exit. */
+			PSCHEDULER_TIMER timer;
+			NTSTATUS status = Scheduler_addTimer(&lpData->schedulerConfig, DRAIN_CONTINUATION_CYCLES, FALSE,
+												 continueDrain, (PVOID)(ULONG_PTR)ringId, &timer);
+			if (NT_SUCCESS(status))
+			{
+				break;
+			}
+
+			/* Without a continuation, leave the rest until the guest next rings the doorbell,
+			 * going straight back to the ring would never give the guest a chance to run. */
+			DEBUG_PRINT("Unable to schedule command ring continuation. Status: 0x%08X\r\n", status);
+			recheck = FALSE;
+		}
+
+		/* Going idle, release the drain lock before setting the idle flag so that
+		 * whoever clears the flag next is always able to take the lock. */
+		InterlockedExchange(&registeredRings[ringId].drainLock, 0);
+
+		LONG previous;
+		if (TRUE == setConsumerIdle(&lpData->mmContext, ringId, 1, 0, &previous))
+		{
+			/* The guest may have posted a command after the last check, but before it
+			 * could see the idle flag, in which case it won't ring the doorbell. */
+			RING_INDEXES indexes;
+			if ((TRUE == recheck) && (TRUE == readIndexes(&lpData->mmContext, ringId, &indexes)) &&
+				(indexes.commandHead != indexes.commandTail))
+			{
+				/* Only carry on if the guest hasn't already taken responsibility. */
+				if ((TRUE == setConsumerIdle(&lpData->mmContext, ringId, 0, 1, &previous)) && (1 == previous) &&
+					(0 == InterlockedCompareExchange(&registeredRings[ringId].drainLock, 1, 0)))
+				{
+					draining = TRUE;
+				}
+			}
+		}
+	}
+
+	MemManage_disableTranslationCache(&lpData->mmContext);
+}
+
+static BOOLEAN drainCommands(PVMM_DATA lpData, UINT32 ringId)
+{
+	BOOLEAN result = TRUE;
+
+	COMMAND_RING_ENTRY commands[DRAIN_CHUNK_ENTRIES];
+	COMPLETION_RING_ENTRY completions[DRAIN_CHUNK_ENTRIES];
+
+	CR3 ownerCR3 = registeredRings[ringId].ownerCR3;
+	SIZE_T executedCount = 0;
+
+	/* An exiting owner is waiting for the drain to finish, so stop at the next chunk. */
+	RING_INDEXES indexes;
+	while ((0 == registeredRings[ringId].closing) && (TRUE == readIndexes(&lpData->mmContext, ringId, &indexes)))
+	{
+		ULONG available = indexes.commandHead - indexes.commandTail;
+		ULONG space = COMMAND_RING_ENTRIES - (indexes.completionHead - indexes.completionTail);
+
+		/* A corrupt header is treated as an empty ring. */
+		if ((0 == available) || (available > COMMAND_RING_ENTRIES) || (space > COMMAND_RING_ENTRIES))
+		{
+			break;
+		}
+
+		if ((0 == space) || (executedCount >= DRAIN_BUDGET_COMMANDS))
+		{
+			result = FALSE;
+			break;
+		}
+
+		/* Work out how many commands to take, the chunk size divides the ring
+		 * so a chunk never wraps for either ring as both indexes move together. */
+		ULONG chunkCount = min(available, space);
+		chunkCount = min(chunkCount, DRAIN_CHUNK_ENTRIES - (indexes.commandTail % DRAIN_CHUNK_ENTRIES));
+		chunkCount = min(chunkCount, DRAIN_CHUNK_ENTRIES - (indexes.completionHead % DRAIN_CHUNK_ENTRIES));
+
+		NTSTATUS status = copyRing(&lpData->mmContext, ringId,
+								   FIELD_OFFSET(COMMAND_RING, commands[indexes.commandTail & COMMAND_RING_MASK]),
+								   commands, chunkCount * sizeof(COMMAND_RING_ENTRY), FALSE);
+		if (!NT_SUCCESS(status))
+		{
+			break;
+		}
+
+		for (ULONG i = 0; i < chunkCount; i++)
+		{
+			completions[i].tag = commands[i].tag;
+			completions[i].status = VMCALL_dispatchCommand(lpData, ownerCR3, &commands[i].command);
+			completions[i].reserved = 0;
+		}
+
+		status = copyRing(&lpData->mmContext, ringId,
+						  FIELD_OFFSET(COMMAND_RING, completions[indexes.completionHead & COMMAND_RING_MASK]),
+						  completions, chunkCount * sizeof(COMPLETION_RING_ENTRY), TRUE);
+		if (!NT_SUCCESS(status))
+		{
+			break;
+		}
+
+		/* Hand the command slots back and publish the completions. */
+		if (FALSE == publishIndexes(&lpData->mmContext, ringId, indexes.commandTail + chunkCount, indexes.completionHead + chunkCount))
+		{
+			break;
+		}
+
+		executedCount += chunkCount;
+	}
+
+	return result;
+}
+
+static void continueDrain(PSCHEDULER_CONFIG schedulerConfig, PVOID userParameter)
+{
+	/* Timers are owned by the processor that scheduled them, so this is its VMM data. */
+	PVMM_DATA lpData = CONTAINING_RECORD(schedulerConfig, VMM_DATA, schedulerConfig);
+	UINT32 ringId = (UINT32)(ULONG_PTR)userParameter;
+
+	/* The drain lock is still held from the drain that scheduled this continuation. */
+	drainRing(lpData, ringId);
+}
+
+static NTSTATUS copyRing(PMM_CONTEXT mmContext, UINT32 ringId, SIZE_T offset, PVOID buffer, SIZE_T size, BOOLEAN write)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+
+	PUINT8 currentBuffer = (PUINT8)buffer;
+
+	while ((0 != size) && (NT_SUCCESS(status)))
+	{
+		/* Split the copy at each page boundary, the pages aren't physically contiguous. */
+		SIZE_T pageOffset = offset & (PAGE_SIZE - 1);
+		SIZE_T bytesThisPage = min(size, PAGE_SIZE - pageOffset);
+
+		HOST_PHYS_ADDRESS physAddress = registeredRings[ringId].pages[offset / PAGE_SIZE] + pageOffset;
+
+		if (TRUE == write)
+		{
+			status = MemManage_writePhysicalAddress(mmContext, physAddress, currentBuffer, bytesThisPage);
+		}
+		else
+		{
+			status = MemManage_readPhysicalAddress(mmContext, physAddress, currentBuffer, bytesThisPage);
+		}
+
+		offset += bytesThisPage;
+		currentBuffer += bytesThisPage;
+		size -= bytesThisPage;
+	}
+
+	return status;
+}
+
+static BOOLEAN readIndexes(PMM_CONTEXT mmContext, UINT32 ringId, PRING_INDEXES indexes)
+{
+	BOOLEAN result = FALSE;
+
+	PCOMMAND_RING_HEADER header = (PCOMMAND_RING_HEADER)MemManage_mapPhysicalAddress(mmContext, registeredRings[ringId].pages[0]);
+	if (NULL != header)
+	{
+		indexes->commandHead = (ULONG)header->commandHead;
+		indexes->commandTail = (ULONG)header->commandTail;
+		indexes->completionHead = (ULONG)header->completionHead;
+		indexes->completionTail = (ULONG)header->completionTail;
+
+		MemManage_unmapPhysicalAddress(mmContext);
+		result = TRUE;
+	}
+
+	return result;
+}
+
+static BOOLEAN publishIndexes(PMM_CONTEXT mmContext, UINT32 ringId, ULONG commandTail, ULONG completionHead)
+{
+	BOOLEAN result = FALSE;
+
+	PCOMMAND_RING_HEADER header = (PCOMMAND_RING_HEADER)MemManage_mapPhysicalAddress(mmContext, registeredRings[ringId].pages[0]);
+	if (NULL != header)
+	{
+		/* The completion entries were written through the same mapping window, the
+		 * exchange orders them before the new head becomes visible to the guest. */
+		InterlockedExchange(&header->completionHead, (LONG)completionHead);
+		InterlockedExchange(&header->commandTail, (LONG)commandTail);
+
+		MemManage_unmapPhysicalAddress(mmContext);
+		result = TRUE;
+	}
+
+	return result;
+}
+
+static BOOLEAN setConsumerIdle(PMM_CONTEXT mmContext, UINT32 ringId, LONG exchange, LONG comparand, PLONG previous)
+{
+	BOOLEAN result = FALSE;
+
+	PCOMMAND_RING_HEADER header = (PCOMMAND_RING_HEADER)MemManage_mapPhysicalAddress(mmContext, registeredRings[ringId].pages[0]);
+	if (NULL != header)
+	{
+		*previous = InterlockedCompareExchange(&header->consumerIdle, exchange, comparand);
+
+		MemManage_unmapPhysicalAddress(mmContext);
+		result = TRUE;
+	}
+
+	return result;
+}
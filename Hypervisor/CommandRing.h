@@ -0,0 +1,26 @@
+#pragma once
+#include <ntifs.h>
+#include "VMM.h"
+#include "CommandRing_Common.h"
+
+/******************** Public Defines ********************/
+
+/* Maximum number of rings that can be registered at the same time. */
+#define COMMAND_RING_MAX_REGISTERED 4
+
+/* Number of pages spanned by a shared ring. */
+#define COMMAND_RING_PAGES ((sizeof(COMMAND_RING) + PAGE_SIZE - 1) / PAGE_SIZE)
+
+/******************** Public Typedefs ********************/
+
+/******************** Public Constants ********************/
+
+/******************** Public Variables ********************/
+
+/******************** Public Prototypes ********************/
+
+NTSTATUS CommandRing_init(void);
+void CommandRing_uninit(void);
+NTSTATUS CommandRing_register(PVMM_DATA lpData, CR3 guestCR3, GUEST_VIRTUAL_ADDRESS ringVA, SIZE_T ringSize, PUINT32 ringId);
+NTSTATUS CommandRing_unregister(CR3 guestCR3, UINT32 ringId);
+NTSTATUS CommandRing_doorbell(PVMM_DATA lpData, CR3 guestCR3, UINT32 ringId);
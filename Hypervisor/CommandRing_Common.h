@@ -0,0 +1,139 @@
+#pragma once
+#include "VMCALL_Common.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/******************** Public Defines ********************/
+
+/* Number of entries in both the command and completion rings, must be a power of two. */
+#define COMMAND_RING_ENTRIES 512
+#define COMMAND_RING_MASK (COMMAND_RING_ENTRIES - 1)
+
+/* Size of a cache line, the indexes are kept on separate lines to avoid false sharing
+ * between the guest producer and the hypervisor consumer. */
+#define COMMAND_RING_CACHE_LINE 64
+
+/******************** Public Typedefs ********************/
+
+/* A command posted by the guest, the tag is returned unchanged with the completion. */
+typedef struct _COMMAND_RING_ENTRY
+{
+	UINT64 tag;
+	VMCALL_COMMAND command;
+} COMMAND_RING_ENTRY, *PCOMMAND_RING_ENTRY;
+
+typedef struct _COMPLETION_RING_ENTRY
+{
+	UINT64 tag;
+	NTSTATUS status;
+	UINT32 reserved;
+} COMPLETION_RING_ENTRY, *PCOMPLETION_RING_ENTRY;
+
+/* Indexes are free running and only ever written by one side each.
+ *
+ *	commandHead		- Written by the guest after an entry has been filled in.
+ *	commandTail		- Written by the hypervisor once an entry has been consumed.
+ *	consumerIdle	- Set by the hypervisor when it stops draining, whoever clears it
+ *					  is responsible for making sure the ring gets drained again.
+ *	completionHead	- Written by the hypervisor after a completion has been filled in.
+ *	completionTail	- Written by the guest once a completion has been consumed. */
+typedef struct _COMMAND_RING_HEADER
+{
+	volatile LONG commandHead;
+	UINT8 padding0[COMMAND_RING_CACHE_LINE - sizeof(LONG)];
+
+	volatile LONG commandTail;
+	volatile LONG consumerIdle;
+	UINT8 padding1[COMMAND_RING_CACHE_LINE - (2 * sizeof(LONG))];
+
+	volatile LONG completionHead;
+	UINT8 padding2[COMMAND_RING_CACHE_LINE - sizeof(LONG)];
+
+	volatile LONG completionTail;
+	UINT8 padding3[COMMAND_RING_CACHE_LINE - sizeof(LONG)];
+} COMMAND_RING_HEADER, *PCOMMAND_RING_HEADER;
+
+/* Layout of the shared memory, this must be page aligned and locked in memory
+ * for as long as it is registered, as the hypervisor accesses it physically. */
+typedef struct _COMMAND_RING
+{
+	COMMAND_RING_HEADER header;
+	COMMAND_RING_ENTRY commands[COMMAND_RING_ENTRIES];
+	COMPLETION_RING_ENTRY completions[COMMAND_RING_ENTRIES];
+} COMMAND_RING, *PCOMMAND_RING;
+
+/******************** Public Constants ********************/
+
+/******************** Public Variables ********************/
+
+/******************** Public Prototypes ********************/
+
+/* Initialises a ring before it is registered, the hypervisor starts off idle
+ * so that the first command posted rings the doorbell. */
+FORCEINLINE void CommandRing_initialise(PCOMMAND_RING ring)
+{
+	ring->header.commandHead = 0;
+	ring->header.commandTail = 0;
+	ring->header.consumerIdle = 1;
+	ring->header.completionHead = 0;
+	ring->header.completionTail = 0;
+}
+
+/* Posts a command, returns FALSE if the ring is full. When doorbell is set on return,
+ * the caller must ring the doorbell (VMCALL_FAST_ACTION_RING_DOORBELL) for this ring. */
+FORCEINLINE BOOLEAN CommandRing_post(PCOMMAND_RING ring, UINT64 tag, const VMCALL_COMMAND* command, PBOOLEAN doorbell)
+{
+	BOOLEAN result = FALSE;
+	*doorbell = FALSE;
+
+	ULONG head = (ULONG)ring->header.commandHead;
+	ULONG tail = (ULONG)ring->header.commandTail;
+
+	if ((head - tail) < COMMAND_RING_ENTRIES)
+	{
+		PCOMMAND_RING_ENTRY entry = &ring->commands[head & COMMAND_RING_MASK];
+		entry->tag = tag;
+		entry->command = *command;
+
+		/* Publish the entry, the exchange is a full barrier so the idle flag
+		 * below can't be read before the new head is visible. */
+		InterlockedExchange(&ring->header.commandHead, (LONG)(head + 1));
+
+		/* Only exit to the hypervisor when it has stopped draining. */
+		if ((0 != ring->header.consumerIdle) && (1 == InterlockedCompareExchange(&ring->header.consumerIdle, 0, 1)))
+		{
+			*doorbell = TRUE;
+		}
+
+		result = TRUE;
+	}
+
+	return result;
+}
+
+/* Polls for a completion, returns FALSE if there are none. */
+FORCEINLINE BOOLEAN CommandRing_pollCompletion(PCOMMAND_RING ring, PCOMPLETION_RING_ENTRY completion)
+{
+	BOOLEAN result = FALSE;
+
+	ULONG tail = (ULONG)ring->header.completionTail;
+	ULONG head = (ULONG)ring->header.completionHead;
+
+	if (head != tail)
+	{
+		*completion = ring->completions[tail & COMMAND_RING_MASK];
+
+		/* Release the slot only once the completion has been copied out. */
+		InterlockedExchange(&ring->header.completionTail, (LONG)(tail + 1));
+		result = TRUE;
+	}
+
+	return result;
+}
+
+#ifdef __cplusplus
+}
+#endif
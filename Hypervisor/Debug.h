@@ -1,22 +1,61 @@
 #pragma once
+#include "DebugLog.h"
+
+/* Debug output that is safe from VMX root. Messages are recorded into a ring of the logical
+ * processor as the format and its raw arguments, nothing is formatted until the drainer
+ * thread gets to them at PASSIVE_LEVEL (see DebugLog.c).
+ *
+ * Each message has a level, those above DEBUG_LEVEL aren't compiled in at all, so they
+ * cost nothing. Strings passed as arguments are read when the message is drained, so they
+ * have to outlive it, literals are fine. */
+
+/******************** Public Defines ********************/
+
+#define DEBUG_LEVEL_NONE 0
+#define DEBUG_LEVEL_ERROR 1
+#define DEBUG_LEVEL_WARNING 2
+#define DEBUG_LEVEL_INFO 3
+#define DEBUG_LEVEL_TRACE 4
+
+/* Debug builds keep everything up to informational messages, release builds errors only. */
+#ifndef DEBUG_LEVEL
+#if DBG
+#define DEBUG_LEVEL DEBUG_LEVEL_INFO
+#else
+#define DEBUG_LEVEL DEBUG_LEVEL_ERROR
+#endif
+#endif
 
+#if DEBUG_LEVEL >= DEBUG_LEVEL_ERROR
+#define DEBUG_ERROR(format, ...) DebugLog_record(DEBUG_LEVEL_ERROR, format, __VA_ARGS__)
+#else
+#define DEBUG_ERROR(format, ...) ((void)0)
+#endif
 
-/******************** Public Typedefs ********************/
-
-/******************** Public Constants ********************/
-
-#define _DEBUG
+#if DEBUG_LEVEL >= DEBUG_LEVEL_WARNING
+#define DEBUG_WARNING(format, ...) DebugLog_record(DEBUG_LEVEL_WARNING, format, __VA_ARGS__)
+#else
+#define DEBUG_WARNING(format, ...) ((void)0)
+#endif
 
-#ifdef _DEBUG 
-#define DEBUG_PRINT( X, ... )                                                                                           \
-	DbgPrintEx( DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL, "[P] [%04i] " X,                                          \
-		   1, __VA_ARGS__ )
+#if DEBUG_LEVEL >= DEBUG_LEVEL_INFO
+#define DEBUG_INFO(format, ...) DebugLog_record(DEBUG_LEVEL_INFO, format, __VA_ARGS__)
+#else
+#define DEBUG_INFO(format, ...) ((void)0)
+#endif
 
-	//#define DEBUG_PRINT(format, ...) DbgPrint(format, ##__VA_ARGS__)
+#if DEBUG_LEVEL >= DEBUG_LEVEL_TRACE
+#define DEBUG_TRACE(format, ...) DebugLog_record(DEBUG_LEVEL_TRACE, format, __VA_ARGS__)
 #else
-	#define `(format, ...)
+#define DEBUG_TRACE(format, ...) ((void)0)
 #endif
 
+#define DEBUG_PRINT DEBUG_INFO
+
+/******************** Public Typedefs ********************/
+
+/******************** Public Constants ********************/
+
 /******************** Public Variables ********************/
 
 /******************** Public Prototypes ********************/
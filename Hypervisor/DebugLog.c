@@ -0,0 +1,301 @@
+#include <ntddk.h>
+#include <ntstrsafe.h>
+#include <intrin.h>
+#include "Debug.h"
+#include "VMM.h"
+
+/******************** External API ********************/
+
+
+/******************** Module Typedefs ********************/
+
+/* A message as recorded, the format is only applied to the arguments once it has been drained.
+ * The sequence works as it does for the worker queue, it equals the position for the producer
+ * and position + 1 for the drainer. */
+typedef struct _DEBUG_LOG_CELL
+{
+	volatile LONG sequence;
+	UINT8 level;
+	UINT8 argumentCount;	/* DEBUG_LOG_TOO_MANY_ARGUMENTS if the format needed more than can be held. */
+	UINT16 reserved;
+	UINT64 timeStamp;
+	CHAR const* format;
+	UINT64 arguments[DEBUG_LOG_MAX_ARGUMENTS];
+} DEBUG_LOG_CELL, *PDEBUG_LOG_CELL;
+
+/* Messages of a logical processor. More than one producer can be recording at once, as VMX
+ * root can interrupt the guest part way through a message, but there is only ever one drainer. */
+typedef struct _DEBUG_LOG_RING
+{
+	volatile LONG enqueuePosition;
+	volatile LONG droppedCount;
+	UINT8 padding[DEBUG_LOG_CACHE_LINE - (2 * sizeof(LONG))];
+
+	LONG dequeuePosition;
+	LONG reportedCount;
+
+	DEBUG_LOG_CELL cells[DEBUG_LOG_ENTRIES];
+} DEBUG_LOG_RING, *PDEBUG_LOG_RING;
+
+/******************** Module Constants ********************/
+
+#define DEBUG_LOG_POOL_TAG 'gdDH'
+
+#define DEBUG_LOG_MASK (DEBUG_LOG_ENTRIES - 1)
+#define DEBUG_LOG_TOO_MANY_ARGUMENTS 0xFF
+
+C_ASSERT((DEBUG_LOG_ENTRIES & DEBUG_LOG_MASK) == 0);
+C_ASSERT(DEBUG_LOG_MAX_ARGUMENTS < DEBUG_LOG_TOO_MANY_ARGUMENTS);
+
+/******************** Module Variables ********************/
+
+static PDEBUG_LOG_RING debugRings = NULL;
+static ULONG debugRingCount = 0;
+
+/******************** Module Prototypes ********************/
+static ULONG countArguments(CHAR const* format);
+static void drainerThread(PVOID context);
+static BOOLEAN drainNextMessage(void);
+static void printMessage(ULONG procIndex, const DEBUG_LOG_CELL* cell);
+static void reportDropped(void);
+
+/******************** Public Code ********************/
+
+NTSTATUS DebugLog_init(void)
+{
+	NTSTATUS status = STATUS_NO_MEMORY;
+
+	ULONG processorCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	if (processorCount > MAX_LOGICAL_PROCESSORS)
+	{
+		processorCount = MAX_LOGICAL_PROCESSORS;
+	}
+
+	debugRings = (PDEBUG_LOG_RING)ExAllocatePoolWithTag(NonPagedPoolNx, processorCount * sizeof(DEBUG_LOG_RING), DEBUG_LOG_POOL_TAG);
+	if (NULL != debugRings)
+	{
+		RtlZeroMemory(debugRings, processorCount * sizeof(DEBUG_LOG_RING));
+
+		/* Each cell starts off owned by the producer at its own position. */
+		for (ULONG i = 0; i < processorCount; i++)
+		{
+			for (LONG j = 0; j < DEBUG_LOG_ENTRIES; j++)
+			{
+				debugRings[i].cells[j].sequence = j;
+			}
+		}
+
+		HANDLE threadHandle;
+		status = PsCreateSystemThread(&threadHandle, THREAD_ALL_ACCESS, NULL, NULL, NULL, drainerThread, NULL);
+		if (NT_SUCCESS(status))
+		{
+			ZwClose(threadHandle);
+			debugRingCount = processorCount;
+		}
+		else
+		{
+			ExFreePoolWithTag(debugRings, DEBUG_LOG_POOL_TAG);
+			debugRings = NULL;
+		}
+	}
+
+	return status;
+}
+
+void DebugLog_record(ULONG level, CHAR const* format, ...)
+{
+	/* Safe from any IRQL and from VMX root, nothing is formatted and nothing calls into the OS.
+	 * Messages recorded before DebugLog_init, or once the ring is full, are dropped. */
+	ULONG procIndex = KeGetCurrentProcessorIndex();
+
+	if (procIndex < debugRingCount)
+	{
+		PDEBUG_LOG_RING ring = &debugRings[procIndex];
+		LONG position = ring->enqueuePosition;
+
+		for (;;)
+		{
+			PDEBUG_LOG_CELL cell = &ring->cells[position & DEBUG_LOG_MASK];
+			LONG difference = cell->sequence - position;
+
+			if (0 == difference)
+			{
+				LONG previous = InterlockedCompareExchange(&ring->enqueuePosition, position + 1, position);
+				if (previous == position)
+				{
+					ULONG argumentCount = countArguments(format);
+
+					cell->level = (UINT8)level;
+					cell->timeStamp = __rdtsc();
+					cell->format = format;
+					cell->argumentCount = (argumentCount > DEBUG_LOG_MAX_ARGUMENTS) ? DEBUG_LOG_TOO_MANY_ARGUMENTS : (UINT8)argumentCount;
+
+					/* Every argument takes up a 64 bit slot on x64, whatever its type. */
+					va_list arguments;
+					va_start(arguments, format);
+
+					for (ULONG i = 0; (i < argumentCount) && (i < DEBUG_LOG_MAX_ARGUMENTS); i++)
+					{
+						cell->arguments[i] = va_arg(arguments, UINT64);
+					}
+
+					va_end(arguments);
+
+					/* Hand the cell over to the drainer. */
+					InterlockedExchange(&cell->sequence, position + 1);
+					break;
+				}
+
+				position = previous;
+			}
+			else if (difference < 0)
+			{
+				/* The drainer hasn't caught up. */
+				InterlockedIncrement(&ring->droppedCount);
+				break;
+			}
+			else
+			{
+				position = ring->enqueuePosition;
+			}
+		}
+	}
+}
+
+/******************** Module Code ********************/
+
+static ULONG countArguments(CHAR const* format)
+{
+	/* Number of arguments the format consumes, one for each conversion and one for each
+	 * width or precision given as *. Only the format is looked at, nothing is formatted. */
+	ULONG result = 0;
+
+	for (CHAR const* position = format; '\0' != *position; position++)
+	{
+		if ('%' != *position)
+		{
+			continue;
+		}
+
+		position++;
+		if ('%' == *position)
+		{
+			continue;
+		}
+
+		/* Skip the flags, width, precision and size up to the type, which is a letter
+		 * other than those of the size prefixes. */
+		while (('\0' != *position) && (NULL == strchr("cCdiouxXeEfgGaApnsSZ", *position)))
+		{
+			result += ('*' == *position) ? 1 : 0;
+			position++;
+		}
+
+		if ('\0' == *position)
+		{
+			break;
+		}
+
+		result++;
+	}
+
+	return result;
+}
+
+static void drainerThread(PVOID context)
+{
+	UNREFERENCED_PARAMETER(context);
+
+	LARGE_INTEGER drainInterval;
+	drainInterval.QuadPart = -10000LL * DEBUG_LOG_DRAIN_INTERVAL_MS;
+
+	for (;;)
+	{
+		/* Print everything recorded, only sleeping once every ring is empty. */
+		while (TRUE == drainNextMessage())
+		{
+		}
+
+		reportDropped();
+		KeDelayExecutionThread(KernelMode, FALSE, &drainInterval);
+	}
+}
+
+static BOOLEAN drainNextMessage(void)
+{
+	/* The oldest message across the rings goes first, so the output reads in the order it happened. */
+	BOOLEAN result = FALSE;
+	PDEBUG_LOG_CELL oldest = NULL;
+	ULONG oldestIndex = 0;
+
+	for (ULONG i = 0; i < debugRingCount; i++)
+	{
+		PDEBUG_LOG_RING ring = &debugRings[i];
+		PDEBUG_LOG_CELL cell = &ring->cells[ring->dequeuePosition & DEBUG_LOG_MASK];
+
+		if (((ring->dequeuePosition + 1) == cell->sequence) && ((NULL == oldest) || (cell->timeStamp < oldest->timeStamp)))
+		{
+			oldest = cell;
+			oldestIndex = i;
+		}
+	}
+
+	if (NULL != oldest)
+	{
+		PDEBUG_LOG_RING ring = &debugRings[oldestIndex];
+
+		DEBUG_LOG_CELL cell;
+		RtlCopyMemory(&cell, oldest, sizeof(cell));
+
+		/* Give the cell back to the producers for the next lap before formatting, which is slow. */
+		InterlockedExchange(&oldest->sequence, ring->dequeuePosition + DEBUG_LOG_ENTRIES);
+		ring->dequeuePosition++;
+
+		printMessage(oldestIndex, &cell);
+		result = TRUE;
+	}
+
+	return result;
+}
+
+static void printMessage(ULONG procIndex, const DEBUG_LOG_CELL* cell)
+{
+	static const CHAR LEVEL_NAMES[] = { ' ', 'E', 'W', 'I', 'T' };
+
+	CHAR message[DEBUG_LOG_MESSAGE_SIZE];
+	size_t prefixLength = 0;
+
+	RtlStringCbPrintfA(message, sizeof(message), "[P] [%04u] [%c] ", procIndex,
+					   (cell->level < sizeof(LEVEL_NAMES)) ? LEVEL_NAMES[cell->level] : '?');
+	RtlStringCbLengthA(message, sizeof(message), &prefixLength);
+
+	if (DEBUG_LOG_TOO_MANY_ARGUMENTS == cell->argumentCount)
+	{
+		/* Formatting would run off the end of the arguments, so the format is printed as it is. */
+		RtlStringCbCopyA(message + prefixLength, sizeof(message) - prefixLength, cell->format);
+	}
+	else
+	{
+		/* On x64 a va_list is just a pointer to consecutive 64 bit slots, which is how the
+		 * arguments were recorded. A message too long for the buffer is cut short. */
+		RtlStringCbVPrintfA(message + prefixLength, sizeof(message) - prefixLength, cell->format, (va_list)cell->arguments);
+	}
+
+	DbgPrintEx(DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL, "%s", message);
+}
+
+static void reportDropped(void)
+{
+	for (ULONG i = 0; i < debugRingCount; i++)
+	{
+		PDEBUG_LOG_RING ring = &debugRings[i];
+		LONG droppedCount = ring->droppedCount;
+
+		if (droppedCount != ring->reportedCount)
+		{
+			DbgPrintEx(DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL, "[P] [%04u] [E] %d debug messages dropped.\r\n", i,
+					   droppedCount - ring->reportedCount);
+			ring->reportedCount = droppedCount;
+		}
+	}
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include <wdm.h>
+
+/******************** Public Defines ********************/
+
+/* Number of messages each logical processor can hold before they are drained, must be a power of two. */
+#define DEBUG_LOG_ENTRIES 256
+
+/* Most arguments a message can have, each one is held as a raw 64 bit value. */
+#define DEBUG_LOG_MAX_ARGUMENTS 8
+
+/* Longest message once formatted, including the prefix. */
+#define DEBUG_LOG_MESSAGE_SIZE 512
+
+/* Keeps the cursors the producers share apart from those of the drainer. */
+#define DEBUG_LOG_CACHE_LINE 64
+
+/* How often the drainer formats and prints the messages recorded, in milliseconds. VMX root
+ * can't signal a dispatcher object, so the drainer has to poll. */
+#define DEBUG_LOG_DRAIN_INTERVAL_MS 10
+
+/******************** Public Typedefs ********************/
+
+/******************** Public Constants ********************/
+
+/******************** Public Variables ********************/
+
+/******************** Public Prototypes ********************/
+NTSTATUS DebugLog_init(void);
+void DebugLog_record(ULONG level, CHAR const* format, ...);
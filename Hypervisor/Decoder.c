@@ -0,0 +1,527 @@
+#include "Decoder.h"
+
+/******************** External API ********************/
+
+
+/******************** Module Typedefs ********************/
+
+
+/******************** Module Constants ********************/
+
+/* Attributes of each opcode, what follows it and whether it is valid in 64 bit mode. */
+#define A_NONE	0x00
+#define A_MODRM	0x01	/* ModRM, along with any SIB and displacement it calls for. */
+#define A_I8	0x02	/* 8 bit immediate. */
+#define A_I16	0x04	/* 16 bit immediate, along with A_I8 for ENTER. */
+#define A_IZ	0x08	/* 16 or 32 bit immediate, depending on the operand size. */
+#define A_IV	0x10	/* 16, 32 or 64 bit immediate, depending on the operand size. */
+#define A_REL	0x20	/* The immediate is relative to the next instruction. */
+#define A_BAD	0x40	/* Invalid in 64 bit mode. */
+#define A_PFX	0x80	/* Prefix or escape, dealt with before the tables are looked at. */
+
+#define A_M		A_MODRM
+#define A_MI8	(A_MODRM | A_I8)
+#define A_MIZ	(A_MODRM | A_IZ)
+#define A_R8	(A_I8 | A_REL)
+#define A_RZ	(A_IZ | A_REL)
+
+/* Rows of eight, built entirely at compile time. */
+#define ROW8(a, b, c, d, e, f, g, h) a, b, c, d, e, f, g, h
+#define ALL8(a) ROW8(a, a, a, a, a, a, a, a)
+
+/* The ALU operations at 00-3F share a layout, four ModRM forms then AL, imm8 and eAX, immz. */
+#define ALU6 A_M, A_M, A_M, A_M, A_I8, A_IZ
+
+static const UINT8 ONE_BYTE_ATTRIBUTES[256] =
+{
+	/* 00 */ ALU6, A_BAD, A_BAD, ALU6, A_BAD, A_PFX,
+	/* 10 */ ALU6, A_BAD, A_BAD, ALU6, A_BAD, A_BAD,
+	/* 20 */ ALU6, A_PFX, A_BAD, ALU6, A_PFX, A_BAD,
+	/* 30 */ ALU6, A_PFX, A_BAD, ALU6, A_PFX, A_BAD,
+	/* 40 */ ALL8(A_PFX), ALL8(A_PFX),
+	/* 50 */ ALL8(A_NONE), ALL8(A_NONE),
+	/* 60 */ ROW8(A_BAD, A_BAD, A_PFX, A_M, A_PFX, A_PFX, A_PFX, A_PFX), ROW8(A_IZ, A_MIZ, A_I8, A_MI8, A_NONE, A_NONE, A_NONE, A_NONE),
+	/* 70 */ ALL8(A_R8), ALL8(A_R8),
+	/* 80 */ ROW8(A_MI8, A_MIZ, A_BAD, A_MI8, A_M, A_M, A_M, A_M), ALL8(A_M),
+	/* 90 */ ALL8(A_NONE), ROW8(A_NONE, A_NONE, A_BAD, A_NONE, A_NONE, A_NONE, A_NONE, A_NONE),
+	/* A0 */ ALL8(A_NONE), ROW8(A_I8, A_IZ, A_NONE, A_NONE, A_NONE, A_NONE, A_NONE, A_NONE),
+	/* B0 */ ALL8(A_I8), ALL8(A_IV),
+	/* C0 */ ROW8(A_MI8, A_MI8, A_I16, A_NONE, A_PFX, A_PFX, A_MI8, A_MIZ), ROW8(A_I16 | A_I8, A_NONE, A_I16, A_NONE, A_NONE, A_I8, A_BAD, A_NONE),
+	/* D0 */ ROW8(A_M, A_M, A_M, A_M, A_BAD, A_BAD, A_BAD, A_NONE), ALL8(A_M),
+	/* E0 */ ROW8(A_R8, A_R8, A_R8, A_R8, A_I8, A_I8, A_I8, A_I8), ROW8(A_RZ, A_RZ, A_BAD, A_R8, A_NONE, A_NONE, A_NONE, A_NONE),
+	/* F0 */ ROW8(A_PFX, A_NONE, A_PFX, A_PFX, A_NONE, A_NONE, A_M, A_M), ROW8(A_NONE, A_NONE, A_NONE, A_NONE, A_NONE, A_NONE, A_M, A_M),
+};
+
+static const UINT8 TWO_BYTE_ATTRIBUTES[256] =
+{
+	/* 00 */ ROW8(A_M, A_M, A_M, A_M, A_BAD, A_NONE, A_NONE, A_NONE), ROW8(A_NONE, A_NONE, A_BAD, A_NONE, A_BAD, A_M, A_NONE, A_PFX),
+	/* 10 */ ALL8(A_M), ALL8(A_M),
+	/* 20 */ ROW8(A_M, A_M, A_M, A_M, A_BAD, A_BAD, A_BAD, A_BAD), ALL8(A_M),
+	/* 30 */ ROW8(A_NONE, A_NONE, A_NONE, A_NONE, A_NONE, A_NONE, A_BAD, A_NONE), ROW8(A_PFX, A_BAD, A_PFX, A_BAD, A_BAD, A_BAD, A_BAD, A_BAD),
+	/* 40 */ ALL8(A_M), ALL8(A_M),
+	/* 50 */ ALL8(A_M), ALL8(A_M),
+	/* 60 */ ALL8(A_M), ALL8(A_M),
+	/* 70 */ ROW8(A_MI8, A_MI8, A_MI8, A_MI8, A_M, A_M, A_M, A_NONE), ROW8(A_M, A_M, A_BAD, A_BAD, A_M, A_M, A_M, A_M),
+	/* 80 */ ALL8(A_RZ), ALL8(A_RZ),
+	/* 90 */ ALL8(A_M), ALL8(A_M),
+	/* A0 */ ROW8(A_NONE, A_NONE, A_NONE, A_M, A_MI8, A_M, A_BAD, A_BAD), ROW8(A_NONE, A_NONE, A_NONE, A_M, A_MI8, A_M, A_M, A_M),
+	/* B0 */ ALL8(A_M), ROW8(A_M, A_M, A_MI8, A_M, A_M, A_M, A_M, A_M),
+	/* C0 */ ROW8(A_M, A_M, A_MI8, A_M, A_MI8, A_MI8, A_MI8, A_M), ALL8(A_NONE),
+	/* D0 */ ALL8(A_M), ALL8(A_M),
+	/* E0 */ ALL8(A_M), ALL8(A_M),
+	/* F0 */ ALL8(A_M), ALL8(A_M),
+};
+
+/* The 0F map when VEX or EVEX encoded, only the SSE, AVX and mask instructions are left. */
+static const UINT8 VEX_MAP1_ATTRIBUTES[256] =
+{
+	/* 00 */ ALL8(A_BAD), ALL8(A_BAD),
+	/* 10 */ ALL8(A_M), ALL8(A_BAD),
+	/* 20 */ ALL8(A_BAD), ALL8(A_M),
+	/* 30 */ ALL8(A_BAD), ALL8(A_BAD),
+	/* 40 */ ROW8(A_BAD, A_M, A_M, A_BAD, A_M, A_M, A_M, A_M), ROW8(A_BAD, A_BAD, A_M, A_M, A_BAD, A_BAD, A_BAD, A_BAD),
+	/* 50 */ ALL8(A_M), ALL8(A_M),
+	/* 60 */ ALL8(A_M), ALL8(A_M),
+	/* 70 */ ROW8(A_MI8, A_MI8, A_MI8, A_MI8, A_M, A_M, A_M, A_NONE), ALL8(A_M),
+	/* 80 */ ALL8(A_BAD), ALL8(A_BAD),
+	/* 90 */ ROW8(A_M, A_M, A_M, A_M, A_BAD, A_BAD, A_BAD, A_BAD), ROW8(A_M, A_M, A_BAD, A_BAD, A_BAD, A_BAD, A_BAD, A_BAD),
+	/* A0 */ ALL8(A_BAD), ROW8(A_BAD, A_BAD, A_BAD, A_BAD, A_BAD, A_BAD, A_M, A_BAD),
+	/* B0 */ ALL8(A_BAD), ALL8(A_BAD),
+	/* C0 */ ROW8(A_BAD, A_BAD, A_MI8, A_BAD, A_MI8, A_MI8, A_MI8, A_BAD), ALL8(A_BAD),
+	/* D0 */ ALL8(A_M), ALL8(A_M),
+	/* E0 */ ALL8(A_M), ALL8(A_M),
+	/* F0 */ ALL8(A_M), ALL8(A_M),
+};
+
+#define PREFIX_REX_W 0x08
+
+/******************** Module Variables ********************/
+
+
+/******************** Module Prototypes ********************/
+static UINT32 decodeVEX(const UINT8* code, UINT32 available, UINT32 position, PDECODED_INSTRUCTION decoded, UINT8* attributes);
+static UINT32 decodeModRM(const UINT8* code, UINT32 available, UINT32 position, PDECODED_INSTRUCTION decoded);
+static UINT64 signExtend(const UINT8* value, UINT32 size);
+
+/******************** Public Code ********************/
+
+UINT32 Decoder_decode(const UINT8* code, UINT32 available, UINT64 address, PDECODED_INSTRUCTION decoded)
+{
+	/* Decodes the 64 bit mode instruction at code, which is executed from address, returning its
+	 * length or zero if it is invalid or runs past what is available. Only the layout is decoded,
+	 * enough to find the length and anything relative to RIP, as cheaply as possible. 66 is
+	 * ignored by near branches as it is on Intel processors, the only ones this runs on. */
+	static const DECODED_INSTRUCTION EMPTY_INSTRUCTION = { 0 };
+
+	UINT32 position = 0;
+	UINT8 attributes = A_BAD;
+	BOOLEAN valid = TRUE;
+	BOOLEAN mandatoryPrefix = FALSE;
+
+	*decoded = EMPTY_INSTRUCTION;
+
+	if (available > DECODER_MAX_LENGTH)
+	{
+		available = DECODER_MAX_LENGTH;
+	}
+
+	/* Legacy prefixes, REX only counts if nothing but the opcode follows it. */
+	while ((position < available) && (A_PFX == ONE_BYTE_ATTRIBUTES[code[position]]) &&
+		   (0x0F != code[position]) && (0xC4 != code[position]) && (0xC5 != code[position]) && (0x62 != code[position]))
+	{
+		UINT8 prefix = code[position];
+
+		if (0x40 == (prefix & 0xF0))
+		{
+			decoded->rex = prefix;
+		}
+		else
+		{
+			decoded->rex = 0;
+
+			if (0x66 == prefix)
+			{
+				decoded->flags |= DECODER_FLAG_OPERAND_SIZE;
+				mandatoryPrefix = TRUE;
+			}
+			else if (0x67 == prefix)
+			{
+				decoded->flags |= DECODER_FLAG_ADDRESS_SIZE;
+			}
+			else if ((0xF0 == prefix) || (0xF2 == prefix) || (0xF3 == prefix))
+			{
+				mandatoryPrefix = TRUE;
+			}
+		}
+
+		position++;
+	}
+
+	if (0 != decoded->rex)
+	{
+		decoded->flags |= DECODER_FLAG_REX;
+	}
+
+	if (position >= available)
+	{
+		valid = FALSE;
+	}
+	else if ((0xC4 == code[position]) || (0xC5 == code[position]) || (0x62 == code[position]) ||
+			 ((0x8F == code[position]) && ((position + 1) < available) && ((code[position + 1] & 0x1F) >= 8)))
+	{
+		/* VEX, EVEX and XOP can't follow REX or the prefixes they stand in for. */
+		if ((0 != decoded->rex) || (TRUE == mandatoryPrefix))
+		{
+			valid = FALSE;
+		}
+		else
+		{
+			position = decodeVEX(code, available, position, decoded, &attributes);
+			valid = (0 != position);
+		}
+	}
+	else if (0x0F == code[position])
+	{
+		position++;
+
+		if (position >= available)
+		{
+			valid = FALSE;
+		}
+		else if (0x38 == code[position])
+		{
+			decoded->map = DECODER_MAP_0F38;
+			attributes = A_M;
+			position++;
+		}
+		else if (0x3A == code[position])
+		{
+			decoded->map = DECODER_MAP_0F3A;
+			attributes = A_MI8;
+			position++;
+		}
+		else if (0x0F == code[position])
+		{
+			/* 3DNow!, the opcode is the immediate that follows the ModRM. */
+			decoded->map = DECODER_MAP_3DNOW;
+			attributes = A_MI8;
+		}
+		else
+		{
+			decoded->map = DECODER_MAP_0F;
+			attributes = TWO_BYTE_ATTRIBUTES[code[position]];
+		}
+	}
+	else
+	{
+		decoded->map = DECODER_MAP_ONE_BYTE;
+		attributes = ONE_BYTE_ATTRIBUTES[code[position]];
+	}
+
+	if ((TRUE == valid) && ((position >= available) || (0 != (attributes & (A_BAD | A_PFX)))))
+	{
+		valid = FALSE;
+	}
+	else if ((TRUE == valid) && (DECODER_MAP_0F == decoded->map) && (0 == (decoded->flags & DECODER_FLAG_VEX)) &&
+			 ((0x78 == code[position]) || (0x79 == code[position])) && (TRUE == mandatoryPrefix))
+	{
+		/* VMREAD and VMWRITE, with a prefix these are the AMD only EXTRQ and INSERTQ. */
+		valid = FALSE;
+	}
+
+	if (TRUE == valid)
+	{
+		decoded->opcodeOffset = (UINT8)position;
+		decoded->opcode = code[position];
+		position++;
+
+		if (0 != (attributes & A_MODRM))
+		{
+			position = decodeModRM(code, available, position, decoded);
+			valid = (0 != position);
+		}
+	}
+
+	if (TRUE == valid)
+	{
+		/* Work out the size of the immediate. */
+		UINT32 immediateSize = 0;
+		BOOLEAN operandSize16 = (0 != (decoded->flags & DECODER_FLAG_OPERAND_SIZE)) && (0 == (decoded->rex & PREFIX_REX_W));
+
+		if (0 != (attributes & A_I8))
+		{
+			immediateSize += 1;
+		}
+
+		if (0 != (attributes & A_I16))
+		{
+			immediateSize += 2;
+		}
+
+		if (0 != (attributes & A_IZ))
+		{
+			/* Near branches are always rel32 in 64 bit mode. */
+			immediateSize += ((TRUE == operandSize16) && (0 == (attributes & A_REL))) ? 2 : 4;
+		}
+
+		if (0 != (attributes & A_IV))
+		{
+			immediateSize += (0 != (decoded->rex & PREFIX_REX_W)) ? 8 : ((TRUE == operandSize16) ? 2 : 4);
+		}
+
+		if (DECODER_MAP_ONE_BYTE == decoded->map)
+		{
+			UINT8 reg = (decoded->modRM >> 3) & 0x07;
+
+			switch (decoded->opcode)
+			{
+			case 0xA0:
+			case 0xA1:
+			case 0xA2:
+			case 0xA3:
+				/* MOV with an absolute address in place of the ModRM. */
+				immediateSize = (0 != (decoded->flags & DECODER_FLAG_ADDRESS_SIZE)) ? 4 : 8;
+				decoded->flags |= DECODER_FLAG_MEMORY;
+				break;
+
+			case 0xF6:
+				/* TEST is the only one of group 3 with an immediate. */
+				immediateSize = (reg < 2) ? 1 : 0;
+				break;
+
+			case 0xF7:
+				immediateSize = (reg < 2) ? ((TRUE == operandSize16) ? 2 : 4) : 0;
+				break;
+
+			case 0xC7:
+				if (0xF8 == decoded->modRM)
+				{
+					/* XBEGIN, rel16 or rel32 to the abort handler. */
+					attributes |= A_REL;
+					decoded->branchType = DECODER_BRANCH_XBEGIN;
+				}
+				break;
+
+			case 0xE0:
+			case 0xE1:
+			case 0xE2:
+			case 0xE3:
+				decoded->branchType = DECODER_BRANCH_LOOP;
+				break;
+
+			case 0xE8:
+				decoded->branchType = DECODER_BRANCH_CALL;
+				break;
+
+			case 0xE9:
+			case 0xEB:
+				decoded->branchType = DECODER_BRANCH_JUMP;
+				break;
+
+			default:
+				if ((decoded->opcode >= 0x70) && (decoded->opcode <= 0x7F))
+				{
+					decoded->branchType = DECODER_BRANCH_CONDITIONAL;
+				}
+				break;
+			}
+		}
+		else if ((DECODER_MAP_0F == decoded->map) && (0 != (attributes & A_REL)))
+		{
+			decoded->branchType = DECODER_BRANCH_CONDITIONAL;
+		}
+
+		if (0 != immediateSize)
+		{
+			decoded->immediateOffset = (UINT8)position;
+			decoded->immediateSize = (UINT8)immediateSize;
+			position += immediateSize;
+		}
+
+		if (position > available)
+		{
+			valid = FALSE;
+		}
+		else
+		{
+			decoded->length = (UINT8)position;
+
+			if (0 != (attributes & A_REL))
+			{
+				decoded->flags |= DECODER_FLAG_RELATIVE;
+				decoded->target = address + position + signExtend(&code[decoded->immediateOffset], decoded->immediateSize);
+			}
+			else if (0 != (decoded->flags & DECODER_FLAG_RIP_RELATIVE))
+			{
+				decoded->target = address + position + signExtend(&code[decoded->displacementOffset], decoded->displacementSize);
+			}
+		}
+	}
+
+	if (FALSE == valid)
+	{
+		*decoded = EMPTY_INSTRUCTION;
+	}
+
+	return decoded->length;
+}
+
+/******************** Module Code ********************/
+
+static UINT32 decodeVEX(const UINT8* code, UINT32 available, UINT32 position, PDECODED_INSTRUCTION decoded, UINT8* attributes)
+{
+	/* Returns the position of the opcode, or zero if the prefix is invalid. Everything encoded
+	 * this way has a ModRM, other than VZEROUPPER and VZEROALL. */
+	UINT8 lead = code[position];
+	UINT32 result = 0;
+	UINT8 map = 0;
+
+	if ((position + 1) < available)
+	{
+		switch (lead)
+		{
+		case 0xC5:
+			map = DECODER_MAP_0F;
+			result = position + 2;
+			break;
+
+		case 0xC4:
+			map = code[position + 1] & 0x1F;
+			result = position + 3;
+			break;
+
+		case 0x62:
+			/* EVEX, the fixed bits of P0 and P1 have to be right. */
+			if (((position + 2) < available) && (0 == (code[position + 1] & 0x08)) && (0 != (code[position + 2] & 0x04)))
+			{
+				map = code[position + 1] & 0x07;
+				result = position + 4;
+			}
+			break;
+
+		default:
+			map = (UINT8)(0x10 | (code[position + 1] & 0x1F));
+			result = position + 3;
+			break;
+		}
+	}
+
+	if (result >= available)
+	{
+		result = 0;
+	}
+	else
+	{
+		UINT8 opcode = code[result];
+
+		decoded->flags |= DECODER_FLAG_VEX;
+		decoded->map = map;
+
+		switch (map)
+		{
+		case DECODER_MAP_0F:
+			*attributes = VEX_MAP1_ATTRIBUTES[opcode];
+			break;
+
+		case DECODER_MAP_0F38:
+		case DECODER_MAP_XOP9:
+			*attributes = A_M;
+			break;
+
+		case DECODER_MAP_0F3A:
+		case DECODER_MAP_XOP8:
+			*attributes = A_MI8;
+			break;
+
+		case DECODER_MAP_XOPA:
+			/* Always a 32 bit immediate, the 66 that would shrink it can't be present. */
+			*attributes = A_MIZ;
+			break;
+
+		case 5:
+		case 6:
+			/* The FP16 maps, which only EVEX has. */
+			*attributes = (0x62 == lead) ? A_M : A_BAD;
+			break;
+
+		default:
+			*attributes = A_BAD;
+			break;
+		}
+	}
+
+	return result;
+}
+
+static UINT32 decodeModRM(const UINT8* code, UINT32 available, UINT32 position, PDECODED_INSTRUCTION decoded)
+{
+	/* Returns the position after the ModRM, SIB and displacement, or zero if they run past
+	 * what is available. Addressing is always 32 or 64 bit in 64 bit mode, so the same forms apply. */
+	UINT32 result = 0;
+
+	if (position < available)
+	{
+		UINT8 modRM = code[position];
+		UINT8 mod = modRM >> 6;
+		UINT8 rm = modRM & 0x07;
+		UINT32 displacementSize = (1 == mod) ? 1 : ((2 == mod) ? 4 : 0);
+
+		decoded->modRM = modRM;
+		decoded->modRMOffset = (UINT8)position;
+		decoded->flags |= DECODER_FLAG_MODRM;
+		result = position + 1;
+
+		if (3 != mod)
+		{
+			decoded->flags |= DECODER_FLAG_MEMORY;
+
+			if (4 == rm)
+			{
+				/* SIB, a base of 101 with mod 00 means a disp32 with no base. */
+				if ((result < available) && (0 == mod) && (5 == (code[result] & 0x07)))
+				{
+					displacementSize = 4;
+				}
+
+				result++;
+			}
+			else if ((0 == mod) && (5 == rm))
+			{
+				decoded->flags |= DECODER_FLAG_RIP_RELATIVE;
+				displacementSize = 4;
+			}
+		}
+
+		if (0 != displacementSize)
+		{
+			decoded->displacementOffset = (UINT8)result;
+			decoded->displacementSize = (UINT8)displacementSize;
+			result += displacementSize;
+		}
+
+		if (result > available)
+		{
+			result = 0;
+		}
+	}
+
+	return result;
+}
+
+static UINT64 signExtend(const UINT8* value, UINT32 size)
+{
+	/* Little endian, read a byte at a time so it doesn't matter how it is aligned. */
+	UINT64 result = 0;
+
+	for (UINT32 i = 0; i < size; i++)
+	{
+		result |= (UINT64)value[i] << (i * 8);
+	}
+
+	if ((0 != size) && (size < 8) && (0 != (value[size - 1] & 0x80)))
+	{
+		result |= ~0ULL << (size * 8);
+	}
+
+	return result;
+}
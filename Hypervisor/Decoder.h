@@ -0,0 +1,89 @@
+#pragma once
+
+/* The decoder is plain C with no state, so the same source is built into the driver and into
+ * the tool that fuzzes and benchmarks it on other platforms. Outside of Windows only the types
+ * it relies on are defined. */
+#ifdef _WIN32
+#include <wdm.h>
+#else
+#include <stdint.h>
+typedef uint8_t UINT8;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+typedef uint8_t BOOLEAN;
+#define TRUE 1
+#define FALSE 0
+#endif
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/******************** Public Defines ********************/
+
+/* Longest an x86 instruction can be, anything longer is invalid. */
+#define DECODER_MAX_LENGTH 15
+
+/* Opcode maps, VEX, EVEX and XOP encode theirs within the prefix. */
+#define DECODER_MAP_ONE_BYTE 0
+#define DECODER_MAP_0F 1
+#define DECODER_MAP_0F38 2
+#define DECODER_MAP_0F3A 3
+#define DECODER_MAP_3DNOW 0x0F
+#define DECODER_MAP_XOP8 0x18
+#define DECODER_MAP_XOP9 0x19
+#define DECODER_MAP_XOPA 0x1A
+
+/* What is known about an instruction once it has been decoded. */
+#define DECODER_FLAG_MODRM			0x0001
+#define DECODER_FLAG_MEMORY			0x0002	/* Has a memory operand, either from the ModRM or an absolute moffs. */
+#define DECODER_FLAG_RIP_RELATIVE	0x0004	/* Memory operand at [RIP+disp32], target is the address it refers to. */
+#define DECODER_FLAG_RELATIVE		0x0008	/* Immediate is relative to the next instruction, target is where it branches to. */
+#define DECODER_FLAG_REX			0x0010
+#define DECODER_FLAG_VEX			0x0020	/* Any of VEX, EVEX or XOP. */
+#define DECODER_FLAG_OPERAND_SIZE	0x0040	/* 66 prefix. */
+#define DECODER_FLAG_ADDRESS_SIZE	0x0080	/* 67 prefix. */
+
+/* Kinds of relative branch, for instructions with DECODER_FLAG_RELATIVE. */
+#define DECODER_BRANCH_NONE 0
+#define DECODER_BRANCH_JUMP 1		/* JMP rel8, JMP rel32 */
+#define DECODER_BRANCH_CALL 2		/* CALL rel32 */
+#define DECODER_BRANCH_CONDITIONAL 3	/* Jcc rel8, Jcc rel32 */
+#define DECODER_BRANCH_LOOP 4		/* LOOPNE, LOOPE, LOOP, JRCXZ, only ever rel8 */
+#define DECODER_BRANCH_XBEGIN 5
+
+/******************** Public Typedefs ********************/
+
+/* Layout of a decoded instruction, offsets are from its first byte and are zero for parts it doesn't have. */
+typedef struct _DECODED_INSTRUCTION
+{
+	UINT8 length;
+	UINT8 opcodeOffset;
+	UINT8 opcode;
+	UINT8 map;
+	UINT8 rex;
+	UINT8 modRM;
+	UINT8 modRMOffset;
+	UINT8 displacementOffset;
+	UINT8 displacementSize;
+	UINT8 immediateOffset;
+	UINT8 immediateSize;
+	UINT8 branchType;
+	UINT32 flags;
+
+	/* Destination of a relative branch, or the address of a RIP relative operand. */
+	UINT64 target;
+} DECODED_INSTRUCTION, *PDECODED_INSTRUCTION;
+
+/******************** Public Constants ********************/
+
+/******************** Public Variables ********************/
+
+/******************** Public Prototypes ********************/
+
+UINT32 Decoder_decode(const UINT8* code, UINT32 available, UINT64 address, PDECODED_INSTRUCTION decoded);
+
+#ifdef __cplusplus
+}
+#endif
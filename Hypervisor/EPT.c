@@ -34,9 +34,14 @@ PVOID OsAllocateContiguousAlignedPages(POOL_TYPE a1, SIZE_T NumberOfPages)
 
 /******************** Module Variables ********************/
 
+/* Splits allocated ahead of time at PASSIVE_LEVEL, so that pages can be split from VMX root
+ * without having to allocate memory there. Popped by any processor, so it is lock-free. */
+static SLIST_HEADER splitReserve = { 0 };
+static volatile LONG splitReserveInitialised = FALSE;
 
 /******************** Module Prototypes ********************/
 static UINT32 adjustEffectiveMemoryType(const PMTRR_RANGE mtrrTable, UINT64 pageAddress, UINT32 desiredType);
+static PEPT_DYNAMIC_SPLIT allocateSplit(void);
 
 /******************** Public Code ********************/
 
@@ -146,7 +151,7 @@ BOOLEAN EPT_handleViolation(PEPT_CONFIG eptConfig, PCONTEXT guestContext)
 
 		virtPA = MmGetVirtualForPhysical(violationGuestPA);
 
-		DEBUG_PRINT("Unhandled EPT violation: PhysAlign %p\tPhysReal %p\tVirtReal %p\n",
+		DEBUG_ERROR("Unhandled EPT violation: PhysAlign %p\tPhysReal %p\tVirtReal %p\n",
 			PAGE_ALIGN(violationGuestPA.QuadPart),
 			(PVOID)violationGuestPA.QuadPart,
 			virtPA);
@@ -197,7 +202,7 @@ NTSTATUS EPT_addViolationHandler(PEPT_CONFIG eptConfig, PHYSICAL_RANGE physicalR
 			newHandler->userParameter = userParameter;
 
 			/* Add this structure to the linked list of already existing handlers. */
-			InsertHeadList(&eptConfig->handlerList, &newHandler->listEntry);
+			EPT_insertViolationHandler(eptConfig, newHandler);
 			status = STATUS_SUCCESS;
 		}
 		else
@@ -213,6 +218,52 @@ NTSTATUS EPT_addViolationHandler(PEPT_CONFIG eptConfig, PHYSICAL_RANGE physicalR
 	return status;
 }
 
+void EPT_insertViolationHandler(PEPT_CONFIG eptConfig, PEPT_HANDLER handler)
+{
+	/* The handler is owned by the caller, which fills it in beforehand. Nothing is allocated,
+	 * so this can be used from VMX root, by the processor the EPT belongs to. */
+	InsertHeadList(&eptConfig->handlerList, &handler->listEntry);
+}
+
+void EPT_removeViolationHandler(PEPT_CONFIG eptConfig, PEPT_HANDLER handler)
+{
+	UNREFERENCED_PARAMETER(eptConfig);
+
+	/* As with inserting, only the processor the EPT belongs to may do this. */
+	RemoveEntryList(&handler->listEntry);
+	InitializeListHead(&handler->listEntry);
+}
+
+NTSTATUS EPT_reserveSplits(ULONG splitCount)
+{
+	/* Tops up the reserve so that at least splitCount pages can be split without allocating,
+	 * called at PASSIVE_LEVEL before EPT changes are made from VMX root. Splits that aren't
+	 * needed stay in the reserve for next time. */
+	NTSTATUS status = STATUS_SUCCESS;
+
+	if (FALSE == splitReserveInitialised)
+	{
+		InitializeSListHead(&splitReserve);
+		InterlockedExchange(&splitReserveInitialised, TRUE);
+	}
+
+	while ((QueryDepthSList(&splitReserve) < splitCount) && (NT_SUCCESS(status)))
+	{
+		PEPT_DYNAMIC_SPLIT newSplit = (PEPT_DYNAMIC_SPLIT)OsAllocateContiguousAlignedPages(NonPagedPool, sizeof(EPT_DYNAMIC_SPLIT));
+
+		if (NULL != newSplit)
+		{
+			InterlockedPushEntrySList(&splitReserve, &newSplit->reserveEntry);
+		}
+		else
+		{
+			status = STATUS_NO_MEMORY;
+		}
+	}
+
+	return status;
+}
+
 NTSTATUS EPT_splitLargePage(PEPT_CONFIG eptConfig, PHYSICAL_ADDRESS physicalAddress)
 {
 	NTSTATUS status;
@@ -226,7 +277,7 @@ NTSTATUS EPT_splitLargePage(PEPT_CONFIG eptConfig, PHYSICAL_ADDRESS physicalAddr
 		* then we don't have to split it as it is already done. */
 		if (FALSE != targetPML2E->LargePage)
 		{
-			PEPT_DYNAMIC_SPLIT newSplit = (PEPT_DYNAMIC_SPLIT)OsAllocateContiguousAlignedPages(NonPagedPool, sizeof(EPT_DYNAMIC_SPLIT));
+			PEPT_DYNAMIC_SPLIT newSplit = allocateSplit();
 
 			if (NULL != newSplit)
 			{
@@ -275,7 +326,8 @@ NTSTATUS EPT_splitLargePage(PEPT_CONFIG eptConfig, PHYSICAL_ADDRESS physicalAddr
 			}
 			else
 			{
-				status = STATUS_NO_MEMORY;
+				/* Nothing was reserved for this split. */
+				status = STATUS_INSUFFICIENT_RESOURCES;
 			}
 		}
 		else
@@ -387,3 +439,22 @@ static UINT32 adjustEffectiveMemoryType(const PMTRR_RANGE mtrrTable, UINT64 page
 
 	return desiredType;
 }
+
+static PEPT_DYNAMIC_SPLIT allocateSplit(void)
+{
+	/* Only ever taken from the reserve, as this can be called from VMX root (or at IPI_LEVEL
+	 * whilst launching) where nothing can be allocated. NULL once the reserve is empty. */
+	PEPT_DYNAMIC_SPLIT result = NULL;
+
+	if (TRUE == splitReserveInitialised)
+	{
+		PSLIST_ENTRY reserveEntry = InterlockedPopEntrySList(&splitReserve);
+
+		if (NULL != reserveEntry)
+		{
+			result = CONTAINING_RECORD(reserveEntry, EPT_DYNAMIC_SPLIT, reserveEntry);
+		}
+	}
+
+	return result;
+}
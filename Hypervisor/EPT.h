@@ -54,6 +54,9 @@ typedef struct _EPT_DYNAMIC_SPLIT
 	/* List entry for the dynamic split, will be used to keep track of all split entries. */
 	LIST_ENTRY listEntry;
 
+	/* Entry within the reserve of splits, whilst it hasn't been used yet. */
+	SLIST_ENTRY reserveEntry;
+
 } EPT_DYNAMIC_SPLIT, *PEPT_DYNAMIC_SPLIT;
 
 typedef struct _EPT_CONFIG
@@ -111,6 +114,9 @@ PVOID OsAllocateContiguousAlignedPages(POOL_TYPE a1, SIZE_T NumberOfPages);
 void EPT_initialise(PEPT_CONFIG eptTable, const PMTRR_RANGE mtrrTable);
 BOOLEAN EPT_handleViolation(PEPT_CONFIG eptConfig, PCONTEXT guestContext);
 NTSTATUS EPT_addViolationHandler(PEPT_CONFIG eptConfig, PHYSICAL_RANGE physicalRange, fnEPTHandlerCallback callback, PVOID userParameter);
+void EPT_insertViolationHandler(PEPT_CONFIG eptConfig, PEPT_HANDLER handler);
+void EPT_removeViolationHandler(PEPT_CONFIG eptConfig, PEPT_HANDLER handler);
+NTSTATUS EPT_reserveSplits(ULONG splitCount);
 NTSTATUS EPT_splitLargePage(PEPT_CONFIG eptConfig, PHYSICAL_ADDRESS physicalAddress);
 PEPT_PML2_2MB EPT_getPML2EFromAddress(PEPT_CONFIG eptConfig, PHYSICAL_ADDRESS physicalAddress);
 PEPT_PML1_ENTRY EPT_getPML1EFromAddress(PEPT_CONFIG eptConfig, PHYSICAL_ADDRESS physicalAddress);
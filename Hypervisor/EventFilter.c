@@ -0,0 +1,338 @@
+#include <ntifs.h>
+#include <intrin.h>
+#include "EventFilter.h"
+#include "VMM.h"
+#include "Debug.h"
+
+/******************** External API ********************/
+
+
+/******************** Module Typedefs ********************/
+
+/* Number of evaluations of each filter slot in progress on a logical processor, these are
+ * counts rather than flags as an event recorded in VMX root can interrupt one from the guest. */
+typedef struct _FILTER_READERS
+{
+	volatile LONG counts[2];
+	UINT8 padding[EVENT_CACHE_LINE - (2 * sizeof(LONG))];
+} FILTER_READERS, *PFILTER_READERS;
+
+/******************** Module Constants ********************/
+
+#define FILTER_SLOT_NONE (-1)
+
+/* Address bits of CR3, the PCID (or the cache control bits) are ignored. */
+#define FILTER_CR3_MASK (~(UINT64)0xFFF)
+
+C_ASSERT(sizeof(FILTER_READERS) == EVENT_CACHE_LINE);
+
+/******************** Module Variables ********************/
+
+/* The filter is double buffered, a new one is built in the inactive slot once nothing is
+ * still evaluating it, then made active in one go. So evaluating never takes a lock. */
+static EVENT_FILTER filterSlots[2] = { 0 };
+static volatile LONG activeSlot = FILTER_SLOT_NONE;
+
+static FILTER_READERS filterReaders[MAX_LOGICAL_PROCESSORS] = { 0 };
+
+/* Set whilst a filter is being installed, only one install can be in progress. */
+static volatile LONG installLock = 0;
+
+/******************** Module Prototypes ********************/
+static BOOLEAN validatePredicate(const EVENT_PREDICATE* predicate);
+static BOOLEAN evaluateFilter(const EVENT_FILTER* filter, ULONG procIndex, UINT32 exitReason, PCONTEXT context, CR3 cr3);
+static BOOLEAN evaluatePredicate(const EVENT_PREDICATE* predicate, ULONG procIndex, UINT32 exitReason, PCONTEXT context, CR3 cr3);
+
+/******************** Public Code ********************/
+
+NTSTATUS EventFilter_install(PMM_CONTEXT mmContext, CR3 guestCR3, GUEST_VIRTUAL_ADDRESS filter, SIZE_T filterSize)
+{
+	/* Called from VMX root, the filter is read straight from the guest into the inactive slot. */
+	NTSTATUS status;
+
+	if ((0 == filter) || (filterSize < FIELD_OFFSET(EVENT_FILTER, predicates)) || (filterSize > sizeof(EVENT_FILTER)))
+	{
+		status = STATUS_INVALID_PARAMETER;
+	}
+	else if (0 != InterlockedCompareExchange(&installLock, 1, 0))
+	{
+		status = STATUS_DEVICE_BUSY;
+	}
+	else
+	{
+		LONG slot = (0 == activeSlot) ? 1 : 0;
+
+		/* Wait for anything still evaluating the previous filter held in this slot. Evaluation
+		 * is bounded and runs with interrupts disabled, so it is never preempted and this is
+		 * never a long wait, nor a wait on this processor. */
+		for (ULONG i = 0; i < MAX_LOGICAL_PROCESSORS; i++)
+		{
+			while (0 != filterReaders[i].counts[slot])
+			{
+				_mm_pause();
+			}
+		}
+
+		PEVENT_FILTER newFilter = &filterSlots[slot];
+
+		status = MemManage_readVirtualAddress(mmContext, guestCR3, filter, newFilter, FIELD_OFFSET(EVENT_FILTER, predicates));
+		if (NT_SUCCESS(status))
+		{
+			ULONG predicateCount = newFilter->predicateCount;
+
+			if ((predicateCount > EVENT_FILTER_MAX_PREDICATES) ||
+				(filterSize < FIELD_OFFSET(EVENT_FILTER, predicates[predicateCount])))
+			{
+				status = STATUS_INVALID_PARAMETER;
+			}
+			else if (0 != predicateCount)
+			{
+				status = MemManage_readVirtualAddress(mmContext, guestCR3, filter + FIELD_OFFSET(EVENT_FILTER, predicates),
+													  newFilter->predicates, predicateCount * sizeof(EVENT_PREDICATE));
+			}
+
+			for (ULONG i = 0; (NT_SUCCESS(status)) && (i < predicateCount); i++)
+			{
+				if (FALSE == validatePredicate(&newFilter->predicates[i]))
+				{
+					status = STATUS_INVALID_PARAMETER;
+				}
+			}
+
+			if (NT_SUCCESS(status))
+			{
+				/* The last clause is ended regardless, so evaluation never depends on what follows. */
+				if (0 != predicateCount)
+				{
+					newFilter->predicates[predicateCount - 1].flags |= EVENT_PREDICATE_FLAG_END_CLAUSE;
+				}
+
+				/* An empty filter removes the filter altogether. */
+				InterlockedExchange(&activeSlot, (0 != predicateCount) ? slot : FILTER_SLOT_NONE);
+			}
+		}
+
+		InterlockedExchange(&installLock, 0);
+	}
+
+	return status;
+}
+
+BOOLEAN EventFilter_match(ULONG procIndex, UINT32 exitReason, PCONTEXT context, CR3 cr3)
+{
+	/* Safe from any IRQL and from VMX root, nothing is allocated and the cost
+	 * is bounded by EVENT_FILTER_MAX_PREDICATES. */
+	BOOLEAN result = TRUE;
+
+	LONG slot = activeSlot;
+	if ((FILTER_SLOT_NONE != slot) && (procIndex < MAX_LOGICAL_PROCESSORS))
+	{
+		PFILTER_READERS readers = &filterReaders[procIndex];
+
+		/* Interrupts are held off whilst the slot is claimed. Otherwise the guest could be
+		 * preempted with it claimed, and an install in VMX root on this processor would then
+		 * wait on it forever. They are always disabled in VMX root. */
+		BOOLEAN interruptsEnabled = (0 != (__readeflags() & EFLAGS_INTERRUPT_ENABLE_FLAG_FLAG));
+		_disable();
+
+		/* Claim the slot, then check it is still the active one. Otherwise an install
+		 * may already have started rewriting it, in which case use the new one. */
+		for (;;)
+		{
+			InterlockedIncrement(&readers->counts[slot]);
+
+			LONG currentSlot = activeSlot;
+			if (currentSlot == slot)
+			{
+				break;
+			}
+
+			InterlockedDecrement(&readers->counts[slot]);
+			slot = currentSlot;
+
+			if (FILTER_SLOT_NONE == slot)
+			{
+				break;
+			}
+		}
+
+		if (FILTER_SLOT_NONE != slot)
+		{
+			result = evaluateFilter(&filterSlots[slot], procIndex, exitReason, context, cr3);
+			InterlockedDecrement(&readers->counts[slot]);
+		}
+
+		if (TRUE == interruptsEnabled)
+		{
+			_enable();
+		}
+	}
+
+	return result;
+}
+
+/******************** Module Code ********************/
+
+static BOOLEAN validatePredicate(const EVENT_PREDICATE* predicate)
+{
+	BOOLEAN result = TRUE;
+
+	if ((predicate->operand >= EVENT_OPERAND_COUNT) || (predicate->comparison >= EVENT_COMPARE_COUNT))
+	{
+		result = FALSE;
+	}
+	else if ((EVENT_OPERAND_GPR == predicate->operand) && (predicate->registerIndex >= EVENT_GPR_COUNT))
+	{
+		result = FALSE;
+	}
+
+	return result;
+}
+
+static BOOLEAN evaluateFilter(const EVENT_FILTER* filter, ULONG procIndex, UINT32 exitReason, PCONTEXT context, CR3 cr3)
+{
+	BOOLEAN result = FALSE;
+	BOOLEAN clauseResult = TRUE;
+
+	ULONG predicateCount = filter->predicateCount;
+	if (predicateCount > EVENT_FILTER_MAX_PREDICATES)
+	{
+		predicateCount = EVENT_FILTER_MAX_PREDICATES;
+	}
+
+	for (ULONG i = 0; i < predicateCount; i++)
+	{
+		const EVENT_PREDICATE* predicate = &filter->predicates[i];
+
+		/* Once a predicate of the clause fails, the rest of it can be skipped. */
+		if (TRUE == clauseResult)
+		{
+			clauseResult = evaluatePredicate(predicate, procIndex, exitReason, context, cr3);
+		}
+
+		if (0 != (predicate->flags & EVENT_PREDICATE_FLAG_END_CLAUSE))
+		{
+			if (TRUE == clauseResult)
+			{
+				result = TRUE;
+				break;
+			}
+
+			clauseResult = TRUE;
+		}
+	}
+
+	return result;
+}
+
+static BOOLEAN evaluatePredicate(const EVENT_PREDICATE* predicate, ULONG procIndex, UINT32 exitReason, PCONTEXT context, CR3 cr3)
+{
+	BOOLEAN result = FALSE;
+	BOOLEAN available = TRUE;
+	UINT64 value = 0;
+
+	switch (predicate->operand)
+	{
+		case EVENT_OPERAND_PROC_INDEX:
+		{
+			value = procIndex;
+			break;
+		}
+
+		case EVENT_OPERAND_CR3:
+		{
+			value = cr3.Flags & FILTER_CR3_MASK;
+			break;
+		}
+
+		case EVENT_OPERAND_RIP:
+		{
+			available = (NULL != context);
+			value = (TRUE == available) ? context->Rip : 0;
+			break;
+		}
+
+		case EVENT_OPERAND_EXIT_REASON:
+		{
+			available = (EVENT_EXIT_REASON_NONE != exitReason);
+			value = exitReason;
+			break;
+		}
+
+		case EVENT_OPERAND_GPR:
+		{
+			/* RAX through R15 are in the same order within CONTEXT. */
+			available = (NULL != context);
+			if (TRUE == available)
+			{
+				if (EVENT_GPR_RIP == predicate->registerIndex)
+				{
+					value = context->Rip;
+				}
+				else if (EVENT_GPR_RFLAGS == predicate->registerIndex)
+				{
+					value = context->EFlags;
+				}
+				else if (predicate->registerIndex <= EVENT_GPR_R15)
+				{
+					value = (&context->Rax)[predicate->registerIndex];
+				}
+				else
+				{
+					available = FALSE;
+				}
+			}
+			break;
+		}
+
+		default:
+		{
+			available = FALSE;
+			break;
+		}
+	}
+
+	/* A predicate on something the event doesn't have never holds. */
+	if (TRUE == available)
+	{
+		switch (predicate->comparison)
+		{
+			case EVENT_COMPARE_EQUAL:
+			{
+				result = (value == predicate->first);
+				break;
+			}
+
+			case EVENT_COMPARE_NOT_EQUAL:
+			{
+				result = (value != predicate->first);
+				break;
+			}
+
+			case EVENT_COMPARE_IN_RANGE:
+			{
+				result = ((value >= predicate->first) && (value <= predicate->second));
+				break;
+			}
+
+			case EVENT_COMPARE_NOT_IN_RANGE:
+			{
+				result = ((value < predicate->first) || (value > predicate->second));
+				break;
+			}
+
+			case EVENT_COMPARE_MASK:
+			{
+				result = ((value & predicate->second) == predicate->first);
+				break;
+			}
+
+			default:
+			{
+				break;
+			}
+		}
+	}
+
+	return result;
+}
@@ -0,0 +1,16 @@
+#pragma once
+#include <wdm.h>
+#include "MemManage.h"
+#include "EventFilter_Common.h"
+
+/******************** Public Defines ********************/
+
+/******************** Public Typedefs ********************/
+
+/******************** Public Constants ********************/
+
+/******************** Public Variables ********************/
+
+/******************** Public Prototypes ********************/
+NTSTATUS EventFilter_install(PMM_CONTEXT mmContext, CR3 guestCR3, GUEST_VIRTUAL_ADDRESS filter, SIZE_T filterSize);
+BOOLEAN EventFilter_match(ULONG procIndex, UINT32 exitReason, PCONTEXT context, CR3 cr3);
@@ -1,51 +1,502 @@
-#include <ntddk.h>
+#include <ntifs.h>
 #include "EventLog.h"
 #include "EventLog_Common.h"
+#include "EventFilter.h"
 #include "Intrinsics.h"
+#include "VMM.h"
+#include "Debug.h"
 
 /******************** External API ********************/
 
-
 /******************** Module Typedefs ********************/
 
+/* The process the rings are currently mapped into, whilst there is one the
+ * writer leaves the rings alone as the consumer owns the cursors. */
+typedef struct _EVENT_CONSUMER
+{
+	HANDLE processId;
+
+	PMDL ringsMdl;
+	PMDL cursorsMdl;
+
+	PVOID userRings;
+	PVOID userCursors;
+} EVENT_CONSUMER, *PEVENT_CONSUMER;
+
+/* State of the writer thread, records are re-encoded into a staging buffer so they can be
+ * delta encoded against the previous record of the file, and written out in large writes. */
+typedef struct _EVENT_WRITER
+{
+	HANDLE fileHandle;
+
+	PUINT8 buffer;
+	SIZE_T bufferUsed;
+
+	/* Records within the buffer for each ring, counted once the buffer has been written. */
+	UINT64 bufferedCounts[EVENT_MAX_RINGS];
+
+	/* Fields of the previous record written, used for the delta encoding. */
+	BOOLEAN havePrevious;
+	UINT64 previousTimeStamp;
+	UINT32 previousProcIndex;
+	BOOLEAN havePreviousCR3;
+	UINT64 previousCR3;
+
+	/* Calibration of the TSCs taken when the writer started, which goes into the header
+	 * of every session, and the interrupt time the next periodic calibration is due. */
+	EVENT_CALIBRATION launchCalibration;
+	UINT64 timeStampFrequency;
+	ULONGLONG nextCalibrationTime;
+
+	/* Strings defined within the session so far, one bit for each id less one. */
+	UINT64 definedStrings[EVENT_STRING_MAX_COUNT / 64];
+} EVENT_WRITER, *PEVENT_WRITER;
+
+/* Shared by every processor taking part in a calibration. */
+typedef struct _CALIBRATION_CONTEXT
+{
+	volatile LONG arrivedCount;
+	LONG processorCount;
+	PEVENT_CALIBRATION calibration;
+} CALIBRATION_CONTEXT, *PCALIBRATION_CONTEXT;
 
 /******************** Module Constants ********************/
 
+#define EVENT_POOL_TAG 'gvEH'
+
+/* Size of the staging buffer of the writer, flushed whenever another record might not fit. */
+#define EVENT_WRITER_BUFFER_SIZE (256 * 1024)
+
+C_ASSERT((EVENT_RING_BYTES & EVENT_RING_MASK) == 0);
+C_ASSERT((EVENT_RING_BYTES % EVENT_RECORD_ALIGNMENT) == 0);
+C_ASSERT((sizeof(EVENT_RECORD_HEADER) + sizeof(EVENT_CALIBRATION)) <= EVENT_RECORD_MAX_SIZE);
+C_ASSERT((sizeof(EVENT_CALIBRATION) % EVENT_RECORD_ALIGNMENT) == 0);
+C_ASSERT(EVENT_MAX_RINGS == MAX_LOGICAL_PROCESSORS);
+C_ASSERT((EVENT_STRING_MAX_COUNT & (EVENT_STRING_MAX_COUNT - 1)) == 0);
+C_ASSERT((sizeof(EVENT_RECORD_HEADER) + sizeof(UINT32) + sizeof(UINT16) + EVENT_STRING_MAX_LENGTH) <= EVENT_RECORD_MAX_SIZE);
+C_ASSERT((sizeof(EVENT_RECORD_HEADER) + sizeof(UINT64) + sizeof(UINT32) + (3 * sizeof(UINT64)) + sizeof(EVENT_GPRS) +
+		  sizeof(UINT16) + EVENT_EXTENDED_SIZE + sizeof(UINT16) + EVENT_STRING_MAX_INLINE + EVENT_RECORD_ALIGNMENT) <= EVENT_RECORD_MAX_SIZE);
+C_ASSERT(EVENT_WRITER_BUFFER_SIZE > ((2 * EVENT_RECORD_MAX_SIZE) + sizeof(EVENT_FILE_HEADER) + sizeof(EVENT_CALIBRATION)));
+C_ASSERT(sizeof(EVENT_CURSORS) == PAGE_SIZE);
 
 /******************** Module Variables ********************/
 
+/* Rings of every logical processor, within a single allocation so they can be mapped
+ * into a consumer as a whole. Allocated before the hypervisor is launched. */
+static PEVENT_RING eventRings = NULL;
+static SIZE_T eventRingsSize = 0;
+static ULONG eventRingCount = 0;
+
+/* Strings interned by the producers, within the same allocation as the rings. */
+static PEVENT_STRING_TABLE eventStrings = NULL;
+
+/* Cursors of every ring, within a page of their own as the consumer writes to them. */
+static PEVENT_CURSORS eventCursors = NULL;
+
+/* Serialises the writer against mapping and unmapping of the consumer. */
+static FAST_MUTEX consumerLock;
+static EVENT_CONSUMER consumer = { 0 };
+
+/* Signalled to stop the writer, which is waited on as it exits. */
+static KEVENT writerStopEvent;
+static PKTHREAD writerThreadObject = NULL;
 
 /******************** Module Prototypes ********************/
-static NTSTATUS saveEventToFile(LPWSTR fileName, PEVENT_DATA eventData);
+static BOOLEAN reserveRecord(PEVENT_RING ring, PEVENT_CURSOR cursor, ULONG size, PLONG position);
+static void commitRecord(PEVENT_RING ring, LONG position, ULONG size, UINT16 fields);
+static UINT32 internString(CHAR const* string, UINT16 length);
+static PUINT8 appendBytes(PUINT8 destination, const void* source, SIZE_T size);
+static void writerThread(PVOID context);
+static SIZE_T encodeRing(PEVENT_WRITER writer, ULONG ringIndex);
+static BOOLEAN encodeRecord(PEVENT_WRITER writer, const EVENT_RECORD_HEADER* header);
+static UINT32 recordStringId(const EVENT_RECORD_HEADER* header);
+static const UINT8* nextField(const UINT8** source, PSIZE_T remaining, SIZE_T size);
+static void defineString(PEVENT_WRITER writer, UINT32 id);
+static void beginSession(PEVENT_WRITER writer);
+static void takeCalibration(PEVENT_CALIBRATION calibration);
+static ULONG_PTR calibrateProcessor(ULONG_PTR argument);
+static void writeCalibration(PEVENT_WRITER writer);
+static void flushWriter(PEVENT_WRITER writer);
+static NTSTATUS openEventFile(LPWSTR fileName, PHANDLE fileHandle);
+static void unmapConsumer(void);
+static void processNotify(PEPROCESS process, HANDLE processId, PPS_CREATE_NOTIFY_INFO createInfo);
 
 /******************** Public Code ********************/
 
-void EventLog_init(void)
+NTSTATUS EventLog_init(void)
 {
+	NTSTATUS status = STATUS_NO_MEMORY;
 
+	ULONG processorCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	if (processorCount > MAX_LOGICAL_PROCESSORS)
+	{
+		processorCount = MAX_LOGICAL_PROCESSORS;
+	}
+
+	ExInitializeFastMutex(&consumerLock);
+	KeInitializeEvent(&writerStopEvent, NotificationEvent, FALSE);
+
+	/* Whole pages only, so that nothing else shares the pages that are mapped to the consumer.
+	 * The string table follows the last ring, so it is mapped read only along with them. */
+	eventRingsSize = ROUND_TO_PAGES((processorCount * sizeof(EVENT_RING)) + sizeof(EVENT_STRING_TABLE));
+	eventRings = (PEVENT_RING)ExAllocatePoolWithTag(NonPagedPoolNx, eventRingsSize, EVENT_POOL_TAG);
+	eventCursors = (PEVENT_CURSORS)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(EVENT_CURSORS), EVENT_POOL_TAG);
+
+	if ((NULL != eventRings) && (NULL != eventCursors))
+	{
+		RtlZeroMemory(eventRings, eventRingsSize);
+		RtlZeroMemory(eventCursors, sizeof(EVENT_CURSORS));
+		eventStrings = (PEVENT_STRING_TABLE)&eventRings[processorCount];
+
+		/* The consumer has to be unmapped before its process goes away. */
+		status = PsSetCreateProcessNotifyRoutineEx(processNotify, FALSE);
+		if (NT_SUCCESS(status))
+		{
+			/* The ring count is set first, the writer reads it from the start. */
+			eventRingCount = processorCount;
+
+			HANDLE threadHandle;
+			status = PsCreateSystemThread(&threadHandle, THREAD_ALL_ACCESS, NULL, NULL, NULL, writerThread, NULL);
+			if (NT_SUCCESS(status))
+			{
+				/* Keep hold of the thread, so it can be waited on when it is stopped. */
+				status = ObReferenceObjectByHandle(threadHandle, SYNCHRONIZE, *PsThreadType, KernelMode, (PVOID*)&writerThreadObject, NULL);
+				if (FALSE == NT_SUCCESS(status))
+				{
+					/* The rings are freed below, so it has to have exited first. */
+					KeSetEvent(&writerStopEvent, IO_NO_INCREMENT, FALSE);
+					ZwWaitForSingleObject(threadHandle, FALSE, NULL);
+				}
+
+				ZwClose(threadHandle);
+			}
+
+			if (FALSE == NT_SUCCESS(status))
+			{
+				eventRingCount = 0;
+				PsSetCreateProcessNotifyRoutineEx(processNotify, TRUE);
+			}
+		}
+	}
+
+	if (!NT_SUCCESS(status))
+	{
+		if (NULL != eventRings)
+		{
+			ExFreePoolWithTag(eventRings, EVENT_POOL_TAG);
+			eventRings = NULL;
+			eventStrings = NULL;
+		}
+
+		if (NULL != eventCursors)
+		{
+			ExFreePoolWithTag(eventCursors, EVENT_POOL_TAG);
+			eventCursors = NULL;
+		}
+	}
+
+	return status;
 }
 
-DECLSPEC_NORETURN void EventLog_logAsGuestThenRestore(PCONTEXT context, ULONG procIndex, CHAR const* extraString)
+void EventLog_uninit(void)
+{
+	/* Called at PASSIVE_LEVEL when the hypervisor fails to start, so nothing can log an event
+	 * and no consumer can have mapped the rings. What is in the rings is written out before
+	 * the writer exits. */
+	if (NULL != writerThreadObject)
+	{
+		KeSetEvent(&writerStopEvent, IO_NO_INCREMENT, FALSE);
+
+		KeWaitForSingleObject(writerThreadObject, Executive, KernelMode, FALSE, NULL);
+		ObDereferenceObject(writerThreadObject);
+		writerThreadObject = NULL;
+
+		PsSetCreateProcessNotifyRoutineEx(processNotify, TRUE);
+
+		eventRingCount = 0;
+		ExFreePoolWithTag(eventRings, EVENT_POOL_TAG);
+		eventRings = NULL;
+		eventStrings = NULL;
+
+		ExFreePoolWithTag(eventCursors, EVENT_POOL_TAG);
+		eventCursors = NULL;
+	}
+}
+
+BOOLEAN EventLog_record(ULONG procIndex, UINT32 exitReason, UINT16 captureFields, PCONTEXT context, CR0 cr0, CR3 cr3, CR4 cr4,
+						CHAR const* extraString)
+{
+	/* Never blocks and never calls into the OS, so this is safe from any IRQL and VMX root.
+	 * Only the fields asked for are captured. Returns FALSE when the record had to be dropped,
+	 * or the event didn't match the event filter. The exit reason is only used by the filter,
+	 * EVENT_EXIT_REASON_NONE when the event didn't come from a VM exit. */
+	BOOLEAN result = FALSE;
+
+	if ((procIndex < eventRingCount) && (FALSE == EventFilter_match(procIndex, exitReason, context, cr3)))
+	{
+		/* Filtered out before anything has been written to the ring. */
+		InterlockedIncrement64(&eventRings[procIndex].header.filteredCount);
+	}
+	else if (procIndex < eventRingCount)
+	{
+		UINT16 fields = EVENT_FIELD_TIMESTAMP | EVENT_FIELD_PROC_INDEX |
+			(captureFields & (EVENT_CAPTURE_CONTROL_REGISTERS | EVENT_FIELD_GPRS | EVENT_FIELD_EXTENDED | EVENT_FIELD_STRING));
+
+		if (NULL == context)
+		{
+			fields &= ~(EVENT_FIELD_GPRS | EVENT_FIELD_EXTENDED);
+		}
+
+		UINT16 stringLength = 0;
+		UINT32 stringId = EVENT_STRING_ID_NONE;
+
+		if ((NULL != extraString) && (0 != (fields & EVENT_FIELD_STRING)))
+		{
+			while ((stringLength < EVENT_STRING_MAX_LENGTH) && ('\0' != extraString[stringLength]))
+			{
+				stringLength++;
+			}
+
+			/* Only the first EVENT_STRING_MAX_LENGTH characters are kept, so a record always fits. */
+			if ('\0' != extraString[stringLength])
+			{
+				InterlockedIncrement64(&eventRings[procIndex].header.truncatedCount);
+			}
+
+			if (0 != stringLength)
+			{
+				stringId = internString(extraString, stringLength);
+			}
+		}
+
+		/* The string is only held inline when it couldn't be interned. */
+		if (EVENT_STRING_ID_NONE != stringId)
+		{
+			fields = (fields & ~EVENT_FIELD_STRING) | EVENT_FIELD_STRING_ID;
+		}
+		else if (0 == stringLength)
+		{
+			fields &= ~EVENT_FIELD_STRING;
+		}
+		else if (stringLength > EVENT_STRING_MAX_INLINE)
+		{
+			stringLength = EVENT_STRING_MAX_INLINE;
+		}
+
+		/* Work out the size of the record from the fields that are present. */
+		ULONG size = sizeof(EVENT_RECORD_HEADER) + sizeof(UINT64) + sizeof(UINT32);
+		size += (0 != (fields & EVENT_FIELD_CR0)) ? sizeof(UINT64) : 0;
+		size += (0 != (fields & EVENT_FIELD_CR3)) ? sizeof(UINT64) : 0;
+		size += (0 != (fields & EVENT_FIELD_CR4)) ? sizeof(UINT64) : 0;
+		size += (0 != (fields & EVENT_FIELD_GPRS)) ? sizeof(EVENT_GPRS) : 0;
+		size += (0 != (fields & EVENT_FIELD_EXTENDED)) ? (sizeof(UINT16) + EVENT_EXTENDED_SIZE) : 0;
+		size += (0 != (fields & EVENT_FIELD_STRING)) ? (sizeof(UINT16) + stringLength) : 0;
+		size += (0 != (fields & EVENT_FIELD_STRING_ID)) ? sizeof(UINT32) : 0;
+		size = ALIGN_UP_BY(size, EVENT_RECORD_ALIGNMENT);
+
+		PEVENT_RING ring = &eventRings[procIndex];
+
+		LONG position;
+		if (TRUE == reserveRecord(ring, &eventCursors->cursors[procIndex], size, &position))
+		{
+			PUINT8 record = &ring->data[position & EVENT_RING_MASK];
+			PUINT8 payload = record + sizeof(EVENT_RECORD_HEADER);
+
+			UINT64 timeStamp = __rdtsc();
+			UINT32 procIndex32 = procIndex;
+
+			payload = appendBytes(payload, &timeStamp, sizeof(timeStamp));
+			payload = appendBytes(payload, &procIndex32, sizeof(procIndex32));
+
+			if (0 != (fields & EVENT_FIELD_CR0))
+			{
+				payload = appendBytes(payload, &cr0.Flags, sizeof(UINT64));
+			}
+
+			if (0 != (fields & EVENT_FIELD_CR3))
+			{
+				payload = appendBytes(payload, &cr3.Flags, sizeof(UINT64));
+			}
+
+			if (0 != (fields & EVENT_FIELD_CR4))
+			{
+				payload = appendBytes(payload, &cr4.Flags, sizeof(UINT64));
+			}
+
+			if (0 != (fields & EVENT_FIELD_GPRS))
+			{
+				EVENT_GPRS gprs;
+				RtlCopyMemory(&gprs.registers[EVENT_GPR_RAX], &context->Rax, (EVENT_GPR_R15 + 1) * sizeof(UINT64));
+				gprs.registers[EVENT_GPR_RIP] = context->Rip;
+				gprs.registers[EVENT_GPR_RFLAGS] = context->EFlags;
+
+				payload = appendBytes(payload, &gprs, sizeof(gprs));
+			}
+
+			if (0 != (fields & EVENT_FIELD_EXTENDED))
+			{
+				UINT16 extendedSize = EVENT_EXTENDED_SIZE;
+
+				payload = appendBytes(payload, &extendedSize, sizeof(extendedSize));
+				payload = appendBytes(payload, &context->FltSave, EVENT_EXTENDED_SIZE);
+			}
+
+			if (0 != (fields & EVENT_FIELD_STRING))
+			{
+				payload = appendBytes(payload, &stringLength, sizeof(stringLength));
+				payload = appendBytes(payload, extraString, stringLength);
+			}
+
+			if (0 != (fields & EVENT_FIELD_STRING_ID))
+			{
+				payload = appendBytes(payload, &stringId, sizeof(stringId));
+			}
+
+			/* Don't leave stale bytes in the alignment padding, the ring can be mapped to a consumer. */
+			RtlZeroMemory(payload, (record + size) - payload);
+
+			commitRecord(ring, position, size, fields);
+			result = TRUE;
+		}
+	}
+
+	return result;
+}
+
+NTSTATUS EventLog_getCounters(ULONG procIndex, PUINT64 writtenCount, PUINT64 droppedCount, PUINT64 filteredCount,
+							  PUINT64 truncatedCount)
+{
+	NTSTATUS status;
+
+	if (procIndex < eventRingCount)
+	{
+		*writtenCount = (UINT64)eventRings[procIndex].header.writtenCount;
+		*droppedCount = (UINT64)eventRings[procIndex].header.droppedCount;
+		*filteredCount = (UINT64)eventRings[procIndex].header.filteredCount;
+		*truncatedCount = (UINT64)eventRings[procIndex].header.truncatedCount;
+		status = STATUS_SUCCESS;
+	}
+	else
+	{
+		status = STATUS_INVALID_PARAMETER;
+	}
+
+	return status;
+}
+
+NTSTATUS EventLog_mapConsumer(PVOID* rings, PVOID* cursors, PULONG ringCount)
 {
-	/* Back up the context to a stack based variable as we need to free
-	 * the one allocated by a pool */
-	EVENT_DATA eventData;
+	/* Must be called at PASSIVE_LEVEL, attached to the consumer process. The rings are
+	 * mapped read only, the cursors are the only thing the consumer can write to. */
+	NTSTATUS status;
+
+	if (0 == eventRingCount)
+	{
+		status = STATUS_DEVICE_NOT_READY;
+	}
+	else
+	{
+		ExAcquireFastMutex(&consumerLock);
+
+		if (NULL == consumer.processId)
+		{
+			consumer.ringsMdl = IoAllocateMdl(eventRings, (ULONG)eventRingsSize, FALSE, FALSE, NULL);
+			consumer.cursorsMdl = IoAllocateMdl(eventCursors, sizeof(EVENT_CURSORS), FALSE, FALSE, NULL);
+
+			if ((NULL != consumer.ringsMdl) && (NULL != consumer.cursorsMdl))
+			{
+				MmBuildMdlForNonPagedPool(consumer.ringsMdl);
+				MmBuildMdlForNonPagedPool(consumer.cursorsMdl);
 
-	eventData.procIndex = procIndex;
-	eventData.timeStamp = __rdtsc();
-	eventData.cr0.Flags = __readcr0();
-	eventData.cr3.Flags = __readcr3();
-	eventData.cr4.Flags = __readcr4();
-	eventData.context = *context;
+				__try
+				{
+					/* Mapped without write access, so the consumer can never corrupt a ring. */
+					consumer.userRings = MmMapLockedPagesSpecifyCache(consumer.ringsMdl, UserMode, MmCached, NULL, FALSE,
+																	  NormalPagePriority | MdlMappingNoWrite);
+					consumer.userCursors = MmMapLockedPagesSpecifyCache(consumer.cursorsMdl, UserMode, MmCached, NULL, FALSE, NormalPagePriority);
+					status = STATUS_SUCCESS;
+				}
+				__except (EXCEPTION_EXECUTE_HANDLER)
+				{
+					status = GetExceptionCode();
+				}
+
+				if (NT_SUCCESS(status) && ((NULL == consumer.userRings) || (NULL == consumer.userCursors)))
+				{
+					status = STATUS_INSUFFICIENT_RESOURCES;
+				}
+			}
+			else
+			{
+				status = STATUS_INSUFFICIENT_RESOURCES;
+			}
+
+			if (NT_SUCCESS(status))
+			{
+				consumer.processId = PsGetProcessId(PsGetCurrentProcess());
+			}
+			else
+			{
+				unmapConsumer();
+			}
+		}
+		else if (PsGetProcessId(PsGetCurrentProcess()) == consumer.processId)
+		{
+			/* Already mapped, just hand back the same mapping. */
+			status = STATUS_SUCCESS;
+		}
+		else
+		{
+			status = STATUS_DEVICE_BUSY;
+		}
+
+		if (NT_SUCCESS(status))
+		{
+			*rings = consumer.userRings;
+			*cursors = consumer.userCursors;
+			*ringCount = eventRingCount;
+		}
+
+		ExReleaseFastMutex(&consumerLock);
+	}
+
+	return status;
+}
+
+NTSTATUS EventLog_unmapConsumer(void)
+{
+	/* Must be called at PASSIVE_LEVEL, attached to the consumer process. */
+	NTSTATUS status;
 
-	/* Fill in extra text strings. */
-	if (NULL != extraString)
+	ExAcquireFastMutex(&consumerLock);
+
+	if ((NULL != consumer.processId) && (PsGetProcessId(PsGetCurrentProcess()) == consumer.processId))
+	{
+		unmapConsumer();
+		status = STATUS_SUCCESS;
+	}
+	else
 	{
-		memcpy(eventData.extraString, extraString, strlen(extraString));
+		status = STATUS_INVALID_PARAMETER;
 	}
 
-	/* Attempt to write it the event to a file. */
-	(void)saveEventToFile(L"\\??\\C:\\EventLog.bin", &eventData);
+	ExReleaseFastMutex(&consumerLock);
+
+	return status;
+}
+
+DECLSPEC_NORETURN void EventLog_logAsGuestThenRestore(PCONTEXT context, ULONG procIndex, CHAR const* extraString)
+{
+	CR0 cr0;
+	CR3 cr3;
+	CR4 cr4;
+
+	cr0.Flags = __readcr0();
+	cr3.Flags = __readcr3();
+	cr4.Flags = __readcr4();
+
+	/* The writer thread takes care of getting it to disk. */
+	(void)EventLog_record(procIndex, EVENT_EXIT_REASON_NONE, EVENT_CAPTURE_DEFAULT, context, cr0, cr3, cr4, extraString);
 
 	/* Restore the context. */
 	_RestoreFromLog(context, NULL);
@@ -53,39 +504,715 @@ DECLSPEC_NORETURN void EventLog_logAsGuestThenRestore(PCONTEXT context, ULONG pr
 
 /******************** Module Code ********************/
 
-static NTSTATUS saveEventToFile(LPWSTR fileName, PEVENT_DATA eventData)
+static BOOLEAN reserveRecord(PEVENT_RING ring, PEVENT_CURSOR cursor, ULONG size, PLONG position)
 {
-	/* Create the file. */
-	HANDLE hFile;
-	OBJECT_ATTRIBUTES objectAttributes;
-	IO_STATUS_BLOCK ioStatusBlock;
+	BOOLEAN result = FALSE;
 
-	UNICODE_STRING usFilePath;
-	RtlInitUnicodeString(&usFilePath, fileName);
+	LONG head = ring->header.head;
+	ULONG padding;
 
-	InitializeObjectAttributes(&objectAttributes, &usFilePath, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL);
+	for (;;)
+	{
+		/* Records never wrap, when there isn't room before the end of the ring
+		 * the rest of it is taken up with a padding record. */
+		ULONG offset = head & EVENT_RING_MASK;
+		padding = ((offset + size) > EVENT_RING_BYTES) ? (EVENT_RING_BYTES - offset) : 0;
 
-	KIRQL origIRQL = KeGetCurrentIrql();
+		/* The consumer may be another process, so only its cursor is trusted to say how much
+		 * is free. Space isn't released until every record before it has been committed,
+		 * so a producer interrupted half way through its record only holds the consumer up. */
+		if ((ULONG)((head + padding + size) - cursor->tail) > EVENT_RING_BYTES)
+		{
+			/* The consumer hasn't caught up, drop the record rather than stall. */
+			InterlockedIncrement64(&ring->header.droppedCount);
+			break;
+		}
 
-	KeLowerIrql(PASSIVE_LEVEL);
+		LONG previous = InterlockedCompareExchange(&ring->header.head, head + padding + size, head);
+		if (previous == head)
+		{
+			result = TRUE;
+			break;
+		}
 
-	NTSTATUS status = ZwCreateFile(&hFile, GENERIC_WRITE, &objectAttributes, &ioStatusBlock, NULL,
-		FILE_ATTRIBUTE_NORMAL, 0, FILE_OPEN_IF, FILE_SYNCHRONOUS_IO_NONALERT, NULL, 0);
+		/* Another producer reserved this position first. */
+		head = previous;
+	}
+
+	if (TRUE == result)
+	{
+		if (0 != padding)
+		{
+			commitRecord(ring, head, padding, EVENT_FIELD_PADDING);
+		}
+
+		*position = head + padding;
+	}
+
+	return result;
+}
+
+static void commitRecord(PEVENT_RING ring, LONG position, ULONG size, UINT16 fields)
+{
+	EVENT_RECORD_HEADER header;
+	header.size = (UINT16)size;
+	header.fields = fields;
+	header.sequence = EVENT_SEQUENCE(position);
+
+	/* The header is written last and in one go, as its sequence is what commits the record. */
+	InterlockedExchange64((volatile LONG64*)&ring->data[position & EVENT_RING_MASK], *(LONG64*)&header);
+}
+
+static UINT32 internString(CHAR const* string, UINT16 length)
+{
+	/* Lock free, as it is called from VMX root. A slot that another producer is still filling
+	 * in isn't waited for, as that producer may have been interrupted, the string is just held
+	 * inline instead. Returns EVENT_STRING_ID_NONE when the string couldn't be interned. */
+	UINT32 result = EVENT_STRING_ID_NONE;
+
+	/* FNV-1a, never zero so it can't be mistaken for an empty slot. */
+	UINT64 hash = 0xCBF29CE484222325ULL;
+	for (UINT16 i = 0; i < length; i++)
+	{
+		hash = (hash ^ (UINT8)string[i]) * 0x100000001B3ULL;
+	}
+
+	hash |= 1;
+
+	for (ULONG probe = 0; probe < EVENT_STRING_MAX_PROBES; probe++)
+	{
+		ULONG index = (ULONG)(hash + probe) & (EVENT_STRING_MAX_COUNT - 1);
+		PEVENT_STRING_SLOT slot = &eventStrings->slots[index];
+
+		LONG state = InterlockedCompareExchange(&slot->state, EVENT_STRING_STATE_CLAIMED, EVENT_STRING_STATE_FREE);
+		if (EVENT_STRING_STATE_FREE == state)
+		{
+			LONG offset = InterlockedExchangeAdd(&eventStrings->bytesUsed, length);
+
+			slot->hash = hash;
+			slot->length = length;
+
+			if ((offset + length) <= EVENT_STRING_BYTES)
+			{
+				RtlCopyMemory(&eventStrings->bytes[offset], string, length);
+				slot->offset = (UINT32)offset;
+
+				InterlockedExchange(&slot->state, EVENT_STRING_STATE_PUBLISHED);
+				result = index + 1;
+			}
+			else
+			{
+				/* Later producers with the same string find the slot full, so they stop here too. */
+				InterlockedExchange(&slot->state, EVENT_STRING_STATE_FULL);
+			}
+
+			break;
+		}
+
+		if (EVENT_STRING_STATE_CLAIMED == state)
+		{
+			break;
+		}
+
+		if ((hash == slot->hash) && (length == slot->length))
+		{
+			if ((EVENT_STRING_STATE_PUBLISHED == state) && (length == RtlCompareMemory(&eventStrings->bytes[slot->offset], string, length)))
+			{
+				result = index + 1;
+				break;
+			}
+
+			if (EVENT_STRING_STATE_FULL == state)
+			{
+				break;
+			}
+		}
+	}
+
+	return result;
+}
+
+static PUINT8 appendBytes(PUINT8 destination, const void* source, SIZE_T size)
+{
+	RtlCopyMemory(destination, source, size);
+	return destination + size;
+}
+
+static void writerThread(PVOID context)
+{
+	UNREFERENCED_PARAMETER(context);
+
+	EVENT_WRITER writer = { 0 };
+
+	NTSTATUS status = STATUS_NO_MEMORY;
+
+	writer.buffer = (PUINT8)ExAllocatePoolWithTag(PagedPool, EVENT_WRITER_BUFFER_SIZE, EVENT_POOL_TAG);
+	if (NULL != writer.buffer)
+	{
+		status = openEventFile(L"\\??\\C:\\EventLog.hvt", &writer.fileHandle);
+	}
 
 	if (NT_SUCCESS(status))
 	{
-		/* Write the current event data to the file. */
+		LARGE_INTEGER interval;
+		interval.QuadPart = -10000LL * EVENT_WRITER_INTERVAL_MS;
+
+		/* Two calibrations a short while apart give the TSC frequency, so timestamps
+		 * can be converted even before the first periodic calibration. */
+		LARGE_INTEGER span;
+		span.QuadPart = -10000LL * EVENT_CALIBRATION_SPAN_MS;
+
+		EVENT_CALIBRATION spanCalibration;
+		takeCalibration(&writer.launchCalibration);
+		KeDelayExecutionThread(KernelMode, FALSE, &span);
+		takeCalibration(&spanCalibration);
+
+		UINT64 elapsedTime = spanCalibration.referenceTime - writer.launchCalibration.referenceTime;
+		if (0 != elapsedTime)
+		{
+			writer.timeStampFrequency = ((spanCalibration.timeStamps[0] - writer.launchCalibration.timeStamps[0]) *
+										 10000000ULL) / elapsedTime;
+		}
+
+		beginSession(&writer);
+		writer.nextCalibrationTime = KeQueryInterruptTime() + (10000ULL * EVENT_CALIBRATION_INTERVAL_MS);
+
+		NTSTATUS waitStatus = STATUS_TIMEOUT;
+		while (STATUS_TIMEOUT == waitStatus)
+		{
+			/* Periodic calibrations are written as records of their own, so the conversion
+			 * of timestamps can follow any drift between the processors. */
+			if (KeQueryInterruptTime() >= writer.nextCalibrationTime)
+			{
+				writeCalibration(&writer);
+				writer.nextCalibrationTime += 10000ULL * EVENT_CALIBRATION_INTERVAL_MS;
+			}
+
+			/* Only sleep once a whole pass finds nothing left to write. */
+			SIZE_T encodedCount = 0;
+
+			ExAcquireFastMutex(&consumerLock);
+
+			if (NULL == consumer.processId)
+			{
+				for (ULONG i = 0; i < eventRingCount; i++)
+				{
+					encodedCount += encodeRing(&writer, i);
+				}
+			}
+
+			ExReleaseFastMutex(&consumerLock);
+
+			if (0 != encodedCount)
+			{
+				flushWriter(&writer);
+			}
+			else
+			{
+				waitStatus = KeWaitForSingleObject(&writerStopEvent, Executive, KernelMode, FALSE, &interval);
+			}
+		}
+
+		ZwClose(writer.fileHandle);
+	}
+	else
+	{
+		DEBUG_PRINT("Unable to open the event log. Status: 0x%08X\r\n", status);
+	}
+
+	if (NULL != writer.buffer)
+	{
+		ExFreePoolWithTag(writer.buffer, EVENT_POOL_TAG);
+	}
+
+	PsTerminateSystemThread(status);
+}
+
+static SIZE_T encodeRing(PEVENT_WRITER writer, ULONG ringIndex)
+{
+	PEVENT_RING ring = &eventRings[ringIndex];
+	PEVENT_CURSOR cursor = &eventCursors->cursors[ringIndex];
+
+	LONG tail = cursor->tail;
+	LONG position = tail;
+	SIZE_T count = 0;
+
+	const EVENT_RECORD_HEADER* header;
+	while (NULL != (header = EventLog_peekRecord(ring, &position)))
+	{
+		/* A record may need the definition of its string to go before it. */
+		if ((writer->bufferUsed + (2 * EVENT_RECORD_MAX_SIZE)) > EVENT_WRITER_BUFFER_SIZE)
+		{
+			flushWriter(writer);
+		}
+
+		UINT32 stringId = recordStringId(header);
+		if (EVENT_STRING_ID_NONE != stringId)
+		{
+			defineString(writer, stringId);
+		}
+
+		if (TRUE == encodeRecord(writer, header))
+		{
+			writer->bufferedCounts[ringIndex]++;
+		}
+		else
+		{
+			InterlockedIncrement64(&ring->header.droppedCount);
+		}
+
+		position += header->size;
+		count++;
+	}
+
+	/* The records have been copied out, so they can be given back straight away. */
+	if (position != tail)
+	{
+		EventLog_releaseRecords(cursor, position);
+	}
+
+	return count;
+}
+
+static BOOLEAN encodeRecord(PEVENT_WRITER writer, const EVENT_RECORD_HEADER* header)
+{
+	/* Within the ring the timestamp and processor index are always present, and nothing
+	 * is delta encoded as the order the producers commit in isn't the order of the ring.
+	 * The rings are mapped into the consumer, so the fields a record claims to have are
+	 * bounded by its size. Returns FALSE, having written nothing, when they overrun it. */
+	BOOLEAN result = FALSE;
+
+	UINT16 recordFields = header->fields;
+	SIZE_T remaining = header->size;
+	const UINT8* source = (const UINT8*)header;
+
+	/* Never larger than a record can be, so the space encodeRing has made always suffices. */
+	if (remaining > EVENT_RECORD_MAX_SIZE)
+	{
+		source = NULL;
+	}
+
+	(void)nextField(&source, &remaining, sizeof(EVENT_RECORD_HEADER));
+	const UINT8* timeStampField = nextField(&source, &remaining, sizeof(UINT64));
+	const UINT8* procIndexField = nextField(&source, &remaining, sizeof(UINT32));
+
+	if ((NULL != timeStampField) && (NULL != procIndexField))
+	{
+		PUINT8 record = writer->buffer + writer->bufferUsed;
+		PUINT8 payload = record + sizeof(EVENT_RECORD_HEADER);
+		UINT16 fields = recordFields & ~(EVENT_FIELD_TIMESTAMP | EVENT_FIELD_PROC_INDEX | EVENT_FIELD_CR3);
+
+		UINT64 timeStamp;
+		RtlCopyMemory(&timeStamp, timeStampField, sizeof(timeStamp));
+
+		if ((TRUE == writer->havePrevious) && (timeStamp >= writer->previousTimeStamp) &&
+			((timeStamp - writer->previousTimeStamp) <= MAXUINT32))
+		{
+			UINT32 delta = (UINT32)(timeStamp - writer->previousTimeStamp);
+			payload = appendBytes(payload, &delta, sizeof(delta));
+			fields |= EVENT_FIELD_TIMESTAMP_DELTA;
+		}
+		else
+		{
+			payload = appendBytes(payload, &timeStamp, sizeof(timeStamp));
+			fields |= EVENT_FIELD_TIMESTAMP;
+		}
+
+		UINT32 procIndex;
+		RtlCopyMemory(&procIndex, procIndexField, sizeof(procIndex));
+
+		/* The processor index is left out whilst it stays the same. */
+		if ((FALSE == writer->havePrevious) || (procIndex != writer->previousProcIndex))
+		{
+			payload = appendBytes(payload, &procIndex, sizeof(procIndex));
+			fields |= EVENT_FIELD_PROC_INDEX;
+		}
+
+		if (0 != (recordFields & EVENT_FIELD_CR0))
+		{
+			const UINT8* cr0Field = nextField(&source, &remaining, sizeof(UINT64));
+			if (NULL != cr0Field)
+			{
+				payload = appendBytes(payload, cr0Field, sizeof(UINT64));
+			}
+		}
+
+		UINT64 cr3 = 0;
+		const UINT8* cr3Field = NULL;
+
+		if (0 != (recordFields & EVENT_FIELD_CR3))
+		{
+			cr3Field = nextField(&source, &remaining, sizeof(UINT64));
+			if (NULL != cr3Field)
+			{
+				RtlCopyMemory(&cr3, cr3Field, sizeof(cr3));
+
+				if ((TRUE == writer->havePreviousCR3) && (cr3 == writer->previousCR3))
+				{
+					fields |= EVENT_FIELD_CR3_REPEAT;
+				}
+				else
+				{
+					payload = appendBytes(payload, &cr3, sizeof(cr3));
+					fields |= EVENT_FIELD_CR3;
+				}
+			}
+		}
+
+		if (0 != (recordFields & EVENT_FIELD_CR4))
+		{
+			const UINT8* cr4Field = nextField(&source, &remaining, sizeof(UINT64));
+			if (NULL != cr4Field)
+			{
+				payload = appendBytes(payload, cr4Field, sizeof(UINT64));
+			}
+		}
+
+		if (0 != (recordFields & EVENT_FIELD_GPRS))
+		{
+			const UINT8* gprsField = nextField(&source, &remaining, sizeof(EVENT_GPRS));
+			if (NULL != gprsField)
+			{
+				payload = appendBytes(payload, gprsField, sizeof(EVENT_GPRS));
+			}
+		}
+
+		/* The extended state and string are variable length, prefixed by their length. */
+		for (UINT16 field = EVENT_FIELD_EXTENDED; field <= EVENT_FIELD_STRING; field <<= 1)
+		{
+			if (0 != (recordFields & field))
+			{
+				UINT16 length = 0;
+				const UINT8* lengthField = nextField(&source, &remaining, sizeof(length));
+				if (NULL != lengthField)
+				{
+					RtlCopyMemory(&length, lengthField, sizeof(length));
+				}
+
+				const UINT8* dataField = nextField(&source, &remaining, length);
+				if (NULL != dataField)
+				{
+					payload = appendBytes(payload, &length, sizeof(length));
+					payload = appendBytes(payload, dataField, length);
+				}
+			}
+		}
+
+		if (0 != (recordFields & EVENT_FIELD_STRING_ID))
+		{
+			const UINT8* stringIdField = nextField(&source, &remaining, sizeof(UINT32));
+			if (NULL != stringIdField)
+			{
+				payload = appendBytes(payload, stringIdField, sizeof(UINT32));
+			}
+		}
+
+		/* Only once every field has been found to be within the record is any of it kept. */
+		if (NULL != source)
+		{
+			if (NULL != cr3Field)
+			{
+				writer->havePreviousCR3 = TRUE;
+				writer->previousCR3 = cr3;
+			}
+
+			writer->havePrevious = TRUE;
+			writer->previousTimeStamp = timeStamp;
+			writer->previousProcIndex = procIndex;
+
+			SIZE_T size = ALIGN_UP_BY(payload - record, EVENT_RECORD_ALIGNMENT);
+			RtlZeroMemory(payload, (record + size) - payload);
+
+			PEVENT_RECORD_HEADER recordHeader = (PEVENT_RECORD_HEADER)record;
+			recordHeader->size = (UINT16)size;
+			recordHeader->fields = fields;
+			recordHeader->sequence = 0;
+
+			writer->bufferUsed += size;
+			result = TRUE;
+		}
+	}
+
+	return result;
+}
+
+static UINT32 recordStringId(const EVENT_RECORD_HEADER* header)
+{
+	/* The id is the last field of a record within a ring, after the fixed size fields and the
+	 * length prefixed ones. Each is bounded by the size of the record, as in encodeRecord. */
+	UINT32 result = EVENT_STRING_ID_NONE;
+
+	UINT16 recordFields = header->fields;
+
+	if (0 != (recordFields & EVENT_FIELD_STRING_ID))
+	{
+		SIZE_T remaining = header->size;
+		const UINT8* source = (const UINT8*)header;
+
+		(void)nextField(&source, &remaining, sizeof(EVENT_RECORD_HEADER) + sizeof(UINT64) + sizeof(UINT32));
+		(void)nextField(&source, &remaining, (0 != (recordFields & EVENT_FIELD_CR0)) ? sizeof(UINT64) : 0);
+		(void)nextField(&source, &remaining, (0 != (recordFields & EVENT_FIELD_CR3)) ? sizeof(UINT64) : 0);
+		(void)nextField(&source, &remaining, (0 != (recordFields & EVENT_FIELD_CR4)) ? sizeof(UINT64) : 0);
+		(void)nextField(&source, &remaining, (0 != (recordFields & EVENT_FIELD_GPRS)) ? sizeof(EVENT_GPRS) : 0);
+
+		for (UINT16 field = EVENT_FIELD_EXTENDED; field <= EVENT_FIELD_STRING; field <<= 1)
+		{
+			if (0 != (recordFields & field))
+			{
+				UINT16 length = 0;
+				const UINT8* lengthField = nextField(&source, &remaining, sizeof(length));
+				if (NULL != lengthField)
+				{
+					RtlCopyMemory(&length, lengthField, sizeof(length));
+				}
+
+				(void)nextField(&source, &remaining, length);
+			}
+		}
+
+		const UINT8* stringIdField = nextField(&source, &remaining, sizeof(result));
+		if (NULL != stringIdField)
+		{
+			RtlCopyMemory(&result, stringIdField, sizeof(result));
+		}
+	}
+
+	return result;
+}
+
+static const UINT8* nextField(const UINT8** source, PSIZE_T remaining, SIZE_T size)
+{
+	/* Steps over the next field of a record, returning where it starts. Once a field runs past
+	 * the end of the record, source is set to NULL and every field after it is NULL as well. */
+	const UINT8* result = NULL;
+
+	if ((NULL != *source) && (size <= *remaining))
+	{
+		result = *source;
+		*source += size;
+		*remaining -= size;
+	}
+	else
+	{
+		*source = NULL;
+	}
+
+	return result;
+}
+
+static void defineString(PEVENT_WRITER writer, UINT32 id)
+{
+	/* Each session of the file defines the strings it uses, ahead of the first record using them. */
+	UINT32 bit = id - 1;
+
+	UINT16 length;
+	const CHAR* string = EventLog_lookupString(eventStrings, id, &length);
+
+	if ((NULL != string) && (0 == (writer->definedStrings[bit / 64] & (1ULL << (bit % 64)))))
+	{
+		EVENT_RECORD_HEADER header;
+		header.size = (UINT16)ALIGN_UP_BY(sizeof(EVENT_RECORD_HEADER) + sizeof(UINT32) + sizeof(UINT16) + length,
+										  EVENT_RECORD_ALIGNMENT);
+		header.fields = EVENT_FIELD_STRING_DEFINITION;
+		header.sequence = 0;
+
+		PUINT8 record = writer->buffer + writer->bufferUsed;
+		PUINT8 payload = appendBytes(record, &header, sizeof(header));
+		payload = appendBytes(payload, &id, sizeof(id));
+		payload = appendBytes(payload, &length, sizeof(length));
+		payload = appendBytes(payload, string, length);
+		RtlZeroMemory(payload, (record + header.size) - payload);
+
+		writer->bufferUsed += header.size;
+		writer->definedStrings[bit / 64] |= 1ULL << (bit % 64);
+	}
+}
+
+static void beginSession(PEVENT_WRITER writer)
+{
+	/* Every session appended to the file starts with a header, so the decoder
+	 * resets its delta encoding state at the same point as the writer. */
+	EVENT_FILE_HEADER fileHeader = { 0 };
+	fileHeader.magic = EVENT_FILE_MAGIC;
+	fileHeader.version = EVENT_FILE_VERSION;
+	fileHeader.size = sizeof(EVENT_FILE_HEADER) + sizeof(EVENT_CALIBRATION);
+	fileHeader.timeStampFrequency = writer->timeStampFrequency;
+
+	PUINT8 position = appendBytes(writer->buffer, &fileHeader, sizeof(fileHeader));
+	position = appendBytes(position, &writer->launchCalibration, sizeof(EVENT_CALIBRATION));
+	writer->bufferUsed = position - writer->buffer;
+
+	writer->havePrevious = FALSE;
+	writer->havePreviousCR3 = FALSE;
+	RtlZeroMemory(writer->definedStrings, sizeof(writer->definedStrings));
+}
+
+static void takeCalibration(PEVENT_CALIBRATION calibration)
+{
+	/* The hypervisor doesn't exit on RDTSC, so the guest reads the same TSC as VMX root. */
+	CALIBRATION_CONTEXT context;
+	context.arrivedCount = 0;
+	context.processorCount = (LONG)KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	context.calibration = calibration;
+
+	RtlZeroMemory(calibration, sizeof(EVENT_CALIBRATION));
+	calibration->processorCount = (context.processorCount > EVENT_MAX_RINGS) ? EVENT_MAX_RINGS : context.processorCount;
+
+	KeIpiGenericCall(calibrateProcessor, (ULONG_PTR)&context);
+}
+
+static ULONG_PTR calibrateProcessor(ULONG_PTR argument)
+{
+	PCALIBRATION_CONTEXT context = (PCALIBRATION_CONTEXT)argument;
+	ULONG procIndex = KeGetCurrentProcessorIndex();
+	UINT64 timeStamp;
+
+	/* Every processor is released at once when the last one arrives, so the TSCs are read
+	 * as close to the same instant as possible. */
+	InterlockedIncrement(&context->arrivedCount);
+	while (context->arrivedCount < context->processorCount)
+	{
+		_mm_pause();
+	}
+
+	if (0 == procIndex)
+	{
+		/* Take the reference time between two reads, and use the TSC half way between them. */
+		LARGE_INTEGER systemTime;
+		UINT64 before = __rdtsc();
+		KeQuerySystemTimePrecise(&systemTime);
+		UINT64 after = __rdtsc();
+
+		context->calibration->referenceTime = (UINT64)systemTime.QuadPart;
+		timeStamp = before + ((after - before) / 2);
+	}
+	else
+	{
+		timeStamp = __rdtsc();
+	}
+
+	if (procIndex < EVENT_MAX_RINGS)
+	{
+		context->calibration->timeStamps[procIndex] = timeStamp;
+	}
+
+	return 0;
+}
+
+static void writeCalibration(PEVENT_WRITER writer)
+{
+	if ((writer->bufferUsed + EVENT_RECORD_MAX_SIZE) > EVENT_WRITER_BUFFER_SIZE)
+	{
+		flushWriter(writer);
+	}
+
+	EVENT_CALIBRATION calibration;
+	takeCalibration(&calibration);
+
+	/* Calibrations don't take part in the delta encoding. */
+	EVENT_RECORD_HEADER header;
+	header.size = sizeof(EVENT_RECORD_HEADER) + sizeof(EVENT_CALIBRATION);
+	header.fields = EVENT_FIELD_CALIBRATION;
+	header.sequence = 0;
+
+	PUINT8 position = appendBytes(writer->buffer + writer->bufferUsed, &header, sizeof(header));
+	position = appendBytes(position, &calibration, sizeof(calibration));
+	writer->bufferUsed = position - writer->buffer;
+}
+
+static void flushWriter(PEVENT_WRITER writer)
+{
+	if (0 != writer->bufferUsed)
+	{
+		IO_STATUS_BLOCK ioStatusBlock;
 		LARGE_INTEGER byteOffset;
 		byteOffset.HighPart = -1;
 		byteOffset.LowPart = FILE_WRITE_TO_END_OF_FILE;
 
-		status = ZwWriteFile(hFile, NULL, NULL, NULL, &ioStatusBlock,
-			eventData, (ULONG)sizeof(EVENT_DATA), &byteOffset, NULL);
+		NTSTATUS status = ZwWriteFile(writer->fileHandle, NULL, NULL, NULL, &ioStatusBlock,
+			writer->buffer, (ULONG)writer->bufferUsed, &byteOffset, NULL);
+
+		for (ULONG i = 0; i < eventRingCount; i++)
+		{
+			/* A failing disk counts as dropped, it mustn't stall the producers. */
+			if (NT_SUCCESS(status))
+			{
+				InterlockedAdd64(&eventRings[i].header.writtenCount, (LONG64)writer->bufferedCounts[i]);
+			}
+			else
+			{
+				InterlockedAdd64(&eventRings[i].header.droppedCount, (LONG64)writer->bufferedCounts[i]);
+			}
+
+			writer->bufferedCounts[i] = 0;
+		}
 
-		ZwClose(hFile);
+		writer->bufferUsed = 0;
+
+		/* What follows can't be encoded against records that never made it to the file. */
+		if (!NT_SUCCESS(status))
+		{
+			beginSession(writer);
+		}
 	}
+}
 
-	KeRaiseIrql(origIRQL, &origIRQL);
+static NTSTATUS openEventFile(LPWSTR fileName, PHANDLE fileHandle)
+{
+	/* The file is kept open by the writer for its whole lifetime. */
+	OBJECT_ATTRIBUTES objectAttributes;
+	IO_STATUS_BLOCK ioStatusBlock;
 
-	return status;
+	UNICODE_STRING usFilePath;
+	RtlInitUnicodeString(&usFilePath, fileName);
+
+	InitializeObjectAttributes(&objectAttributes, &usFilePath, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL);
+
+	return ZwCreateFile(fileHandle, GENERIC_WRITE, &objectAttributes, &ioStatusBlock, NULL,
+		FILE_ATTRIBUTE_NORMAL, 0, FILE_OPEN_IF, FILE_SYNCHRONOUS_IO_NONALERT, NULL, 0);
+}
+
+static void unmapConsumer(void)
+{
+	/* Called with the consumer lock held, from within the consumer process. */
+	if (NULL != consumer.userRings)
+	{
+		MmUnmapLockedPages(consumer.userRings, consumer.ringsMdl);
+	}
+
+	if (NULL != consumer.userCursors)
+	{
+		MmUnmapLockedPages(consumer.userCursors, consumer.cursorsMdl);
+	}
+
+	if (NULL != consumer.ringsMdl)
+	{
+		IoFreeMdl(consumer.ringsMdl);
+	}
+
+	if (NULL != consumer.cursorsMdl)
+	{
+		IoFreeMdl(consumer.cursorsMdl);
+	}
+
+	RtlZeroMemory(&consumer, sizeof(consumer));
+}
+
+static void processNotify(PEPROCESS process, HANDLE processId, PPS_CREATE_NOTIFY_INFO createInfo)
+{
+	UNREFERENCED_PARAMETER(process);
+
+	/* Called in the context of the exiting process, which is where the mapping lives.
+	 * The writer picks up from wherever the consumer got to. */
+	if ((NULL == createInfo) && (processId == consumer.processId))
+	{
+		ExAcquireFastMutex(&consumerLock);
+
+		if (processId == consumer.processId)
+		{
+			unmapConsumer();
+		}
+
+		ExReleaseFastMutex(&consumerLock);
+	}
 }
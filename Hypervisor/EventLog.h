@@ -1,6 +1,17 @@
 #pragma once
 #include <wdm.h>
 #include "ia32.h"
+#include "EventFilter_Common.h"
+
+/******************** Public Defines ********************/
+
+/* How long the writer sleeps once every ring has been drained, in milliseconds. */
+#define EVENT_WRITER_INTERVAL_MS 10
+
+/* How often the TSCs of every processor are calibrated against the system time, and how far
+ * apart the two calibrations taken when the writer starts are, in milliseconds. */
+#define EVENT_CALIBRATION_INTERVAL_MS 1000
+#define EVENT_CALIBRATION_SPAN_MS 100
 
 /******************** Public Typedefs ********************/
 
@@ -9,5 +20,11 @@
 /******************** Public Variables ********************/
 
 /******************** Public Prototypes ********************/
-void EventLog_init(void);
-DECLSPEC_NORETURN void EventLog_logAsGuestThenRestore(PCONTEXT context, ULONG procIndex, CHAR const* extraString);
\ No newline at end of file
+NTSTATUS EventLog_init(void);
+void EventLog_uninit(void);
+BOOLEAN EventLog_record(ULONG procIndex, UINT32 exitReason, UINT16 captureFields, PCONTEXT context, CR0 cr0, CR3 cr3, CR4 cr4, CHAR const* extraString);
+NTSTATUS EventLog_getCounters(ULONG procIndex, PUINT64 writtenCount, PUINT64 droppedCount, PUINT64 filteredCount,
+							  PUINT64 truncatedCount);
+NTSTATUS EventLog_mapConsumer(PVOID* rings, PVOID* cursors, PULONG ringCount);
+NTSTATUS EventLog_unmapConsumer(void);
+DECLSPEC_NORETURN void EventLog_logAsGuestThenRestore(PCONTEXT context, ULONG procIndex, CHAR const* extraString);
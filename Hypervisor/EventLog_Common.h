@@ -1,12 +1,225 @@
 #pragma once
+
+/* The record format is shared with tools that decode traces on other platforms,
+ * so outside of Windows only the fixed width types it relies on are defined. */
+#ifdef _WIN32
 #include "ia32.h"
+#else
+#include <stddef.h>
+#include <stdint.h>
+typedef uint8_t UINT8;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+typedef int32_t LONG;
+typedef int64_t LONG64;
+typedef char CHAR;
+#endif
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
 
 /******************** Public Typedefs ********************/
-#define EVENT_COUNT_MAX 100000
-#define EVENT_BUFFER_SIZE (EVENT_COUNT_MAX * sizeof(EVENT_DATA))
 
 #define MAX_EXTRA_CHARS 50
 
+/* Size of the ring of each logical processor in bytes, must be a power of two. */
+#define EVENT_RING_BYTES (256 * 1024)
+#define EVENT_RING_MASK (EVENT_RING_BYTES - 1)
+
+/* Maximum number of rings, one for each logical processor. */
+#define EVENT_MAX_RINGS 64
+
+/* Size of a cache line, the ring indexes are kept on separate lines to avoid false sharing. */
+#define EVENT_CACHE_LINE 64
+
+/* Every record starts on, and is padded out to, this alignment. */
+#define EVENT_RECORD_ALIGNMENT 8
+#define EVENT_RECORD_MAX_SIZE 1024
+
+/* Annotation strings are interned into a table shared by every processor, so records only
+ * carry the 32 bit id of their string. The number of strings must be a power of two. Strings
+ * are only held inline when they can't be interned, up to EVENT_STRING_MAX_INLINE characters.
+ * Longer strings than EVENT_STRING_MAX_LENGTH are cut short, which truncatedCount counts. */
+#define EVENT_STRING_MAX_COUNT 4096
+#define EVENT_STRING_BYTES (256 * 1024)
+#define EVENT_STRING_MAX_LENGTH 512
+#define EVENT_STRING_MAX_INLINE 256
+
+/* Slots looked at when interning a string, which bounds the cost of recording an event. */
+#define EVENT_STRING_MAX_PROBES 16
+
+/* Ids are the slot of the string plus one, zero is never used. */
+#define EVENT_STRING_ID_NONE 0
+
+/* States of a slot of the string table. */
+#define EVENT_STRING_STATE_FREE 0
+#define EVENT_STRING_STATE_CLAIMED 1	/* The characters are still being copied in. */
+#define EVENT_STRING_STATE_PUBLISHED 2
+#define EVENT_STRING_STATE_FULL 3		/* There wasn't room left for the characters. */
+
+/* Each file written starts with a header, which also resets the delta encoding state.
+ * Files that don't start with one hold the legacy fixed size records. From version 2
+ * the header is followed by the calibration of the TSCs taken when the session started. */
+#define EVENT_FILE_MAGIC 0x56455648
+#define EVENT_FILE_VERSION 2
+
+/* Fields of a record, the payload holds the present fields in the order of these bits.
+ *
+ *	TIMESTAMP		UINT64, TSC of the event.
+ *	TIMESTAMP_DELTA	UINT32, TSC relative to the previous record (files only).
+ *	PROC_INDEX		UINT32, within a file this is omitted when unchanged from the previous record.
+ *	CR0/CR3/CR4		UINT64 each.
+ *	CR3_REPEAT		No payload, CR3 is unchanged from the previous record (files only).
+ *	GPRS			EVENT_GPRS.
+ *	EXTENDED		UINT16 length, followed by the extended state (the legacy FXSAVE area).
+ *	STRING			UINT16 length, followed by the characters without a terminator.
+ *	STRING_ID		UINT32, id of the interned string.
+ *	STRING_DEFINITION	UINT32 id, UINT16 length and the characters, on its own (files only).
+ *					Precedes the first record of a session that refers to the string.
+ *	CALIBRATION		EVENT_CALIBRATION, on its own without any other fields (files only).
+ *	PADDING			Skips to the end of a ring, never present in files. */
+#define EVENT_FIELD_TIMESTAMP		0x0001
+#define EVENT_FIELD_TIMESTAMP_DELTA	0x0002
+#define EVENT_FIELD_PROC_INDEX		0x0004
+#define EVENT_FIELD_CR0				0x0008
+#define EVENT_FIELD_CR3				0x0010
+#define EVENT_FIELD_CR3_REPEAT		0x0020
+#define EVENT_FIELD_CR4				0x0040
+#define EVENT_FIELD_GPRS			0x0080
+#define EVENT_FIELD_EXTENDED		0x0100
+#define EVENT_FIELD_STRING			0x0200
+#define EVENT_FIELD_STRING_ID		0x0400
+#define EVENT_FIELD_STRING_DEFINITION	0x2000
+#define EVENT_FIELD_CALIBRATION		0x4000
+#define EVENT_FIELD_PADDING			0x8000
+
+/* Fields a producer can choose to capture, the timestamp and processor index always are.
+ * A captured string is recorded as STRING_ID whenever it can be interned. */
+#define EVENT_CAPTURE_CONTROL_REGISTERS (EVENT_FIELD_CR0 | EVENT_FIELD_CR3 | EVENT_FIELD_CR4)
+#define EVENT_CAPTURE_DEFAULT (EVENT_CAPTURE_CONTROL_REGISTERS | EVENT_FIELD_GPRS | EVENT_FIELD_STRING)
+
+/* Size of the extended state, the FXSAVE area of CONTEXT. */
+#define EVENT_EXTENDED_SIZE 512
+
+#define EVENT_SEQUENCE(position) ((UINT32)((UINT32)(position) / EVENT_RECORD_ALIGNMENT) + 1)
+
+typedef enum
+{
+	EVENT_GPR_RAX = 0,
+	EVENT_GPR_RCX,
+	EVENT_GPR_RDX,
+	EVENT_GPR_RBX,
+	EVENT_GPR_RSP,
+	EVENT_GPR_RBP,
+	EVENT_GPR_RSI,
+	EVENT_GPR_RDI,
+	EVENT_GPR_R8,
+	EVENT_GPR_R9,
+	EVENT_GPR_R10,
+	EVENT_GPR_R11,
+	EVENT_GPR_R12,
+	EVENT_GPR_R13,
+	EVENT_GPR_R14,
+	EVENT_GPR_R15,
+	EVENT_GPR_RIP,
+	EVENT_GPR_RFLAGS,
+	EVENT_GPR_COUNT
+} EVENT_GPR;
+
+typedef struct _EVENT_GPRS
+{
+	UINT64 registers[EVENT_GPR_COUNT];
+} EVENT_GPRS, *PEVENT_GPRS;
+
+typedef struct _EVENT_FILE_HEADER
+{
+	UINT32 magic;
+	UINT16 version;
+	UINT16 size;				/* Including the calibration that follows from version 2. */
+	UINT64 timeStampFrequency;	/* TSC ticks per second measured when the session started, zero in version 1. */
+} EVENT_FILE_HEADER, *PEVENT_FILE_HEADER;
+
+/* The TSC of every logical processor, read at the same instant along with the system time.
+ * Taken when each session starts and periodically after that, so timestamps of different
+ * processors can be put on to a common timeline. */
+typedef struct _EVENT_CALIBRATION
+{
+	UINT64 referenceTime;		/* System time, in 100ns intervals since 1601 (UTC). */
+	UINT32 processorCount;
+	UINT32 reserved;
+	UINT64 timeStamps[EVENT_MAX_RINGS];
+} EVENT_CALIBRATION, *PEVENT_CALIBRATION;
+
+typedef struct _EVENT_RECORD_HEADER
+{
+	UINT16 size;		/* Size of the whole record, a multiple of EVENT_RECORD_ALIGNMENT. */
+	UINT16 fields;		/* EVENT_FIELD_* */
+	UINT32 sequence;	/* Within a ring, EVENT_SEQUENCE of its position once committed. Zero within a file. */
+} EVENT_RECORD_HEADER, *PEVENT_RECORD_HEADER;
+
+typedef struct _EVENT_RING_HEADER
+{
+	/* Free running byte position of the next record to be reserved by a producer. */
+	volatile LONG head;
+	UINT8 padding0[EVENT_CACHE_LINE - sizeof(LONG)];
+
+	/* Records discarded because the ring was full, records written out to disk, events
+	 * that weren't recorded as they didn't match the event filter and strings that were
+	 * cut short at EVENT_STRING_MAX_LENGTH. */
+	volatile LONG64 droppedCount;
+	volatile LONG64 writtenCount;
+	volatile LONG64 filteredCount;
+	volatile LONG64 truncatedCount;
+	UINT8 padding1[EVENT_CACHE_LINE - (4 * sizeof(LONG64))];
+} EVENT_RING_HEADER, *PEVENT_RING_HEADER;
+
+/* Ring of records for a logical processor, this is only ever written by the producers.
+ * Records never wrap around the end of the ring, a padding record is used instead.
+ * A record is committed once the sequence of its header matches its position. */
+typedef struct _EVENT_RING
+{
+	EVENT_RING_HEADER header;
+	UINT8 data[EVENT_RING_BYTES];
+} EVENT_RING, *PEVENT_RING;
+
+/* Free running byte position of the next record to be consumed from a ring, only written by the consumer. */
+typedef struct _EVENT_CURSOR
+{
+	volatile LONG tail;
+	UINT8 padding[EVENT_CACHE_LINE - sizeof(LONG)];
+} EVENT_CURSOR, *PEVENT_CURSOR;
+
+typedef struct _EVENT_STRING_SLOT
+{
+	volatile LONG state;	/* EVENT_STRING_STATE_* */
+	UINT32 offset;			/* Of the characters within the bytes of the table. */
+	UINT64 hash;
+	UINT32 length;
+	UINT32 reserved;
+} EVENT_STRING_SLOT, *PEVENT_STRING_SLOT;
+
+/* Interned strings, an open addressed hash table. Slots are claimed by the first producer
+ * to intern a string, which copies its characters in and then publishes the slot. Nothing is
+ * ever removed. The table follows the last ring and is mapped to the consumer along with them. */
+typedef struct _EVENT_STRING_TABLE
+{
+	volatile LONG bytesUsed;
+	UINT8 padding[EVENT_CACHE_LINE - sizeof(LONG)];
+	EVENT_STRING_SLOT slots[EVENT_STRING_MAX_COUNT];
+	CHAR bytes[EVENT_STRING_BYTES];
+} EVENT_STRING_TABLE, *PEVENT_STRING_TABLE;
+
+/* Cursors of every ring, these fill a single page which the consumer can write to. */
+typedef struct _EVENT_CURSORS
+{
+	EVENT_CURSOR cursors[EVENT_MAX_RINGS];
+} EVENT_CURSORS, *PEVENT_CURSORS;
+
+#ifdef _WIN32
+/* Legacy fixed size record, files written before the variable length format are made up of these. */
 typedef struct _EVENT_DATA
 {
 	ULONG procIndex;
@@ -17,9 +230,78 @@ typedef struct _EVENT_DATA
 	CONTEXT context;
 	CHAR extraString[MAX_EXTRA_CHARS];
 } EVENT_DATA, *PEVENT_DATA;
+#endif
 
 /******************** Public Constants ********************/
 
 /******************** Public Variables ********************/
 
 /******************** Public Prototypes ********************/
+
+#ifdef _WIN32
+/* Returns the next committed record of a ring in place, or NULL if there are none. Padding
+ * is skipped by moving the position on. The record stays valid until it is released. */
+FORCEINLINE const EVENT_RECORD_HEADER* EventLog_peekRecord(const EVENT_RING* ring, PLONG position)
+{
+	const EVENT_RECORD_HEADER* result = NULL;
+
+	for (;;)
+	{
+		/* A header is written in one go, so once the sequence matches the rest of it can be trusted.
+		 * The size is checked as well, so a stale payload from the previous lap is never mistaken for one. */
+		const EVENT_RECORD_HEADER* header = (const EVENT_RECORD_HEADER*)&ring->data[*position & EVENT_RING_MASK];
+		if ((EVENT_SEQUENCE(*position) != *(volatile const UINT32*)&header->sequence) ||
+			(0 == header->size) || (0 != (header->size % EVENT_RECORD_ALIGNMENT)) ||
+			(((*position & EVENT_RING_MASK) + header->size) > EVENT_RING_BYTES))
+		{
+			break;
+		}
+
+		if (0 == (header->fields & EVENT_FIELD_PADDING))
+		{
+			result = header;
+			break;
+		}
+
+		*position += header->size;
+	}
+
+	return result;
+}
+
+/* Timestamp of a record within a ring, which always holds it first. */
+FORCEINLINE UINT64 EventLog_recordTimeStamp(const EVENT_RECORD_HEADER* header)
+{
+	return *(const UINT64*)(header + 1);
+}
+
+/* Characters of an interned string, or NULL if the id isn't that of a published string. */
+FORCEINLINE const CHAR* EventLog_lookupString(const EVENT_STRING_TABLE* table, UINT32 id, PUINT16 length)
+{
+	const CHAR* result = NULL;
+
+	if ((EVENT_STRING_ID_NONE != id) && (id <= EVENT_STRING_MAX_COUNT))
+	{
+		const EVENT_STRING_SLOT* slot = &table->slots[id - 1];
+
+		if ((EVENT_STRING_STATE_PUBLISHED == *(volatile const LONG*)&slot->state) && (slot->length <= EVENT_STRING_MAX_LENGTH) &&
+			((slot->offset + slot->length) <= EVENT_STRING_BYTES))
+		{
+			*length = (UINT16)slot->length;
+			result = &table->bytes[slot->offset];
+		}
+	}
+
+	return result;
+}
+
+/* Hands every record before the position back to the producers. */
+FORCEINLINE void EventLog_releaseRecords(PEVENT_CURSOR cursor, LONG position)
+{
+	InterlockedExchange(&cursor->tail, position);
+}
+#endif
+
+#ifdef __cplusplus
+}
+#endif
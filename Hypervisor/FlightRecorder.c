@@ -0,0 +1,138 @@
+#include <ntifs.h>
+#include <intrin.h>
+#include "FlightRecorder.h"
+#include "VMM.h"
+#include "ia32.h"
+
+/******************** External API ********************/
+
+
+/******************** Module Typedefs ********************/
+
+
+/******************** Module Constants ********************/
+
+C_ASSERT(sizeof(FLIGHT_RECORDER) == PAGE_SIZE);
+
+/******************** Module Variables ********************/
+
+/* Recorders of each logical processor, these are kept in the image rather than the
+ * VMM data so that they are found at a fixed place in a crash dump, and so they can be
+ * dumped from whichever processor receives the VMCALL. */
+static DECLSPEC_ALIGN(PAGE_SIZE) FLIGHT_RECORDER flightRecorders[MAX_LOGICAL_PROCESSORS] = { 0 };
+
+/******************** Module Prototypes ********************/
+
+
+/******************** Public Code ********************/
+
+void FlightRecorder_initialise(ULONG processorIndex)
+{
+	if (processorIndex < MAX_LOGICAL_PROCESSORS)
+	{
+		PFLIGHT_RECORDER recorder = &flightRecorders[processorIndex];
+
+		RtlZeroMemory(recorder, sizeof(FLIGHT_RECORDER));
+		recorder->version = FLIGHT_RECORDER_VERSION;
+		recorder->processorIndex = processorIndex;
+		recorder->recordCount = FLIGHT_RECORDER_RECORDS;
+		recorder->recordSize = sizeof(FLIGHT_RECORD);
+
+		/* The signature goes last, so a recorder is only ever found once it is usable. */
+		recorder->signature = FLIGHT_RECORDER_SIGNATURE;
+	}
+}
+
+PFLIGHT_RECORD FlightRecorder_begin(ULONG processorIndex, UINT32 exitReason)
+{
+	/* Called at the start of every exit, this is always on so it has to stay cheap: three VMCS
+	 * reads, a TSC read and plain stores into memory only this processor writes to. */
+	PFLIGHT_RECORD record = NULL;
+
+	if (processorIndex < MAX_LOGICAL_PROCESSORS)
+	{
+		PFLIGHT_RECORDER recorder = &flightRecorders[processorIndex];
+		record = &recorder->records[recorder->next];
+
+		recorder->next = (recorder->next + 1 < FLIGHT_RECORDER_RECORDS) ? (recorder->next + 1) : 0;
+		recorder->exitCount++;
+
+		size_t guestRIP;
+		size_t guestCR3;
+		size_t qualification;
+		__vmx_vmread(VMCS_GUEST_RIP, &guestRIP);
+		__vmx_vmread(VMCS_GUEST_CR3, &guestCR3);
+		__vmx_vmread(VMCS_EXIT_QUALIFICATION, &qualification);
+
+		record->timeStamp = __rdtsc();
+		record->guestRIP = guestRIP;
+		record->guestCR3 = guestCR3;
+		record->qualification = qualification;
+		record->exitReason = exitReason;
+		record->handlerCycles = 0;
+		record->sequence = (UINT32)recorder->exitCount;
+	}
+
+	return record;
+}
+
+void FlightRecorder_end(PFLIGHT_RECORD record)
+{
+	if (NULL != record)
+	{
+		UINT64 handlerCycles = __rdtsc() - record->timeStamp;
+
+		/* Zero is kept for exits that haven't finished. */
+		if (0 == handlerCycles)
+		{
+			handlerCycles = 1;
+		}
+		else if (handlerCycles > MAXUINT32)
+		{
+			handlerCycles = MAXUINT32;
+		}
+
+		record->handlerCycles = (UINT32)handlerCycles;
+	}
+}
+
+NTSTATUS FlightRecorder_dump(PMM_CONTEXT mmContext, CR3 guestCR3, GUEST_VIRTUAL_ADDRESS recorders,
+							 UINT32 recorderCapacity, PUINT32 recorderCount)
+{
+	/* Copies the recorder of every virtualised processor into the guest buffer in turn. The other
+	 * processors carry on recording whilst theirs is copied, the sequences of their records
+	 * tell which are the newest. The exit of the VMCALL itself is shown as still being handled. */
+	NTSTATUS status = STATUS_SUCCESS;
+	UINT32 copied = 0;
+
+	if (0 == recorders)
+	{
+		status = STATUS_INVALID_PARAMETER;
+	}
+
+	for (UINT32 i = 0; (i < MAX_LOGICAL_PROCESSORS) && (NT_SUCCESS(status)); i++)
+	{
+		if (FLIGHT_RECORDER_SIGNATURE == flightRecorders[i].signature)
+		{
+			if (copied < recorderCapacity)
+			{
+				status = MemManage_writeVirtualAddress(mmContext, guestCR3, recorders + (copied * sizeof(FLIGHT_RECORDER)),
+													   &flightRecorders[i], sizeof(FLIGHT_RECORDER));
+				if (NT_SUCCESS(status))
+				{
+					copied++;
+				}
+			}
+			else
+			{
+				status = STATUS_BUFFER_TOO_SMALL;
+			}
+		}
+	}
+
+	*recorderCount = copied;
+
+	return status;
+}
+
+/******************** Module Code ********************/
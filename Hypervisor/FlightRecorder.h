@@ -0,0 +1,18 @@
+#pragma once
+#include <wdm.h>
+#include "MemManage.h"
+#include "FlightRecorder_Common.h"
+
+/******************** Public Typedefs ********************/
+
+/******************** Public Constants ********************/
+
+/******************** Public Variables ********************/
+
+/******************** Public Prototypes ********************/
+
+void FlightRecorder_initialise(ULONG processorIndex);
+PFLIGHT_RECORD FlightRecorder_begin(ULONG processorIndex, UINT32 exitReason);
+void FlightRecorder_end(PFLIGHT_RECORD record);
+NTSTATUS FlightRecorder_dump(PMM_CONTEXT mmContext, CR3 guestCR3, GUEST_VIRTUAL_ADDRESS recorders,
+							 UINT32 recorderCapacity, PUINT32 recorderCount);
@@ -7,11 +7,15 @@
 #include "CPUID.h"
 #include "VMCALL.h"
 #include "VMShadow.h"
+#include "Profiler.h"
+#include "Scheduler.h"
+#include "FlightRecorder.h"
+#include "EventLog.h"
 #include "Debug.h"
 
 /******************** External API ********************/
 
-/* DEBUG: Just some fields for monitoring VMExits. */
+/* DEBUG: Range of guest RIP's whose VM exits are recorded to the event log. */
 SIZE_T monitoredRangeStart = 0;
 SIZE_T monitoredRangeEnd = 0;
 
@@ -28,6 +32,7 @@ static volatile ULONG64 lastGuestTSC = 0;
 
 /******************** Module Prototypes ********************/
 static void handleExitReason(PVMM_DATA lpData);
+static void recordExit(PVMM_DATA lpData, UINT32 exitReason);
 static void incrementRIP(void);
 static void indicateVMXFail(void);
 
@@ -113,32 +118,28 @@ static void handleExitReason(PVMM_DATA lpData)
 	/* We need to determine what the exit reason was and take appropriate action. */
 	size_t exitReason;
 	__vmx_vmread(VMCS_EXIT_REASON, &exitReason);
+
+	/* Always on, so there is a history of the last exits when the guest hangs or a handler breaks. */
+	PFLIGHT_RECORD flightRecord = FlightRecorder_begin(lpData->processorIndex, (UINT32)exitReason);
+
 	exitReason &= 0xFFFF;
 
-	///* Check to see if we are actively monitoring a range. */
-	//if ((0 != monitoredRangeStart) && (0 != monitoredRangeEnd))
-	//{
-	//	/* Check to see if guest RIP is within this range. */
-	//	/* If so, we log the VMM exit. */
-	//	size_t guestRIP;
-	//	__vmx_vmread(VMCS_GUEST_RIP, &guestRIP);
-
-	//	if ((guestRIP >= monitoredRangeStart) && (guestRIP <= monitoredRangeEnd))
-	//	{
-	//		DEBUG_PRINT("VMM exit in monitored range.\n");
-	//		DEBUG_PRINT("\tExit Reason: 0x%I64X\n", exitReason);
-	//		DEBUG_PRINT("\tGuest RIP: 0x%I64X\n", guestRIP);
-
-	//		static SIZE_T lastExitRIP = 0;
-
-	//		/* Some debug code to prevent multiple breaks on same instruction due to loops */
-	//		if (guestRIP != lastExitRIP)
-	//		{
-	//			//DbgBreakPoint();
-	//			lastExitRIP = guestRIP;
-	//		}
-	//	}
-	//}
+	lpData->exitCount++;
+
+	/* Apply any changes to the profiler state that were requested since the last exit. */
+	Profiler_sync(&lpData->profilerConfig, &lpData->schedulerConfig);
+
+	/* Exits within the monitored range are recorded, the event filter can narrow them down by exit reason. */
+	if ((0 != monitoredRangeStart) && (0 != monitoredRangeEnd))
+	{
+		size_t guestRIP;
+		__vmx_vmread(VMCS_GUEST_RIP, &guestRIP);
+
+		if ((guestRIP >= monitoredRangeStart) && (guestRIP <= monitoredRangeEnd))
+		{
+			recordExit(lpData, (UINT32)exitReason);
+		}
+	}
 
 	switch (exitReason)
 	{
@@ -187,6 +188,14 @@ static void handleExitReason(PVMM_DATA lpData)
 			break;
 		}
 
+		case VMX_EXIT_REASON_VMX_PREEMPTION_TIMER_EXPIRED:
+		{
+			/* Not caused by an instruction, so the guest continues where it was interrupted. */
+			Scheduler_handleTimer(&lpData->schedulerConfig);
+			moveToNextInstruction = FALSE;
+			break;
+		}
+
 		case VMX_EXIT_REASON_EPT_VIOLATION:
 		{
 			if (TRUE == EPT_handleViolation(&lpData->eptConfig, &lpData->guestContext))
@@ -251,7 +260,7 @@ static void handleExitReason(PVMM_DATA lpData)
 
 		case VMX_EXIT_REASON_EXECUTE_CPUID:
 		{
-			if (TRUE == CPUID_handle(lpData))
+			if (TRUE == CPUID_handle(&lpData->cpuidCache, &lpData->guestContext))
 			{
 				moveToNextInstruction = TRUE;
 			}
@@ -295,7 +304,7 @@ static void handleExitReason(PVMM_DATA lpData)
 				DbgBreakPoint();
 			}
 
-			DEBUG_PRINT("Unhandled VMExit with reason: 0x%I64X\r\n", exitReason);
+			DEBUG_ERROR("Unhandled VMExit with reason: 0x%I64X\r\n", exitReason);
 			break;
 		}
 	}
@@ -304,6 +313,46 @@ static void handleExitReason(PVMM_DATA lpData)
 	{
 		incrementRIP();
 	}
+
+	FlightRecorder_end(flightRecord);
+}
+
+static void recordExit(PVMM_DATA lpData, UINT32 exitReason)
+{
+	/* The captured context holds the guest GPRs, but RIP, RSP and RFLAGS are only in the VMCS.
+	 * They are swapped in for the record and then put back, as resuming the guest relies on them. */
+	PCONTEXT guestContext = &lpData->guestContext;
+
+	UINT64 hostRip = guestContext->Rip;
+	UINT64 hostRsp = guestContext->Rsp;
+	ULONG hostEFlags = guestContext->EFlags;
+
+	size_t guestRIP, guestRSP, guestRFLAGS;
+	__vmx_vmread(VMCS_GUEST_RIP, &guestRIP);
+	__vmx_vmread(VMCS_GUEST_RSP, &guestRSP);
+	__vmx_vmread(VMCS_GUEST_RFLAGS, &guestRFLAGS);
+
+	guestContext->Rip = guestRIP;
+	guestContext->Rsp = guestRSP;
+	guestContext->EFlags = (ULONG)guestRFLAGS;
+
+	size_t guestCR0, guestCR3, guestCR4;
+	__vmx_vmread(VMCS_GUEST_CR0, &guestCR0);
+	__vmx_vmread(VMCS_GUEST_CR3, &guestCR3);
+	__vmx_vmread(VMCS_GUEST_CR4, &guestCR4);
+
+	CR0 cr0;
+	CR3 cr3;
+	CR4 cr4;
+	cr0.Flags = guestCR0;
+	cr3.Flags = guestCR3;
+	cr4.Flags = guestCR4;
+
+	(void)EventLog_record(lpData->processorIndex, exitReason, EVENT_CAPTURE_DEFAULT, guestContext, cr0, cr3, cr4, NULL);
+
+	guestContext->Rip = hostRip;
+	guestContext->Rsp = hostRsp;
+	guestContext->EFlags = hostEFlags;
 }
 
 static void incrementRIP(void)
@@ -3,6 +3,10 @@
 #include "Hypervisor.h"
 #include "PageTable.h"
 #include "VMM.h"
+#include "Worker.h"
+#include "EventLog.h"
+#include "CommandRing.h"
+#include "VMHook.h"
 #include "Debug.h"
 #include "ia32.h"
 
@@ -13,13 +17,18 @@
 
 
 /******************** Module Constants ********************/
-#define MAX_LOGICAL_PROCESSORS 64
+
 
 /******************** Module Variables ********************/
 
 /* Holds the runtime data for each logical processor. */
 static VMM_DATA vmmData[MAX_LOGICAL_PROCESSORS] = { 0 };
 
+/* First failure of any processor to launch, the IPI only returns the status of the one
+ * that issued it, along with how many of them were launched. */
+static volatile LONG launchStatus = STATUS_SUCCESS;
+static volatile LONG launchedCount = 0;
+
 /******************** Module Prototypes ********************/
 static ULONG_PTR logicalProcessorInit(ULONG_PTR argument);
 static NTSTATUS isHVSupported(void);
@@ -37,7 +46,13 @@ NTSTATUS Hypervisor_init(void)
 	//	DbgBreakPoint();
 	//}
 
-	status = isHVSupported();
+	/* Debug output is recorded from the start, it is only printed once the drainer gets to it. */
+	status = DebugLog_init();
+	if (NT_SUCCESS(status))
+	{
+		status = isHVSupported();
+	}
+
 	if (NT_SUCCESS(status))
 	{
 		/* Holds the CR3/PML4 entry that our HOST (when we are VMX root) will use. */
@@ -46,15 +61,46 @@ NTSTATUS Hypervisor_init(void)
 		originalCR3.Flags = __readcr3();
 
 		status = PageTable_init(originalCR3, &vmCR3);
+		if (NT_SUCCESS(status))
+		{
+			/* Start the worker before any processor can queue a deferred action to it. */
+			status = Worker_initialise();
+		}
+
+		if (NT_SUCCESS(status))
+		{
+			/* The event rings have to exist before anything can be logged from VMX root. */
+			status = EventLog_init();
+		}
+
+		if (NT_SUCCESS(status))
+		{
+			/* Rings are torn down as their owner exits, which needs a process notification. */
+			status = CommandRing_init();
+		}
+
 		if (NT_SUCCESS(status))
 		{
 
 			/* We need to notify each logical processor to start the hypervisor.
-			 * This is done using using a IPI.
-			 *
-			 * TODO: IPI result only returns callee processors status
-			 *		 We are discarding other X logical processors results, need to fix this. */
-			status = (NTSTATUS)KeIpiGenericCall(logicalProcessorInit, (ULONG_PTR)vmCR3.Flags);
+			 * This is done using using a IPI. The hooks are held for the whole launch, and
+			 * only changed by IPI from then on if every processor was launched. */
+			VMHook_beginLaunch();
+
+			KeIpiGenericCall(logicalProcessorInit, (ULONG_PTR)vmCR3.Flags);
+			status = (NTSTATUS)launchStatus;
+
+			VMHook_endLaunch(NT_SUCCESS(status));
+		}
+
+		if ((FALSE == NT_SUCCESS(status)) && (0 == launchedCount))
+		{
+			/* Nothing is running under the hypervisor, so nothing can be using what was started for it.
+			 * Each of these does nothing if it wasn't started. A processor that did launch keeps using
+			 * them, so they are left alone then. Debug output carries on, it is how the failure is seen. */
+			CommandRing_uninit();
+			EventLog_uninit();
+			Worker_uninitialise();
 		}
 	}
 
@@ -84,6 +130,14 @@ static ULONG_PTR logicalProcessorInit(ULONG_PTR argument)
 
 	/* Initialise the VMM here. */
 	status = VMM_init(lpData);
+	if (NT_SUCCESS(status))
+	{
+		InterlockedIncrement(&launchedCount);
+	}
+	else
+	{
+		InterlockedCompareExchange(&launchStatus, status, STATUS_SUCCESS);
+	}
 
 	/* Explicitly cast to desired format for IPI broadcast. */
 	return (ULONG_PTR)status;
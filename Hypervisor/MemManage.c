@@ -55,11 +55,10 @@ typedef enum
 
 /******************** Module Prototypes ********************/
 PT_ENTRY_64* getSystemPTEFromVA(CR3 tableBase, PVOID virtualAddress, MM_LEVEL* level);
-static VOID* mapPhysicalAddress(PMM_CONTEXT context, HOST_PHYS_ADDRESS physicalAddress);
-static void unmapPhysicalAddress(PMM_CONTEXT context);
 static NTSTATUS split2MbPage(PDE_2MB_64* pdeLarge);
 static UINT64 physicalFromVirtual(VOID* virtualAddress);
 static VOID* virtualFromPhysical(UINT64 physicalAddress);
+static HOST_PHYS_ADDRESS translateGuestVA(PMM_CONTEXT context, CR3 tableBase, GUEST_VIRTUAL_ADDRESS guestVA);
 
 /******************** Public Code ********************/
 
@@ -94,6 +93,7 @@ NTSTATUS MemManage_init(PMM_CONTEXT context, CR3 hostCR3)
 
 			context->reservedPage = reservedPage;
 			context->reservedPagePte = (PTE_64*)reservedPagePTE;
+			context->translationCache.enabled = FALSE;
 		}
 	}
 	else
@@ -150,7 +150,7 @@ NTSTATUS MemManage_readVirtualAddress(PMM_CONTEXT context, CR3 tableBase, GUEST_
 		}
 
 		/* Get the physical address of the guest memory. */
-		HOST_PHYS_ADDRESS physHost = GuestShim_GuestUVAToHPA(context, tableBase, currentVA);
+		HOST_PHYS_ADDRESS physHost = translateGuestVA(context, tableBase, currentVA);
 		if (0 != physHost)
 		{
 			/* Read the memory. */
@@ -164,6 +164,12 @@ NTSTATUS MemManage_readVirtualAddress(PMM_CONTEXT context, CR3 tableBase, GUEST_
 				size -= bytesThisPage;
 			}
 		}
+		else
+		{
+			/* The page isn't mapped in the guest, there is no point retrying. */
+			status = STATUS_UNSUCCESSFUL;
+			break;
+		}
 	}
 
 	return status;
@@ -200,7 +206,7 @@ NTSTATUS MemManage_writeVirtualAddress(PMM_CONTEXT context, CR3 tableBase, GUEST
 		}
 
 		/* Get the physical address of the guest memory. */
-		HOST_PHYS_ADDRESS physHost = GuestShim_GuestUVAToHPA(context, tableBase, currentVA);
+		HOST_PHYS_ADDRESS physHost = translateGuestVA(context, tableBase, currentVA);
 		if (0 != physHost)
 		{
 			/* Write the memory. */
@@ -214,6 +220,12 @@ NTSTATUS MemManage_writeVirtualAddress(PMM_CONTEXT context, CR3 tableBase, GUEST
 				size -= bytesThisPage;
 			}
 		}
+		else
+		{
+			/* The page isn't mapped in the guest, there is no point retrying. */
+			status = STATUS_UNSUCCESSFUL;
+			break;
+		}
 	}
 
 	return status;
@@ -224,14 +236,14 @@ NTSTATUS MemManage_readPhysicalAddress(PMM_CONTEXT context, HOST_PHYS_ADDRESS ph
 	NTSTATUS status;
 
 	/* Map the physical memory. */
-	VOID* mappedVA = mapPhysicalAddress(context, physicalAddress);
+	VOID* mappedVA = MemManage_mapPhysicalAddress(context, physicalAddress);
 	if (NULL != mappedVA)
 	{
 		/* Do the copy. */
 		RtlCopyMemory(buffer, mappedVA, bytesToCopy);
 
 		/* Unmap the physical memory. */
-		unmapPhysicalAddress(context);
+		MemManage_unmapPhysicalAddress(context);
 		status = STATUS_SUCCESS;
 	}
 	else
@@ -247,14 +259,14 @@ NTSTATUS MemManage_writePhysicalAddress(PMM_CONTEXT context, HOST_PHYS_ADDRESS p
 	NTSTATUS status;
 
 	/* Map the physical memory. */
-	VOID* mappedVA = mapPhysicalAddress(context, physicalAddress);
+	VOID* mappedVA = MemManage_mapPhysicalAddress(context, physicalAddress);
 	if (NULL != mappedVA)
 	{
 		/* Do the copy. */
 		RtlCopyMemory(mappedVA, buffer, bytesToCopy);
 
 		/* Unmap the physical memory. */
-		unmapPhysicalAddress(context);
+		MemManage_unmapPhysicalAddress(context);
 		status = STATUS_SUCCESS;
 	}
 	else
@@ -293,8 +305,79 @@ CR3 MemManage_getPageTableBase(PEPROCESS process)
 	return tableBase;
 }
 
+VOID* MemManage_mapPhysicalAddress(PMM_CONTEXT context, HOST_PHYS_ADDRESS physicalAddress)
+{
+	/* Map the requested physical address to our reserved page. */
+	context->reservedPagePte->Present = TRUE;
+	context->reservedPagePte->Write = TRUE;
+	context->reservedPagePte->PageFrameNumber = physicalAddress / PAGE_SIZE;
+
+	/* Invalidate the TLB entries so we don't get cached old data. */
+	__invlpg(context->reservedPage);
+
+	return (VOID*)(((PUINT8)context->reservedPage) + ADDRMASK_PML1_OFFSET(physicalAddress));
+}
+
+void MemManage_unmapPhysicalAddress(PMM_CONTEXT context)
+{
+	/* Clear the page entry and flush the cache (TLB). */
+	context->reservedPagePte->Flags = 0;
+	__invlpg(context->reservedPage);
+}
+
+void MemManage_enableTranslationCache(PMM_CONTEXT context, CR3 tableBase)
+{
+	PMM_TRANSLATION_CACHE cache = &context->translationCache;
+
+	/* Start from an empty cache, nothing from a previous exit can be trusted. */
+	RtlZeroMemory(cache->entries, sizeof(cache->entries));
+
+	cache->tableBase.Flags = tableBase.Flags & ~0xFFFULL;
+	cache->enabled = TRUE;
+}
+
+void MemManage_disableTranslationCache(PMM_CONTEXT context)
+{
+	context->translationCache.enabled = FALSE;
+}
+
 /******************** Module Code ********************/
 
+static HOST_PHYS_ADDRESS translateGuestVA(PMM_CONTEXT context, CR3 tableBase, GUEST_VIRTUAL_ADDRESS guestVA)
+{
+	HOST_PHYS_ADDRESS result;
+
+	PMM_TRANSLATION_CACHE cache = &context->translationCache;
+	GUEST_VIRTUAL_ADDRESS guestPage = guestVA & ~(GUEST_VIRTUAL_ADDRESS)(PAGE_SIZE - 1);
+
+	/* Only translations for the table base the cache was enabled for are kept. */
+	if ((TRUE == cache->enabled) && (cache->tableBase.Flags == (tableBase.Flags & ~0xFFFULL)))
+	{
+		PMM_TRANSLATION entry = &cache->entries[(guestPage >> PAGE_SHIFT) % MM_TRANSLATION_CACHE_SIZE];
+
+		if ((0 != entry->hostPage) && (guestPage == entry->guestPage))
+		{
+			result = entry->hostPage + (guestVA & (PAGE_SIZE - 1));
+		}
+		else
+		{
+			result = GuestShim_GuestUVAToHPA(context, tableBase, guestVA);
+
+			if (0 != result)
+			{
+				entry->guestPage = guestPage;
+				entry->hostPage = result & ~(HOST_PHYS_ADDRESS)(PAGE_SIZE - 1);
+			}
+		}
+	}
+	else
+	{
+		result = GuestShim_GuestUVAToHPA(context, tableBase, guestVA);
+	}
+
+	return result;
+}
+
 PT_ENTRY_64* getSystemPTEFromVA(CR3 tableBase, PVOID virtualAddress, MM_LEVEL* level)
 {
 	PT_ENTRY_64* result = NULL;
@@ -344,26 +427,6 @@ PT_ENTRY_64* getSystemPTEFromVA(CR3 tableBase, PVOID virtualAddress, MM_LEVEL* l
 	return result;
 }
 
-static VOID* mapPhysicalAddress(PMM_CONTEXT context, HOST_PHYS_ADDRESS physicalAddress)
-{
-	/* Map the requested physical address to our reserved page. */
-	context->reservedPagePte->Present = TRUE;
-	context->reservedPagePte->Write = TRUE;
-	context->reservedPagePte->PageFrameNumber = physicalAddress / PAGE_SIZE;
-
-	/* Invalidate the TLB entries so we don't get cached old data. */
-	__invlpg(context->reservedPage);
-
-	return (VOID*)(((PUINT8)context->reservedPage) + ADDRMASK_PML1_OFFSET(physicalAddress));
-}
-
-static void unmapPhysicalAddress(PMM_CONTEXT context)
-{
-	/* Clear the page entry and flush the cache (TLB). */
-	context->reservedPagePte->Flags = 0;
-	__invlpg(context->reservedPage);
-}
-
 static NTSTATUS split2MbPage(PDE_2MB_64* pdeLarge)
 {
 	NTSTATUS status;
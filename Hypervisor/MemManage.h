@@ -2,7 +2,32 @@
 #include <wdm.h>
 #include "ia32.h"
 
+/******************** Public Defines ********************/
+
+/* Number of guest page translations remembered whilst the translation cache is enabled. */
+#define MM_TRANSLATION_CACHE_SIZE 16
+
 /******************** Public Typedefs ********************/
+
+typedef SIZE_T HOST_PHYS_ADDRESS;
+typedef SIZE_T GUEST_VIRTUAL_ADDRESS;
+
+typedef struct _MM_TRANSLATION
+{
+	GUEST_VIRTUAL_ADDRESS guestPage;
+	HOST_PHYS_ADDRESS hostPage;
+} MM_TRANSLATION, *PMM_TRANSLATION;
+
+/* Small direct mapped cache of guest virtual to host physical page translations.
+ * This is only enabled for the duration of a single exit, as the guest is free
+ * to change its page tables as soon as it is running again. */
+typedef struct _MM_TRANSLATION_CACHE
+{
+	BOOLEAN enabled;
+	CR3 tableBase;
+	MM_TRANSLATION entries[MM_TRANSLATION_CACHE_SIZE];
+} MM_TRANSLATION_CACHE, *PMM_TRANSLATION_CACHE;
+
 typedef struct _MM_CONTEXT
 {
 	/* The reserved page that will be used for storing data in. */
@@ -10,10 +35,10 @@ typedef struct _MM_CONTEXT
 
 	/* PTE that belongs to the reserved page. */
 	PTE_64* reservedPagePte;
-} MM_CONTEXT, *PMM_CONTEXT;
 
-typedef SIZE_T HOST_PHYS_ADDRESS;
-typedef SIZE_T GUEST_VIRTUAL_ADDRESS;
+	/* Translations of guest pages, used to amortise page walks across many accesses. */
+	MM_TRANSLATION_CACHE translationCache;
+} MM_CONTEXT, *PMM_CONTEXT;
 
 /******************** Public Constants ********************/
 
@@ -26,4 +51,8 @@ NTSTATUS MemManage_readVirtualAddress(PMM_CONTEXT context, CR3 tableBase, GUEST_
 NTSTATUS MemManage_writeVirtualAddress(PMM_CONTEXT context, CR3 tableBase, GUEST_VIRTUAL_ADDRESS guestVA, PVOID buffer, SIZE_T size);
 NTSTATUS MemManage_readPhysicalAddress(PMM_CONTEXT context, HOST_PHYS_ADDRESS physicalAddress, VOID* buffer, SIZE_T bytesToCopy);
 NTSTATUS MemManage_writePhysicalAddress(PMM_CONTEXT context, HOST_PHYS_ADDRESS physicalAddress, VOID* buffer, SIZE_T bytesToCopy);
-CR3 MemManage_getPageTableBase(PEPROCESS process);
\ No newline at end of file
+VOID* MemManage_mapPhysicalAddress(PMM_CONTEXT context, HOST_PHYS_ADDRESS physicalAddress);
+void MemManage_unmapPhysicalAddress(PMM_CONTEXT context);
+CR3 MemManage_getPageTableBase(PEPROCESS process);
+void MemManage_enableTranslationCache(PMM_CONTEXT context, CR3 tableBase);
+void MemManage_disableTranslationCache(PMM_CONTEXT context);
\ No newline at end of file
@@ -0,0 +1,272 @@
+#include <ntifs.h>
+#include <intrin.h>
+#include "Profiler.h"
+#include "VMM.h"
+#include "Debug.h"
+#include "ia32.h"
+
+/******************** External API ********************/
+
+
+/******************** Module Typedefs ********************/
+
+/* Single producer, single consumer ring of samples for a logical processor.
+ * The owning processor is the only producer (from VMX root), draining is
+ * serialised by the drain lock so there is only ever one consumer. */
+typedef struct _PROFILER_RING
+{
+	/* Free running index of the next sample to be written. */
+	volatile LONG head;
+
+	/* Free running index of the next sample to be read. */
+	volatile LONG tail;
+
+	/* Number of samples discarded since the last drain, due to the ring being full. */
+	volatile LONG droppedCount;
+
+	/* Set whilst a drain of this ring is in progress. */
+	volatile LONG drainLock;
+
+	PROFILER_SAMPLE samples[PROFILER_RING_SAMPLES];
+} PROFILER_RING, *PPROFILER_RING;
+
+/******************** Module Constants ********************/
+
+#define PROFILER_RING_MASK (PROFILER_RING_SAMPLES - 1)
+
+C_ASSERT((PROFILER_RING_SAMPLES & PROFILER_RING_MASK) == 0);
+
+/******************** Module Variables ********************/
+
+/* Incremented every time the requested periods change, each logical processor
+ * compares this against the generation it last applied on its next exit. */
+static volatile LONG controlGeneration = 0;
+
+/* Requested sampling period in TSC cycles for each logical processor, zero when stopped. */
+static volatile UINT64 requestedPeriod[MAX_LOGICAL_PROCESSORS] = { 0 };
+
+/* Sample rings for each logical processor, these are kept outside of the VMM data
+ * so they can be drained from whichever processor receives the VMCALL. */
+static PROFILER_RING sampleRings[MAX_LOGICAL_PROCESSORS] = { 0 };
+
+/******************** Module Prototypes ********************/
+static void recordSample(PSCHEDULER_CONFIG schedulerConfig, PVOID userParameter);
+static NTSTATUS setRequestedPeriod(UINT32 processorIndex, UINT64 periodCycles);
+
+/******************** Public Code ********************/
+
+void Profiler_initialise(PPROFILER_CONFIG profilerConfig, ULONG processorIndex)
+{
+	profilerConfig->processorIndex = processorIndex;
+	profilerConfig->sampleTimer = NULL;
+	profilerConfig->periodCycles = 0;
+	profilerConfig->appliedGeneration = controlGeneration;
+}
+
+void Profiler_sync(PPROFILER_CONFIG profilerConfig, PSCHEDULER_CONFIG schedulerConfig)
+{
+	/* Cheap check performed on every exit, only when the control state has
+	 * changed do we need to touch the scheduler. */
+	LONG generation = controlGeneration;
+
+	if (generation != profilerConfig->appliedGeneration)
+	{
+		profilerConfig->appliedGeneration = generation;
+
+		UINT64 periodCycles = requestedPeriod[profilerConfig->processorIndex];
+
+		if (periodCycles != profilerConfig->periodCycles)
+		{
+			if (NULL != profilerConfig->sampleTimer)
+			{
+				Scheduler_removeTimer(schedulerConfig, profilerConfig->sampleTimer);
+				profilerConfig->sampleTimer = NULL;
+			}
+
+			/* Sampling is just a periodic timer of the scheduler, which takes care of
+			 * arming and disarming the preemption timer. */
+			if ((0 != periodCycles) &&
+				(NT_SUCCESS(Scheduler_addTimer(schedulerConfig, periodCycles, TRUE, recordSample,
+											   profilerConfig, &profilerConfig->sampleTimer))))
+			{
+				profilerConfig->periodCycles = periodCycles;
+			}
+			else
+			{
+				profilerConfig->periodCycles = 0;
+			}
+		}
+	}
+}
+
+NTSTATUS Profiler_start(UINT32 processorIndex, UINT64 periodCycles)
+{
+	NTSTATUS status;
+
+	if (0 != periodCycles)
+	{
+		status = setRequestedPeriod(processorIndex, periodCycles);
+	}
+	else
+	{
+		status = STATUS_INVALID_PARAMETER;
+	}
+
+	return status;
+}
+
+NTSTATUS Profiler_stop(UINT32 processorIndex)
+{
+	return setRequestedPeriod(processorIndex, 0);
+}
+
+NTSTATUS Profiler_getCounters(UINT32 processorIndex, PUINT64 pendingCount, PUINT64 droppedCount)
+{
+	NTSTATUS status;
+
+	if (processorIndex < MAX_LOGICAL_PROCESSORS)
+	{
+		PPROFILER_RING ring = &sampleRings[processorIndex];
+
+		*pendingCount = (ULONG)ring->head - (ULONG)ring->tail;
+		*droppedCount = (ULONG)ring->droppedCount;
+		status = STATUS_SUCCESS;
+	}
+	else
+	{
+		status = STATUS_INVALID_PARAMETER;
+	}
+
+	return status;
+}
+
+NTSTATUS Profiler_drain(UINT32 processorIndex, PMM_CONTEXT mmContext, CR3 guestCR3, GUEST_VIRTUAL_ADDRESS samples,
+						SIZE_T sampleCapacity, PSIZE_T sampleCount, PUINT32 droppedCount)
+{
+	NTSTATUS status;
+
+	*sampleCount = 0;
+	*droppedCount = 0;
+
+	if ((processorIndex < MAX_LOGICAL_PROCESSORS) && (0 != samples))
+	{
+		PPROFILER_RING ring = &sampleRings[processorIndex];
+
+		/* Only one consumer can be draining a ring at a time. */
+		if (0 == InterlockedCompareExchange(&ring->drainLock, 1, 0))
+		{
+			ULONG tail = (ULONG)ring->tail;
+			ULONG head = (ULONG)ring->head;
+
+			SIZE_T available = (SIZE_T)(head - tail);
+			SIZE_T toCopy = (available < sampleCapacity) ? available : sampleCapacity;
+			SIZE_T copied = 0;
+
+			status = STATUS_SUCCESS;
+
+			/* Copy directly out of the ring, in at most two contiguous chunks. */
+			while ((copied < toCopy) && (NT_SUCCESS(status)))
+			{
+				ULONG index = (tail + (ULONG)copied) & PROFILER_RING_MASK;
+
+				SIZE_T chunk = toCopy - copied;
+				if (chunk > (SIZE_T)(PROFILER_RING_SAMPLES - index))
+				{
+					chunk = PROFILER_RING_SAMPLES - index;
+				}
+
+				status = MemManage_writeVirtualAddress(mmContext, guestCR3,
+													   samples + (copied * sizeof(PROFILER_SAMPLE)),
+													   &ring->samples[index],
+													   chunk * sizeof(PROFILER_SAMPLE));
+				if (NT_SUCCESS(status))
+				{
+					copied += chunk;
+				}
+			}
+
+			/* Release the space of the samples that made it to the guest. */
+			InterlockedExchange(&ring->tail, (LONG)(tail + (ULONG)copied));
+
+			*sampleCount = copied;
+			*droppedCount = (UINT32)InterlockedExchange(&ring->droppedCount, 0);
+
+			InterlockedExchange(&ring->drainLock, 0);
+		}
+		else
+		{
+			status = STATUS_DEVICE_BUSY;
+		}
+	}
+	else
+	{
+		status = STATUS_INVALID_PARAMETER;
+	}
+
+	return status;
+}
+
+/******************** Module Code ********************/
+
+static void recordSample(PSCHEDULER_CONFIG schedulerConfig, PVOID userParameter)
+{
+	UNREFERENCED_PARAMETER(schedulerConfig);
+
+	PPROFILER_CONFIG profilerConfig = (PPROFILER_CONFIG)userParameter;
+	PPROFILER_RING ring = &sampleRings[profilerConfig->processorIndex];
+
+	ULONG head = (ULONG)ring->head;
+	ULONG tail = (ULONG)ring->tail;
+
+	if ((head - tail) < PROFILER_RING_SAMPLES)
+	{
+		PPROFILER_SAMPLE sample = &ring->samples[head & PROFILER_RING_MASK];
+
+		sample->timeStamp = __rdtsc();
+		sample->processorIndex = profilerConfig->processorIndex;
+
+		__vmx_vmread(VMCS_GUEST_RIP, &sample->guestRIP);
+		__vmx_vmread(VMCS_GUEST_CR3, &sample->guestCR3);
+
+		/* The CPL is always equal to the DPL of the stack segment. */
+		size_t accessRights;
+		__vmx_vmread(VMCS_GUEST_SS_ACCESS_RIGHTS, &accessRights);
+		sample->guestCPL = VMX_SEGMENT_ACCESS_RIGHTS_DESCRIPTOR_PRIVILEGE_LEVEL(accessRights);
+
+		/* Publish the sample, the exchange also acts as a barrier for the writes above. */
+		InterlockedExchange(&ring->head, (LONG)(head + 1));
+	}
+	else
+	{
+		InterlockedIncrement(&ring->droppedCount);
+	}
+}
+
+static NTSTATUS setRequestedPeriod(UINT32 processorIndex, UINT64 periodCycles)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+
+	if (PROFILER_ALL_PROCESSORS == processorIndex)
+	{
+		for (UINT32 i = 0; i < MAX_LOGICAL_PROCESSORS; i++)
+		{
+			requestedPeriod[i] = periodCycles;
+		}
+	}
+	else if (processorIndex < MAX_LOGICAL_PROCESSORS)
+	{
+		requestedPeriod[processorIndex] = periodCycles;
+	}
+	else
+	{
+		status = STATUS_INVALID_PARAMETER;
+	}
+
+	if (NT_SUCCESS(status))
+	{
+		/* Notify each logical processor that it should apply the new period on its next exit. */
+		InterlockedIncrement(&controlGeneration);
+	}
+
+	return status;
+}
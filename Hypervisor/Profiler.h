@@ -0,0 +1,34 @@
+#pragma once
+#include <wdm.h>
+#include "MemManage.h"
+#include "Scheduler.h"
+#include "Profiler_Common.h"
+
+/******************** Public Typedefs ********************/
+
+/* Per logical processor state of the sampling profiler. */
+typedef struct _PROFILER_CONFIG
+{
+	ULONG processorIndex;
+
+	/* Periodic scheduler timer that takes the samples, NULL whilst stopped. */
+	PSCHEDULER_TIMER sampleTimer;
+	UINT64 periodCycles;
+
+	/* Last generation of the global control state that was applied to this processor. */
+	LONG appliedGeneration;
+} PROFILER_CONFIG, *PPROFILER_CONFIG;
+
+/******************** Public Constants ********************/
+
+/******************** Public Variables ********************/
+
+/******************** Public Prototypes ********************/
+
+void Profiler_initialise(PPROFILER_CONFIG profilerConfig, ULONG processorIndex);
+void Profiler_sync(PPROFILER_CONFIG profilerConfig, PSCHEDULER_CONFIG schedulerConfig);
+NTSTATUS Profiler_start(UINT32 processorIndex, UINT64 periodCycles);
+NTSTATUS Profiler_stop(UINT32 processorIndex);
+NTSTATUS Profiler_getCounters(UINT32 processorIndex, PUINT64 pendingCount, PUINT64 droppedCount);
+NTSTATUS Profiler_drain(UINT32 processorIndex, PMM_CONTEXT mmContext, CR3 guestCR3, GUEST_VIRTUAL_ADDRESS samples,
+						SIZE_T sampleCapacity, PSIZE_T sampleCount, PUINT32 droppedCount);
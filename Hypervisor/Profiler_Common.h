@@ -0,0 +1,36 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/******************** Public Defines ********************/
+
+/* Number of samples that can be held per logical processor before samples are dropped. */
+#define PROFILER_RING_SAMPLES 2048
+
+/* Processor index used by start/stop requests to target every logical processor. */
+#define PROFILER_ALL_PROCESSORS ((UINT32)0xFFFFFFFF)
+
+/******************** Public Typedefs ********************/
+
+/* A single sample taken when the VMX preemption timer of a logical processor expired. */
+typedef struct _PROFILER_SAMPLE
+{
+	UINT64 timeStamp;
+	UINT64 guestRIP;
+	UINT64 guestCR3;
+	UINT32 processorIndex;
+	UINT32 guestCPL;
+} PROFILER_SAMPLE, *PPROFILER_SAMPLE;
+
+/******************** Public Constants ********************/
+
+/******************** Public Variables ********************/
+
+/******************** Public Prototypes ********************/
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,301 @@
+#include <ntifs.h>
+#include "Relocate.h"
+#include "Trampoline.h"
+
+/******************** External API ********************/
+
+
+/******************** Module Typedefs ********************/
+
+
+/******************** Module Constants ********************/
+
+#define REX_W 0x08
+#define REX_R 0x04
+
+/* Sizes of the forms that are written. */
+#define JMP_REL32_SIZE RELOCATE_NEAR_JUMP_SIZE
+#define JMP_RIP_SIZE RELOCATE_MAX_JUMP_SIZE
+#define JMP_REL8_SIZE 2
+#define CALL_REL32_SIZE 5
+#define CALL_RIP_SIZE 16
+#define JCC_REL32_SIZE 6
+#define MOV_IMM64_SIZE 10
+
+/******************** Module Variables ********************/
+
+
+/******************** Module Prototypes ********************/
+static NTSTATUS relocateBranch(const UINT8* instruction, const DECODED_INSTRUCTION* decoded, PUINT8 buffer,
+							   UINT64 bufferAddress, SIZE_T bufferSize, PSIZE_T writtenSize);
+static NTSTATUS relocateRIPRelative(const UINT8* instruction, const DECODED_INSTRUCTION* decoded, PUINT8 buffer,
+									UINT64 bufferAddress, SIZE_T bufferSize, PSIZE_T writtenSize);
+static SIZE_T writeCall(PUINT8 buffer, UINT64 sourceAddress, UINT64 targetAddress);
+
+/******************** Public Code ********************/
+
+NTSTATUS Relocate_instruction(const UINT8* instruction, const DECODED_INSTRUCTION* decoded, PUINT8 buffer,
+							  UINT64 bufferAddress, SIZE_T bufferSize, PSIZE_T writtenSize)
+{
+	/* Rewrites the decoded instruction so that it does the same thing when executed from bufferAddress.
+	 * Relative branches and RIP relative operands are pointed back at what they referred to,
+	 * anything else is copied as it is. No register is used that the instruction didn't already
+	 * write to, so the trampoline behaves exactly as the original would have. */
+	NTSTATUS status = STATUS_NOT_FOUND;
+
+	*writtenSize = 0;
+
+	if (0 != (decoded->flags & DECODER_FLAG_RELATIVE))
+	{
+		status = relocateBranch(instruction, decoded, buffer, bufferAddress, bufferSize, writtenSize);
+	}
+	else if (0 != (decoded->flags & DECODER_FLAG_RIP_RELATIVE))
+	{
+		status = relocateRIPRelative(instruction, decoded, buffer, bufferAddress, bufferSize, writtenSize);
+	}
+
+	if (STATUS_NOT_FOUND == status)
+	{
+		/* Doesn't depend on where it is. */
+		if (decoded->length <= bufferSize)
+		{
+			RtlCopyMemory(buffer, instruction, decoded->length);
+			*writtenSize = decoded->length;
+			status = STATUS_SUCCESS;
+		}
+		else
+		{
+			status = STATUS_BUFFER_TOO_SMALL;
+		}
+	}
+
+	return status;
+}
+
+SIZE_T Relocate_writeJump(PUINT8 buffer, UINT64 sourceAddress, UINT64 targetAddress)
+{
+	/* Writes a jump that will be executed at sourceAddress, returning its size. Neither form touches
+	 * the stack or a register, and there is no RET without a CALL to upset the return stack buffer.
+	 * A JMP [RIP+0] reads its own bytes, so it mustn't be written into an execute only shadow page. */
+	SIZE_T result;
+
+	if (TRUE == Trampoline_isNear((PVOID)sourceAddress, (PVOID)targetAddress))
+	{
+		/* JMP rel32 */
+		buffer[0] = 0xE9;
+		*((PINT32)&buffer[1]) = (INT32)(targetAddress - (sourceAddress + JMP_REL32_SIZE));
+
+		result = JMP_REL32_SIZE;
+	}
+	else
+	{
+		/* JMP [RIP+0], with the address straight after it. */
+		buffer[0] = 0xFF;
+		buffer[1] = 0x25;
+		*((PINT32)&buffer[2]) = 0;
+
+		*((PUINT64)&buffer[6]) = targetAddress;
+
+		result = JMP_RIP_SIZE;
+	}
+
+	return result;
+}
+
+SIZE_T Relocate_writeRegisterJump(PUINT8 buffer, UINT64 targetAddress)
+{
+	/* Writes a jump to anywhere that reads nothing from memory, so it can go into an execute only
+	 * shadow page. It trashes R11, which is volatile and never carries an argument, so this is
+	 * only safe at the start of a function. */
+
+	/* MOV R11, imm64 */
+	buffer[0] = 0x49;
+	buffer[1] = 0xBB;
+	*((PUINT64)&buffer[2]) = targetAddress;
+
+	/* JMP R11 */
+	buffer[10] = 0x41;
+	buffer[11] = 0xFF;
+	buffer[12] = 0xE3;
+
+	return RELOCATE_REGISTER_JUMP_SIZE;
+}
+
+/******************** Module Code ********************/
+
+static NTSTATUS relocateBranch(const UINT8* instruction, const DECODED_INSTRUCTION* decoded, PUINT8 buffer,
+							   UINT64 bufferAddress, SIZE_T bufferSize, PSIZE_T writtenSize)
+{
+	/* Relative branches are rewritten with a rel32 when the target is within reach of the buffer,
+	 * otherwise with an absolute address held alongside the code. */
+	NTSTATUS status = STATUS_SUCCESS;
+	UINT8 opcode = decoded->opcode;
+	UINT64 target = decoded->target;
+	BOOLEAN targetNear = Trampoline_isNear((PVOID)bufferAddress, (PVOID)target);
+
+	/* Large enough for any form written, checked against the buffer at the end. */
+	UINT8 rewritten[RELOCATE_MAX_SIZE];
+	SIZE_T size = 0;
+
+	switch (decoded->branchType)
+	{
+	case DECODER_BRANCH_JUMP:
+		/* JMP rel32, JMP rel8 */
+		size = Relocate_writeJump(rewritten, bufferAddress, target);
+		break;
+
+	case DECODER_BRANCH_CALL:
+		/* CALL rel32, the return address is within the trampoline, which carries on from there. */
+		size = writeCall(rewritten, bufferAddress, target);
+		break;
+
+	case DECODER_BRANCH_CONDITIONAL:
+		/* Jcc rel8 or Jcc rel32, the condition is the low nibble of either opcode. */
+		if (TRUE == targetNear)
+		{
+			rewritten[0] = 0x0F;
+			rewritten[1] = 0x80 | (opcode & 0x0F);
+			*((PINT32)&rewritten[2]) = (INT32)(target - (bufferAddress + JCC_REL32_SIZE));
+			size = JCC_REL32_SIZE;
+		}
+		else
+		{
+			/* Jump over the jump to the target on the opposite condition. */
+			SIZE_T jumpSize = Relocate_writeJump(&rewritten[JMP_REL8_SIZE], bufferAddress + JMP_REL8_SIZE, target);
+
+			rewritten[0] = 0x70 | ((opcode & 0x0F) ^ 0x01);
+			rewritten[1] = (UINT8)jumpSize;
+			size = JMP_REL8_SIZE + jumpSize;
+		}
+		break;
+
+	case DECODER_BRANCH_LOOP:
+	{
+		/* LOOPNE, LOOPE, LOOP and JRCXZ only have a rel8. They are kept, along with any address
+		 * size prefix, but branch to a jump to the target just past a jump that skips it. */
+		SIZE_T loopSize = decoded->length;
+
+		if ((loopSize + JMP_REL8_SIZE + JMP_RIP_SIZE) <= sizeof(rewritten))
+		{
+			SIZE_T jumpSize = Relocate_writeJump(&rewritten[loopSize + JMP_REL8_SIZE], bufferAddress + loopSize + JMP_REL8_SIZE, target);
+
+			RtlCopyMemory(rewritten, instruction, loopSize - 1);
+			rewritten[loopSize - 1] = JMP_REL8_SIZE;
+			rewritten[loopSize] = 0xEB;
+			rewritten[loopSize + 1] = (UINT8)jumpSize;
+
+			size = loopSize + JMP_REL8_SIZE + jumpSize;
+		}
+		else
+		{
+			status = STATUS_NOT_SUPPORTED;
+		}
+		break;
+	}
+
+	default:
+		/* XBEGIN, the abort handler can't be pointed anywhere else. */
+		status = STATUS_NOT_SUPPORTED;
+		break;
+	}
+
+	if (NT_SUCCESS(status))
+	{
+		if (size <= bufferSize)
+		{
+			RtlCopyMemory(buffer, rewritten, size);
+			*writtenSize = size;
+		}
+		else
+		{
+			status = STATUS_BUFFER_TOO_SMALL;
+		}
+	}
+
+	return status;
+}
+
+static NTSTATUS relocateRIPRelative(const UINT8* instruction, const DECODED_INSTRUCTION* decoded, PUINT8 buffer,
+									UINT64 bufferAddress, SIZE_T bufferSize, PSIZE_T writtenSize)
+{
+	/* An operand at [RIP+disp32] keeps the same instruction with the displacement adjusted,
+	 * when the buffer is near enough for that. LEA is the only one that can be rewritten otherwise,
+	 * as the address it loads can be an immediate. */
+	NTSTATUS status;
+	UINT64 operandAddress = decoded->target;
+
+	/* RIP is the address of the next instruction, so anything after the displacement counts. */
+	UINT64 nextAddress = bufferAddress + decoded->length;
+
+	if (TRUE == Trampoline_isNear((PVOID)nextAddress, (PVOID)operandAddress))
+	{
+		if (decoded->length <= bufferSize)
+		{
+			RtlCopyMemory(buffer, instruction, decoded->length);
+			*((PINT32)&buffer[decoded->displacementOffset]) = (INT32)(operandAddress - nextAddress);
+
+			*writtenSize = decoded->length;
+			status = STATUS_SUCCESS;
+		}
+		else
+		{
+			status = STATUS_BUFFER_TOO_SMALL;
+		}
+	}
+	else if ((DECODER_MAP_ONE_BYTE == decoded->map) && (0x8D == decoded->opcode) && (0 != (decoded->rex & REX_W)) &&
+			 (1 == decoded->opcodeOffset))
+	{
+		/* LEA r64, [RIP+disp32] with only a REX prefix becomes MOV r64, imm64, neither touch the flags.
+		 * The register moves from REX.R to REX.B. */
+		if (MOV_IMM64_SIZE <= bufferSize)
+		{
+			UINT8 reg = (UINT8)((decoded->modRM >> 3) & 0x07);
+
+			buffer[0] = 0x48 | ((0 != (decoded->rex & REX_R)) ? 0x01 : 0x00);
+			buffer[1] = 0xB8 + reg;
+			*((PUINT64)&buffer[2]) = operandAddress;
+
+			*writtenSize = MOV_IMM64_SIZE;
+			status = STATUS_SUCCESS;
+		}
+		else
+		{
+			status = STATUS_BUFFER_TOO_SMALL;
+		}
+	}
+	else
+	{
+		/* Can't be done without a scratch register. */
+		status = STATUS_NOT_SUPPORTED;
+	}
+
+	return status;
+}
+
+static SIZE_T writeCall(PUINT8 buffer, UINT64 sourceAddress, UINT64 targetAddress)
+{
+	SIZE_T result;
+
+	if (TRUE == Trampoline_isNear((PVOID)sourceAddress, (PVOID)targetAddress))
+	{
+		/* CALL rel32 */
+		buffer[0] = 0xE8;
+		*((PINT32)&buffer[1]) = (INT32)(targetAddress - (sourceAddress + CALL_REL32_SIZE));
+
+		result = CALL_REL32_SIZE;
+	}
+	else
+	{
+		/* CALL [RIP+2], returning to a JMP over the address that follows it. */
+		buffer[0] = 0xFF;
+		buffer[1] = 0x15;
+		*((PINT32)&buffer[2]) = JMP_REL8_SIZE;
+		buffer[6] = 0xEB;
+		buffer[7] = sizeof(UINT64);
+		*((PUINT64)&buffer[8]) = targetAddress;
+
+		result = CALL_RIP_SIZE;
+	}
+
+	return result;
+}
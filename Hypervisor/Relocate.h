@@ -0,0 +1,31 @@
+#pragma once
+#include <wdm.h>
+#include "Decoder.h"
+
+/******************** Public Defines ********************/
+
+/* Longest a single instruction can become once it has been relocated, a LOOP
+ * that can't reach its target with a rel32. */
+#define RELOCATE_MAX_SIZE 20
+
+/* Longest jump that is written, a JMP [RIP+0] along with its address. */
+#define RELOCATE_MAX_JUMP_SIZE 14
+
+/* Jump that is written when the target is within reach, a JMP rel32. */
+#define RELOCATE_NEAR_JUMP_SIZE 5
+
+/* Jump through R11 to anywhere, a MOV R11, imm64 followed by a JMP R11. */
+#define RELOCATE_REGISTER_JUMP_SIZE 13
+
+/******************** Public Typedefs ********************/
+
+/******************** Public Constants ********************/
+
+/******************** Public Variables ********************/
+
+/******************** Public Prototypes ********************/
+
+NTSTATUS Relocate_instruction(const UINT8* instruction, const DECODED_INSTRUCTION* decoded, PUINT8 buffer,
+							  UINT64 bufferAddress, SIZE_T bufferSize, PSIZE_T writtenSize);
+SIZE_T Relocate_writeJump(PUINT8 buffer, UINT64 sourceAddress, UINT64 targetAddress);
+SIZE_T Relocate_writeRegisterJump(PUINT8 buffer, UINT64 targetAddress);
@@ -0,0 +1,330 @@
+#include <ntifs.h>
+#include <intrin.h>
+#include "Scheduler.h"
+#include "Debug.h"
+#include "ia32.h"
+
+/******************** External API ********************/
+
+
+/******************** Module Typedefs ********************/
+
+
+/******************** Module Constants ********************/
+
+#define SCHEDULER_WHEEL_MASK (SCHEDULER_WHEEL_SLOTS - 1)
+
+C_ASSERT((SCHEDULER_WHEEL_SLOTS & SCHEDULER_WHEEL_MASK) == 0);
+
+/******************** Module Variables ********************/
+
+
+/******************** Module Prototypes ********************/
+static UINT64 currentTick(void);
+static void insertTimer(PSCHEDULER_CONFIG schedulerConfig, PSCHEDULER_TIMER timer);
+static void releaseTimer(PSCHEDULER_CONFIG schedulerConfig, PSCHEDULER_TIMER timer);
+static void rearm(PSCHEDULER_CONFIG schedulerConfig);
+static void armForTick(PSCHEDULER_CONFIG schedulerConfig, UINT64 tick);
+static void setTimerActivated(BOOLEAN activated);
+
+/******************** Public Code ********************/
+
+void Scheduler_initialise(PSCHEDULER_CONFIG schedulerConfig, UINT64 vmxMisc, LARGE_INTEGER pinControls)
+{
+	/* The preemption timer can only be used if the activate bit is allowed to be set,
+	 * it counts down at the rate of the TSC divided by 2^X, where X is specified in IA32_VMX_MISC. */
+	schedulerConfig->timerSupported = (0 != (pinControls.HighPart & IA32_VMX_PINBASED_CTLS_ACTIVATE_VMX_PREEMPTION_TIMER_FLAG));
+	schedulerConfig->timerRate = (UINT8)IA32_VMX_MISC_PREEMPTION_TIMER_TSC_RELATIONSHIP(vmxMisc);
+
+	schedulerConfig->armed = FALSE;
+	schedulerConfig->armedTick = 0;
+	schedulerConfig->processedTick = currentTick();
+	schedulerConfig->pendingCount = 0;
+
+	for (UINT32 i = 0; i < SCHEDULER_WHEEL_SLOTS; i++)
+	{
+		InitializeListHead(&schedulerConfig->wheel[i]);
+	}
+
+	/* All timers come from a fixed pool, as there is no allocating memory whilst in VMX root. */
+	InitializeListHead(&schedulerConfig->freeList);
+
+	for (UINT32 i = 0; i < SCHEDULER_MAX_TIMERS; i++)
+	{
+		schedulerConfig->timers[i].inUse = FALSE;
+		schedulerConfig->timers[i].running = FALSE;
+		InsertTailList(&schedulerConfig->freeList, &schedulerConfig->timers[i].listEntry);
+	}
+}
+
+BOOLEAN Scheduler_handleTimer(PSCHEDULER_CONFIG schedulerConfig)
+{
+	UINT64 startTSC = __rdtsc();
+	UINT64 nowTick = startTSC >> SCHEDULER_TICK_SHIFT;
+
+	UINT32 callbackCount = 0;
+	BOOLEAN budgetExhausted = FALSE;
+
+	/* Walk every slot that has come due since the last time we processed the wheel,
+	 * there is no point walking the wheel more than once around. */
+	UINT64 firstTick = schedulerConfig->processedTick + 1;
+	if ((nowTick - schedulerConfig->processedTick) > SCHEDULER_WHEEL_SLOTS)
+	{
+		firstTick = nowTick - SCHEDULER_WHEEL_SLOTS + 1;
+	}
+
+	for (UINT64 tick = firstTick; (tick <= nowTick) && (FALSE == budgetExhausted); tick++)
+	{
+		PLIST_ENTRY slot = &schedulerConfig->wheel[tick & SCHEDULER_WHEEL_MASK];
+		PLIST_ENTRY currentEntry = slot->Flink;
+
+		while (currentEntry != slot)
+		{
+			PSCHEDULER_TIMER timer = CONTAINING_RECORD(currentEntry, SCHEDULER_TIMER, listEntry);
+			currentEntry = currentEntry->Flink;
+
+			/* Timers further than one revolution away share the slot, skip them. */
+			if (timer->deadlineTick > nowTick)
+			{
+				continue;
+			}
+
+			/* Bound the time spent in root for a single tick, whatever is left
+			 * remains in the wheel and is picked up straight after re-entering the guest. */
+			if ((callbackCount >= SCHEDULER_MAX_CALLBACKS_PER_TICK) ||
+				((__rdtsc() - startTSC) >= SCHEDULER_TICK_BUDGET_CYCLES))
+			{
+				budgetExhausted = TRUE;
+				break;
+			}
+
+			/* Detach the timer whilst it runs, so the callback is free to remove it. */
+			RemoveEntryList(&timer->listEntry);
+			schedulerConfig->pendingCount--;
+			timer->running = TRUE;
+
+			timer->callback(schedulerConfig, timer->userParameter);
+			callbackCount++;
+
+			timer->running = FALSE;
+
+			if ((TRUE == timer->inUse) && (0 != timer->periodTicks))
+			{
+				/* If we have fallen behind, skip the missed periods rather than firing repeatedly. */
+				timer->deadlineTick += timer->periodTicks;
+				if (timer->deadlineTick <= nowTick)
+				{
+					timer->deadlineTick = nowTick + timer->periodTicks;
+				}
+
+				insertTimer(schedulerConfig, timer);
+			}
+			else
+			{
+				releaseTimer(schedulerConfig, timer);
+			}
+		}
+
+		/* Only the slots that were completely walked count as processed. */
+		if (FALSE == budgetExhausted)
+		{
+			schedulerConfig->processedTick = tick;
+		}
+	}
+
+	if (TRUE == budgetExhausted)
+	{
+		armForTick(schedulerConfig, nowTick);
+	}
+	else
+	{
+		rearm(schedulerConfig);
+	}
+
+	return TRUE;
+}
+
+NTSTATUS Scheduler_addTimer(PSCHEDULER_CONFIG schedulerConfig, UINT64 delayCycles, BOOLEAN periodic,
+							fnSchedulerCallback callback, PVOID userParameter, PSCHEDULER_TIMER* timer)
+{
+	NTSTATUS status;
+
+	if ((NULL != callback) && (0 != delayCycles))
+	{
+		if (TRUE == schedulerConfig->timerSupported)
+		{
+			if (FALSE == IsListEmpty(&schedulerConfig->freeList))
+			{
+				PSCHEDULER_TIMER newTimer = CONTAINING_RECORD(RemoveHeadList(&schedulerConfig->freeList), SCHEDULER_TIMER, listEntry);
+
+				/* Round the delay up to a whole number of ticks. */
+				UINT64 delayTicks = (delayCycles + (1ULL << SCHEDULER_TICK_SHIFT) - 1) >> SCHEDULER_TICK_SHIFT;
+
+				newTimer->deadlineTick = currentTick() + delayTicks;
+				newTimer->periodTicks = (TRUE == periodic) ? delayTicks : 0;
+				newTimer->callback = callback;
+				newTimer->userParameter = userParameter;
+				newTimer->inUse = TRUE;
+				newTimer->running = FALSE;
+
+				insertTimer(schedulerConfig, newTimer);
+
+				/* Only touch the preemption timer if this deadline is sooner than what is armed. */
+				if ((FALSE == schedulerConfig->armed) || (newTimer->deadlineTick < schedulerConfig->armedTick))
+				{
+					armForTick(schedulerConfig, newTimer->deadlineTick);
+				}
+
+				if (NULL != timer)
+				{
+					*timer = newTimer;
+				}
+
+				status = STATUS_SUCCESS;
+			}
+			else
+			{
+				status = STATUS_INSUFFICIENT_RESOURCES;
+			}
+		}
+		else
+		{
+			status = STATUS_NOT_SUPPORTED;
+		}
+	}
+	else
+	{
+		status = STATUS_INVALID_PARAMETER;
+	}
+
+	return status;
+}
+
+NTSTATUS Scheduler_removeTimer(PSCHEDULER_CONFIG schedulerConfig, PSCHEDULER_TIMER timer)
+{
+	NTSTATUS status;
+
+	if ((NULL != timer) && (TRUE == timer->inUse))
+	{
+		timer->inUse = FALSE;
+
+		/* A running timer has already been detached from the wheel, it will be
+		 * released once its callback returns. */
+		if (FALSE == timer->running)
+		{
+			RemoveEntryList(&timer->listEntry);
+			schedulerConfig->pendingCount--;
+			releaseTimer(schedulerConfig, timer);
+
+			/* Stop the preemption timer altogether if that was the last timer. */
+			if (0 == schedulerConfig->pendingCount)
+			{
+				rearm(schedulerConfig);
+			}
+		}
+
+		status = STATUS_SUCCESS;
+	}
+	else
+	{
+		status = STATUS_INVALID_PARAMETER;
+	}
+
+	return status;
+}
+
+/******************** Module Code ********************/
+
+static UINT64 currentTick(void)
+{
+	return __rdtsc() >> SCHEDULER_TICK_SHIFT;
+}
+
+static void insertTimer(PSCHEDULER_CONFIG schedulerConfig, PSCHEDULER_TIMER timer)
+{
+	InsertTailList(&schedulerConfig->wheel[timer->deadlineTick & SCHEDULER_WHEEL_MASK], &timer->listEntry);
+	schedulerConfig->pendingCount++;
+}
+
+static void releaseTimer(PSCHEDULER_CONFIG schedulerConfig, PSCHEDULER_TIMER timer)
+{
+	timer->inUse = FALSE;
+	timer->callback = NULL;
+	timer->userParameter = NULL;
+
+	InsertHeadList(&schedulerConfig->freeList, &timer->listEntry);
+}
+
+static void rearm(PSCHEDULER_CONFIG schedulerConfig)
+{
+	if (0 != schedulerConfig->pendingCount)
+	{
+		/* Find the earliest deadline, the pool is small enough that this is cheaper
+		 * than walking every slot of the wheel. */
+		UINT64 earliestTick = MAXULONG64;
+
+		for (UINT32 i = 0; i < SCHEDULER_MAX_TIMERS; i++)
+		{
+			PSCHEDULER_TIMER timer = &schedulerConfig->timers[i];
+
+			if ((TRUE == timer->inUse) && (FALSE == timer->running) && (timer->deadlineTick < earliestTick))
+			{
+				earliestTick = timer->deadlineTick;
+			}
+		}
+
+		armForTick(schedulerConfig, earliestTick);
+	}
+	else if (TRUE == schedulerConfig->armed)
+	{
+		/* Nothing is pending, so don't take any more timer exits. */
+		schedulerConfig->armed = FALSE;
+		setTimerActivated(FALSE);
+	}
+}
+
+static void armForTick(PSCHEDULER_CONFIG schedulerConfig, UINT64 tick)
+{
+	UINT64 deadlineTSC = tick << SCHEDULER_TICK_SHIFT;
+	UINT64 nowTSC = __rdtsc();
+
+	/* The timer decrements once every 2^timerRate TSC cycles, a value of zero
+	 * causes an exit before the guest executes any instructions, so use at least one. */
+	UINT64 timerValue = (deadlineTSC > nowTSC) ? ((deadlineTSC - nowTSC) >> schedulerConfig->timerRate) : 0;
+
+	if (0 == timerValue)
+	{
+		timerValue = 1;
+	}
+	else if (timerValue > MAXUINT32)
+	{
+		timerValue = MAXUINT32;
+	}
+
+	__vmx_vmwrite(VMCS_GUEST_VMX_PREEMPTION_TIMER_VALUE, timerValue);
+
+	if (FALSE == schedulerConfig->armed)
+	{
+		setTimerActivated(TRUE);
+	}
+
+	schedulerConfig->armed = TRUE;
+	schedulerConfig->armedTick = tick;
+}
+
+static void setTimerActivated(BOOLEAN activated)
+{
+	size_t pinControls;
+	__vmx_vmread(VMCS_CTRL_PIN_BASED_VM_EXECUTION_CONTROLS, &pinControls);
+
+	if (TRUE == activated)
+	{
+		pinControls |= IA32_VMX_PINBASED_CTLS_ACTIVATE_VMX_PREEMPTION_TIMER_FLAG;
+	}
+	else
+	{
+		pinControls &= ~(size_t)IA32_VMX_PINBASED_CTLS_ACTIVATE_VMX_PREEMPTION_TIMER_FLAG;
+	}
+
+	__vmx_vmwrite(VMCS_CTRL_PIN_BASED_VM_EXECUTION_CONTROLS, pinControls);
+}
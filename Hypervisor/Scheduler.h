@@ -0,0 +1,76 @@
+#pragma once
+#include <wdm.h>
+
+/******************** Public Defines ********************/
+
+/* Number of slots in the timer wheel, must be a power of two. */
+#define SCHEDULER_WHEEL_SLOTS 64
+
+/* Maximum number of timers that can be registered per logical processor. */
+#define SCHEDULER_MAX_TIMERS 32
+
+/* One tick of the wheel is 2^SCHEDULER_TICK_SHIFT TSC cycles. */
+#define SCHEDULER_TICK_SHIFT 12
+
+/* Upper bounds on the work that is done within a single preemption timer exit. */
+#define SCHEDULER_MAX_CALLBACKS_PER_TICK 8
+#define SCHEDULER_TICK_BUDGET_CYCLES 50000
+
+/******************** Public Typedefs ********************/
+
+typedef struct _SCHEDULER_CONFIG SCHEDULER_CONFIG, *PSCHEDULER_CONFIG;
+
+/* Callback function for an expired timer, called from VMX root on the owning processor. */
+typedef void(*fnSchedulerCallback)(PSCHEDULER_CONFIG schedulerConfig, PVOID userParameter);
+
+typedef struct _SCHEDULER_TIMER
+{
+	/* Absolute tick at which the timer next expires. */
+	UINT64 deadlineTick;
+
+	/* Number of ticks between expiries, zero for a one-shot timer. */
+	UINT64 periodTicks;
+
+	fnSchedulerCallback callback;
+	PVOID userParameter;
+
+	BOOLEAN inUse;
+	BOOLEAN running;
+
+	/* Linked list entry, either within a wheel slot or the free list. */
+	LIST_ENTRY listEntry;
+} SCHEDULER_TIMER, *PSCHEDULER_TIMER;
+
+/* Per logical processor timer wheel, driven by the VMX preemption timer. */
+struct _SCHEDULER_CONFIG
+{
+	/* Capabilities of the VMX preemption timer on this processor. */
+	BOOLEAN timerSupported;
+	UINT8 timerRate;
+
+	/* Whether the preemption timer is armed, and the tick it was armed for. */
+	BOOLEAN armed;
+	UINT64 armedTick;
+
+	/* Last tick whose slot has been fully processed. */
+	UINT64 processedTick;
+
+	/* Number of timers currently within the wheel. */
+	UINT32 pendingCount;
+
+	LIST_ENTRY wheel[SCHEDULER_WHEEL_SLOTS];
+	LIST_ENTRY freeList;
+	SCHEDULER_TIMER timers[SCHEDULER_MAX_TIMERS];
+};
+
+/******************** Public Constants ********************/
+
+/******************** Public Variables ********************/
+
+/******************** Public Prototypes ********************/
+
+void Scheduler_initialise(PSCHEDULER_CONFIG schedulerConfig, UINT64 vmxMisc, LARGE_INTEGER pinControls);
+BOOLEAN Scheduler_handleTimer(PSCHEDULER_CONFIG schedulerConfig);
+NTSTATUS Scheduler_addTimer(PSCHEDULER_CONFIG schedulerConfig, UINT64 delayCycles, BOOLEAN periodic,
+							fnSchedulerCallback callback, PVOID userParameter, PSCHEDULER_TIMER* timer);
+NTSTATUS Scheduler_removeTimer(PSCHEDULER_CONFIG schedulerConfig, PSCHEDULER_TIMER timer);
@@ -0,0 +1,314 @@
+#include <ntifs.h>
+#include "Trampoline.h"
+
+/******************** External API ********************/
+
+
+/******************** Module Typedefs ********************/
+
+/* Executable memory carved into slots, a set bit within the bitmap is a slot in use. */
+typedef struct _TRAMPOLINE_SLAB
+{
+	LIST_ENTRY listEntry;
+
+	PUINT8 base;
+	RTL_BITMAP slotMap;
+	ULONG slotBits[TRAMPOLINE_SLAB_SIZE / TRAMPOLINE_SLOT_SIZE / (8 * sizeof(ULONG))];
+} TRAMPOLINE_SLAB, *PTRAMPOLINE_SLAB;
+
+/******************** Module Constants ********************/
+
+#define TRAMPOLINE_POOL_TAG 'prTH'
+#define TRAMPOLINE_SLOT_COUNT (TRAMPOLINE_SLAB_SIZE / TRAMPOLINE_SLOT_SIZE)
+
+/* Unused bytes are filled with INT3, so a stray jump into the arena faults straight away. */
+#define TRAMPOLINE_FILL 0xCC
+
+/* Furthest a rel32 can reach, less a margin for the length of the instruction itself. */
+#define TRAMPOLINE_NEAR_DISTANCE (MAXLONG - PAGE_SIZE)
+
+C_ASSERT((TRAMPOLINE_SLOT_SIZE & (TRAMPOLINE_SLOT_SIZE - 1)) == 0);
+C_ASSERT((TRAMPOLINE_SLOT_COUNT % (8 * sizeof(ULONG))) == 0);
+
+/******************** Module Variables ********************/
+
+/* The first slab is part of the driver image, which the loader places amongst the other kernel
+ * images, so trampolines for them are usually within reach of a rel32. Slabs from the pool
+ * are only used once it is full, they may be anywhere. The section is never writable, so it
+ * is only written through a mapping of its own, see mapWritable. */
+#pragma section(".hvtramp", read, execute)
+__declspec(allocate(".hvtramp")) static DECLSPEC_ALIGN(PAGE_SIZE) UINT8 imageArena[TRAMPOLINE_SLAB_SIZE];
+
+static TRAMPOLINE_SLAB imageSlab = { 0 };
+static LIST_ENTRY slabList = { &slabList, &slabList };
+
+/* A zeroed push lock is already initialised. */
+static EX_PUSH_LOCK arenaLock;
+
+/******************** Module Prototypes ********************/
+static NTSTATUS initialiseSlab(PTRAMPOLINE_SLAB slab, PUINT8 base);
+static PUINT8 allocateFromSlab(PTRAMPOLINE_SLAB slab, ULONG slotCount);
+static PTRAMPOLINE_SLAB findSlab(PUINT8 trampoline);
+static BOOLEAN isSlabNear(PTRAMPOLINE_SLAB slab, PVOID nearAddress);
+static PUINT8 mapWritable(PUINT8 address, SIZE_T size, PMDL* mdl);
+static void unmapWritable(PUINT8 mapping, PMDL mdl);
+
+/******************** Public Code ********************/
+
+PUINT8 Trampoline_allocate(PVOID nearAddress, SIZE_T size)
+{
+	/* Called at PASSIVE_LEVEL. Slots within reach of nearAddress are preferred, then any free
+	 * slots, and only then is a new slab allocated. The trampoline is filled with INT3. */
+	PUINT8 result = NULL;
+
+	if ((0 != size) && (size <= TRAMPOLINE_MAX_SIZE))
+	{
+		ULONG slotCount = (ULONG)((size + TRAMPOLINE_SLOT_SIZE - 1) / TRAMPOLINE_SLOT_SIZE);
+
+		KeEnterCriticalRegion();
+		ExAcquirePushLockExclusive(&arenaLock);
+
+		if (NULL == imageSlab.base)
+		{
+			(void)initialiseSlab(&imageSlab, imageArena);
+		}
+
+		for (PLIST_ENTRY currentEntry = slabList.Flink;
+			(currentEntry != &slabList) && (NULL == result);
+			currentEntry = currentEntry->Flink)
+		{
+			PTRAMPOLINE_SLAB current = CONTAINING_RECORD(currentEntry, TRAMPOLINE_SLAB, listEntry);
+
+			if (TRUE == isSlabNear(current, nearAddress))
+			{
+				result = allocateFromSlab(current, slotCount);
+			}
+		}
+
+		for (PLIST_ENTRY currentEntry = slabList.Flink;
+			(currentEntry != &slabList) && (NULL == result);
+			currentEntry = currentEntry->Flink)
+		{
+			result = allocateFromSlab(CONTAINING_RECORD(currentEntry, TRAMPOLINE_SLAB, listEntry), slotCount);
+		}
+
+		if (NULL == result)
+		{
+			PTRAMPOLINE_SLAB newSlab = (PTRAMPOLINE_SLAB)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(TRAMPOLINE_SLAB), TRAMPOLINE_POOL_TAG);
+
+			if (NULL != newSlab)
+			{
+				PUINT8 newBase = (PUINT8)ExAllocatePoolWithTag(NonPagedPoolExecute, TRAMPOLINE_SLAB_SIZE, TRAMPOLINE_POOL_TAG);
+
+				if ((NULL != newBase) && (NT_SUCCESS(initialiseSlab(newSlab, newBase))))
+				{
+					result = allocateFromSlab(newSlab, slotCount);
+				}
+				else
+				{
+					if (NULL != newBase)
+					{
+						ExFreePoolWithTag(newBase, TRAMPOLINE_POOL_TAG);
+					}
+
+					ExFreePoolWithTag(newSlab, TRAMPOLINE_POOL_TAG);
+				}
+			}
+		}
+
+		ExReleasePushLockExclusive(&arenaLock);
+		KeLeaveCriticalRegion();
+	}
+
+	return result;
+}
+
+void Trampoline_trim(PUINT8 trampoline, SIZE_T allocatedSize, SIZE_T usedSize)
+{
+	/* Gives back the slots past the end of a trampoline that turned out shorter than allocated. */
+	SIZE_T usedSlots = (usedSize + TRAMPOLINE_SLOT_SIZE - 1) / TRAMPOLINE_SLOT_SIZE;
+	SIZE_T allocatedSlots = (allocatedSize + TRAMPOLINE_SLOT_SIZE - 1) / TRAMPOLINE_SLOT_SIZE;
+
+	if (usedSlots < allocatedSlots)
+	{
+		Trampoline_free(trampoline + (usedSlots * TRAMPOLINE_SLOT_SIZE), (allocatedSlots - usedSlots) * TRAMPOLINE_SLOT_SIZE);
+	}
+}
+
+NTSTATUS Trampoline_write(PUINT8 trampoline, const UINT8* code, SIZE_T size)
+{
+	/* Called at PASSIVE_LEVEL, before the trampoline can be executed. The code is built elsewhere
+	 * for the address of the trampoline, then copied in through a writable mapping. */
+	NTSTATUS status = STATUS_INSUFFICIENT_RESOURCES;
+
+	PMDL mdl;
+	PUINT8 mapping = mapWritable(trampoline, size, &mdl);
+
+	if (NULL != mapping)
+	{
+		RtlCopyMemory(mapping, code, size);
+		unmapWritable(mapping, mdl);
+		status = STATUS_SUCCESS;
+	}
+
+	return status;
+}
+
+void Trampoline_free(PUINT8 trampoline, SIZE_T size)
+{
+	/* Only once nothing can be executing the trampoline. Slabs are never freed. */
+	if ((NULL != trampoline) && (0 != size))
+	{
+		KeEnterCriticalRegion();
+		ExAcquirePushLockExclusive(&arenaLock);
+
+		PTRAMPOLINE_SLAB slab = findSlab(trampoline);
+
+		if (NULL != slab)
+		{
+			ULONG firstSlot = (ULONG)((trampoline - slab->base) / TRAMPOLINE_SLOT_SIZE);
+			ULONG slotCount = (ULONG)((size + TRAMPOLINE_SLOT_SIZE - 1) / TRAMPOLINE_SLOT_SIZE);
+
+			PUINT8 slots = slab->base + ((SIZE_T)firstSlot * TRAMPOLINE_SLOT_SIZE);
+			SIZE_T slotsSize = (SIZE_T)slotCount * TRAMPOLINE_SLOT_SIZE;
+
+			/* Should the slots not be mapped, the next trampoline there still writes over them. */
+			PMDL mdl;
+			PUINT8 mapping = mapWritable(slots, slotsSize, &mdl);
+
+			if (NULL != mapping)
+			{
+				RtlFillMemory(mapping, slotsSize, TRAMPOLINE_FILL);
+				unmapWritable(mapping, mdl);
+			}
+
+			RtlClearBits(&slab->slotMap, firstSlot, slotCount);
+		}
+
+		ExReleasePushLockExclusive(&arenaLock);
+		KeLeaveCriticalRegion();
+	}
+}
+
+BOOLEAN Trampoline_isNear(PVOID from, PVOID to)
+{
+	/* Whether a rel32 at one address can reach the other. */
+	LONG64 distance = (LONG64)((ULONG_PTR)to - (ULONG_PTR)from);
+
+	return ((distance >= -TRAMPOLINE_NEAR_DISTANCE) && (distance <= TRAMPOLINE_NEAR_DISTANCE)) ? TRUE : FALSE;
+}
+
+/******************** Module Code ********************/
+
+static NTSTATUS initialiseSlab(PTRAMPOLINE_SLAB slab, PUINT8 base)
+{
+	NTSTATUS status = STATUS_INSUFFICIENT_RESOURCES;
+
+	PMDL mdl;
+	PUINT8 mapping = mapWritable(base, TRAMPOLINE_SLAB_SIZE, &mdl);
+
+	if (NULL != mapping)
+	{
+		RtlFillMemory(mapping, TRAMPOLINE_SLAB_SIZE, TRAMPOLINE_FILL);
+		unmapWritable(mapping, mdl);
+
+		slab->base = base;
+		RtlInitializeBitMap(&slab->slotMap, slab->slotBits, TRAMPOLINE_SLOT_COUNT);
+		RtlClearAllBits(&slab->slotMap);
+
+		InsertTailList(&slabList, &slab->listEntry);
+		status = STATUS_SUCCESS;
+	}
+
+	return status;
+}
+
+static PUINT8 allocateFromSlab(PTRAMPOLINE_SLAB slab, ULONG slotCount)
+{
+	PUINT8 result = NULL;
+
+	ULONG firstSlot = RtlFindClearBitsAndSet(&slab->slotMap, slotCount, 0);
+	if (MAXULONG != firstSlot)
+	{
+		result = slab->base + ((SIZE_T)firstSlot * TRAMPOLINE_SLOT_SIZE);
+	}
+
+	return result;
+}
+
+static PTRAMPOLINE_SLAB findSlab(PUINT8 trampoline)
+{
+	PTRAMPOLINE_SLAB result = NULL;
+
+	for (PLIST_ENTRY currentEntry = slabList.Flink;
+		currentEntry != &slabList;
+		currentEntry = currentEntry->Flink)
+	{
+		PTRAMPOLINE_SLAB current = CONTAINING_RECORD(currentEntry, TRAMPOLINE_SLAB, listEntry);
+
+		if ((trampoline >= current->base) && (trampoline < (current->base + TRAMPOLINE_SLAB_SIZE)))
+		{
+			result = current;
+			break;
+		}
+	}
+
+	return result;
+}
+
+static BOOLEAN isSlabNear(PTRAMPOLINE_SLAB slab, PVOID nearAddress)
+{
+	/* Both ends have to be in reach, so every slot within the slab is. */
+	return ((TRUE == Trampoline_isNear(nearAddress, slab->base)) &&
+		(TRUE == Trampoline_isNear(nearAddress, slab->base + TRAMPOLINE_SLAB_SIZE))) ? TRUE : FALSE;
+}
+
+static PUINT8 mapWritable(PUINT8 address, SIZE_T size, PMDL* mdl)
+{
+	/* Maps the pages behind the slots a second time, read/write but not executable, so that
+	 * nothing ever has to be both writable and executable at the same address. */
+	PUINT8 result = NULL;
+
+	*mdl = IoAllocateMdl(address, (ULONG)size, FALSE, FALSE, NULL);
+
+	if (NULL != *mdl)
+	{
+		BOOLEAN locked = FALSE;
+
+		__try
+		{
+			MmProbeAndLockPages(*mdl, KernelMode, IoReadAccess);
+			locked = TRUE;
+		}
+		__except (EXCEPTION_EXECUTE_HANDLER)
+		{
+			locked = FALSE;
+		}
+
+		if (TRUE == locked)
+		{
+			result = (PUINT8)MmMapLockedPagesSpecifyCache(*mdl, KernelMode, MmCached, NULL, FALSE,
+														  NormalPagePriority | MdlMappingNoExecute);
+
+			if (NULL == result)
+			{
+				MmUnlockPages(*mdl);
+			}
+		}
+
+		if (NULL == result)
+		{
+			IoFreeMdl(*mdl);
+			*mdl = NULL;
+		}
+	}
+
+	return result;
+}
+
+static void unmapWritable(PUINT8 mapping, PMDL mdl)
+{
+	MmUnmapLockedPages(mapping, mdl);
+	MmUnlockPages(mdl);
+	IoFreeMdl(mdl);
+}
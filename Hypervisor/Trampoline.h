@@ -0,0 +1,30 @@
+#pragma once
+#include <ntifs.h>
+
+/******************** Public Defines ********************/
+
+/* Trampolines are packed into slabs of executable memory, carved into slots of this many
+ * bytes. A trampoline takes as many consecutive slots as it needs, so a short one shares
+ * its cache line with its neighbour. Must be a power of two. Slabs aren't writable where
+ * they are executed, trampolines are written with Trampoline_write. */
+#define TRAMPOLINE_SLOT_SIZE 32
+
+/* Size of each slab, the first is within the image of the driver itself. */
+#define TRAMPOLINE_SLAB_SIZE (16 * PAGE_SIZE)
+
+/* Largest trampoline that can be allocated. */
+#define TRAMPOLINE_MAX_SIZE (4 * TRAMPOLINE_SLOT_SIZE)
+
+/******************** Public Typedefs ********************/
+
+/******************** Public Constants ********************/
+
+/******************** Public Variables ********************/
+
+/******************** Public Prototypes ********************/
+
+PUINT8 Trampoline_allocate(PVOID nearAddress, SIZE_T size);
+void Trampoline_trim(PUINT8 trampoline, SIZE_T allocatedSize, SIZE_T usedSize);
+NTSTATUS Trampoline_write(PUINT8 trampoline, const UINT8* code, SIZE_T size);
+void Trampoline_free(PUINT8 trampoline, SIZE_T size);
+BOOLEAN Trampoline_isNear(PVOID from, PVOID to);
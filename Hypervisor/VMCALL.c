@@ -4,7 +4,12 @@
 #include "VMShadow.h"
 #include "EventLog.h"
 #include "EventLog_Common.h"
+#include "EventFilter.h"
 #include "Process.h"
+#include "Profiler.h"
+#include "CommandRing.h"
+#include "Worker.h"
+#include "FlightRecorder.h"
 
 /******************** External API ********************/
 
@@ -12,9 +17,24 @@
 /******************** Module Typedefs ********************/
 
 typedef NTSTATUS(*fnActionHandler)(PVMM_DATA lpData, CR3 guestCR3, GUEST_VIRTUAL_ADDRESS buffer, SIZE_T bufferSize);
+typedef NTSTATUS(*fnFastActionHandler)(PVMM_DATA lpData, PVMCALL_FAST_REGISTERS registers);
+
+/* Passed from the worker back into VMX root, once the target process has been looked up. */
+typedef struct _SHADOW_IN_PROCESS_CONTEXT
+{
+	CR3 tableBase;
+	PUINT8 targetVA;
+	PUINT8 execVA;
+} SHADOW_IN_PROCESS_CONTEXT, *PSHADOW_IN_PROCESS_CONTEXT;
 
 /******************** Module Constants ********************/
 
+/* Number of batch commands (and statuses) that are transferred with each guest memory access. */
+#define BATCH_CHUNK_COMMANDS 32
+
+/* Only the address of the page tables of a caller is compared, not the PCID. */
+#define GATHER_CR3_MASK (~(UINT64)0xFFF)
+
 
 /******************** Module Variables ********************/
 
@@ -23,7 +43,23 @@ typedef NTSTATUS(*fnActionHandler)(PVMM_DATA lpData, CR3 guestCR3, GUEST_VIRTUAL
 static NTSTATUS actionCheckPresence(PVMM_DATA lpData, CR3 guestCR3, GUEST_VIRTUAL_ADDRESS buffer, SIZE_T bufferSize);
 static NTSTATUS actionRunAsRoot(PVMM_DATA lpData, CR3 guestCR3, GUEST_VIRTUAL_ADDRESS buffer, SIZE_T bufferSize);
 static NTSTATUS actionShadowInProcess(PVMM_DATA lpData, CR3 guestCR3, GUEST_VIRTUAL_ADDRESS buffer, SIZE_T bufferSize);
+static NTSTATUS workerShadowInProcess(PUINT64 parameters, PUINT64 information);
+static NTSTATUS rootShadowInProcess(PVOID hvParameter, PVOID userParameter);
 static NTSTATUS actionGatherEvents(PVMM_DATA lpData, CR3 guestCR3, GUEST_VIRTUAL_ADDRESS buffer, SIZE_T bufferSize);
+static NTSTATUS workerGatherEvents(PUINT64 parameters, PUINT64 information);
+static NTSTATUS actionProfilerControl(PVMM_DATA lpData, CR3 guestCR3, GUEST_VIRTUAL_ADDRESS buffer, SIZE_T bufferSize);
+static NTSTATUS actionBatch(PVMM_DATA lpData, CR3 guestCR3, GUEST_VIRTUAL_ADDRESS buffer, SIZE_T bufferSize);
+static NTSTATUS actionRingControl(PVMM_DATA lpData, CR3 guestCR3, GUEST_VIRTUAL_ADDRESS buffer, SIZE_T bufferSize);
+static NTSTATUS actionSetEventFilter(PVMM_DATA lpData, CR3 guestCR3, GUEST_VIRTUAL_ADDRESS buffer, SIZE_T bufferSize);
+static NTSTATUS actionDumpFlightRecorder(PVMM_DATA lpData, CR3 guestCR3, GUEST_VIRTUAL_ADDRESS buffer, SIZE_T bufferSize);
+static BOOLEAN handleFastCall(PVMM_DATA lpData);
+static NTSTATUS fastActionCheckPresence(PVMM_DATA lpData, PVMCALL_FAST_REGISTERS registers);
+static NTSTATUS fastActionReadCounter(PVMM_DATA lpData, PVMCALL_FAST_REGISTERS registers);
+static NTSTATUS fastActionProfilerStart(PVMM_DATA lpData, PVMCALL_FAST_REGISTERS registers);
+static NTSTATUS fastActionProfilerStop(PVMM_DATA lpData, PVMCALL_FAST_REGISTERS registers);
+static NTSTATUS fastActionRingDoorbell(PVMM_DATA lpData, PVMCALL_FAST_REGISTERS registers);
+static NTSTATUS queueDeferredAction(PVMM_DATA lpData, CR3 guestCR3, fnWorkerRoutine routine,
+									const UINT64 parameters[WORKER_ITEM_PARAMETERS], PVMCALL_STATUS_BLOCK statusBlock);
 
 /******************** Action Handlers ********************/
 
@@ -33,6 +69,20 @@ static const fnActionHandler ACTION_HANDLERS[VMCALL_ACTION_COUNT] =
 	[VMCALL_ACTION_RUN_AS_ROOT] = actionRunAsRoot,
 	[VMCALL_ACTION_SHADOW_IN_PROCESS] = actionShadowInProcess,
 	[VMCALL_ACTION_GATHER_EVENTS] = actionGatherEvents,
+	[VMCALL_ACTION_PROFILER_CONTROL] = actionProfilerControl,
+	[VMCALL_ACTION_BATCH] = actionBatch,
+	[VMCALL_ACTION_RING_CONTROL] = actionRingControl,
+	[VMCALL_ACTION_SET_EVENT_FILTER] = actionSetEventFilter,
+	[VMCALL_ACTION_DUMP_FLIGHT_RECORDER] = actionDumpFlightRecorder,
+};
+
+static const fnFastActionHandler FAST_ACTION_HANDLERS[VMCALL_FAST_ACTION_COUNT] =
+{
+	[VMCALL_FAST_ACTION_CHECK_PRESENCE] = fastActionCheckPresence,
+	[VMCALL_FAST_ACTION_READ_COUNTER] = fastActionReadCounter,
+	[VMCALL_FAST_ACTION_PROFILER_START] = fastActionProfilerStart,
+	[VMCALL_FAST_ACTION_PROFILER_STOP] = fastActionProfilerStop,
+	[VMCALL_FAST_ACTION_RING_DOORBELL] = fastActionRingDoorbell,
 };
 
 /******************** Public Code ********************/
@@ -49,6 +99,13 @@ BOOLEAN VMCALL_handle(PVMM_DATA lpData)
 	 *
 	 *	RCX = Secret Key
 	 *	RDX = VMCALL Command Buffer
+	 *
+	 * Small commands can instead use the fast key, which carries everything in registers
+	 * so no guest page tables need to be walked at all.
+	 *
+	 *	RCX = Secret Fast Key
+	 *	RDX = Fast Action
+	 *	R8 - R11 = Arguments, on return RDX, R8 - R10 = Results
 	 */
 	if (VMCALL_KEY == lpData->guestContext.Rcx)
 	{
@@ -56,6 +113,10 @@ BOOLEAN VMCALL_handle(PVMM_DATA lpData)
 		CR3 guestCR3;
 		__vmx_vmread(VMCS_GUEST_CR3, &guestCR3.Flags);
 
+		/* The command and the parameters of the action are read through the same page tables,
+		 * so remember the translations until this VMCALL has been handled. */
+		MemManage_enableTranslationCache(&lpData->mmContext, guestCR3);
+
 		/* Treat RDX of the guest as the pointer for the command. */
 		VMCALL_COMMAND readCommand = { 0 };
 		NTSTATUS status = MemManage_readVirtualAddress(&lpData->mmContext, guestCR3, lpData->guestContext.Rdx,
@@ -64,24 +125,41 @@ BOOLEAN VMCALL_handle(PVMM_DATA lpData)
 		if (NT_SUCCESS(status))
 		{
 			/* Call the specific action handler for the command and put the result NTSTATUS into RAX. */
-			if (readCommand.action < VMCALL_ACTION_COUNT)
-			{
-				lpData->guestContext.Rax = ACTION_HANDLERS[readCommand.action](lpData, guestCR3, 
-					(GUEST_VIRTUAL_ADDRESS)readCommand.buffer, 
-					readCommand.bufferSize);
-			}
-			else
-			{
-				lpData->guestContext.Rax = (ULONG64)STATUS_INVALID_PARAMETER;
-			}
+			lpData->guestContext.Rax = (ULONG64)VMCALL_dispatchCommand(lpData, guestCR3, &readCommand);
 
 			result = TRUE;
 		}
+
+		MemManage_disableTranslationCache(&lpData->mmContext);
+	}
+	else if (VMCALL_FAST_KEY == lpData->guestContext.Rcx)
+	{
+		result = handleFastCall(lpData);
 	}
 
 	return result;
 }
 
+NTSTATUS VMCALL_dispatchCommand(PVMM_DATA lpData, CR3 guestCR3, PVMCALL_COMMAND command)
+{
+	NTSTATUS status;
+
+	/* Commands can also come from a command ring, in which case the buffer
+	 * belongs to the process that registered the ring. */
+	if (command->action < VMCALL_ACTION_COUNT)
+	{
+		status = ACTION_HANDLERS[command->action](lpData, guestCR3,
+			(GUEST_VIRTUAL_ADDRESS)command->buffer,
+			command->bufferSize);
+	}
+	else
+	{
+		status = STATUS_INVALID_PARAMETER;
+	}
+
+	return status;
+}
+
 /******************** Module Code ********************/
 
 static NTSTATUS actionCheckPresence(PVMM_DATA lpData, CR3 guestCR3, GUEST_VIRTUAL_ADDRESS buffer, SIZE_T bufferSize)
@@ -135,22 +213,322 @@ static NTSTATUS actionShadowInProcess(PVMM_DATA lpData, CR3 guestCR3, GUEST_VIRT
 		status = MemManage_readVirtualAddress(&lpData->mmContext, guestCR3, buffer, &params, sizeof(params));
 		if (NT_SUCCESS(status))
 		{
-
-			/* Get the PEPROCESS of the target process. */
-			PEPROCESS targetProcess;
+			/* Looking up the target process can't be done from VMX root, so only the parameters
+			 * are validated here and the rest is done by the worker at PASSIVE_LEVEL. */
 			if (0 != params.procID)
 			{
-				status = PsLookupProcessByProcessId((HANDLE)params.procID, &targetProcess);
+				const UINT64 parameters[WORKER_ITEM_PARAMETERS] =
+				{
+					params.procID,
+					(UINT64)params.userTargetVA,
+					(UINT64)params.kernelExecPageVA,
+					0
+				};
+
+				status = queueDeferredAction(lpData, guestCR3, workerShadowInProcess, parameters, params.statusBlock);
+			}
+			else
+			{
+				status = STATUS_INVALID_PARAMETER;
+			}
+		}
+	}
+	else
+	{
+		status = STATUS_INVALID_PARAMETER;
+	}
+
+	return status;
+}
+
+static NTSTATUS workerShadowInProcess(PUINT64 parameters, PUINT64 information)
+{
+	UNREFERENCED_PARAMETER(information);
+
+	/* Called at PASSIVE_LEVEL from the worker thread.
+	 * Parameters: [0] = Process ID, [1] = Target VA, [2] = Executable Page VA. */
+	PEPROCESS targetProcess;
+	NTSTATUS status = PsLookupProcessByProcessId((HANDLE)parameters[0], &targetProcess);
+	if (NT_SUCCESS(status))
+	{
+		SHADOW_IN_PROCESS_CONTEXT context;
+		context.tableBase = MemManage_getPageTableBase(targetProcess);
+		context.targetVA = (PUINT8)parameters[1];
+		context.execVA = (PUINT8)parameters[2];
+
+		ObDereferenceObject(targetProcess);
+
+		/* The page is hidden within the EPT of this processor only, which might have to split
+		 * the large page that holds it. That can't be allocated from VMX root. */
+		status = EPT_reserveSplits(1);
+		if (NT_SUCCESS(status))
+		{
+			/* Only the EPT changes need to be made from VMX root. */
+			VM_PARAM_RUN_AS_ROOT rootParams;
+			rootParams.callback = rootShadowInProcess;
+			rootParams.parameter = &context;
+
+			VMCALL_COMMAND command;
+			command.action = VMCALL_ACTION_RUN_AS_ROOT;
+			command.buffer = &rootParams;
+			command.bufferSize = sizeof(rootParams);
+
+			status = VMCALL_actionHost(VMCALL_KEY, &command);
+		}
+	}
+
+	return status;
+}
+
+static NTSTATUS rootShadowInProcess(PVOID hvParameter, PVOID userParameter)
+{
+	PSHADOW_IN_PROCESS_CONTEXT context = (PSHADOW_IN_PROCESS_CONTEXT)userParameter;
+
+	/* Tell the VMShadow module to hide the executable page at the specified
+	 * address, for the target process only. */
+	return VMShadow_hideExecInProcess((PVMM_DATA)hvParameter,
+		context->tableBase,
+		context->targetVA,
+		context->execVA);
+}
+
+static NTSTATUS actionGatherEvents(PVMM_DATA lpData, CR3 guestCR3, GUEST_VIRTUAL_ADDRESS buffer, SIZE_T bufferSize)
+{
+	NTSTATUS status;
+
+	if ((0 != buffer) && (sizeof(VM_PARAM_GATHER_EVENTS) == bufferSize))
+	{
+		VM_PARAM_GATHER_EVENTS params = { 0 };
+
+		status = MemManage_readVirtualAddress(&lpData->mmContext, guestCR3, buffer, &params, sizeof(params));
+		if (NT_SUCCESS(status))
+		{
+			/* Mapping the event rings into the caller has to be done by the worker. Once mapped,
+			 * the caller reads the events in place without any further VMCALLs. The caller is the
+			 * process of the thread that was running, which is read through the KPCR the host GS
+			 * still points to, it is never taken from the guest. */
+			if ((EVENT_OPERATION_MAP == params.operation) || (EVENT_OPERATION_UNMAP == params.operation))
+			{
+				const UINT64 parameters[WORKER_ITEM_PARAMETERS] =
+				{
+					(UINT64)PsGetCurrentProcessId(),
+					(UINT64)buffer,
+					(UINT64)params.operation,
+					guestCR3.Flags
+				};
+
+				status = queueDeferredAction(lpData, guestCR3, workerGatherEvents, parameters, params.statusBlock);
+			}
+			else
+			{
+				status = STATUS_INVALID_PARAMETER;
+			}
+		}
+	}
+	else
+	{
+		status = STATUS_INVALID_PARAMETER;
+	}
+
+	return status;
+}
+
+static NTSTATUS workerGatherEvents(PUINT64 parameters, PUINT64 information)
+{
+	UNREFERENCED_PARAMETER(information);
+
+	/* Called at PASSIVE_LEVEL from the worker thread.
+	 * Parameters: [0] = Process ID of the caller, [1] = Parameters VA, [2] = Operation, [3] = CR3 of the caller. */
+	PEPROCESS process;
+	NTSTATUS status = PsLookupProcessByProcessId((HANDLE)parameters[0], &process);
+	if (NT_SUCCESS(status))
+	{
+		/* Both the mapping and the parameters live within the calling process. */
+		KAPC_STATE apcState;
+		KeStackAttachProcess(process, &apcState);
+
+		/* The caller may have exited and its ID been reused since, in which case the page tables
+		 * differ. It may have called from either mode, which differ under KVA shadowing. */
+		CR3 kernelCR3;
+		kernelCR3.Flags = __readcr3();
+		CR3 userCR3 = MemManage_getPageTableBase(process);
+
+		if (((parameters[3] & GATHER_CR3_MASK) != (kernelCR3.Flags & GATHER_CR3_MASK)) &&
+			((parameters[3] & GATHER_CR3_MASK) != (userCR3.Flags & GATHER_CR3_MASK)))
+		{
+			status = STATUS_PROCESS_IS_TERMINATING;
+		}
+		else if (EVENT_OPERATION_MAP == (EVENT_OPERATION)parameters[2])
+		{
+			PVOID rings;
+			PVOID cursors;
+			ULONG ringCount;
+
+			status = EventLog_mapConsumer(&rings, &cursors, &ringCount);
+			if (NT_SUCCESS(status))
+			{
+				PVM_PARAM_GATHER_EVENTS params = (PVM_PARAM_GATHER_EVENTS)parameters[1];
+
+				__try
+				{
+					ProbeForWrite(params, sizeof(VM_PARAM_GATHER_EVENTS), sizeof(UINT32));
+
+					params->rings = rings;
+					params->cursors = cursors;
+					params->ringCount = ringCount;
+				}
+				__except (EXCEPTION_EXECUTE_HANDLER)
+				{
+					status = GetExceptionCode();
+				}
+
+				if (!NT_SUCCESS(status))
+				{
+					EventLog_unmapConsumer();
+				}
+			}
+		}
+		else
+		{
+			status = EventLog_unmapConsumer();
+		}
+
+		KeUnstackDetachProcess(&apcState);
+		ObDereferenceObject(process);
+	}
+
+	return status;
+}
+
+static NTSTATUS actionProfilerControl(PVMM_DATA lpData, CR3 guestCR3, GUEST_VIRTUAL_ADDRESS buffer, SIZE_T bufferSize)
+{
+	NTSTATUS status;
+
+	if ((0 != buffer) && (sizeof(VM_PARAM_PROFILER_CONTROL) == bufferSize))
+	{
+		VM_PARAM_PROFILER_CONTROL params = { 0 };
+
+		status = MemManage_readVirtualAddress(&lpData->mmContext, guestCR3, buffer, &params, sizeof(params));
+		if (NT_SUCCESS(status))
+		{
+			switch (params.operation)
+			{
+				case PROFILER_OPERATION_START:
+				{
+					status = Profiler_start(params.processorIndex, params.periodCycles);
+					break;
+				}
+
+				case PROFILER_OPERATION_STOP:
+				{
+					status = Profiler_stop(params.processorIndex);
+					break;
+				}
+
+				case PROFILER_OPERATION_DRAIN:
+				{
+					/* Samples are written straight from the ring of the requested processor into the guest buffer. */
+					status = Profiler_drain(params.processorIndex, &lpData->mmContext, guestCR3,
+											(GUEST_VIRTUAL_ADDRESS)params.samples, params.sampleCapacity,
+											&params.sampleCount, &params.droppedCount);
+
+					/* Write the parameters back to the guest, so the caller knows how many were drained. */
+					if (NT_SUCCESS(status))
+					{
+						status = MemManage_writeVirtualAddress(&lpData->mmContext, guestCR3, buffer, &params, sizeof(params));
+					}
+					break;
+				}
+
+				default:
+				{
+					status = STATUS_INVALID_PARAMETER;
+					break;
+				}
+			}
+		}
+	}
+	else
+	{
+		status = STATUS_INVALID_PARAMETER;
+	}
+
+	return status;
+}
+
+static NTSTATUS actionBatch(PVMM_DATA lpData, CR3 guestCR3, GUEST_VIRTUAL_ADDRESS buffer, SIZE_T bufferSize)
+{
+	NTSTATUS status;
+
+	if ((0 != buffer) && (sizeof(VM_PARAM_BATCH) == bufferSize))
+	{
+		VM_PARAM_BATCH params = { 0 };
+
+		/* Every parameter block of the batch lives in the same address space, so the translation
+		 * cache enabled for this VMCALL shares the page walks between all of the commands. */
+		status = MemManage_readVirtualAddress(&lpData->mmContext, guestCR3, buffer, &params, sizeof(params));
+		if (NT_SUCCESS(status))
+		{
+			if ((NULL != params.commands) && (NULL != params.statuses) &&
+				(0 != params.commandCount) && (params.commandCount <= VMCALL_BATCH_MAX_COMMANDS))
+			{
+				VMCALL_COMMAND commands[BATCH_CHUNK_COMMANDS];
+				NTSTATUS statuses[BATCH_CHUNK_COMMANDS];
+
+				BOOLEAN stopped = FALSE;
+				params.completedCount = 0;
+
+				while ((params.completedCount < params.commandCount) && (FALSE == stopped) && (NT_SUCCESS(status)))
+				{
+					SIZE_T chunkCount = params.commandCount - params.completedCount;
+					if (chunkCount > BATCH_CHUNK_COMMANDS)
+					{
+						chunkCount = BATCH_CHUNK_COMMANDS;
+					}
+
+					/* Read a whole chunk of commands with a single access. */
+					status = MemManage_readVirtualAddress(&lpData->mmContext, guestCR3,
+														  (GUEST_VIRTUAL_ADDRESS)(params.commands + params.completedCount),
+														  commands, chunkCount * sizeof(VMCALL_COMMAND));
+					if (NT_SUCCESS(status))
+					{
+						SIZE_T executed = 0;
+
+						while ((executed < chunkCount) && (FALSE == stopped))
+						{
+							PVMCALL_COMMAND command = &commands[executed];
+
+							/* Batches can't be nested, as the chunk buffers live on the host stack. */
+							if (VMCALL_ACTION_BATCH != command->action)
+							{
+								statuses[executed] = VMCALL_dispatchCommand(lpData, guestCR3, command);
+							}
+							else
+							{
+								statuses[executed] = STATUS_INVALID_PARAMETER;
+							}
+
+							if ((NT_ERROR(statuses[executed])) && (0 != (params.flags & VMCALL_BATCH_FLAG_STOP_ON_ERROR)))
+							{
+								stopped = TRUE;
+							}
+
+							executed++;
+						}
+
+						/* Write the statuses back for the whole chunk at once. */
+						status = MemManage_writeVirtualAddress(&lpData->mmContext, guestCR3,
+															   (GUEST_VIRTUAL_ADDRESS)(params.statuses + params.completedCount),
+															   statuses, executed * sizeof(NTSTATUS));
+
+						params.completedCount += executed;
+					}
+				}
+
+				/* Write the parameters back to the guest, so the caller knows how far the batch got. */
 				if (NT_SUCCESS(status))
 				{
-					/* Tell the VMShadow module to hide the executable page at the specified
-						* address, for the target process only. */
-					status = VMShadow_hideExecInProcess(lpData,
-						targetProcess,
-						params.userTargetVA,
-						params.kernelExecPageVA);
-
-					ObDereferenceObject(targetProcess);
+					status = MemManage_writeVirtualAddress(&lpData->mmContext, guestCR3, buffer, &params, sizeof(params));
 				}
 			}
 			else
@@ -167,71 +545,250 @@ static NTSTATUS actionShadowInProcess(PVMM_DATA lpData, CR3 guestCR3, GUEST_VIRT
 	return status;
 }
 
-static NTSTATUS actionGatherEvents(PVMM_DATA lpData, CR3 guestCR3, GUEST_VIRTUAL_ADDRESS buffer, SIZE_T bufferSize)
+static NTSTATUS actionRingControl(PVMM_DATA lpData, CR3 guestCR3, GUEST_VIRTUAL_ADDRESS buffer, SIZE_T bufferSize)
+{
+	NTSTATUS status;
+
+	if ((0 != buffer) && (sizeof(VM_PARAM_RING_CONTROL) == bufferSize))
+	{
+		VM_PARAM_RING_CONTROL params = { 0 };
+
+		status = MemManage_readVirtualAddress(&lpData->mmContext, guestCR3, buffer, &params, sizeof(params));
+		if (NT_SUCCESS(status))
+		{
+			switch (params.operation)
+			{
+				case RING_OPERATION_REGISTER:
+				{
+					/* The ring is owned by the calling process, commands posted to it
+					 * are executed within its address space. */
+					status = CommandRing_register(lpData, guestCR3, (GUEST_VIRTUAL_ADDRESS)params.ring, params.ringSize, &params.ringId);
+					if (NT_SUCCESS(status))
+					{
+						status = MemManage_writeVirtualAddress(&lpData->mmContext, guestCR3, buffer, &params, sizeof(params));
+						if (!NT_SUCCESS(status))
+						{
+							CommandRing_unregister(guestCR3, params.ringId);
+						}
+					}
+					break;
+				}
+
+				case RING_OPERATION_UNREGISTER:
+				{
+					status = CommandRing_unregister(guestCR3, params.ringId);
+					break;
+				}
+
+				default:
+				{
+					status = STATUS_INVALID_PARAMETER;
+					break;
+				}
+			}
+		}
+	}
+	else
+	{
+		status = STATUS_INVALID_PARAMETER;
+	}
+
+	return status;
+}
+
+static NTSTATUS actionSetEventFilter(PVMM_DATA lpData, CR3 guestCR3, GUEST_VIRTUAL_ADDRESS buffer, SIZE_T bufferSize)
+{
+	/* Takes effect on every logical processor as soon as this returns, the size of
+	 * the buffer only has to cover the predicates that are in use. */
+	return EventFilter_install(&lpData->mmContext, guestCR3, buffer, bufferSize);
+}
+
+static NTSTATUS actionDumpFlightRecorder(PVMM_DATA lpData, CR3 guestCR3, GUEST_VIRTUAL_ADDRESS buffer, SIZE_T bufferSize)
+{
+	NTSTATUS status;
+
+	if ((0 != buffer) && (sizeof(VM_PARAM_DUMP_FLIGHT_RECORDER) == bufferSize))
+	{
+		VM_PARAM_DUMP_FLIGHT_RECORDER params = { 0 };
+
+		status = MemManage_readVirtualAddress(&lpData->mmContext, guestCR3, buffer, &params, sizeof(params));
+		if (NT_SUCCESS(status))
+		{
+			status = FlightRecorder_dump(&lpData->mmContext, guestCR3, (GUEST_VIRTUAL_ADDRESS)params.recorders,
+										 params.recorderCapacity, &params.recorderCount);
+
+			/* The count is written back even when the buffer was too small, so the caller knows what it got. */
+			if ((NT_SUCCESS(status)) || (STATUS_BUFFER_TOO_SMALL == status))
+			{
+				NTSTATUS writeStatus = MemManage_writeVirtualAddress(&lpData->mmContext, guestCR3, buffer, &params, sizeof(params));
+				if (!NT_SUCCESS(writeStatus))
+				{
+					status = writeStatus;
+				}
+			}
+		}
+	}
+	else
+	{
+		status = STATUS_INVALID_PARAMETER;
+	}
+
+	return status;
+}
+
+static BOOLEAN handleFastCall(PVMM_DATA lpData)
+{
+	VMCALL_FAST_REGISTERS registers;
+	registers.values[0] = lpData->guestContext.R8;
+	registers.values[1] = lpData->guestContext.R9;
+	registers.values[2] = lpData->guestContext.R10;
+	registers.values[3] = lpData->guestContext.R11;
+
+	if (lpData->guestContext.Rdx < VMCALL_FAST_ACTION_COUNT)
+	{
+		lpData->guestContext.Rax = (ULONG64)FAST_ACTION_HANDLERS[lpData->guestContext.Rdx](lpData, &registers);
+	}
+	else
+	{
+		lpData->guestContext.Rax = (ULONG64)STATUS_INVALID_PARAMETER;
+	}
+
+	/* Whatever the handler left in the registers is returned to the guest. */
+	lpData->guestContext.Rdx = registers.values[0];
+	lpData->guestContext.R8 = registers.values[1];
+	lpData->guestContext.R9 = registers.values[2];
+	lpData->guestContext.R10 = registers.values[3];
+
+	return TRUE;
+}
+
+static NTSTATUS fastActionCheckPresence(PVMM_DATA lpData, PVMCALL_FAST_REGISTERS registers)
+{
+	registers->values[0] = VMCALL_FAST_SIGNATURE;
+	registers->values[1] = lpData->processorIndex;
+	registers->values[2] = 0;
+	registers->values[3] = 0;
+
+	return STATUS_SUCCESS;
+}
+
+static NTSTATUS fastActionReadCounter(PVMM_DATA lpData, PVMCALL_FAST_REGISTERS registers)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+
+	/* Arguments: [0] = Counter, [1] = Processor Index (profiler and event counters only).
+	 * Results: [0] = Counter Value, [1] = Processor Index the VMCALL was handled on. */
+	UINT64 counter = registers->values[0];
+	UINT32 processorIndex = (UINT32)registers->values[1];
+
+	UINT64 pendingCount;
+	UINT64 droppedCount;
+	UINT64 writtenCount;
+	UINT64 filteredCount;
+	UINT64 truncatedCount;
+
+	switch (counter)
+	{
+		case VMCALL_COUNTER_EXIT_COUNT:
+		{
+			registers->values[0] = lpData->exitCount;
+			break;
+		}
+
+		case VMCALL_COUNTER_PROFILER_PENDING:
+		case VMCALL_COUNTER_PROFILER_DROPPED:
+		{
+			status = Profiler_getCounters(processorIndex, &pendingCount, &droppedCount);
+			registers->values[0] = (VMCALL_COUNTER_PROFILER_PENDING == counter) ? pendingCount : droppedCount;
+			break;
+		}
+
+		case VMCALL_COUNTER_EVENTS_WRITTEN:
+		case VMCALL_COUNTER_EVENTS_DROPPED:
+		case VMCALL_COUNTER_EVENTS_FILTERED:
+		case VMCALL_COUNTER_EVENTS_TRUNCATED:
+		{
+			status = EventLog_getCounters(processorIndex, &writtenCount, &droppedCount, &filteredCount, &truncatedCount);
+			registers->values[0] = (VMCALL_COUNTER_EVENTS_WRITTEN == counter) ? writtenCount :
+				(VMCALL_COUNTER_EVENTS_DROPPED == counter) ? droppedCount :
+				(VMCALL_COUNTER_EVENTS_FILTERED == counter) ? filteredCount : truncatedCount;
+			break;
+		}
+
+		default:
+		{
+			status = STATUS_INVALID_PARAMETER;
+			break;
+		}
+	}
+
+	if (NT_SUCCESS(status))
+	{
+		registers->values[1] = lpData->processorIndex;
+	}
+
+	return status;
+}
+
+static NTSTATUS fastActionProfilerStart(PVMM_DATA lpData, PVMCALL_FAST_REGISTERS registers)
 {
 	UNREFERENCED_PARAMETER(lpData);
-	UNREFERENCED_PARAMETER(guestCR3);
-	UNREFERENCED_PARAMETER(buffer);
-	UNREFERENCED_PARAMETER(bufferSize);
 
-	NTSTATUS status = STATUS_UNSUCCESSFUL;
-
-	//if ((0 != buffer) && (sizeof(VM_PARAM_GATHER_EVENTS) == bufferSize))
-	//{
-	//	VM_PARAM_GATHER_EVENTS params = { 0 };
-
-	//	status = MemManage_readVirtualAddress(&lpData->mmContext, guestCR3, buffer, &params, sizeof(params));
-	//	if (NT_SUCCESS(status))
-	//	{
-	//		/* Check to see if expected size is zero.
-	//		 * if so, we return the current size of the event log. */
-	//		if ((NULL != params.buffer) && (0 != params.bufferSize))
-	//		{
-	//			/* Here is a static buffer that is reserved for holding events,
-	//			 * we use this to store events. */
-	//			static UINT8 staticEventBuffer[EVENT_BUFFER_SIZE];
-
-	//			/* Ensure we can fetch only enough for our static buffer size. */
-	//			if (params.bufferSize > EVENT_BUFFER_SIZE)
-	//			{
-	//				params.bufferSize = EVENT_BUFFER_SIZE;
-	//			}
-
-	//			/* Read the events into our allocated buffer. */
-	//			status = EventLog_retrieveAndClear(staticEventBuffer, params.bufferSize, &params.eventCount);
-
-	//			if (0 == params.eventCount)
-	//			{
-	//				/* Unable to retrieve, due to no events being present. */
-	//				status = STATUS_UNSUCCESSFUL;
-	//			}
-
-	//			if (NT_SUCCESS(status))
-	//			{
-	//				/* Now write the buffer to the guest VA specified. */
-	//				status = MemManage_writeVirtualAddress(&lpData->mmContext,
-	//					guestCR3,
-	//					(GUEST_VIRTUAL_ADDRESS)params.buffer,
-	//					staticEventBuffer,
-	//					params.bufferSize);
-	//			}
-	//		}
-	//		else
-	//		{
-	//			status = STATUS_INVALID_PARAMETER;
-	//		}
-
-	//		/* Write the parameters back to the guest, as they may have been modified. */
-	//		if (NT_SUCCESS(status))
-	//		{
-	//			status = MemManage_writeVirtualAddress(&lpData->mmContext, guestCR3, buffer, &params, sizeof(params));
-	//		}
-	//	}
-	//}
-	//else
-	//{
-	//	status = STATUS_INVALID_PARAMETER;
-	//}
+	/* Arguments: [0] = Processor Index, [1] = Period Cycles. */
+	return Profiler_start((UINT32)registers->values[0], registers->values[1]);
+}
+
+static NTSTATUS fastActionProfilerStop(PVMM_DATA lpData, PVMCALL_FAST_REGISTERS registers)
+{
+	UNREFERENCED_PARAMETER(lpData);
+
+	/* Arguments: [0] = Processor Index. */
+	return Profiler_stop((UINT32)registers->values[0]);
+}
+
+static NTSTATUS fastActionRingDoorbell(PVMM_DATA lpData, PVMCALL_FAST_REGISTERS registers)
+{
+	/* Arguments: [0] = Ring ID. Only the process that registered the ring can ring it. */
+	CR3 guestCR3;
+	__vmx_vmread(VMCS_GUEST_CR3, &guestCR3.Flags);
+
+	return CommandRing_doorbell(lpData, guestCR3, (UINT32)registers->values[0]);
+}
+
+static NTSTATUS queueDeferredAction(PVMM_DATA lpData, CR3 guestCR3, fnWorkerRoutine routine,
+									const UINT64 parameters[WORKER_ITEM_PARAMETERS], PVMCALL_STATUS_BLOCK statusBlock)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+
+	GUEST_VIRTUAL_ADDRESS statusBlockVA = (GUEST_VIRTUAL_ADDRESS)statusBlock;
+
+	if (0 != statusBlockVA)
+	{
+		/* The block is completed from VMX root through the page tables of the caller, once the
+		 * worker has finished. Being aligned to its size, it can't span two pages. */
+		if (0 == (statusBlockVA & (sizeof(VMCALL_STATUS_BLOCK) - 1)))
+		{
+			/* Must be pending before the item is queued, as the worker can complete it straight away. */
+			VMCALL_STATUS_BLOCK pendingBlock = { .status = STATUS_PENDING };
+			status = MemManage_writeVirtualAddress(&lpData->mmContext, guestCR3, statusBlockVA, &pendingBlock, sizeof(pendingBlock));
+		}
+		else
+		{
+			status = STATUS_INVALID_ADDRESS;
+		}
+	}
+
+	if (NT_SUCCESS(status))
+	{
+		/* The guest resumes straight away, with STATUS_PENDING. */
+		status = Worker_queue(routine, parameters, guestCR3, statusBlockVA);
+
+		if ((STATUS_PENDING != status) && (0 != statusBlockVA))
+		{
+			VMCALL_STATUS_BLOCK failedBlock = { .status = status };
+			MemManage_writeVirtualAddress(&lpData->mmContext, guestCR3, statusBlockVA, &failedBlock, sizeof(failedBlock));
+		}
+	}
 
 	return status;
 }
\ No newline at end of file
@@ -1,6 +1,8 @@
-    .code
+; Driver variant of Shared/VMCALL_Stub.asm, using the kernel unwind macros.
 
-	VMCALL_actionHost PROC
+include ksamd64.inc
+
+	LEAF_ENTRY VMCALL_actionHost, _TEXT$00
 
 	; RCX should hold the key (hopefully convention not broken)
 	; RDX should hold a pointer to VMCALL_COMMAND parameters (same as above)
@@ -11,6 +13,38 @@
 
 	ret
 
-	VMCALL_actionHost ENDP
+	LEAF_END VMCALL_actionHost, _TEXT$00
+
+	; RBX is saved in a prologue of its own, so the stack can still be unwound should the
+	; guest fault on the registers block.
+	NESTED_ENTRY VMCALL_fastActionHost, _TEXT$00
+
+	push_reg rbx
+	END_PROLOGUE
+
+	; RCX holds the fast key, RDX holds the action.
+	; R8 holds a pointer to VMCALL_FAST_REGISTERS, the arguments are loaded
+	; into R8 - R11 and the results are returned in RDX, R8 - R10.
+	mov rbx, r8
+
+	mov r8, [rbx]
+	mov r9, [rbx + 8]
+	mov r10, [rbx + 16]
+	mov r11, [rbx + 24]
+
+	vmcall
+
+	mov [rbx], rdx
+	mov [rbx + 8], r8
+	mov [rbx + 16], r9
+	mov [rbx + 24], r10
+
+	; RAX will contain the result NTSTATUS, set by the host.
+
+	BEGIN_EPILOGUE
+	pop rbx
+	ret
+
+	NESTED_END VMCALL_fastActionHost, _TEXT$00
 
-    end
\ No newline at end of file
+    end
@@ -1,8 +1,12 @@
 #include <ntifs.h>
 #include <intrin.h>
 #include "VMHook.h"
+#include "Trampoline.h"
+#include "Relocate.h"
+#include "Decoder.h"
 #include "VMShadow.h"
-#include "BEA\BeaEngine.h"
+#include "VMCALL_Common.h"
+#include "VMM.h"
 #include "Debug.h"
 
 /******************** External API ********************/
@@ -10,48 +14,198 @@
 
 /******************** Module Typedefs ********************/
 
-typedef struct _PENDING_HOOK
+/* A physical page of code that has at least one hook on it. Every hook on the page is
+ * written into the same shadow, so the EPT only ever has a single handler for the page. */
+typedef struct _VM_HOOK_PAGE
 {
+	/* Entry within the list of every hooked page. */
+	LIST_ENTRY listEntry;
+
+	PHYSICAL_ADDRESS targetPA;
+
+	/* Executable copy of the page, with the detour of every hook on it written in. */
+	PSHADOW_GLOBAL_PAGE shadowPage;
+
+	/* Pieces of the hooks on the page, ordered by their offset into it. */
+	LIST_ENTRY pieceList;
+} VM_HOOK_PAGE, *PVM_HOOK_PAGE;
+
+/* Part of a hook that lies on a single page. A hook that starts near the end of a page
+ * carries on into the next one, which has a piece of its own. */
+typedef struct _VM_HOOK_PIECE
+{
+	/* Entry within the list of the pieces on the same page. */
+	LIST_ENTRY pageEntry;
+
+	PVM_HOOK_PAGE page;
+	struct _VM_HOOK* hook;
+
+	/* Offset into the page, and the part of the detour that is written there. */
+	SIZE_T offset;
+	SIZE_T patchStart;
+	SIZE_T patchSize;
+} VM_HOOK_PIECE, *PVM_HOOK_PIECE;
+
+/* A hook within the registry. Everything it needs is created when it is installed,
+ * so all that is left is to write it into the shadow of its pages. */
+typedef struct _VM_HOOK
+{
+	/* Next hook within the same bucket of the registry. */
+	struct _VM_HOOK* nextInBucket;
+
 	PVOID target;
 	PVOID hook;
 	PVOID* original;
-} PENDING_HOOK, * PPENDING_HOOK;
+	PVOID trampoline;
+	SIZE_T trampolineSize;
+
+	/* Detour written over the start of the target, in the shadow of its pages. */
+	SIZE_T patchSize;
+	UINT8 patch[VMHOOK_PATCH_SIZE];
+
+	/* Bytes of the whole instructions the detour overwrites, no other hook may overlap them. */
+	SIZE_T coveredSize;
+
+	VM_HOOK_PIECE pieces[VMHOOK_MAX_PAGES];
+	ULONG pieceCount;
+
+	/* Installed for a hook chain, which is never removed. */
+	BOOLEAN chained;
+} VM_HOOK, *PVM_HOOK;
+
+typedef enum
+{
+	HOOK_CHANGE_APPLY = 0,	/* Hide the page within the EPT of every processor. */
+	HOOK_CHANGE_REVOKE,		/* Stop hiding the page on every processor. */
+	HOOK_CHANGE_WRITE		/* Write bytes into the shadow whilst no processor can be executing it. */
+} HOOK_CHANGE;
+
+/* Change to one of the pages of a hook. */
+typedef struct _HOOK_PAGE_CHANGE
+{
+	PVM_HOOK_PAGE page;
+	HOOK_CHANGE change;
+
+	/* Bytes to write for HOOK_CHANGE_WRITE. */
+	SIZE_T offset;
+	const UINT8* buffer;
+	SIZE_T size;
+} HOOK_PAGE_CHANGE, *PHOOK_PAGE_CHANGE;
+
+/* Changes to the pages of a hook that are made together, whilst every logical processor is held
+ * in the same IPI. No processor sees one page of a hook change without the other. */
+typedef struct _HOOK_BROADCAST
+{
+	HOOK_PAGE_CHANGE changes[VMHOOK_MAX_PAGES];
+	ULONG changeCount;
+
+	/* Processors wait for each other when there are bytes to write, so none of them
+	 * goes back to the guest until they have been written. */
+	BOOLEAN hasWrites;
+	volatile LONG arrivedCount;
+	LONG processorCount;
+	volatile LONG written;
+
+	/* First failure of any processor, success if there wasn't one. */
+	volatile LONG status;
+} HOOK_BROADCAST, *PHOOK_BROADCAST;
 
 /******************** Module Constants ********************/
-#define MAX_HOOKS 50
+
+#define VMHOOK_POOL_TAG 'khVH'
+
+C_ASSERT(RELOCATE_NEAR_JUMP_SIZE <= VMHOOK_PATCH_SIZE);
+C_ASSERT(RELOCATE_REGISTER_JUMP_SIZE <= VMHOOK_PATCH_SIZE);
+#define VMHOOK_BUCKET_MASK (VMHOOK_BUCKET_COUNT - 1)
+
+C_ASSERT((VMHOOK_BUCKET_COUNT & VMHOOK_BUCKET_MASK) == 0);
 
 /******************** Module Variables ********************/
 
-static SIZE_T pendingHookCount = 0;
-static PENDING_HOOK pendingHooks[MAX_HOOKS] = { 0 };
+/* Every hooked page, along with every hook hashed by its target. Both are guarded by the
+ * registry lock, which is held by the launch for as long as the processors are launched. */
+static LIST_ENTRY pageList = { &pageList, &pageList };
+static PVM_HOOK hookBuckets[VMHOOK_BUCKET_COUNT] = { 0 };
+static SIZE_T hookCount = 0;
+
+/* A zeroed push lock is already initialised, so hooks can be installed before anything else has run. */
+static EX_PUSH_LOCK registryLock;
+
+/* Set once every processor has been launched, from then on changes to the hooks
+ * have to be made whilst every processor is held in an IPI. */
+static volatile LONG hooksLaunched = FALSE;
+
+/* Set when a processor failed to launch. Only some of them might be running the hypervisor,
+ * so a change could reach neither all of them by IPI nor be applied as they launch. */
+static BOOLEAN launchFailed = FALSE;
 
 /******************** Module Prototypes ********************/
-static NTSTATUS hookAFunction(PEPT_CONFIG eptConfig, PVOID targetFunction, PVOID hookFunction, PVOID* origFunction);
-static NTSTATUS createTrampoline(PUINT8 hookPage, PVOID targetFunction, PVOID hookFunction, PVOID* origFunction);
-static void generateAbsoluteJump(PUINT8 targetBuffer, SIZE_T targetAddress);
+static NTSTATUS installHook(PVOID targetFunction, PVOID hookFunction, PVOID* origFunction, BOOLEAN chained);
+static NTSTATUS addToPages(PVM_HOOK hook);
+static NTSTATUS createPage(PHYSICAL_ADDRESS targetPA, const UINT8* pageVA, PVM_HOOK_PAGE* page);
+static void freePage(PVM_HOOK_PAGE page);
+static PLIST_ENTRY findPiecePosition(PVM_HOOK_PAGE page, PVM_HOOK_PIECE piece);
+static void removeFromPages(PVM_HOOK hook);
+static void addChange(PHOOK_BROADCAST broadcast, PVM_HOOK_PAGE page, HOOK_CHANGE change, SIZE_T offset, const UINT8* buffer, SIZE_T size);
+static NTSTATUS broadcastChanges(PHOOK_BROADCAST broadcast);
+static ULONG_PTR changeOnProcessor(ULONG_PTR argument);
+static NTSTATUS rootChangePages(PVOID hvParameter, PVOID userParameter);
+static PVM_HOOK_PAGE findPage(PHYSICAL_ADDRESS targetPA);
+static PVM_HOOK findHook(PVOID targetFunction);
+static void insertHook(PVM_HOOK hook);
+static void unlinkHook(PVM_HOOK hook);
+static ULONG hashTarget(PVOID targetFunction);
+static NTSTATUS createTrampoline(PVM_HOOK hook);
 
 /******************** Public Code ********************/
 
-NTSTATUS VMHook_init(PEPT_CONFIG eptConfig)
+void VMHook_beginLaunch(void)
+{
+	/* Called at PASSIVE_LEVEL before the IPI that launches the processors. The registry is held
+	 * until VMHook_endLaunch, so VMHook_init can walk it, and a hook installed meanwhile waits
+	 * until it is known whether it has to be broadcast. */
+	KeEnterCriticalRegion();
+	ExAcquirePushLockExclusive(&registryLock);
+}
+
+void VMHook_endLaunch(BOOLEAN launched)
 {
-	/* This is called when the hypervisor IS initialised. Hooks can be pending before.
-	* This is called once per logical-processor. */
+	/* Called once every processor has returned from the launch IPI, launched only when all of
+	 * them succeeded. */
+	if (TRUE == launched)
+	{
+		InterlockedExchange(&hooksLaunched, TRUE);
+	}
+	else
+	{
+		launchFailed = TRUE;
+	}
+
+	ExReleasePushLockExclusive(&registryLock);
+	KeLeaveCriticalRegion();
+}
+
+NTSTATUS VMHook_init(PEPT_CONFIG eptConfig, ULONG processorIndex)
+{
+	/* This is called when the hypervisor IS initialised, once per logical-processor at IPI_LEVEL,
+	 * between VMHook_beginLaunch and VMHook_endLaunch. Every page hooked so far is applied to the
+	 * EPT of the processor, nothing is allocated. The processor mustn't be launched should this fail. */
 
 	/* Assume successful until failure. */
 	NTSTATUS status = STATUS_SUCCESS;
 
-	/* Iterate through all the pending hooks and initialise them. */
-	for (SIZE_T i = 0; i < pendingHookCount; i++)
+	for (PLIST_ENTRY currentEntry = pageList.Flink;
+		currentEntry != &pageList;
+		currentEntry = currentEntry->Flink)
 	{
-		PPENDING_HOOK current = &pendingHooks[i];
+		PVM_HOOK_PAGE current = CONTAINING_RECORD(currentEntry, VM_HOOK_PAGE, listEntry);
 
-		DEBUG_PRINT("[VMHook_init] %p %p %p\n", current->target, current->hook, current->original);
-
-		status = hookAFunction(eptConfig, current->target, current->hook, current->original);
+		status = VMShadow_applyGlobalPage(current->shadowPage, eptConfig, processorIndex);
 
 		if (FALSE == NT_SUCCESS(status))
 		{
 			/* Don't continue with hooking, just fail gracefully. */
+			DEBUG_ERROR("[VMHook_init] Unable to apply the hooked page 0x%llX: 0x%X\n", current->targetPA.QuadPart, status);
 			break;
 		}
 	}
@@ -59,160 +213,341 @@ NTSTATUS VMHook_init(PEPT_CONFIG eptConfig)
 	return status;
 }
 
-void VMHook_queueHook(PVOID targetFunction, PVOID hookFunction, PVOID* origFunction)
+NTSTATUS VMHook_install(PVOID targetFunction, PVOID hookFunction, PVOID* origFunction)
 {
-	/* As some hooks are may be called before the hypervisor is initialised, we provide the
-	* ability to create a queue of hooks, this means we can do the hooks without needing to be
-	* running at the hypervisor's DPC IRQL.
-	*
-	* All pending hooks are hooked at hypervisor initialisation. */
+	/* Called at PASSIVE_LEVEL, either before the hypervisor is launched, in which case the hook is
+	 * applied as each processor is launched, or afterwards, when every processor applies it straight
+	 * away. The trampoline to call the original is written to origFunction before the hook can be hit,
+	 * and set back to NULL should the install fail.
+	 *
+	 * NOTE: At the moment this only works with virtual addresses in the kernel as they are mapped
+	 * to every logical processor. We will need to use IoAllocateMdl if we want to hook usermode
+	 * addresses in the future. */
+	return installHook(targetFunction, hookFunction, origFunction, FALSE);
+}
 
-	/* NOTE: At the moment this only works with virtual addresses in the kernel as they are mapped
-	* to every logical processor. We will need to use IoAllocateMdl if we want to hook usermode
-	* addresses in the future. */
+NTSTATUS VMHook_installChained(PVOID targetFunction, PVOID stubFunction, PVOID* origFunction)
+{
+	/* As VMHook_install, for the stub of a hook chain, which is never removed. */
+	return installHook(targetFunction, stubFunction, origFunction, TRUE);
+}
 
-	PPENDING_HOOK newHook = &pendingHooks[pendingHookCount];
+NTSTATUS VMHook_remove(PVOID targetFunction)
+{
+	/* Called at PASSIVE_LEVEL, every processor stops executing the detour before this returns.
+	 * The trampoline is left in place, as a thread could still be running within the hook and
+	 * about to call the original through it. The target of a hook chain can't be removed, its
+	 * chain owns the trampoline. */
+	NTSTATUS status;
 
-	newHook->target = targetFunction;
-	newHook->hook = hookFunction;
-	newHook->original = origFunction;
+	KeEnterCriticalRegion();
+	ExAcquirePushLockExclusive(&registryLock);
 
-	pendingHookCount++;
-}
+	PVM_HOOK hook = findHook(targetFunction);
 
-/******************** Module Code ********************/
+	if (TRUE == launchFailed)
+	{
+		status = STATUS_DEVICE_NOT_READY;
+	}
+	else if ((NULL != hook) && (TRUE == hook->chained))
+	{
+		/* A chained target stays hooked, its handlers are unregistered instead. */
+		status = STATUS_ACCESS_DENIED;
+	}
+	else if (NULL != hook)
+	{
+		unlinkHook(hook);
+		removeFromPages(hook);
+
+		ExFreePoolWithTag(hook, VMHOOK_POOL_TAG);
+		status = STATUS_SUCCESS;
+	}
+	else
+	{
+		status = STATUS_NOT_FOUND;
+	}
+
+	ExReleasePushLockExclusive(&registryLock);
+	KeLeaveCriticalRegion();
 
-static NTSTATUS hookAFunction(PEPT_CONFIG eptConfig, PVOID targetFunction, PVOID hookFunction, PVOID* origFunction)
+	return status;
+}
+
+NTSTATUS VMHook_query(PVOID targetFunction, PVMHOOK_INFORMATION information)
 {
+	/* Called at or below APC_LEVEL, looks up the hook of the target if there is one. */
 	NTSTATUS status;
 
-	/* Create the page that will be used as the shadow. */
-	PVOID alignedTarget = PAGE_ALIGN(targetFunction);
+	KeEnterCriticalRegion();
+	ExAcquirePushLockShared(&registryLock);
 
-	/* Create a buffer that will contain the hook
-	* First copy the original bytes of the page into it. */
-	PUINT8 hookPage = (PUINT8)OsAllocateContiguousAlignedPages(NonPagedPool, PAGE_SIZE);
+	PVM_HOOK hook = findHook(targetFunction);
 
-	if (NULL != hookPage)
+	if (NULL != hook)
+	{
+		information->target = hook->target;
+		information->hook = hook->hook;
+		information->trampoline = hook->trampoline;
+		status = STATUS_SUCCESS;
+	}
+	else
 	{
-		/* Copy the original bytes into the hook page. */
-		RtlCopyMemory(hookPage, alignedTarget, PAGE_SIZE);
+		status = STATUS_NOT_FOUND;
+	}
 
-		/* Create the trampoline in the hook page. */
-		status = createTrampoline(hookPage, targetFunction, hookFunction, origFunction);
+	ExReleasePushLockShared(&registryLock);
+	KeLeaveCriticalRegion();
 
-		if (NT_SUCCESS(status))
+	return status;
+}
+
+SIZE_T VMHook_getCount(void)
+{
+	return hookCount;
+}
+
+/******************** Module Code ********************/
+
+static NTSTATUS installHook(PVOID targetFunction, PVOID hookFunction, PVOID* origFunction, BOOLEAN chained)
+{
+	NTSTATUS status;
+
+	if ((NULL != targetFunction) && (NULL != hookFunction) && (NULL != origFunction))
+	{
+		KeEnterCriticalRegion();
+		ExAcquirePushLockExclusive(&registryLock);
+
+		if (TRUE == launchFailed)
 		{
-			PHYSICAL_ADDRESS targetPA = MmGetPhysicalAddress(alignedTarget);
-			status = VMShadow_hidePageGlobally(eptConfig, targetPA, hookPage, FALSE);
+			status = STATUS_DEVICE_NOT_READY;
+		}
+		else if (NULL == findHook(targetFunction))
+		{
+			PVM_HOOK newHook = (PVM_HOOK)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(VM_HOOK), VMHOOK_POOL_TAG);
 
+			if (NULL != newHook)
+			{
+				RtlZeroMemory(newHook, sizeof(VM_HOOK));
+				newHook->target = targetFunction;
+				newHook->hook = hookFunction;
+				newHook->original = origFunction;
+				newHook->chained = chained;
 
+				status = createTrampoline(newHook);
+
+				if (NT_SUCCESS(status))
+				{
+					status = addToPages(newHook);
+
+					if (NT_SUCCESS(status))
+					{
+						insertHook(newHook);
+					}
+					else
+					{
+						/* The hook was never reachable, so neither is its trampoline. The caller
+						 * mustn't be left holding it once it is freed. */
+						*origFunction = NULL;
+						Trampoline_free(newHook->trampoline, newHook->trampolineSize);
+					}
+				}
+
+				if (FALSE == NT_SUCCESS(status))
+				{
+					ExFreePoolWithTag(newHook, VMHOOK_POOL_TAG);
+				}
+			}
+			else
+			{
+				status = STATUS_NO_MEMORY;
+			}
+		}
+		else
+		{
+			status = STATUS_ALREADY_REGISTERED;
 		}
 
-		/* Free the memory as no longer needed as VMShadow copies the hooked page. */
-		ExFreePool(hookPage);
+		ExReleasePushLockExclusive(&registryLock);
+		KeLeaveCriticalRegion();
 	}
 	else
 	{
-		status = STATUS_NO_MEMORY;
+		status = STATUS_INVALID_PARAMETER;
 	}
 
-
 	return status;
 }
 
-static NTSTATUS createTrampoline(PUINT8 hookPage, PVOID targetFunction, PVOID hookFunction, PVOID* origFunction)
+static NTSTATUS addToPages(PVM_HOOK hook)
 {
-	static const Int32 GP_CONTROL_TRANSFER = (GENERAL_PURPOSE_INSTRUCTION | CONTROL_TRANSFER);
-	static const SIZE_T BYTES_FOR_ABSOLUTE_JUMP = 16;
-
+	/* Writes the detour into the shadow of each page the hook is on, creating the shadow of a page
+	 * if this is the first hook on it. When the hook carries on into the next page both are changed
+	 * within the same IPI, so no processor executes half of the detour. Hooks can't overlap. */
 	NTSTATUS status = STATUS_SUCCESS;
 
-	/* Calculate the function's offset into the page. */
-	SIZE_T offsetIntoPage = ADDRMASK_EPT_PML1_OFFSET((UINT64)targetFunction);
+	PUINT8 firstPage = (PUINT8)PAGE_ALIGN(hook->target);
+	SIZE_T offsetIntoPage = BYTE_OFFSET(hook->target);
 
-	/* Allocate some memory for the trampoline. */
-	PUINT8 trampoline = OsAllocateContiguousAlignedPages(NonPagedPoolExecute, PAGE_SIZE);
+	PVM_HOOK_PAGE newPages[VMHOOK_MAX_PAGES] = { 0 };
+	PLIST_ENTRY positions[VMHOOK_MAX_PAGES] = { 0 };
 
-	if (NULL != trampoline)
+	HOOK_BROADCAST broadcast;
+	RtlZeroMemory(&broadcast, sizeof(broadcast));
+
+	/* Split the hook at the end of the page, the second piece starts at the top of the next one. */
+	hook->pieceCount = ((offsetIntoPage + hook->coveredSize) > PAGE_SIZE) ? 2 : 1;
+
+	hook->pieces[0].offset = offsetIntoPage;
+	hook->pieces[0].patchStart = 0;
+	hook->pieces[0].patchSize = min(hook->patchSize, PAGE_SIZE - offsetIntoPage);
+
+	hook->pieces[1].offset = 0;
+	hook->pieces[1].patchStart = hook->pieces[0].patchSize;
+	hook->pieces[1].patchSize = hook->patchSize - hook->pieces[0].patchSize;
+
+	for (ULONG i = 0; (i < hook->pieceCount) && (NT_SUCCESS(status)); i++)
 	{
-		/* Zero the trampoline buffer. */
-		RtlZeroMemory(trampoline, PAGE_SIZE);
+		PVM_HOOK_PIECE piece = &hook->pieces[i];
+		PUINT8 pageVA = firstPage + (i * PAGE_SIZE);
+		PHYSICAL_ADDRESS targetPA = MmGetPhysicalAddress(pageVA);
 
-		/* Determine the number of instructions necessary to overwrite to fit the hook using a disassembler. */
-		SIZE_T sizeOfTrampoline = 0;
-		SIZE_T sizeOfDisassembled = 0;
+		piece->hook = hook;
+		piece->page = findPage(targetPA);
 
-		/* Get the size of instructions we will overwrite. */
-		DISASM disInfo = { 0 };
-		disInfo.EIP = (UIntPtr)targetFunction;
+		if ((1 == i) && (targetPA.QuadPart == hook->pieces[0].page->targetPA.QuadPart))
+		{
+			/* Both pages are mapped to the same physical page, which can't have two shadows. */
+			status = STATUS_NOT_SUPPORTED;
+		}
+		else if (NULL != piece->page)
+		{
+			/* Patch the shadow that is already being executed, rather than creating another. */
+			positions[i] = findPiecePosition(piece->page, piece);
 
-		while (sizeOfTrampoline < BYTES_FOR_ABSOLUTE_JUMP)
+			if (NULL != positions[i])
+			{
+				addChange(&broadcast, piece->page, HOOK_CHANGE_WRITE, piece->offset, &hook->patch[piece->patchStart], piece->patchSize);
+			}
+			else
+			{
+				status = STATUS_CONFLICTING_ADDRESSES;
+			}
+		}
+		else
 		{
-			SIZE_T instrLength = Disasm(&disInfo);
+			/* The shadow starts out as a copy of the original page, which nothing is executing yet,
+			 * so the detour can be written straight into it. */
+			status = createPage(targetPA, pageVA, &newPages[i]);
+
+			if (NT_SUCCESS(status))
+			{
+				piece->page = newPages[i];
+				positions[i] = &newPages[i]->pieceList;
+
+				VMShadow_writeGlobalPage(newPages[i]->shadowPage, piece->offset, &hook->patch[piece->patchStart], piece->patchSize);
+				addChange(&broadcast, newPages[i], HOOK_CHANGE_APPLY, 0, NULL, 0);
+			}
+		}
+	}
+
+	if (NT_SUCCESS(status))
+	{
+		/* The new pages are applied from VMX root, so whatever splitting them might take on every
+		 * processor is reserved up front. Until the processors are launched every page is still
+		 * to be applied, as each of them is launched. */
+		ULONG pendingPages = 0;
+
+		if (FALSE == hooksLaunched)
+		{
+			for (PLIST_ENTRY currentEntry = pageList.Flink; currentEntry != &pageList; currentEntry = currentEntry->Flink)
+			{
+				pendingPages++;
+			}
+		}
+
+		for (ULONG i = 0; i < hook->pieceCount; i++)
+		{
+			pendingPages += (NULL != newPages[i]) ? 1 : 0;
+		}
+
+		status = VMShadow_reserveGlobalPages(pendingPages);
+	}
+
+	if (NT_SUCCESS(status))
+	{
+		status = broadcastChanges(&broadcast);
+
+		if (FALSE == NT_SUCCESS(status))
+		{
+			/* Take the new pages back off the processors that did manage to apply them, and the
+			 * detour back out of the shadows that were already there. */
+			UINT8 originalBytes[VMHOOK_PATCH_SIZE];
+			RtlCopyMemory(originalBytes, hook->target, hook->patchSize);
+
+			HOOK_BROADCAST undo;
+			RtlZeroMemory(&undo, sizeof(undo));
 
-			/* Check to see if the disassembled instruction uses relative control transfers
-			* CALL, JXX etc. If it does we need to patch the address. */
-			if (disInfo.Error != UNKNOWN_OPCODE)
+			for (ULONG i = 0; i < hook->pieceCount; i++)
 			{
-				if (((disInfo.Instruction.Category & GP_CONTROL_TRANSFER) == GP_CONTROL_TRANSFER) &&
-					(CallType == disInfo.Instruction.BranchType))
+				PVM_HOOK_PIECE piece = &hook->pieces[i];
+
+				if (NULL != newPages[i])
 				{
-					/* At the moment we will only fix CALL's, we trash the R11 register doing so too.
-					* hopefully as it's rare R11 is used in first few bytes this is acceptable. */
-
-					/* MOVABS R11, 0x0000000000000000
-					* CALL R11 */
-					UINT8 shimAbsCall[12] = { 0x48, 0xB8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF, 0xD0 };
-					*((UINT64*)&shimAbsCall[2]) = disInfo.Instruction.AddrValue;
-
-					/* Copy the shim. */
-					RtlCopyMemory(trampoline + sizeOfTrampoline,
-						shimAbsCall,
-						sizeof(shimAbsCall));
-
-					/* Adjust the size of hooked instruction + EIP. */
-					sizeOfTrampoline += sizeof(shimAbsCall);
-					sizeOfDisassembled += instrLength;		/* Not the same size as the shim. */
-					disInfo.EIP += instrLength;
+					addChange(&undo, piece->page, HOOK_CHANGE_REVOKE, 0, NULL, 0);
 				}
 				else
 				{
-					/* We don't need to patch, just copy. */
-					RtlCopyMemory(trampoline + sizeOfTrampoline,
-						((PUINT8)targetFunction) + sizeOfTrampoline,
-						instrLength);
-
-					sizeOfTrampoline += instrLength;
-					sizeOfDisassembled += instrLength;
-					disInfo.EIP += instrLength;
+					addChange(&undo, piece->page, HOOK_CHANGE_WRITE, piece->offset, &originalBytes[piece->patchStart], piece->patchSize);
 				}
 			}
-			else
+
+			broadcastChanges(&undo);
+		}
+	}
+
+	for (ULONG i = 0; i < hook->pieceCount; i++)
+	{
+		if (NT_SUCCESS(status))
+		{
+			InsertTailList(positions[i], &hook->pieces[i].pageEntry);
+
+			if (NULL != newPages[i])
 			{
-				/* No tidy way of returning here really. */
-				status = STATUS_UNSUCCESSFUL;
-				break;
+				InsertTailList(&pageList, &newPages[i]->listEntry);
 			}
 		}
-
-		/* Ensure the hook isn't over two pages. */
-		if ((offsetIntoPage + sizeOfTrampoline) < (PAGE_SIZE - 1))
+		else if (NULL != newPages[i])
 		{
-			/* Add the absolute jump to the trampoline to return back to actual code. */
-			generateAbsoluteJump(&trampoline[sizeOfTrampoline], (SIZE_T)targetFunction + sizeOfDisassembled);
+			freePage(newPages[i]);
+		}
+	}
 
-			/* Add the absolute jump to detour the target to the hook code. */
-			generateAbsoluteJump(&hookPage[offsetIntoPage], (SIZE_T)hookFunction);
+	return status;
+}
 
-			/* Store the hook function, so it can be used. */
-			*origFunction = trampoline;
+static NTSTATUS createPage(PHYSICAL_ADDRESS targetPA, const UINT8* pageVA, PVM_HOOK_PAGE* page)
+{
+	NTSTATUS status;
+
+	PVM_HOOK_PAGE newPage = (PVM_HOOK_PAGE)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(VM_HOOK_PAGE), VMHOOK_POOL_TAG);
+
+	*page = NULL;
+
+	if (NULL != newPage)
+	{
+		RtlZeroMemory(newPage, sizeof(VM_HOOK_PAGE));
+		newPage->targetPA = targetPA;
+		InitializeListHead(&newPage->pieceList);
 
-			status = STATUS_SUCCESS;
+		status = VMShadow_createGlobalPage(targetPA, pageVA, &newPage->shadowPage);
+
+		if (NT_SUCCESS(status))
+		{
+			*page = newPage;
 		}
 		else
 		{
-			status = STATUS_NOT_CAPABLE;
+			ExFreePoolWithTag(newPage, VMHOOK_POOL_TAG);
 		}
 	}
 	else
@@ -220,31 +555,427 @@ static NTSTATUS createTrampoline(PUINT8 hookPage, PVOID targetFunction, PVOID ho
 		status = STATUS_NO_MEMORY;
 	}
 
-	if (FALSE == NT_SUCCESS(status))
+	return status;
+}
+
+static void freePage(PVM_HOOK_PAGE page)
+{
+	/* Only once it has been revoked from every processor. */
+	VMShadow_freeGlobalPage(page->shadowPage);
+	ExFreePoolWithTag(page, VMHOOK_POOL_TAG);
+}
+
+static PLIST_ENTRY findPiecePosition(PVM_HOOK_PAGE page, PVM_HOOK_PIECE piece)
+{
+	/* Finds where the piece goes in the ordered list of the page, returning the entry to insert
+	 * it before, or NULL if it overlaps a hook that is already there. Hooks are compared by the
+	 * bytes they cover, which can carry on past the end of the page. */
+	PLIST_ENTRY result = page->pieceList.Flink;
+	UINT64 start = (UINT64)piece->hook->target;
+	UINT64 end = start + piece->hook->coveredSize;
+
+	while (result != &page->pieceList)
 	{
-		ExFreePool(trampoline);
+		PVM_HOOK_PIECE current = CONTAINING_RECORD(result, VM_HOOK_PIECE, pageEntry);
+		UINT64 currentStart = (UINT64)current->hook->target;
+		UINT64 currentEnd = currentStart + current->hook->coveredSize;
+
+		if ((start < currentEnd) && (currentStart < end))
+		{
+			result = NULL;
+			break;
+		}
+		else if (piece->offset < current->offset)
+		{
+			break;
+		}
+
+		result = result->Flink;
 	}
 
+	return result;
+}
+
+static void removeFromPages(PVM_HOOK hook)
+{
+	/* The detour is taken back out of every page it is on within the same IPI. Reads of the
+	 * target see the original pages rather than the shadows, so they hold the original bytes. */
+	UINT8 originalBytes[VMHOOK_PATCH_SIZE];
+	RtlCopyMemory(originalBytes, hook->target, hook->patchSize);
+
+	HOOK_BROADCAST broadcast;
+	RtlZeroMemory(&broadcast, sizeof(broadcast));
+
+	for (ULONG i = 0; i < hook->pieceCount; i++)
+	{
+		PVM_HOOK_PIECE piece = &hook->pieces[i];
+
+		RemoveEntryList(&piece->pageEntry);
+
+		if (FALSE == IsListEmpty(&piece->page->pieceList))
+		{
+			/* Other hooks are still on the page, so only this detour is taken out of the shadow. */
+			addChange(&broadcast, piece->page, HOOK_CHANGE_WRITE, piece->offset, &originalBytes[piece->patchStart], piece->patchSize);
+		}
+		else
+		{
+			addChange(&broadcast, piece->page, HOOK_CHANGE_REVOKE, 0, NULL, 0);
+		}
+	}
+
+	/* Revoking and writing can't fail, so the pages are no longer hidden anywhere afterwards. */
+	broadcastChanges(&broadcast);
+
+	for (ULONG i = 0; i < hook->pieceCount; i++)
+	{
+		PVM_HOOK_PAGE page = hook->pieces[i].page;
+
+		if (TRUE == IsListEmpty(&page->pieceList))
+		{
+			RemoveEntryList(&page->listEntry);
+			freePage(page);
+		}
+	}
+}
+
+static void addChange(PHOOK_BROADCAST broadcast, PVM_HOOK_PAGE page, HOOK_CHANGE change, SIZE_T offset, const UINT8* buffer, SIZE_T size)
+{
+	PHOOK_PAGE_CHANGE pageChange = &broadcast->changes[broadcast->changeCount];
+
+	pageChange->page = page;
+	pageChange->change = change;
+	pageChange->offset = offset;
+	pageChange->buffer = buffer;
+	pageChange->size = size;
+
+	if ((HOOK_CHANGE_WRITE == change) && (0 != size))
+	{
+		broadcast->hasWrites = TRUE;
+	}
+
+	broadcast->changeCount++;
+}
+
+static NTSTATUS broadcastChanges(PHOOK_BROADCAST broadcast)
+{
+	/* Each processor makes the changes to its own EPT, the IPI only returns once they all have.
+	 * Until the processors have been launched nothing is hidden yet, so the bytes are just written
+	 * and the pages are applied as each processor is launched. */
+	broadcast->status = STATUS_SUCCESS;
+
+	if (TRUE == hooksLaunched)
+	{
+		broadcast->processorCount = (LONG)KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+		KeIpiGenericCall(changeOnProcessor, (ULONG_PTR)broadcast);
+	}
+	else
+	{
+		for (ULONG i = 0; i < broadcast->changeCount; i++)
+		{
+			PHOOK_PAGE_CHANGE pageChange = &broadcast->changes[i];
+
+			if (HOOK_CHANGE_WRITE == pageChange->change)
+			{
+				VMShadow_writeGlobalPage(pageChange->page->shadowPage, pageChange->offset, pageChange->buffer, pageChange->size);
+			}
+		}
+	}
+
+	return (NTSTATUS)broadcast->status;
+}
+
+static ULONG_PTR changeOnProcessor(ULONG_PTR argument)
+{
+	/* Called at IPI_LEVEL on every processor. */
+	PHOOK_BROADCAST broadcast = (PHOOK_BROADCAST)argument;
+	NTSTATUS status = STATUS_SUCCESS;
+	BOOLEAN changesEPT = FALSE;
+
+	if (TRUE == broadcast->hasWrites)
+	{
+		/* The shadows are shared, so writing to them doesn't change the EPT. Once every processor has
+		 * arrived none of them can be executing the pages, one writes the bytes whilst the rest wait
+		 * for it to finish. Returning from the IPI serialises each processor, so none of them run
+		 * stale instructions. */
+		InterlockedIncrement(&broadcast->arrivedCount);
+		while (broadcast->arrivedCount < broadcast->processorCount)
+		{
+			_mm_pause();
+		}
+
+		if (0 == KeGetCurrentProcessorIndex())
+		{
+			for (ULONG i = 0; i < broadcast->changeCount; i++)
+			{
+				PHOOK_PAGE_CHANGE pageChange = &broadcast->changes[i];
+
+				if (HOOK_CHANGE_WRITE == pageChange->change)
+				{
+					VMShadow_writeGlobalPage(pageChange->page->shadowPage, pageChange->offset, pageChange->buffer, pageChange->size);
+				}
+			}
+
+			InterlockedExchange(&broadcast->written, TRUE);
+		}
+		else
+		{
+			while (FALSE == broadcast->written)
+			{
+				_mm_pause();
+			}
+		}
+	}
+
+	for (ULONG i = 0; i < broadcast->changeCount; i++)
+	{
+		if (HOOK_CHANGE_WRITE != broadcast->changes[i].change)
+		{
+			changesEPT = TRUE;
+		}
+	}
+
+	if (TRUE == changesEPT)
+	{
+		/* The EPT can only be changed from VMX root. */
+		VM_PARAM_RUN_AS_ROOT rootParams;
+		rootParams.callback = rootChangePages;
+		rootParams.parameter = broadcast;
+
+		VMCALL_COMMAND command;
+		command.action = VMCALL_ACTION_RUN_AS_ROOT;
+		command.buffer = &rootParams;
+		command.bufferSize = sizeof(rootParams);
+
+		status = VMCALL_actionHost(VMCALL_KEY, &command);
+		if (FALSE == NT_SUCCESS(status))
+		{
+			InterlockedCompareExchange(&broadcast->status, status, STATUS_SUCCESS);
+		}
+	}
+
+	return (ULONG_PTR)status;
+}
+
+static NTSTATUS rootChangePages(PVOID hvParameter, PVOID userParameter)
+{
+	/* Every page of the hook is changed before the EPT is flushed, so the processor goes
+	 * straight from none of them being hidden to all of them. */
+	PVMM_DATA lpData = (PVMM_DATA)hvParameter;
+	PHOOK_BROADCAST broadcast = (PHOOK_BROADCAST)userParameter;
+	NTSTATUS status = STATUS_SUCCESS;
+
+	for (ULONG i = 0; (i < broadcast->changeCount) && (NT_SUCCESS(status)); i++)
+	{
+		PHOOK_PAGE_CHANGE pageChange = &broadcast->changes[i];
+
+		if (HOOK_CHANGE_APPLY == pageChange->change)
+		{
+			status = VMShadow_applyGlobalPage(pageChange->page->shadowPage, &lpData->eptConfig, lpData->processorIndex);
+		}
+		else if (HOOK_CHANGE_REVOKE == pageChange->change)
+		{
+			VMShadow_revokeGlobalPage(pageChange->page->shadowPage, &lpData->eptConfig, lpData->processorIndex);
+		}
+	}
+
+	/* We have modified EPT layout, therefore flush and reload. */
+	EPT_invalidateAndFlush(&lpData->eptConfig);
+
 	return status;
 }
 
-static void generateAbsoluteJump(PUINT8 targetBuffer, SIZE_T targetAddress)
+static PVM_HOOK_PAGE findPage(PHYSICAL_ADDRESS targetPA)
 {
-	/* PUSH RAX */
-	targetBuffer[0] = 0x50;
+	PVM_HOOK_PAGE result = NULL;
 
-	/* MOV RAX, targetAddress */
-	targetBuffer[1] = 0x48;
-	targetBuffer[2] = 0xB8;
+	for (PLIST_ENTRY currentEntry = pageList.Flink;
+		currentEntry != &pageList;
+		currentEntry = currentEntry->Flink)
+	{
+		PVM_HOOK_PAGE current = CONTAINING_RECORD(currentEntry, VM_HOOK_PAGE, listEntry);
 
-	*((PSIZE_T)&targetBuffer[3]) = targetAddress;
+		if (targetPA.QuadPart == current->targetPA.QuadPart)
+		{
+			result = current;
+			break;
+		}
+	}
+
+	return result;
+}
+
+static PVM_HOOK findHook(PVOID targetFunction)
+{
+	PVM_HOOK result = hookBuckets[hashTarget(targetFunction)];
+
+	while ((NULL != result) && (targetFunction != result->target))
+	{
+		result = result->nextInBucket;
+	}
+
+	return result;
+}
+
+static void insertHook(PVM_HOOK hook)
+{
+	ULONG bucket = hashTarget(hook->target);
+
+	hook->nextInBucket = hookBuckets[bucket];
+	hookBuckets[bucket] = hook;
+	hookCount++;
+}
+
+static void unlinkHook(PVM_HOOK hook)
+{
+	PVM_HOOK* link = &hookBuckets[hashTarget(hook->target)];
+
+	while (hook != *link)
+	{
+		link = &(*link)->nextInBucket;
+	}
+
+	*link = hook->nextInBucket;
+	hookCount--;
+}
+
+static ULONG hashTarget(PVOID targetFunction)
+{
+	/* Functions are aligned, so the low bits are mixed in with a multiplicative hash. */
+	UINT64 value = (UINT64)targetFunction * 0x9E3779B97F4A7C15ULL;
+
+	return (ULONG)(value >> 32) & VMHOOK_BUCKET_MASK;
+}
+
+static NTSTATUS createTrampoline(PVM_HOOK hook)
+{
+	/* Builds the trampoline that calls the original, and the detour that goes over the start of
+	 * the target within the shadow of its page. The instructions the detour covers can carry on
+	 * into the next page, whose shadow is then changed along with the first. */
+	static const SIZE_T MAX_BYTES_FOR_JUMP = RELOCATE_MAX_JUMP_SIZE;
+
+	NTSTATUS status = STATUS_SUCCESS;
+	PVOID targetFunction = hook->target;
+
+	/* Calculate the function's offset into the page. */
+	SIZE_T offsetIntoPage = BYTE_OFFSET(targetFunction);
+
+	/* Instructions are only decoded into the next page when there is one. */
+	PUINT8 nextPage = (PUINT8)PAGE_ALIGN(targetFunction) + PAGE_SIZE;
+	SIZE_T readableSize = (TRUE == MmIsAddressValid(nextPage)) ? (2 * PAGE_SIZE) : PAGE_SIZE;
+
+	/* Allocate the largest trampoline there could be, near to the target if possible. The slots
+	 * that aren't needed are given back once it has been written. */
+	PUINT8 trampoline = Trampoline_allocate(targetFunction, TRAMPOLINE_MAX_SIZE);
+
+	if (NULL != trampoline)
+	{
+		/* Built here for the address of the trampoline, then written to it in one go. */
+		UINT8 code[TRAMPOLINE_MAX_SIZE];
+
+		/* Determine the number of instructions necessary to overwrite to fit the hook. */
+		SIZE_T sizeOfTrampoline = 0;
+		SIZE_T sizeOfDisassembled = 0;
+
+		/* The shadow is execute only, so the detour mustn't read anything from it, a read would swap
+		 * the original page back in. A hook out of reach of a JMP rel32 is reached through a JMP [RIP+0]
+		 * at the end of the trampoline instead. Should neither be near, the detour loads the address of
+		 * the hook into R11 and jumps through it. */
+		BOOLEAN hookNear = Trampoline_isNear(targetFunction, hook->hook);
+		BOOLEAN useRelay = (FALSE == hookNear) && (TRUE == Trampoline_isNear(targetFunction, trampoline));
+		SIZE_T relaySize = (TRUE == useRelay) ? RELOCATE_MAX_JUMP_SIZE : 0;
+
+		hook->patchSize = ((TRUE == hookNear) || (TRUE == useRelay)) ? RELOCATE_NEAR_JUMP_SIZE : RELOCATE_REGISTER_JUMP_SIZE;
+
+		while (sizeOfDisassembled < hook->patchSize)
+		{
+			const UINT8* instruction = (const UINT8*)targetFunction + sizeOfDisassembled;
+			UINT64 instructionAddress = (UINT64)instruction;
+			DECODED_INSTRUCTION decoded;
 
-	/* XCHG [RSP], RAX */
-	targetBuffer[11] = 0x48;
-	targetBuffer[12] = 0x87;
-	targetBuffer[13] = 0x04;
-	targetBuffer[14] = 0x24;
+			/* Nothing is read past what is there. */
+			SIZE_T available = readableSize - (offsetIntoPage + sizeOfDisassembled);
 
-	/* RET */
-	targetBuffer[15] = 0xC3;
+			if (0 == Decoder_decode(instruction, (UINT32)min(available, DECODER_MAX_LENGTH), instructionAddress, &decoded))
+			{
+				DEBUG_ERROR("[createTrampoline] Unable to decode the instruction at %p\n", instruction);
+				status = STATUS_NOT_CAPABLE;
+				break;
+			}
+
+			/* A branch back into the detour would land part way through it. */
+			if ((0 != (decoded.flags & DECODER_FLAG_RELATIVE)) && (decoded.target >= (UINT64)targetFunction) &&
+				(decoded.target < ((UINT64)targetFunction + hook->patchSize)))
+			{
+				status = STATUS_NOT_CAPABLE;
+				break;
+			}
+
+			/* Relative branches and operands are rewritten to point back to where they did before,
+			 * leaving room for the jump back to the rest of the target and the relay. */
+			SIZE_T relocatedSize;
+			status = Relocate_instruction(instruction, &decoded, &code[sizeOfTrampoline], (UINT64)&trampoline[sizeOfTrampoline],
+										  TRAMPOLINE_MAX_SIZE - MAX_BYTES_FOR_JUMP - relaySize - sizeOfTrampoline, &relocatedSize);
+
+			if (FALSE == NT_SUCCESS(status))
+			{
+				DEBUG_ERROR("[createTrampoline] Unable to relocate the instruction at %p: 0x%X\n", instruction, status);
+				status = STATUS_NOT_CAPABLE;
+				break;
+			}
+
+			/* The relocated instruction can be larger than the original. */
+			sizeOfTrampoline += relocatedSize;
+			sizeOfDisassembled += decoded.length;
+		}
+
+		if (NT_SUCCESS(status))
+		{
+			/* Add the jump to the trampoline to return back to actual code. */
+			sizeOfTrampoline += Relocate_writeJump(&code[sizeOfTrampoline], (UINT64)&trampoline[sizeOfTrampoline],
+												   (UINT64)targetFunction + sizeOfDisassembled);
+
+			if (TRUE == useRelay)
+			{
+				PUINT8 relay = &trampoline[sizeOfTrampoline];
+
+				sizeOfTrampoline += Relocate_writeJump(&code[sizeOfTrampoline], (UINT64)relay, (UINT64)hook->hook);
+				Relocate_writeJump(hook->patch, (UINT64)targetFunction, (UINT64)relay);
+			}
+			else if (TRUE == hookNear)
+			{
+				Relocate_writeJump(hook->patch, (UINT64)targetFunction, (UINT64)hook->hook);
+			}
+			else
+			{
+				Relocate_writeRegisterJump(hook->patch, (UINT64)hook->hook);
+			}
+
+			hook->coveredSize = sizeOfDisassembled;
+
+			status = Trampoline_write(trampoline, code, sizeOfTrampoline);
+		}
+
+		if (NT_SUCCESS(status))
+		{
+			/* Give back the slots past the end of the trampoline. */
+			Trampoline_trim(trampoline, TRAMPOLINE_MAX_SIZE, sizeOfTrampoline);
+
+			/* Store the hook function, so it can be used. */
+			hook->trampoline = trampoline;
+			hook->trampolineSize = sizeOfTrampoline;
+			*hook->original = trampoline;
+		}
+	}
+	else
+	{
+		status = STATUS_NO_MEMORY;
+	}
+
+	if (FALSE == NT_SUCCESS(status))
+	{
+		Trampoline_free(trampoline, TRAMPOLINE_MAX_SIZE);
+	}
+
+	return status;
 }
@@ -4,12 +4,38 @@
 
 /******************** Public Defines ********************/
 
+/* Hooks are kept in a registry hashed by their target, over this many buckets. Any number
+ * of hooks can be installed, must be a power of two. */
+#define VMHOOK_BUCKET_COUNT 256
+
+/* Largest detour written over the start of a target, a MOV R11 along with a JMP R11 for a hook
+ * out of reach. A JMP rel32 of 5 bytes is written instead when the hook, or a trampoline to relay
+ * through, is within reach. */
+#define VMHOOK_PATCH_SIZE 13
+
+/* Pages a hook can be on, the instructions it covers can carry on past the end of the first. */
+#define VMHOOK_MAX_PAGES 2
+
 /******************** Public Typedefs ********************/
 
+/* Hook installed on a target, as returned by VMHook_query. */
+typedef struct _VMHOOK_INFORMATION
+{
+	PVOID target;
+	PVOID hook;
+	PVOID trampoline;	/* Calls the original target. */
+} VMHOOK_INFORMATION, *PVMHOOK_INFORMATION;
+
 /******************** Public Constants ********************/
 
 /******************** Public Variables ********************/
 
 /******************** Public Prototypes ********************/
-NTSTATUS VMHook_init(PEPT_CONFIG eptConfig);
-void VMHook_queueHook(PVOID targetFunction, PVOID hookFunction, PVOID* origFunction);
+void VMHook_beginLaunch(void);
+void VMHook_endLaunch(BOOLEAN launched);
+NTSTATUS VMHook_init(PEPT_CONFIG eptConfig, ULONG processorIndex);
+NTSTATUS VMHook_install(PVOID targetFunction, PVOID hookFunction, PVOID* origFunction);
+NTSTATUS VMHook_installChained(PVOID targetFunction, PVOID stubFunction, PVOID* origFunction);
+NTSTATUS VMHook_remove(PVOID targetFunction);
+NTSTATUS VMHook_query(PVOID targetFunction, PVMHOOK_INFORMATION information);
+SIZE_T VMHook_getCount(void);
@@ -0,0 +1,87 @@
+; Dispatches calls to chained targets through their handlers, see VMHookChain.c.
+
+include ksamd64.inc
+
+	extern VMHookChain_enter:proc
+	extern VMHookChain_leave:proc
+
+; Layout of the stack below the saved RBP.
+CHAIN_ARGUMENTS			equ 20h		; Stack arguments copied for the original, after its home space.
+CHAIN_ARGUMENT_COUNT	equ 8		; VMHOOK_STACK_ARGUMENTS
+CHAIN_FRAME				equ 60h		; CHAIN_FRAME, CHAIN_FRAME_SIZE bytes.
+CHAIN_XMM				equ 0B0h	; XMM0 to XMM3.
+CHAIN_LOCALS			equ 0F0h
+
+; Stack arguments of the caller, above the saved RBP, the return address and the home space.
+CALLER_ARGUMENTS		equ 30h
+
+; Offsets within CHAIN_FRAME, checked by VMHookChain.c.
+FRAME_RCX				equ CHAIN_FRAME + 00h
+FRAME_RDX				equ CHAIN_FRAME + 08h
+FRAME_R8				equ CHAIN_FRAME + 10h
+FRAME_R9				equ CHAIN_FRAME + 18h
+FRAME_CALLER_STACK		equ CHAIN_FRAME + 20h
+FRAME_RETURN_VALUE		equ CHAIN_FRAME + 28h
+FRAME_CHAIN				equ CHAIN_FRAME + 38h
+
+	; Jumped to by the stub of a target with RAX holding its chain, the stack is as the caller
+	; left it. The pre handlers are called, then the original unless one of them skipped it,
+	; then the post handlers, and whatever is in returnValue is returned to the caller.
+	NESTED_ENTRY VMHookChain_dispatch, _TEXT$00
+		push_reg	rbp
+		set_frame	rbp, 0
+		alloc_stack	CHAIN_LOCALS
+		END_PROLOGUE
+
+		mov		FRAME_RCX[rsp], rcx
+		mov		FRAME_RDX[rsp], rdx
+		mov		FRAME_R8[rsp], r8
+		mov		FRAME_R9[rsp], r9
+		lea		r10, 8[rbp]
+		mov		FRAME_CALLER_STACK[rsp], r10
+		mov		FRAME_CHAIN[rsp], rax
+
+		; Floating point arguments are passed through to the original untouched.
+		movaps	(CHAIN_XMM + 00h)[rsp], xmm0
+		movaps	(CHAIN_XMM + 10h)[rsp], xmm1
+		movaps	(CHAIN_XMM + 20h)[rsp], xmm2
+		movaps	(CHAIN_XMM + 30h)[rsp], xmm3
+
+		lea		rcx, CHAIN_FRAME[rsp]
+		call	VMHookChain_enter
+		test	rax, rax
+		jz		ChainLeave
+		mov		r10, rax
+
+		; Copied after the pre handlers, which may have changed them through callerStack. The
+		; number the target takes isn't known, so VMHOOK_STACK_ARGUMENTS are always copied.
+		ARGUMENT = 0
+		REPT CHAIN_ARGUMENT_COUNT
+		mov		r11, (CALLER_ARGUMENTS + ARGUMENT * 8)[rbp]
+		mov		(CHAIN_ARGUMENTS + ARGUMENT * 8)[rsp], r11
+		ARGUMENT = ARGUMENT + 1
+		ENDM
+
+		movaps	xmm0, (CHAIN_XMM + 00h)[rsp]
+		movaps	xmm1, (CHAIN_XMM + 10h)[rsp]
+		movaps	xmm2, (CHAIN_XMM + 20h)[rsp]
+		movaps	xmm3, (CHAIN_XMM + 30h)[rsp]
+		mov		rcx, FRAME_RCX[rsp]
+		mov		rdx, FRAME_RDX[rsp]
+		mov		r8, FRAME_R8[rsp]
+		mov		r9, FRAME_R9[rsp]
+		call	r10
+		mov		FRAME_RETURN_VALUE[rsp], rax
+
+ChainLeave:
+		lea		rcx, CHAIN_FRAME[rsp]
+		call	VMHookChain_leave
+		mov		rax, FRAME_RETURN_VALUE[rsp]
+
+		BEGIN_EPILOGUE
+		lea		rsp, [rbp]
+		pop		rbp
+		ret
+	NESTED_END VMHookChain_dispatch, _TEXT$00
+
+	end
@@ -0,0 +1,499 @@
+#include <ntifs.h>
+#include "VMHookChain.h"
+#include "VMHook.h"
+#include "Trampoline.h"
+#include "Relocate.h"
+#include "Debug.h"
+
+/******************** External API ********************/
+
+/* Entered from the stub of every chained target with RAX holding its chain, see VMHookChain.asm. */
+void VMHookChain_dispatch(void);
+
+/******************** Module Typedefs ********************/
+
+/* Calls to a chain in progress on a logical processor that were started with each of its
+ * handler slots. A call can finish on another processor, so it keeps hold of the one it
+ * started on. */
+typedef struct _CHAIN_READERS
+{
+	volatile LONG counts[2];
+	UINT8 padding[SYSTEM_CACHE_ALIGNMENT_SIZE - (2 * sizeof(LONG))];
+} CHAIN_READERS, *PCHAIN_READERS;
+
+/* Handlers of a chain in the order they are called, never changed once published. */
+typedef struct _CHAIN_HANDLER
+{
+	VMHOOK_HANDLER preHandler;
+	VMHOOK_HANDLER postHandler;
+	PVOID context;
+} CHAIN_HANDLER, *PCHAIN_HANDLER;
+
+typedef struct _CHAIN_HANDLERS
+{
+	ULONG count;
+	CHAIN_HANDLER handlers[1];
+} CHAIN_HANDLERS, *PCHAIN_HANDLERS;
+
+/* Every target with handlers has a chain, which is hooked to a stub of its own. Once hooked,
+ * a chain is never removed, so handlers can come and go without the target being patched again. */
+typedef struct _HOOK_CHAIN
+{
+	LIST_ENTRY listEntry;
+
+	PVOID target;
+	PVOID original;		/* Trampoline to the original target. */
+	PUINT8 stub;
+
+	/* Serialises updates of this chain, which wait on the calls using its previous handlers.
+	 * Guards the registrations, ordered by their order. */
+	EX_PUSH_LOCK updateLock;
+	LIST_ENTRY registrationList;
+	ULONG registrationCount;
+
+	/* Handlers are double buffered, the inactive slot is only ever NULL or on its way out. */
+	PCHAIN_HANDLERS volatile handlerSlots[2];
+	volatile LONG activeSlot;
+
+	ULONG readerCount;
+	PCHAIN_READERS readers;
+} HOOK_CHAIN, *PHOOK_CHAIN;
+
+typedef struct _VMHOOK_REGISTRATION
+{
+	LIST_ENTRY listEntry;
+	PHOOK_CHAIN chain;
+
+	VMHOOK_HANDLER preHandler;
+	VMHOOK_HANDLER postHandler;
+	PVOID context;
+	LONG order;
+} VMHOOK_REGISTRATION;
+
+/* A call in progress, built by VMHookChain_dispatch within its own stack frame. */
+typedef struct _CHAIN_FRAME
+{
+	VMHOOK_CALL call;
+	PHOOK_CHAIN chain;
+
+	/* Set on entry, the handlers called and the reader count held until the call is left. */
+	const CHAIN_HANDLERS* handlers;
+	volatile LONG* readerCount;
+} CHAIN_FRAME, *PCHAIN_FRAME;
+
+/******************** Module Constants ********************/
+
+#define CHAIN_POOL_TAG 'chVH'
+
+/* MOV RAX, imm64 */
+#define CHAIN_STUB_LOAD_SIZE 10
+#define CHAIN_STUB_SIZE (CHAIN_STUB_LOAD_SIZE + RELOCATE_MAX_JUMP_SIZE)
+
+/* How often an update checks whether the calls using the previous handlers have finished. */
+#define CHAIN_WAIT_INTERVAL_MS 1
+
+/* Offsets and size VMHookChain.asm has been written for. */
+#define CHAIN_FRAME_SIZE 0x50
+
+C_ASSERT(FIELD_OFFSET(CHAIN_FRAME, call.arguments) == 0x00);
+C_ASSERT(FIELD_OFFSET(CHAIN_FRAME, call.callerStack) == 0x20);
+C_ASSERT(FIELD_OFFSET(CHAIN_FRAME, call.returnValue) == 0x28);
+C_ASSERT(FIELD_OFFSET(CHAIN_FRAME, chain) == 0x38);
+C_ASSERT(sizeof(CHAIN_FRAME) <= CHAIN_FRAME_SIZE);
+C_ASSERT(VMHOOK_STACK_ARGUMENTS == 8);
+C_ASSERT(sizeof(CHAIN_READERS) == SYSTEM_CACHE_ALIGNMENT_SIZE);
+C_ASSERT(CHAIN_STUB_SIZE <= TRAMPOLINE_SLOT_SIZE);
+
+/******************** Module Variables ********************/
+
+/* Every chain, guarded by the chain lock. It is only held to find or create a chain, never
+ * whilst an update waits, so a slow call to one target doesn't hold up the others. Calls to a
+ * chained target never touch it. */
+static LIST_ENTRY chainList = { &chainList, &chainList };
+static EX_PUSH_LOCK chainLock;
+
+/******************** Module Prototypes ********************/
+PVOID VMHookChain_enter(PCHAIN_FRAME frame);
+void VMHookChain_leave(PCHAIN_FRAME frame);
+
+static NTSTATUS createChain(PVOID targetFunction, PHOOK_CHAIN* chain);
+static PHOOK_CHAIN findChain(PVOID targetFunction);
+static void insertRegistration(PHOOK_CHAIN chain, PVMHOOK_REGISTRATION registration);
+static NTSTATUS publishHandlers(PHOOK_CHAIN chain);
+static void waitForReaders(PHOOK_CHAIN chain, LONG slot);
+
+/******************** Public Code ********************/
+
+NTSTATUS VMHookChain_register(PVOID targetFunction, VMHOOK_HANDLER preHandler, VMHOOK_HANDLER postHandler, PVOID context,
+							  LONG order, PVMHOOK_REGISTRATION* registration)
+{
+	/* Called at PASSIVE_LEVEL. The target is hooked by its first registration, later ones only
+	 * publish a new list of handlers. Pre handlers are called lowest order first and post handlers
+	 * in the reverse order, handlers of the same order in the order they were registered.
+	 * The target must take no more than 4 + VMHOOK_STACK_ARGUMENTS arguments. */
+	NTSTATUS status;
+
+	if ((NULL == targetFunction) || ((NULL == preHandler) && (NULL == postHandler)) || (NULL == registration))
+	{
+		status = STATUS_INVALID_PARAMETER;
+	}
+	else
+	{
+		PVMHOOK_REGISTRATION newRegistration = (PVMHOOK_REGISTRATION)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(VMHOOK_REGISTRATION),
+																							CHAIN_POOL_TAG);
+		if (NULL != newRegistration)
+		{
+			PHOOK_CHAIN chain;
+
+			RtlZeroMemory(newRegistration, sizeof(VMHOOK_REGISTRATION));
+			newRegistration->preHandler = preHandler;
+			newRegistration->postHandler = postHandler;
+			newRegistration->context = context;
+			newRegistration->order = order;
+
+			KeEnterCriticalRegion();
+			ExAcquirePushLockExclusive(&chainLock);
+
+			chain = findChain(targetFunction);
+			if (NULL != chain)
+			{
+				status = STATUS_SUCCESS;
+			}
+			else
+			{
+				status = createChain(targetFunction, &chain);
+			}
+
+			ExReleasePushLockExclusive(&chainLock);
+
+			/* Chains are never freed, so it can be used once the chain lock has been released. */
+			if (NT_SUCCESS(status))
+			{
+				ExAcquirePushLockExclusive(&chain->updateLock);
+
+				insertRegistration(chain, newRegistration);
+
+				status = publishHandlers(chain);
+				if (FALSE == NT_SUCCESS(status))
+				{
+					RemoveEntryList(&newRegistration->listEntry);
+					chain->registrationCount--;
+				}
+
+				ExReleasePushLockExclusive(&chain->updateLock);
+			}
+
+			KeLeaveCriticalRegion();
+
+			if (NT_SUCCESS(status))
+			{
+				*registration = newRegistration;
+			}
+			else
+			{
+				ExFreePoolWithTag(newRegistration, CHAIN_POOL_TAG);
+			}
+		}
+		else
+		{
+			status = STATUS_NO_MEMORY;
+		}
+	}
+
+	return status;
+}
+
+NTSTATUS VMHookChain_unregister(PVMHOOK_REGISTRATION registration)
+{
+	/* Called at PASSIVE_LEVEL, waits for every call that could still reach the handlers to finish,
+	 * so once this returns neither handler will be called again and their context can be freed.
+	 * The target stays hooked, with no handlers left it calls straight through to the original. */
+	NTSTATUS status;
+
+	if (NULL != registration)
+	{
+		PHOOK_CHAIN chain = registration->chain;
+
+		KeEnterCriticalRegion();
+		ExAcquirePushLockExclusive(&chain->updateLock);
+
+		RemoveEntryList(&registration->listEntry);
+		chain->registrationCount--;
+
+		status = publishHandlers(chain);
+		if (FALSE == NT_SUCCESS(status))
+		{
+			/* Handlers are still being called, so it has to stay registered. */
+			insertRegistration(chain, registration);
+		}
+
+		ExReleasePushLockExclusive(&chain->updateLock);
+		KeLeaveCriticalRegion();
+
+		if (NT_SUCCESS(status))
+		{
+			ExFreePoolWithTag(registration, CHAIN_POOL_TAG);
+		}
+	}
+	else
+	{
+		status = STATUS_INVALID_PARAMETER;
+	}
+
+	return status;
+}
+
+PVOID VMHookChain_enter(PCHAIN_FRAME frame)
+{
+	/* Called by VMHookChain_dispatch at the IRQL the target was called at, with the arguments
+	 * already in the frame. Returns the original to call, or NULL when a handler skipped it. */
+	PVOID result;
+
+	PHOOK_CHAIN chain = frame->chain;
+	PCHAIN_READERS readers = &chain->readers[KeGetCurrentProcessorIndex() % chain->readerCount];
+
+	/* Claim the slot, then check it is still the active one. Otherwise an update may already be
+	 * waiting to free its handlers, in which case use the new one. */
+	LONG slot = chain->activeSlot;
+	for (;;)
+	{
+		InterlockedIncrement(&readers->counts[slot]);
+
+		LONG currentSlot = chain->activeSlot;
+		if (currentSlot == slot)
+		{
+			break;
+		}
+
+		InterlockedDecrement(&readers->counts[slot]);
+		slot = currentSlot;
+	}
+
+	frame->handlers = chain->handlerSlots[slot];
+	frame->readerCount = &readers->counts[slot];
+	frame->call.returnValue = 0;
+	frame->call.skipOriginal = FALSE;
+
+	if (NULL != frame->handlers)
+	{
+		for (ULONG i = 0; i < frame->handlers->count; i++)
+		{
+			const CHAIN_HANDLER* handler = &frame->handlers->handlers[i];
+
+			if (NULL != handler->preHandler)
+			{
+				handler->preHandler(&frame->call, handler->context);
+			}
+		}
+	}
+
+	result = (TRUE == frame->call.skipOriginal) ? NULL : chain->original;
+
+	return result;
+}
+
+void VMHookChain_leave(PCHAIN_FRAME frame)
+{
+	/* Called by VMHookChain_dispatch once the original has returned, or was skipped. The
+	 * handlers are released last, they can be freed as soon as they are. */
+	if (NULL != frame->handlers)
+	{
+		for (ULONG i = frame->handlers->count; i > 0; i--)
+		{
+			const CHAIN_HANDLER* handler = &frame->handlers->handlers[i - 1];
+
+			if (NULL != handler->postHandler)
+			{
+				handler->postHandler(&frame->call, handler->context);
+			}
+		}
+	}
+
+	InterlockedDecrement(frame->readerCount);
+}
+
+/******************** Module Code ********************/
+
+static NTSTATUS createChain(PVOID targetFunction, PHOOK_CHAIN* chain)
+{
+	/* Hooks the target to a stub of its own, which loads the chain and enters the dispatcher.
+	 * The chain starts without handlers, so calls go straight through to the original. */
+	NTSTATUS status;
+
+	ULONG readerCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	PHOOK_CHAIN newChain = (PHOOK_CHAIN)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(HOOK_CHAIN), CHAIN_POOL_TAG);
+	PCHAIN_READERS readers = (PCHAIN_READERS)ExAllocatePoolWithTag(NonPagedPoolNx, readerCount * sizeof(CHAIN_READERS),
+																   CHAIN_POOL_TAG);
+	PUINT8 stub = Trampoline_allocate(targetFunction, CHAIN_STUB_SIZE);
+
+	if ((NULL != newChain) && (NULL != readers) && (NULL != stub))
+	{
+		RtlZeroMemory(newChain, sizeof(HOOK_CHAIN));
+		RtlZeroMemory(readers, readerCount * sizeof(CHAIN_READERS));
+
+		newChain->target = targetFunction;
+		newChain->stub = stub;
+		newChain->readerCount = readerCount;
+		newChain->readers = readers;
+		ExInitializePushLock(&newChain->updateLock);
+		InitializeListHead(&newChain->registrationList);
+
+		UINT8 code[CHAIN_STUB_SIZE];
+		code[0] = 0x48;
+		code[1] = 0xB8;
+		*(PVOID*)&code[2] = newChain;
+		SIZE_T stubSize = CHAIN_STUB_LOAD_SIZE +
+			Relocate_writeJump(&code[CHAIN_STUB_LOAD_SIZE], (UINT64)&stub[CHAIN_STUB_LOAD_SIZE], (UINT64)VMHookChain_dispatch);
+
+		status = Trampoline_write(stub, code, stubSize);
+		if (NT_SUCCESS(status))
+		{
+			/* The original is written before the hook can be hit, so the stub never sees it unset. */
+			status = VMHook_installChained(targetFunction, stub, &newChain->original);
+		}
+
+		if (NT_SUCCESS(status))
+		{
+			InsertTailList(&chainList, &newChain->listEntry);
+			*chain = newChain;
+		}
+		else
+		{
+			DEBUG_ERROR("[VMHookChain] Unable to hook 0x%p: 0x%X\n", targetFunction, status);
+		}
+	}
+	else
+	{
+		status = STATUS_NO_MEMORY;
+	}
+
+	if (FALSE == NT_SUCCESS(status))
+	{
+		if (NULL != stub)
+		{
+			Trampoline_free(stub, CHAIN_STUB_SIZE);
+		}
+
+		if (NULL != readers)
+		{
+			ExFreePoolWithTag(readers, CHAIN_POOL_TAG);
+		}
+
+		if (NULL != newChain)
+		{
+			ExFreePoolWithTag(newChain, CHAIN_POOL_TAG);
+		}
+	}
+
+	return status;
+}
+
+static PHOOK_CHAIN findChain(PVOID targetFunction)
+{
+	PHOOK_CHAIN result = NULL;
+
+	for (PLIST_ENTRY currentEntry = chainList.Flink;
+		(NULL == result) && (currentEntry != &chainList);
+		currentEntry = currentEntry->Flink)
+	{
+		PHOOK_CHAIN current = CONTAINING_RECORD(currentEntry, HOOK_CHAIN, listEntry);
+
+		if (current->target == targetFunction)
+		{
+			result = current;
+		}
+	}
+
+	return result;
+}
+
+static void insertRegistration(PHOOK_CHAIN chain, PVMHOOK_REGISTRATION registration)
+{
+	/* After every registration of the same or a lower order. */
+	PLIST_ENTRY position = chain->registrationList.Flink;
+
+	while ((position != &chain->registrationList) &&
+		(CONTAINING_RECORD(position, VMHOOK_REGISTRATION, listEntry)->order <= registration->order))
+	{
+		position = position->Flink;
+	}
+
+	InsertTailList(position, &registration->listEntry);
+	registration->chain = chain;
+	chain->registrationCount++;
+}
+
+static NTSTATUS publishHandlers(PHOOK_CHAIN chain)
+{
+	/* Called with the update lock of the chain held. The handlers are copied out of the registrations into the
+	 * inactive slot, which is then made active, and the previous handlers are freed once every
+	 * call started with them has left. */
+	NTSTATUS status = STATUS_SUCCESS;
+	PCHAIN_HANDLERS newHandlers = NULL;
+
+	if (0 != chain->registrationCount)
+	{
+		newHandlers = (PCHAIN_HANDLERS)ExAllocatePoolWithTag(NonPagedPoolNx,
+															 FIELD_OFFSET(CHAIN_HANDLERS, handlers[chain->registrationCount]),
+															 CHAIN_POOL_TAG);
+		if (NULL != newHandlers)
+		{
+			ULONG index = 0;
+
+			for (PLIST_ENTRY currentEntry = chain->registrationList.Flink;
+				currentEntry != &chain->registrationList;
+				currentEntry = currentEntry->Flink)
+			{
+				PVMHOOK_REGISTRATION current = CONTAINING_RECORD(currentEntry, VMHOOK_REGISTRATION, listEntry);
+
+				newHandlers->handlers[index].preHandler = current->preHandler;
+				newHandlers->handlers[index].postHandler = current->postHandler;
+				newHandlers->handlers[index].context = current->context;
+				index++;
+			}
+
+			newHandlers->count = index;
+		}
+		else
+		{
+			status = STATUS_NO_MEMORY;
+		}
+	}
+
+	if (NT_SUCCESS(status))
+	{
+		LONG oldSlot = chain->activeSlot;
+		LONG newSlot = (0 == oldSlot) ? 1 : 0;
+
+		chain->handlerSlots[newSlot] = newHandlers;
+		InterlockedExchange(&chain->activeSlot, newSlot);
+
+		/* A call claiming the old slot from here on sees it is no longer active and moves on
+		 * without reading it, so only those that already had it need to be waited for. */
+		waitForReaders(chain, oldSlot);
+
+		if (NULL != chain->handlerSlots[oldSlot])
+		{
+			ExFreePoolWithTag(chain->handlerSlots[oldSlot], CHAIN_POOL_TAG);
+			chain->handlerSlots[oldSlot] = NULL;
+		}
+	}
+
+	return status;
+}
+
+static void waitForReaders(PHOOK_CHAIN chain, LONG slot)
+{
+	/* A call holds its slot for as long as the original takes, which can block, so this sleeps
+	 * rather than spins. */
+	LARGE_INTEGER waitInterval;
+	waitInterval.QuadPart = -10000LL * CHAIN_WAIT_INTERVAL_MS;
+
+	for (ULONG i = 0; i < chain->readerCount; i++)
+	{
+		while (0 != chain->readers[i].counts[slot])
+		{
+			KeDelayExecutionThread(KernelMode, FALSE, &waitInterval);
+		}
+	}
+}
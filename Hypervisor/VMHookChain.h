@@ -0,0 +1,46 @@
+#pragma once
+#include <wdm.h>
+
+/******************** Public Defines ********************/
+
+/* Arguments passed on the stack, after the four in registers, that are copied when the original
+ * is called. The dispatcher can't know how many a target takes, so it always copies this many
+ * slots from the caller's stack. Those past the target's own arguments are just the caller's
+ * frame and are ignored. Any further arguments are not seen by the original, so a target taking
+ * more than 12 arguments in all can't be chained. */
+#define VMHOOK_STACK_ARGUMENTS 8
+
+/******************** Public Typedefs ********************/
+
+/* A call to a chained target, as seen by its handlers. Pre handlers can change the arguments
+ * before the original sees them, post handlers can change the value it returned. */
+typedef struct _VMHOOK_CALL
+{
+	UINT64 arguments[4];	/* RCX, RDX, R8 and R9. */
+
+	/* Stack of the caller as the target was entered, [0] is the return address and the
+	 * arguments after the first four start at [5]. */
+	PUINT64 callerStack;
+
+	/* Integer value returned to the caller, floating point results are not supported. */
+	UINT64 returnValue;
+
+	/* Set by a pre handler for the original not to be called, returnValue is returned instead.
+	 * The remaining pre handlers and every post handler are still called. */
+	BOOLEAN skipOriginal;
+} VMHOOK_CALL, *PVMHOOK_CALL;
+
+/* Called at whatever IRQL the target is called at, so it has to be safe there. It must not
+ * register or unregister handlers of the same target. */
+typedef void (*VMHOOK_HANDLER)(PVMHOOK_CALL call, PVOID context);
+
+typedef struct _VMHOOK_REGISTRATION* PVMHOOK_REGISTRATION;
+
+/******************** Public Constants ********************/
+
+/******************** Public Variables ********************/
+
+/******************** Public Prototypes ********************/
+NTSTATUS VMHookChain_register(PVOID targetFunction, VMHOOK_HANDLER preHandler, VMHOOK_HANDLER postHandler, PVOID context,
+							  LONG order, PVMHOOK_REGISTRATION* registration);
+NTSTATUS VMHookChain_unregister(PVMHOOK_REGISTRATION registration);
@@ -6,6 +6,7 @@
 #include "GDT.h"
 #include "MemManage.h"
 #include "HandlerShim.h"
+#include "FlightRecorder.h"
 #include "Debug.h"
 #include "ia32.h"
 
@@ -87,17 +88,32 @@ static NTSTATUS launchVMMOnProcessor(PVMM_DATA lpData)
 	status = MemManage_init(&lpData->mmContext, lpData->hostCR3);
 	if (NT_SUCCESS(status))
 	{
+		/* Build the CPUID cache for this processor, so CPUID exits don't need to execute CPUID. */
+		CPUID_initialise(&lpData->cpuidCache);
+
+		/* Initialise the timer wheel, this records the preemption timer capabilities it relies on. */
+		Scheduler_initialise(&lpData->schedulerConfig, lpData->msrData[5].QuadPart, lpData->msrData[13]);
+
+		/* Initialise the sampling profiler, which takes its samples from a scheduler timer. */
+		Profiler_initialise(&lpData->profilerConfig, lpData->processorIndex);
+
+		/* Start recording the exits of this processor. */
+		FlightRecorder_initialise(lpData->processorIndex);
+
 		/* Initialise the MTF structure. */
 		MTF_initialise(&lpData->mtfConfig);
 
 		/* Initialise EPT structure. */
 		EPT_initialise(&lpData->eptConfig, (const PMTRR_RANGE)&lpData->mtrrTable);
 
-		/* Initialise all of the pending hooks. */
-		VMHook_init(&lpData->eptConfig);
+		/* Apply every hook installed so far to this processor, it isn't launched without them. */
+		status = VMHook_init(&lpData->eptConfig, lpData->processorIndex);
 
-		/* Attempt to enter VMX root. */
-		status = enterRootMode(lpData);
+		if (NT_SUCCESS(status))
+		{
+			/* Attempt to enter VMX root. */
+			status = enterRootMode(lpData);
+		}
 
 		if (NT_SUCCESS(status))
 		{
@@ -266,8 +282,12 @@ static void setupVMCS(PVMM_DATA lpData)
 
 	__vmx_vmwrite(VMCS_CTRL_PROCESSOR_BASED_VM_EXECUTION_CONTROLS, adjustedMSR);
 
-	/* Make sure to enter us in x64 mode at all times.*/
-	adjustedMSR = MSR_adjustMSR(lpData->msrData[15], IA32_VMX_EXIT_CTLS_HOST_ADDRESS_SPACE_SIZE_FLAG);
+	/* Make sure to enter us in x64 mode at all times.
+	 * The preemption timer value is saved on exit so that whilst the scheduler has it armed,
+	 * exits for other reasons don't restart the countdown to the next deadline. */
+	adjustedMSR = MSR_adjustMSR(lpData->msrData[15],
+		IA32_VMX_EXIT_CTLS_HOST_ADDRESS_SPACE_SIZE_FLAG |
+		IA32_VMX_EXIT_CTLS_SAVE_VMX_PREEMPTION_TIMER_VALUE_FLAG);
 	__vmx_vmwrite(VMCS_CTRL_VMEXIT_CONTROLS, adjustedMSR);
 
 	/* As we exit back into the guest, make sure to exist in x64 mode as well. */
@@ -4,6 +4,14 @@
 #include "EPT.h"
 #include "MTF.h"
 #include "MemManage.h"
+#include "CPUID.h"
+#include "Scheduler.h"
+#include "Profiler.h"
+
+/******************** Public Defines ********************/
+
+/* Maximum number of logical processors that can be virtualised. */
+#define MAX_LOGICAL_PROCESSORS 64
 
 /******************** Public Typedefs ********************/
 
@@ -43,12 +51,16 @@ typedef struct _VMM_DATA
 
 	MM_CONTEXT mmContext;
 	ULONG processorIndex;
+	UINT64 exitCount;
 	CR3 hostCR3;
 	CONTROL_REGISTERS controlRegisters;
 	CONTEXT hostContext;
 	CONTEXT guestContext;
 	LARGE_INTEGER msrData[17];
 	MTRR_RANGE mtrrTable[IA32_MTRR_VARIABLE_COUNT];
+	CPUID_CACHE cpuidCache;
+	SCHEDULER_CONFIG schedulerConfig;
+	PROFILER_CONFIG profilerConfig;
 	UINT32 eptControls;
 } VMM_DATA, *PVMM_DATA;
 
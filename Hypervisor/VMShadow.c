@@ -11,11 +11,9 @@
 
 /******************** Module Typedefs ********************/
 
-/* Structure that will hold the shadow configuration for hiding executable pages. */
+/* Structure that will hold the shadow configuration for hiding an executable page within an EPT. */
 typedef struct _SHADOW_PAGE
 {
-	DECLSPEC_ALIGN(PAGE_SIZE) UINT8 executePage[PAGE_SIZE];
-
 	/* Target process that will be hooked, NULL if global. */
 	CR3 targetCR3;
 
@@ -29,8 +27,32 @@ typedef struct _SHADOW_PAGE
 	EPT_PML1_ENTRY activeExecNotTargetPML1E;
 	EPT_PML1_ENTRY activeRWPML1E;
 
+	/* Violation handler of the page, registered with the EPT whilst the page is hidden. */
+	EPT_HANDLER handler;
+
 } SHADOW_PAGE, * PSHADOW_PAGE;
 
+/* A page hidden within a single process, on the processor that asked for it. */
+typedef struct _SHADOW_PROCESS_PAGE
+{
+	DECLSPEC_ALIGN(PAGE_SIZE) UINT8 executePage[PAGE_SIZE];
+
+	SHADOW_PAGE shadow;
+} SHADOW_PROCESS_PAGE, *PSHADOW_PROCESS_PAGE;
+
+/* A page hidden on every logical processor, they all execute the same copy of it.
+ * Everything each processor needs is allocated up front, so it can be applied from VMX root. */
+struct _SHADOW_GLOBAL_PAGE
+{
+	DECLSPEC_ALIGN(PAGE_SIZE) UINT8 executePage[PAGE_SIZE];
+
+	PHYSICAL_ADDRESS targetPA;
+
+	/* Shadow within the EPT of each processor, only valid once it has been applied there. */
+	SHADOW_PAGE shadows[MAX_LOGICAL_PROCESSORS];
+	BOOLEAN applied[MAX_LOGICAL_PROCESSORS];
+};
+
 /******************** Module Constants ********************/
 
 
@@ -40,6 +62,8 @@ typedef struct _SHADOW_PAGE
 /******************** Module Prototypes ********************/
 static BOOLEAN handleShadowExec(PEPT_CONFIG eptConfig, PCONTEXT guestContext, PVOID userBuffer);
 static NTSTATUS hidePage(PEPT_CONFIG eptConfig, CR3 targetCR3, PHYSICAL_ADDRESS targetPA, PVOID executePage);
+static NTSTATUS initialiseShadow(PEPT_CONFIG eptConfig, PSHADOW_PAGE shadowConfig, CR3 targetCR3, PHYSICAL_ADDRESS targetPA,
+								 PUINT8 executePage);
 static void setAllShadowsToReadWrite(PEPT_CONFIG eptConfig);
 
 /******************** Public Code ********************/
@@ -101,42 +125,122 @@ BOOLEAN VMShadow_handleMovCR(PVMM_DATA lpData)
 	return TRUE;
 }
 
-NTSTATUS VMShadow_hidePageGlobally(
-	PEPT_CONFIG eptConfig,
-	PHYSICAL_ADDRESS targetPA,
-	PUINT8 payloadPage,
-	BOOLEAN hypervisorRunning
-)
+NTSTATUS VMShadow_createGlobalPage(PHYSICAL_ADDRESS targetPA, const UINT8* payloadPage, PSHADOW_GLOBAL_PAGE* globalPage)
 {
-	NTSTATUS status = STATUS_INVALID_PARAMETER;
+	/* Called at PASSIVE_LEVEL, the page isn't hidden anywhere until it is applied to the EPT of each processor. */
+	NTSTATUS status;
 
-	CR3 nullCR3 = { .Flags = 0 };
-	status = hidePage(eptConfig, nullCR3, targetPA, payloadPage);
+	*globalPage = NULL;
 
-	if (NT_SUCCESS(status) && (TRUE == hypervisorRunning))
+	if (0ULL != targetPA.QuadPart)
 	{
+		PSHADOW_GLOBAL_PAGE newPage = (PSHADOW_GLOBAL_PAGE)OsAllocateContiguousAlignedPages(NonPagedPool, sizeof(SHADOW_GLOBAL_PAGE));
 
+		if (NULL != newPage)
+		{
+			RtlZeroMemory(newPage, sizeof(SHADOW_GLOBAL_PAGE));
+			RtlCopyMemory(newPage->executePage, payloadPage, PAGE_SIZE);
+			newPage->targetPA.QuadPart = (LONGLONG)PAGE_ALIGN(targetPA.QuadPart);
 
-		/* We have modified EPT layout, therefore flush and reload. */
-		EPT_invalidateAndFlush(eptConfig);
+			*globalPage = newPage;
+			status = STATUS_SUCCESS;
+		}
+		else
+		{
+			status = STATUS_NO_MEMORY;
+		}
+	}
+	else
+	{
+		status = STATUS_INVALID_ADDRESS;
+	}
+
+	return status;
+}
+
+NTSTATUS VMShadow_reserveGlobalPages(ULONG pageCount)
+{
+	/* Called at PASSIVE_LEVEL before pages are applied. Each processor has an EPT of its own,
+	 * so every processor might have to split the large page holding each of the pages. */
+	ULONG processorCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+	return EPT_reserveSplits(pageCount * processorCount);
+}
+
+NTSTATUS VMShadow_applyGlobalPage(PSHADOW_GLOBAL_PAGE globalPage, PEPT_CONFIG eptConfig, ULONG processorIndex)
+{
+	/* Hides the page within the EPT of the processor, either whilst it is being launched or from
+	 * VMX root on that processor. The caller flushes the EPT once it has finished changing it. */
+	NTSTATUS status;
+
+	if (processorIndex < MAX_LOGICAL_PROCESSORS)
+	{
+		if (FALSE == globalPage->applied[processorIndex])
+		{
+			CR3 nullCR3 = { .Flags = 0 };
+
+			status = initialiseShadow(eptConfig, &globalPage->shadows[processorIndex], nullCR3, globalPage->targetPA,
+									  globalPage->executePage);
+			if (NT_SUCCESS(status))
+			{
+				globalPage->applied[processorIndex] = TRUE;
+			}
+		}
+		else
+		{
+			status = STATUS_ALREADY_COMPLETE;
+		}
+	}
+	else
+	{
+		status = STATUS_INVALID_PARAMETER;
 	}
 
 	return status;
 }
 
+void VMShadow_revokeGlobalPage(PSHADOW_GLOBAL_PAGE globalPage, PEPT_CONFIG eptConfig, ULONG processorIndex)
+{
+	/* Undoes VMShadow_applyGlobalPage from VMX root on the processor, the caller flushes the EPT. */
+	if ((processorIndex < MAX_LOGICAL_PROCESSORS) && (TRUE == globalPage->applied[processorIndex]))
+	{
+		PSHADOW_PAGE shadowPage = &globalPage->shadows[processorIndex];
+
+		shadowPage->targetPML1E->Flags = shadowPage->originalPML1E.Flags;
+		EPT_removeViolationHandler(eptConfig, &shadowPage->handler);
+
+		globalPage->applied[processorIndex] = FALSE;
+	}
+}
+
+void VMShadow_writeGlobalPage(PSHADOW_GLOBAL_PAGE globalPage, SIZE_T offset, const UINT8* buffer, SIZE_T size)
+{
+	/* Changes the page every processor executes in place, so no EPT entry has to change. The caller
+	 * makes sure no processor can be executing the bytes whilst they are written. */
+	if ((offset < PAGE_SIZE) && (size <= (PAGE_SIZE - offset)))
+	{
+		RtlCopyMemory(&globalPage->executePage[offset], buffer, size);
+	}
+}
+
+void VMShadow_freeGlobalPage(PSHADOW_GLOBAL_PAGE globalPage)
+{
+	/* Only once it has been revoked from every processor, and their EPT flushed. */
+	MmFreeContiguousMemory(globalPage);
+}
 
 
 NTSTATUS VMShadow_hideExecInProcess(
 	PVMM_DATA lpData,
-	PEPROCESS targetProcess,
+	CR3 tableBase,
 	PUINT8 targetVA,
 	PUINT8 execVA
 )
 {
 	NTSTATUS status = STATUS_UNSUCCESSFUL;
 
-	/* Get the process/page table we want to shadow the memory from. */
-	CR3 tableBase = MemManage_getPageTableBase(targetProcess);
+	/* The page table we want to shadow the memory from, this has to be looked up
+	 * from the process by the caller as that can't be done from VMX root. */
 	if (0 != tableBase.Flags)
 	{
 		/* Calculate the physical address of the target VA,
@@ -238,93 +342,103 @@ static NTSTATUS hidePage(PEPT_CONFIG eptConfig, CR3 targetCR3, PHYSICAL_ADDRESS
 
 	if (0ULL != targetPA.QuadPart)
 	{
-		PSHADOW_PAGE shadowConfig = (PSHADOW_PAGE)OsAllocateContiguousAlignedPages(NonPagedPool, sizeof(SHADOW_PAGE));
+		PSHADOW_PROCESS_PAGE processPage = (PSHADOW_PROCESS_PAGE)OsAllocateContiguousAlignedPages(NonPagedPool, sizeof(SHADOW_PROCESS_PAGE));
 
-		if (NULL != shadowConfig)
+		if (NULL != processPage)
 		{
-			/* As we have set up PDT to 2MB large pages we need to split this for performance.
-			* The lowest we can split it to is the size of a page, 2MB = 512 * 4096 blocks. */
-			status = EPT_splitLargePage(eptConfig, targetPA);
+			/* Copy the fake bytes */
+			RtlCopyMemory(&processPage->executePage[0], executePage, PAGE_SIZE);
 
-			/* If the page split was successful or was already split, continue. */
-			if (NT_SUCCESS(status) || (STATUS_ALREADY_COMPLETE == status))
+			status = initialiseShadow(eptConfig, &processPage->shadow, targetCR3, targetPA, processPage->executePage);
+			if (FALSE == NT_SUCCESS(status))
 			{
-				/* Zero the newly allocated page config. */
-				RtlZeroMemory(shadowConfig, sizeof(SHADOW_PAGE));
-
-				/* Calculate the start and end of the physical address page we are hooking. */
-				PHYSICAL_ADDRESS physStart;
-				PHYSICAL_ADDRESS physEnd;
-
-				physStart.QuadPart = (LONGLONG)PAGE_ALIGN(targetPA.QuadPart);
-				physEnd.QuadPart = physStart.QuadPart + PAGE_SIZE;
-
-				/* Store the target process. */
-				shadowConfig->targetCR3 = targetCR3;
-
-
-				/* Store a pointer to the PML1E we will be modifying. */
-				shadowConfig->targetPML1E = EPT_getPML1EFromAddress(eptConfig, targetPA);
-
-				if (NULL != shadowConfig->targetPML1E)
-				{
-					/* Store a copy of the original */
-					shadowConfig->originalPML1E.Flags = shadowConfig->targetPML1E->Flags;
-
-					/* Create the executable PML1E when it IS the target process. */
-					shadowConfig->activeExecTargetPML1E.Flags = shadowConfig->targetPML1E->Flags;
-					shadowConfig->activeExecTargetPML1E.ReadAccess = 0;
-					shadowConfig->activeExecTargetPML1E.WriteAccess = 0;
-					shadowConfig->activeExecTargetPML1E.ExecuteAccess = 1;
-					shadowConfig->activeExecTargetPML1E.PageFrameNumber = MmGetPhysicalAddress(&shadowConfig->executePage).QuadPart / PAGE_SIZE;
+				MmFreeContiguousMemory(processPage);
+			}
+		}
+		else
+		{
+			status = STATUS_NO_MEMORY;
+		}
+	}
+	else
+	{
+		status = STATUS_INVALID_ADDRESS;
+	}
 
-					/* Create the executable PML1E when the it is NOT the target process.
-					 * Here we want to keep original flags and guest physical address, but just disable read/write. */
-					shadowConfig->activeExecNotTargetPML1E.Flags = shadowConfig->targetPML1E->Flags;
-					shadowConfig->activeExecNotTargetPML1E.ReadAccess = 0;
-					shadowConfig->activeExecNotTargetPML1E.WriteAccess = 0;
-					shadowConfig->activeExecNotTargetPML1E.ExecuteAccess = 1;
+	return status;
+}
 
-					/* Create the readwrite PML1E when ANY read write to the page takes place.
-					 * Here we want to keep original flags, however disable execute access. */
-					shadowConfig->activeRWPML1E.Flags = shadowConfig->targetPML1E->Flags;
-					shadowConfig->activeRWPML1E.ReadAccess = 1;
-					shadowConfig->activeRWPML1E.WriteAccess = 1;
-					shadowConfig->activeRWPML1E.ExecuteAccess = 0;
+static NTSTATUS initialiseShadow(PEPT_CONFIG eptConfig, PSHADOW_PAGE shadowConfig, CR3 targetCR3, PHYSICAL_ADDRESS targetPA,
+								 PUINT8 executePage)
+{
+	/* As we have set up PDT to 2MB large pages we need to split this for performance.
+	* The lowest we can split it to is the size of a page, 2MB = 512 * 4096 blocks. */
+	NTSTATUS status = EPT_splitLargePage(eptConfig, targetPA);
 
-					/* Set the actual PML1E to the value of the readWrite. */
-					shadowConfig->targetPML1E->Flags = shadowConfig->activeRWPML1E.Flags;
+	/* If the page split was successful or was already split, continue. */
+	if (NT_SUCCESS(status) || (STATUS_ALREADY_COMPLETE == status))
+	{
+		/* Zero the page config. */
+		RtlZeroMemory(shadowConfig, sizeof(SHADOW_PAGE));
 
-					/* Copy the fake bytes */
-					RtlCopyMemory(&shadowConfig->executePage[0], executePage, PAGE_SIZE);
+		/* Calculate the start and end of the physical address page we are hooking. */
+		PHYSICAL_ADDRESS physStart;
+		PHYSICAL_ADDRESS physEnd;
 
-					/* Calculate the range, that this handler will be for. */
+		physStart.QuadPart = (LONGLONG)PAGE_ALIGN(targetPA.QuadPart);
+		physEnd.QuadPart = physStart.QuadPart + PAGE_SIZE;
 
+		/* Store the target process. */
+		shadowConfig->targetCR3 = targetCR3;
 
-					PHYSICAL_RANGE handlerRange;
-					handlerRange.start = physStart;
-					handlerRange.end = physEnd;
+		/* Store a pointer to the PML1E we will be modifying. */
+		shadowConfig->targetPML1E = EPT_getPML1EFromAddress(eptConfig, targetPA);
 
-					/* Add this shadow hook to the EPT shadow list. */
-					status = EPT_addViolationHandler(eptConfig, handlerRange, handleShadowExec, (PVOID)shadowConfig);
-				}
-				else
-				{
-					/* Unable to find the PML1E for the target page. */
-					ExFreePool(shadowConfig);
-					status = STATUS_NO_SUCH_MEMBER;
-				}
-			}
+		if (NULL != shadowConfig->targetPML1E)
+		{
+			/* Store a copy of the original */
+			shadowConfig->originalPML1E.Flags = shadowConfig->targetPML1E->Flags;
+
+			/* Create the executable PML1E when it IS the target process. */
+			shadowConfig->activeExecTargetPML1E.Flags = shadowConfig->targetPML1E->Flags;
+			shadowConfig->activeExecTargetPML1E.ReadAccess = 0;
+			shadowConfig->activeExecTargetPML1E.WriteAccess = 0;
+			shadowConfig->activeExecTargetPML1E.ExecuteAccess = 1;
+			shadowConfig->activeExecTargetPML1E.PageFrameNumber = MmGetPhysicalAddress(executePage).QuadPart / PAGE_SIZE;
+
+			/* Create the executable PML1E when the it is NOT the target process.
+			 * Here we want to keep original flags and guest physical address, but just disable read/write. */
+			shadowConfig->activeExecNotTargetPML1E.Flags = shadowConfig->targetPML1E->Flags;
+			shadowConfig->activeExecNotTargetPML1E.ReadAccess = 0;
+			shadowConfig->activeExecNotTargetPML1E.WriteAccess = 0;
+			shadowConfig->activeExecNotTargetPML1E.ExecuteAccess = 1;
+
+			/* Create the readwrite PML1E when ANY read write to the page takes place.
+			 * Here we want to keep original flags, however disable execute access. */
+			shadowConfig->activeRWPML1E.Flags = shadowConfig->targetPML1E->Flags;
+			shadowConfig->activeRWPML1E.ReadAccess = 1;
+			shadowConfig->activeRWPML1E.WriteAccess = 1;
+			shadowConfig->activeRWPML1E.ExecuteAccess = 0;
+
+			/* Set the actual PML1E to the value of the readWrite. */
+			shadowConfig->targetPML1E->Flags = shadowConfig->activeRWPML1E.Flags;
+
+			/* Add this shadow hook to the EPT shadow list, the handler is part of the config
+			 * so nothing needs to be allocated. */
+			shadowConfig->handler.physRange.start = physStart;
+			shadowConfig->handler.physRange.end = physEnd;
+			shadowConfig->handler.callback = handleShadowExec;
+			shadowConfig->handler.userParameter = (PVOID)shadowConfig;
+
+			EPT_insertViolationHandler(eptConfig, &shadowConfig->handler);
+			status = STATUS_SUCCESS;
 		}
 		else
 		{
-			status = STATUS_NO_MEMORY;
+			/* Unable to find the PML1E for the target page. */
+			status = STATUS_NO_SUCH_MEMBER;
 		}
 	}
-	else
-	{
-		status = STATUS_INVALID_ADDRESS;
-	}
 
 	return status;
 }
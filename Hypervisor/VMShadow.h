@@ -7,6 +7,9 @@
 
 /******************** Public Typedefs ********************/
 
+/* A page hidden on every logical processor, opaque outside of VMShadow. */
+typedef struct _SHADOW_GLOBAL_PAGE SHADOW_GLOBAL_PAGE, *PSHADOW_GLOBAL_PAGE;
+
 /******************** Public Constants ********************/
 
 /******************** Public Variables ********************/
@@ -15,16 +18,16 @@
 
 BOOLEAN VMShadow_handleMovCR(PVMM_DATA lpData);
 
-NTSTATUS VMShadow_hidePageGlobally(
-	PEPT_CONFIG eptConfig,
-	PHYSICAL_ADDRESS targetPA,
-	PUINT8 payloadPage,
-	BOOLEAN hypervisorRunning
-);
+NTSTATUS VMShadow_createGlobalPage(PHYSICAL_ADDRESS targetPA, const UINT8* payloadPage, PSHADOW_GLOBAL_PAGE* globalPage);
+NTSTATUS VMShadow_reserveGlobalPages(ULONG pageCount);
+NTSTATUS VMShadow_applyGlobalPage(PSHADOW_GLOBAL_PAGE globalPage, PEPT_CONFIG eptConfig, ULONG processorIndex);
+void VMShadow_revokeGlobalPage(PSHADOW_GLOBAL_PAGE globalPage, PEPT_CONFIG eptConfig, ULONG processorIndex);
+void VMShadow_writeGlobalPage(PSHADOW_GLOBAL_PAGE globalPage, SIZE_T offset, const UINT8* buffer, SIZE_T size);
+void VMShadow_freeGlobalPage(PSHADOW_GLOBAL_PAGE globalPage);
 
 NTSTATUS VMShadow_hideExecInProcess(
 	PVMM_DATA lpData,
-	PEPROCESS targetProcess,
+	CR3 tableBase,
 	PUINT8 targetVA,
 	PUINT8 execVA
 );
\ No newline at end of file
@@ -0,0 +1,415 @@
+#include <ntifs.h>
+#include "Worker.h"
+#include "VMCALL_Common.h"
+#include "VMM.h"
+#include "Debug.h"
+
+/******************** External API ********************/
+
+
+/******************** Module Typedefs ********************/
+
+/* A cell of the work queue. The sequence tells each side whether the cell is theirs,
+ * it equals the position for the producer and position + 1 for the consumer. */
+typedef struct _WORKER_CELL
+{
+	volatile LONG sequence;
+
+	fnWorkerRoutine routine;
+	UINT64 parameters[WORKER_ITEM_PARAMETERS];
+
+	/* Status block to complete within the address space of the caller, zero if there isn't one. */
+	CR3 statusBlockCR3;
+	GUEST_VIRTUAL_ADDRESS statusBlock;
+} WORKER_CELL, *PWORKER_CELL;
+
+/* A process that exited whilst items it queued were still to be run. Their status blocks
+ * aren't completed, as its page tables are freed once it has gone. */
+typedef struct _WORKER_EXITED_PROCESS
+{
+	BOOLEAN inUse;
+
+	/* The process may have queued items from either mode, which differ under KVA shadowing. */
+	CR3 userCR3;
+	CR3 kernelCR3;
+
+	/* Everything the process queued was queued before this position. */
+	LONG position;
+} WORKER_EXITED_PROCESS, *PWORKER_EXITED_PROCESS;
+
+/* Completion of a status block, written from VMX root. */
+typedef struct _STATUS_BLOCK_COMPLETION
+{
+	CR3 tableBase;
+	GUEST_VIRTUAL_ADDRESS statusBlock;
+	NTSTATUS status;
+	UINT64 information;
+} STATUS_BLOCK_COMPLETION, *PSTATUS_BLOCK_COMPLETION;
+
+/******************** Module Constants ********************/
+
+#define WORKER_QUEUE_MASK (WORKER_QUEUE_ITEMS - 1)
+
+C_ASSERT((WORKER_QUEUE_ITEMS & WORKER_QUEUE_MASK) == 0);
+
+/* Only the address of the page tables is compared, not the PCID. */
+#define WORKER_CR3_MASK (~(UINT64)0xFFF)
+
+/* Processes that can exit with items outstanding at the same time, any more wait for the
+ * worker to catch up. */
+#define WORKER_MAX_EXITED_PROCESSES 16
+
+/* How often an exiting process checks whether the worker has caught up, in milliseconds. */
+#define WORKER_EXIT_INTERVAL_MS 1
+
+/******************** Module Variables ********************/
+
+/* Items are queued from VMX root on any logical processor, and removed only by the worker thread. */
+static WORKER_CELL workQueue[WORKER_QUEUE_ITEMS] = { 0 };
+static volatile LONG enqueuePosition = 0;
+static LONG dequeuePosition = 0;
+
+static BOOLEAN workerRunning = FALSE;
+
+/* Serialises completing a status block against a process exiting, along with the position
+ * of the next item to be completed. */
+static FAST_MUTEX completionLock;
+static LONG completedPosition = 0;
+static WORKER_EXITED_PROCESS exitedProcesses[WORKER_MAX_EXITED_PROCESSES] = { 0 };
+static BOOLEAN notifyRegistered = FALSE;
+
+/* Signalled to stop the worker, which is waited on as it exits. */
+static KEVENT stopEvent;
+static PKTHREAD workerThreadObject = NULL;
+
+/******************** Module Prototypes ********************/
+static void workerThread(PVOID context);
+static BOOLEAN runNextItem(void);
+static void completeStatusBlock(CR3 tableBase, GUEST_VIRTUAL_ADDRESS statusBlock, NTSTATUS status, UINT64 information);
+static NTSTATUS rootCompleteStatusBlock(PVOID hvParameter, PVOID userParameter);
+static void onProcessNotify(PEPROCESS process, HANDLE processId, PPS_CREATE_NOTIFY_INFO createInfo);
+static BOOLEAN hasExited(CR3 tableBase, LONG position);
+
+/******************** Public Code ********************/
+
+NTSTATUS Worker_initialise(void)
+{
+	NTSTATUS status;
+
+	/* Each cell starts off owned by the producer at its own position. */
+	for (LONG i = 0; i < WORKER_QUEUE_ITEMS; i++)
+	{
+		workQueue[i].sequence = i;
+	}
+
+	KeInitializeEvent(&stopEvent, NotificationEvent, FALSE);
+	ExInitializeFastMutex(&completionLock);
+
+	/* A status block can't be completed once the page tables of its process have been freed. */
+	status = PsSetCreateProcessNotifyRoutineEx(onProcessNotify, FALSE);
+	if (NT_SUCCESS(status))
+	{
+		notifyRegistered = TRUE;
+	}
+
+	HANDLE threadHandle;
+	if (NT_SUCCESS(status))
+	{
+		status = PsCreateSystemThread(&threadHandle, THREAD_ALL_ACCESS, NULL, NULL, NULL, workerThread, NULL);
+	}
+
+	if (NT_SUCCESS(status))
+	{
+		/* Keep hold of the thread, so it can be waited on when it is stopped. */
+		status = ObReferenceObjectByHandle(threadHandle, SYNCHRONIZE, *PsThreadType, KernelMode, (PVOID*)&workerThreadObject, NULL);
+		if (NT_SUCCESS(status))
+		{
+			workerRunning = TRUE;
+		}
+		else
+		{
+			KeSetEvent(&stopEvent, IO_NO_INCREMENT, FALSE);
+		}
+
+		ZwClose(threadHandle);
+	}
+
+	if ((FALSE == NT_SUCCESS(status)) && (TRUE == notifyRegistered))
+	{
+		PsSetCreateProcessNotifyRoutineEx(onProcessNotify, TRUE);
+		notifyRegistered = FALSE;
+	}
+
+	return status;
+}
+
+void Worker_uninitialise(void)
+{
+	/* Called at PASSIVE_LEVEL when the hypervisor fails to start. Nothing more can be queued,
+	 * anything already queued is run before the worker exits. */
+	if (NULL != workerThreadObject)
+	{
+		workerRunning = FALSE;
+		KeSetEvent(&stopEvent, IO_NO_INCREMENT, FALSE);
+
+		KeWaitForSingleObject(workerThreadObject, Executive, KernelMode, FALSE, NULL);
+		ObDereferenceObject(workerThreadObject);
+		workerThreadObject = NULL;
+	}
+
+	if (TRUE == notifyRegistered)
+	{
+		PsSetCreateProcessNotifyRoutineEx(onProcessNotify, TRUE);
+		notifyRegistered = FALSE;
+	}
+}
+
+NTSTATUS Worker_queue(fnWorkerRoutine routine, const UINT64 parameters[WORKER_ITEM_PARAMETERS], CR3 statusBlockCR3,
+					  GUEST_VIRTUAL_ADDRESS statusBlock)
+{
+	/* Safe to call from VMX root, nothing here touches the OS. */
+	NTSTATUS status = STATUS_INSUFFICIENT_RESOURCES;
+
+	if (TRUE == workerRunning)
+	{
+		LONG position = enqueuePosition;
+
+		for (;;)
+		{
+			PWORKER_CELL cell = &workQueue[position & WORKER_QUEUE_MASK];
+			LONG difference = cell->sequence - position;
+
+			if (0 == difference)
+			{
+				/* The cell is free, try to claim the position. */
+				LONG previous = InterlockedCompareExchange(&enqueuePosition, position + 1, position);
+				if (previous == position)
+				{
+					cell->routine = routine;
+					RtlCopyMemory(cell->parameters, parameters, sizeof(cell->parameters));
+					cell->statusBlockCR3 = statusBlockCR3;
+					cell->statusBlock = statusBlock;
+
+					/* Hand the cell over to the worker. */
+					InterlockedExchange(&cell->sequence, position + 1);
+
+					status = STATUS_PENDING;
+					break;
+				}
+
+				position = previous;
+			}
+			else if (difference < 0)
+			{
+				/* The worker hasn't caught up, the queue is full. */
+				break;
+			}
+			else
+			{
+				/* Another processor claimed this position first. */
+				position = enqueuePosition;
+			}
+		}
+	}
+
+	return status;
+}
+
+/******************** Module Code ********************/
+
+static void workerThread(PVOID context)
+{
+	UNREFERENCED_PARAMETER(context);
+
+	LARGE_INTEGER pollInterval;
+	pollInterval.QuadPart = -10000LL * WORKER_POLL_INTERVAL_MS;
+
+	NTSTATUS waitStatus = STATUS_TIMEOUT;
+	while (STATUS_TIMEOUT == waitStatus)
+	{
+		/* Run everything that is queued, only sleeping once the queue is empty. */
+		while (TRUE == runNextItem())
+		{
+		}
+
+		waitStatus = KeWaitForSingleObject(&stopEvent, Executive, KernelMode, FALSE, &pollInterval);
+	}
+
+	/* Anything queued before the worker was stopped still has a caller waiting on it. */
+	while (TRUE == runNextItem())
+	{
+	}
+
+	PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+static BOOLEAN runNextItem(void)
+{
+	BOOLEAN result = FALSE;
+
+	LONG position = dequeuePosition;
+	PWORKER_CELL cell = &workQueue[position & WORKER_QUEUE_MASK];
+	if ((position + 1) == cell->sequence)
+	{
+		fnWorkerRoutine routine = cell->routine;
+		CR3 statusBlockCR3 = cell->statusBlockCR3;
+		GUEST_VIRTUAL_ADDRESS statusBlock = cell->statusBlock;
+
+		UINT64 parameters[WORKER_ITEM_PARAMETERS];
+		RtlCopyMemory(parameters, cell->parameters, sizeof(parameters));
+
+		/* Give the cell back to the producers for the next lap of the queue. */
+		InterlockedExchange(&cell->sequence, position + WORKER_QUEUE_ITEMS);
+		dequeuePosition++;
+
+		UINT64 information = 0;
+		NTSTATUS status = routine(parameters, &information);
+
+		/* A process can't finish exiting whilst its status block is being completed. */
+		ExAcquireFastMutex(&completionLock);
+
+		if ((0 != statusBlock) && (FALSE == hasExited(statusBlockCR3, position)))
+		{
+			completeStatusBlock(statusBlockCR3, statusBlock, status, information);
+		}
+
+		completedPosition = position + 1;
+
+		/* Forget the processes that have nothing left to complete. */
+		for (ULONG i = 0; i < WORKER_MAX_EXITED_PROCESSES; i++)
+		{
+			if ((TRUE == exitedProcesses[i].inUse) && ((LONG)(exitedProcesses[i].position - completedPosition) <= 0))
+			{
+				exitedProcesses[i].inUse = FALSE;
+			}
+		}
+
+		ExReleaseFastMutex(&completionLock);
+
+		result = TRUE;
+	}
+
+	return result;
+}
+
+static void completeStatusBlock(CR3 tableBase, GUEST_VIRTUAL_ADDRESS statusBlock, NTSTATUS status, UINT64 information)
+{
+	/* The worker doesn't run in the address space of the caller, and the block is in user memory
+	 * the worker can't safely touch. It is written from VMX root through the page tables of the
+	 * caller instead, which fails cleanly should the caller have freed it. */
+	STATUS_BLOCK_COMPLETION completion;
+	completion.tableBase = tableBase;
+	completion.statusBlock = statusBlock;
+	completion.status = status;
+	completion.information = information;
+
+	VM_PARAM_RUN_AS_ROOT rootParams;
+	rootParams.callback = rootCompleteStatusBlock;
+	rootParams.parameter = &completion;
+
+	VMCALL_COMMAND command;
+	command.action = VMCALL_ACTION_RUN_AS_ROOT;
+	command.buffer = &rootParams;
+	command.bufferSize = sizeof(rootParams);
+
+	NTSTATUS completeStatus = VMCALL_actionHost(VMCALL_KEY, &command);
+	if (FALSE == NT_SUCCESS(completeStatus))
+	{
+		DEBUG_PRINT("Unable to complete status block at 0x%llX. Status: 0x%08X\r\n", statusBlock, completeStatus);
+	}
+}
+
+static NTSTATUS rootCompleteStatusBlock(PVOID hvParameter, PVOID userParameter)
+{
+	PVMM_DATA lpData = (PVMM_DATA)hvParameter;
+	PSTATUS_BLOCK_COMPLETION completion = (PSTATUS_BLOCK_COMPLETION)userParameter;
+
+	NTSTATUS status = MemManage_writeVirtualAddress(&lpData->mmContext, completion->tableBase,
+													completion->statusBlock + FIELD_OFFSET(VMCALL_STATUS_BLOCK, information),
+													&completion->information, sizeof(completion->information));
+	if (NT_SUCCESS(status))
+	{
+		/* Publish the status last, the caller polls on it. */
+		status = MemManage_writeVirtualAddress(&lpData->mmContext, completion->tableBase,
+											   completion->statusBlock + FIELD_OFFSET(VMCALL_STATUS_BLOCK, status),
+											   &completion->status, sizeof(completion->status));
+	}
+
+	return status;
+}
+
+static void onProcessNotify(PEPROCESS process, HANDLE processId, PPS_CREATE_NOTIFY_INFO createInfo)
+{
+	/* Called at PASSIVE_LEVEL as a process is created or exits, only exits are of interest.
+	 * The address space of the process is still intact, so a completion in progress can finish,
+	 * but none is started for it afterwards. */
+	UNREFERENCED_PARAMETER(processId);
+
+	if (NULL == createInfo)
+	{
+		KAPC_STATE apcState;
+		CR3 kernelCR3;
+		CR3 userCR3 = MemManage_getPageTableBase(process);
+
+		KeStackAttachProcess(process, &apcState);
+		kernelCR3.Flags = __readcr3();
+		KeUnstackDetachProcess(&apcState);
+
+		LARGE_INTEGER exitInterval;
+		exitInterval.QuadPart = -10000LL * WORKER_EXIT_INTERVAL_MS;
+
+		BOOLEAN recorded = FALSE;
+		while (FALSE == recorded)
+		{
+			ExAcquireFastMutex(&completionLock);
+
+			/* Nothing more can be queued by the process, it has no threads left. */
+			LONG position = enqueuePosition;
+
+			if (position == completedPosition)
+			{
+				recorded = TRUE;
+			}
+
+			for (ULONG i = 0; (FALSE == recorded) && (i < WORKER_MAX_EXITED_PROCESSES); i++)
+			{
+				if (FALSE == exitedProcesses[i].inUse)
+				{
+					exitedProcesses[i].userCR3 = userCR3;
+					exitedProcesses[i].kernelCR3 = kernelCR3;
+					exitedProcesses[i].position = position;
+					exitedProcesses[i].inUse = TRUE;
+					recorded = TRUE;
+				}
+			}
+
+			ExReleaseFastMutex(&completionLock);
+
+			if (FALSE == recorded)
+			{
+				KeDelayExecutionThread(KernelMode, FALSE, &exitInterval);
+			}
+		}
+	}
+}
+
+static BOOLEAN hasExited(CR3 tableBase, LONG position)
+{
+	/* Called with the completion lock held. The page tables of a process that has exited can be
+	 * reused by a new one, whose items are only ever queued after the exit was recorded. */
+	BOOLEAN result = FALSE;
+
+	for (ULONG i = 0; (FALSE == result) && (i < WORKER_MAX_EXITED_PROCESSES); i++)
+	{
+		PWORKER_EXITED_PROCESS exited = &exitedProcesses[i];
+
+		if ((TRUE == exited->inUse) && ((LONG)(position - exited->position) < 0) &&
+			(((tableBase.Flags & WORKER_CR3_MASK) == (exited->userCR3.Flags & WORKER_CR3_MASK)) ||
+			 ((tableBase.Flags & WORKER_CR3_MASK) == (exited->kernelCR3.Flags & WORKER_CR3_MASK))))
+		{
+			result = TRUE;
+		}
+	}
+
+	return result;
+}
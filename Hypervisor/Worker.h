@@ -0,0 +1,33 @@
+#pragma once
+#include <ntifs.h>
+#include "MemManage.h"
+
+/******************** Public Defines ********************/
+
+/* Number of work items that can be queued at once, must be a power of two. */
+#define WORKER_QUEUE_ITEMS 64
+
+/* Number of parameters carried by each work item. */
+#define WORKER_ITEM_PARAMETERS 4
+
+/* How often the worker checks the queue for new items, in milliseconds. VMX root
+ * can't signal a dispatcher object, so the worker has to poll for new work until
+ * it is stopped. */
+#define WORKER_POLL_INTERVAL_MS 1
+
+/******************** Public Typedefs ********************/
+
+/* Routine of a work item, called at PASSIVE_LEVEL on the worker thread.
+ * The status returned is written to the status block of the item. */
+typedef NTSTATUS(*fnWorkerRoutine)(PUINT64 parameters, PUINT64 information);
+
+/******************** Public Constants ********************/
+
+/******************** Public Variables ********************/
+
+/******************** Public Prototypes ********************/
+
+NTSTATUS Worker_initialise(void);
+void Worker_uninitialise(void);
+NTSTATUS Worker_queue(fnWorkerRoutine routine, const UINT64 parameters[WORKER_ITEM_PARAMETERS], CR3 statusBlockCR3,
+					  GUEST_VIRTUAL_ADDRESS statusBlock);
@@ -0,0 +1,458 @@
+#pragma once
+#include <string.h>
+#include "EventLog_Common.h"
+
+/* Portable decoder of event log files and ring records.
+ *
+ * Reads both the variable length records of the .hvt files, expanding their delta
+ * encoding, and the legacy fixed size EVENT_DATA records of the older .bin files.
+ * Nothing here depends on Windows, so traces can be decoded on any platform by
+ * mapping or reading the whole file into memory and handing it to EventDecoder_open. */
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/******************** Public Defines ********************/
+
+/* Layout of the legacy EVENT_DATA record, which embeds the x64 CONTEXT. */
+#define EVENT_LEGACY_RECORD_SIZE		1344
+#define EVENT_LEGACY_PROC_INDEX			0
+#define EVENT_LEGACY_TIMESTAMP			8
+#define EVENT_LEGACY_CR0				16
+#define EVENT_LEGACY_CR3				24
+#define EVENT_LEGACY_CR4				32
+#define EVENT_LEGACY_CONTEXT			48
+#define EVENT_LEGACY_CONTEXT_EFLAGS		(EVENT_LEGACY_CONTEXT + 0x44)
+#define EVENT_LEGACY_CONTEXT_RAX		(EVENT_LEGACY_CONTEXT + 0x78)
+#define EVENT_LEGACY_CONTEXT_RIP		(EVENT_LEGACY_CONTEXT + 0xF8)
+#define EVENT_LEGACY_CONTEXT_FLTSAVE	(EVENT_LEGACY_CONTEXT + 0x100)
+#define EVENT_LEGACY_STRING				1280
+
+/******************** Public Typedefs ********************/
+
+typedef enum
+{
+	EVENT_DECODE_OK = 0,
+	EVENT_DECODE_END,
+	EVENT_DECODE_CORRUPT,
+	EVENT_DECODE_CALIBRATION,	/* No record was decoded, the calibration of the decoder has been updated. */
+	EVENT_DECODE_STRING			/* No record was decoded, a string has been defined (definedStringId). */
+} EVENT_DECODE_RESULT;
+
+/* A decoded record. The delta encoding has been expanded, so the fields only ever hold
+ * TIMESTAMP, PROC_INDEX, CR0, CR3, CR4, GPRS, EXTENDED, STRING and STRING_ID. The extended
+ * state and string point into the data being decoded. An interned string is resolved, with
+ * STRING set as well as STRING_ID, once the decoder has come across its definition. */
+typedef struct _EVENT_DECODED
+{
+	UINT16 fields;
+	UINT32 procIndex;
+	UINT64 timeStamp;
+	UINT64 cr0;
+	UINT64 cr3;
+	UINT64 cr4;
+	EVENT_GPRS gprs;
+
+	const UINT8* extended;
+	UINT16 extendedSize;
+
+	const CHAR* string;
+	UINT16 stringLength;
+	UINT32 stringId;
+} EVENT_DECODED, *PEVENT_DECODED;
+
+typedef struct _EVENT_DECODER
+{
+	const UINT8* data;
+	size_t size;
+	size_t offset;
+
+	/* Offset of the record last returned by EventDecoder_next. */
+	size_t recordOffset;
+
+	/* Set when the data holds legacy EVENT_DATA records. */
+	int legacy;
+
+	/* Count of the sessions (file headers) so far, less one. Timestamps are only comparable
+	 * within a session, as the TSCs start over when the machine does. */
+	UINT32 session;
+
+	/* Of the current session, the frequency is zero if it isn't known. */
+	UINT64 timeStampFrequency;
+	EVENT_CALIBRATION calibration;
+
+	/* Fields of the previous record, which delta encoded records refer back to. */
+	int havePrevious;
+	UINT64 previousTimeStamp;
+	UINT32 previousProcIndex;
+	int havePreviousCR3;
+	UINT64 previousCR3;
+
+	/* Definitions of the strings within the current session, the payload of their records,
+	 * and the id of the one last returned as EVENT_DECODE_STRING. */
+	const UINT8* strings[EVENT_STRING_MAX_COUNT];
+	UINT32 definedStringId;
+} EVENT_DECODER, *PEVENT_DECODER;
+
+/******************** Public Constants ********************/
+
+/******************** Public Variables ********************/
+
+/******************** Public Prototypes ********************/
+
+static inline int EventDecoder_read(const UINT8** payload, const UINT8* end, void* value, size_t size)
+{
+	int result = 0;
+
+	if ((size_t)(end - *payload) >= size)
+	{
+		memcpy(value, *payload, size);
+		*payload += size;
+		result = 1;
+	}
+
+	return result;
+}
+
+/* Reads a length prefixed field, leaving it in place. */
+static inline int EventDecoder_readBlob(const UINT8** payload, const UINT8* end, const UINT8** blob, UINT16* length)
+{
+	int result = 0;
+
+	if ((0 != EventDecoder_read(payload, end, length, sizeof(UINT16))) && ((size_t)(end - *payload) >= *length))
+	{
+		*blob = *payload;
+		*payload += *length;
+		result = 1;
+	}
+
+	return result;
+}
+
+/* Decodes the payload of a record. Without a decoder the record has to be free of delta encoding,
+ * as those within the rings are. */
+static inline EVENT_DECODE_RESULT EventDecoder_decodePayload(PEVENT_DECODER decoder, const EVENT_RECORD_HEADER* header,
+													  PEVENT_DECODED decoded)
+{
+	const UINT8* payload = (const UINT8*)(header + 1);
+	const UINT8* end = (const UINT8*)header + header->size;
+	int valid = 1;
+
+	memset(decoded, 0, sizeof(EVENT_DECODED));
+	decoded->fields = EVENT_FIELD_TIMESTAMP | EVENT_FIELD_PROC_INDEX;
+
+	if (0 != (header->fields & EVENT_FIELD_TIMESTAMP))
+	{
+		valid &= EventDecoder_read(&payload, end, &decoded->timeStamp, sizeof(UINT64));
+	}
+	else if ((0 != (header->fields & EVENT_FIELD_TIMESTAMP_DELTA)) && (NULL != decoder) && (0 != decoder->havePrevious))
+	{
+		UINT32 delta = 0;
+		valid &= EventDecoder_read(&payload, end, &delta, sizeof(delta));
+		decoded->timeStamp = decoder->previousTimeStamp + delta;
+	}
+	else
+	{
+		valid = 0;
+	}
+
+	if (0 != (header->fields & EVENT_FIELD_PROC_INDEX))
+	{
+		valid &= EventDecoder_read(&payload, end, &decoded->procIndex, sizeof(UINT32));
+	}
+	else if ((NULL != decoder) && (0 != decoder->havePrevious))
+	{
+		decoded->procIndex = decoder->previousProcIndex;
+	}
+	else
+	{
+		valid = 0;
+	}
+
+	if (0 != (header->fields & EVENT_FIELD_CR0))
+	{
+		valid &= EventDecoder_read(&payload, end, &decoded->cr0, sizeof(UINT64));
+		decoded->fields |= EVENT_FIELD_CR0;
+	}
+
+	if (0 != (header->fields & EVENT_FIELD_CR3))
+	{
+		valid &= EventDecoder_read(&payload, end, &decoded->cr3, sizeof(UINT64));
+		decoded->fields |= EVENT_FIELD_CR3;
+	}
+	else if (0 != (header->fields & EVENT_FIELD_CR3_REPEAT))
+	{
+		if ((NULL != decoder) && (0 != decoder->havePreviousCR3))
+		{
+			decoded->cr3 = decoder->previousCR3;
+			decoded->fields |= EVENT_FIELD_CR3;
+		}
+		else
+		{
+			valid = 0;
+		}
+	}
+
+	if (0 != (header->fields & EVENT_FIELD_CR4))
+	{
+		valid &= EventDecoder_read(&payload, end, &decoded->cr4, sizeof(UINT64));
+		decoded->fields |= EVENT_FIELD_CR4;
+	}
+
+	if (0 != (header->fields & EVENT_FIELD_GPRS))
+	{
+		valid &= EventDecoder_read(&payload, end, &decoded->gprs, sizeof(EVENT_GPRS));
+		decoded->fields |= EVENT_FIELD_GPRS;
+	}
+
+	if (0 != (header->fields & EVENT_FIELD_EXTENDED))
+	{
+		valid &= EventDecoder_readBlob(&payload, end, &decoded->extended, &decoded->extendedSize);
+		decoded->fields |= EVENT_FIELD_EXTENDED;
+	}
+
+	if (0 != (header->fields & EVENT_FIELD_STRING))
+	{
+		valid &= EventDecoder_readBlob(&payload, end, (const UINT8**)&decoded->string, &decoded->stringLength);
+		decoded->fields |= EVENT_FIELD_STRING;
+	}
+
+	if (0 != (header->fields & EVENT_FIELD_STRING_ID))
+	{
+		valid &= EventDecoder_read(&payload, end, &decoded->stringId, sizeof(UINT32));
+		decoded->fields |= EVENT_FIELD_STRING_ID;
+
+		if ((NULL != decoder) && (EVENT_STRING_ID_NONE != decoded->stringId) && (decoded->stringId <= EVENT_STRING_MAX_COUNT) &&
+			(NULL != decoder->strings[decoded->stringId - 1]))
+		{
+			const UINT8* definition = decoder->strings[decoded->stringId - 1] + sizeof(UINT32);
+			memcpy(&decoded->stringLength, definition, sizeof(UINT16));
+			decoded->string = (const CHAR*)(definition + sizeof(UINT16));
+			decoded->fields |= EVENT_FIELD_STRING;
+		}
+	}
+
+	if ((0 != valid) && (NULL != decoder))
+	{
+		decoder->havePrevious = 1;
+		decoder->previousTimeStamp = decoded->timeStamp;
+		decoder->previousProcIndex = decoded->procIndex;
+
+		if (0 != (decoded->fields & EVENT_FIELD_CR3))
+		{
+			decoder->havePreviousCR3 = 1;
+			decoder->previousCR3 = decoded->cr3;
+		}
+	}
+
+	return (0 != valid) ? EVENT_DECODE_OK : EVENT_DECODE_CORRUPT;
+}
+
+static inline EVENT_DECODE_RESULT EventDecoder_decodeLegacy(const UINT8* record, PEVENT_DECODED decoded)
+{
+	memset(decoded, 0, sizeof(EVENT_DECODED));
+	decoded->fields = EVENT_FIELD_TIMESTAMP | EVENT_FIELD_PROC_INDEX | EVENT_CAPTURE_CONTROL_REGISTERS |
+		EVENT_FIELD_GPRS | EVENT_FIELD_EXTENDED;
+
+	memcpy(&decoded->procIndex, record + EVENT_LEGACY_PROC_INDEX, sizeof(UINT32));
+	memcpy(&decoded->timeStamp, record + EVENT_LEGACY_TIMESTAMP, sizeof(UINT64));
+	memcpy(&decoded->cr0, record + EVENT_LEGACY_CR0, sizeof(UINT64));
+	memcpy(&decoded->cr3, record + EVENT_LEGACY_CR3, sizeof(UINT64));
+	memcpy(&decoded->cr4, record + EVENT_LEGACY_CR4, sizeof(UINT64));
+
+	/* RAX through R15 are in the same order within CONTEXT. */
+	UINT32 eflags;
+	memcpy(&decoded->gprs.registers[EVENT_GPR_RAX], record + EVENT_LEGACY_CONTEXT_RAX, (EVENT_GPR_R15 + 1) * sizeof(UINT64));
+	memcpy(&decoded->gprs.registers[EVENT_GPR_RIP], record + EVENT_LEGACY_CONTEXT_RIP, sizeof(UINT64));
+	memcpy(&eflags, record + EVENT_LEGACY_CONTEXT_EFLAGS, sizeof(eflags));
+	decoded->gprs.registers[EVENT_GPR_RFLAGS] = eflags;
+
+	decoded->extended = record + EVENT_LEGACY_CONTEXT_FLTSAVE;
+	decoded->extendedSize = EVENT_EXTENDED_SIZE;
+
+	/* The string is only terminated if it was shorter than the field. */
+	decoded->string = (const CHAR*)(record + EVENT_LEGACY_STRING);
+	while ((decoded->stringLength < MAX_EXTRA_CHARS) && ('\0' != decoded->string[decoded->stringLength]))
+	{
+		decoded->stringLength++;
+	}
+
+	if (0 != decoded->stringLength)
+	{
+		decoded->fields |= EVENT_FIELD_STRING;
+	}
+
+	return EVENT_DECODE_OK;
+}
+
+/* Starts decoding a whole file, which has to stay in memory whilst it is decoded. */
+static inline void EventDecoder_open(PEVENT_DECODER decoder, const void* data, size_t size)
+{
+	UINT32 magic = 0;
+
+	memset(decoder, 0, sizeof(EVENT_DECODER));
+	decoder->data = (const UINT8*)data;
+	decoder->size = size;
+
+	if (size >= sizeof(magic))
+	{
+		memcpy(&magic, data, sizeof(magic));
+	}
+
+	decoder->legacy = (EVENT_FILE_MAGIC != magic);
+	decoder->session = (UINT32)-1;
+}
+
+/* Decodes the next record of the file. Once the data is found to be corrupt the rest of it is ignored.
+ * Calibrations and string definitions are returned in between the records, as EVENT_DECODE_CALIBRATION
+ * and EVENT_DECODE_STRING. */
+static inline EVENT_DECODE_RESULT EventDecoder_next(PEVENT_DECODER decoder, PEVENT_DECODED decoded)
+{
+	EVENT_DECODE_RESULT result = EVENT_DECODE_END;
+
+	for (;;)
+	{
+		size_t remaining = decoder->size - decoder->offset;
+		const UINT8* data = decoder->data + decoder->offset;
+
+		if (0 != decoder->legacy)
+		{
+			if (remaining >= EVENT_LEGACY_RECORD_SIZE)
+			{
+				decoder->recordOffset = decoder->offset;
+				result = EventDecoder_decodeLegacy(data, decoded);
+				decoder->offset += EVENT_LEGACY_RECORD_SIZE;
+			}
+
+			break;
+		}
+
+		if (remaining < sizeof(EVENT_RECORD_HEADER))
+		{
+			break;
+		}
+
+		UINT32 magic;
+		memcpy(&magic, data, sizeof(magic));
+
+		/* A file header starts every writer session, the magic can't be mistaken for a record header
+		 * as its size would be beyond EVENT_RECORD_MAX_SIZE. Delta encoding starts over after one. */
+		if (EVENT_FILE_MAGIC == magic)
+		{
+			EVENT_FILE_HEADER fileHeader = { 0 };
+			if (remaining >= sizeof(fileHeader))
+			{
+				memcpy(&fileHeader, data, sizeof(fileHeader));
+			}
+
+			if ((fileHeader.size < sizeof(fileHeader)) || (fileHeader.size > remaining) ||
+				(0 == fileHeader.version) || (fileHeader.version > EVENT_FILE_VERSION) ||
+				((fileHeader.version >= 2) && (fileHeader.size < (sizeof(fileHeader) + sizeof(EVENT_CALIBRATION)))))
+			{
+				result = EVENT_DECODE_CORRUPT;
+				decoder->offset = decoder->size;
+				break;
+			}
+
+			decoder->offset += fileHeader.size;
+			decoder->havePrevious = 0;
+			decoder->havePreviousCR3 = 0;
+			decoder->session++;
+			memset((void*)decoder->strings, 0, sizeof(decoder->strings));
+			decoder->timeStampFrequency = (fileHeader.version >= 2) ? fileHeader.timeStampFrequency : 0;
+
+			/* Version 1 sessions don't have any calibrations at all. */
+			if (fileHeader.version >= 2)
+			{
+				decoder->recordOffset = decoder->offset - fileHeader.size;
+				memcpy(&decoder->calibration, data + sizeof(fileHeader), sizeof(EVENT_CALIBRATION));
+				result = EVENT_DECODE_CALIBRATION;
+				break;
+			}
+
+			continue;
+		}
+
+		EVENT_RECORD_HEADER header;
+		memcpy(&header, data, sizeof(header));
+
+		if ((header.size < sizeof(header)) || (header.size > EVENT_RECORD_MAX_SIZE) ||
+			(0 != (header.size % EVENT_RECORD_ALIGNMENT)) || (header.size > remaining))
+		{
+			result = EVENT_DECODE_CORRUPT;
+			decoder->offset = decoder->size;
+			break;
+		}
+
+		decoder->recordOffset = decoder->offset;
+		decoder->offset += header.size;
+
+		if (0 != (header.fields & EVENT_FIELD_CALIBRATION))
+		{
+			if (header.size < (sizeof(header) + sizeof(EVENT_CALIBRATION)))
+			{
+				result = EVENT_DECODE_CORRUPT;
+				decoder->offset = decoder->size;
+			}
+			else
+			{
+				memcpy(&decoder->calibration, data + sizeof(header), sizeof(EVENT_CALIBRATION));
+				result = EVENT_DECODE_CALIBRATION;
+			}
+
+			break;
+		}
+
+		if (0 != (header.fields & EVENT_FIELD_STRING_DEFINITION))
+		{
+			const UINT8* payload = data + sizeof(header);
+			UINT32 id = EVENT_STRING_ID_NONE;
+			UINT16 length = 0;
+			int valid = (header.size >= (sizeof(header) + sizeof(id) + sizeof(length)));
+
+			if (0 != valid)
+			{
+				memcpy(&id, payload, sizeof(id));
+				memcpy(&length, payload + sizeof(id), sizeof(length));
+
+				valid = (EVENT_STRING_ID_NONE != id) && (id <= EVENT_STRING_MAX_COUNT) &&
+					(header.size >= (sizeof(header) + sizeof(id) + sizeof(length) + length));
+			}
+
+			if (0 == valid)
+			{
+				result = EVENT_DECODE_CORRUPT;
+				decoder->offset = decoder->size;
+			}
+			else
+			{
+				decoder->strings[id - 1] = payload;
+				decoder->definedStringId = id;
+				result = EVENT_DECODE_STRING;
+			}
+
+			break;
+		}
+
+		/* Padding never makes it to a file, but there's no harm in skipping it. */
+		if (0 == (header.fields & EVENT_FIELD_PADDING))
+		{
+			result = EventDecoder_decodePayload(decoder, (const EVENT_RECORD_HEADER*)data, decoded);
+			break;
+		}
+	}
+
+	return result;
+}
+
+/* Decodes a record in place within a ring, as returned by EventLog_peekRecord or EventStream_next. */
+static inline EVENT_DECODE_RESULT EventDecoder_decodeRecord(const EVENT_RECORD_HEADER* header, PEVENT_DECODED decoded)
+{
+	return EventDecoder_decodePayload(NULL, header, decoded);
+}
+
+#ifdef __cplusplus
+}
+#endif
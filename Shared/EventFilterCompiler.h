@@ -0,0 +1,285 @@
+#pragma once
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include "EventFilter_Common.h"
+#ifdef _WIN32
+#include "VMCALL_Common.h"
+#endif
+
+/* Compiler of event filter expressions into the predicate table evaluated by the hypervisor.
+ *
+ * An expression is one or more clauses separated by ||, each clause is one or more
+ * predicates separated by &&. There are no parentheses, && binds tighter than ||.
+ *
+ *	operand == value		operand != value
+ *	operand < value			operand <= value		operand > value		operand >= value
+ *	operand in low..high	operand !in low..high	(inclusive)
+ *	operand & mask == value
+ *
+ * Operands are proc, cr3, rip, exit and the registers rax - r15 and rflags. Values are
+ * decimal, or hexadecimal with a 0x prefix. For example:
+ *
+ *	cr3 == 0x1AA000 && rip in 0xFFFFF80000000000..0xFFFFF8FFFFFFFFFF || exit == 10
+ *
+ * The compiler is portable, only EventFilter_set depends on Windows. */
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/******************** Public Defines ********************/
+
+/******************** Public Typedefs ********************/
+
+/******************** Public Constants ********************/
+
+/******************** Public Variables ********************/
+
+/******************** Public Prototypes ********************/
+
+static inline const char* EventFilter_skipSpaces(const char* text)
+{
+	while ((' ' == *text) || ('\t' == *text) || ('\r' == *text) || ('\n' == *text))
+	{
+		text++;
+	}
+
+	return text;
+}
+
+/* Consumes the token if it is next, returns non zero if it was. */
+static inline int EventFilter_accept(const char** text, const char* token)
+{
+	int result = 0;
+	const char* position = EventFilter_skipSpaces(*text);
+	size_t length = strlen(token);
+
+	if (0 == strncmp(position, token, length))
+	{
+		*text = position + length;
+		result = 1;
+	}
+
+	return result;
+}
+
+static inline int EventFilter_parseValue(const char** text, UINT64* value)
+{
+	int result = 0;
+	const char* position = EventFilter_skipSpaces(*text);
+	char* end = NULL;
+
+	/* Never octal, a leading zero is still decimal. */
+	if (('0' == position[0]) && (('x' == position[1]) || ('X' == position[1])) && (0 != isxdigit((unsigned char)position[2])))
+	{
+		*value = (UINT64)strtoull(&position[2], &end, 16);
+		*text = end;
+		result = 1;
+	}
+	else if (('0' <= *position) && ('9' >= *position))
+	{
+		*value = (UINT64)strtoull(position, &end, 10);
+		*text = end;
+		result = 1;
+	}
+
+	return result;
+}
+
+static inline int EventFilter_parseOperand(const char** text, PEVENT_PREDICATE predicate)
+{
+	static const char* const REGISTER_NAMES[EVENT_GPR_COUNT] =
+	{
+		"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+		"r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+		"rip", "rflags"
+	};
+
+	int result = 1;
+	const char* position = EventFilter_skipSpaces(*text);
+	size_t length = 0;
+
+	while ((('a' <= position[length]) && ('z' >= position[length])) || (('0' <= position[length]) && ('9' >= position[length])))
+	{
+		length++;
+	}
+
+	predicate->registerIndex = 0;
+
+	if ((4 == length) && (0 == strncmp(position, "proc", length)))
+	{
+		predicate->operand = EVENT_OPERAND_PROC_INDEX;
+	}
+	else if ((3 == length) && (0 == strncmp(position, "cr3", length)))
+	{
+		predicate->operand = EVENT_OPERAND_CR3;
+	}
+	else if ((3 == length) && (0 == strncmp(position, "rip", length)))
+	{
+		predicate->operand = EVENT_OPERAND_RIP;
+	}
+	else if ((4 == length) && (0 == strncmp(position, "exit", length)))
+	{
+		predicate->operand = EVENT_OPERAND_EXIT_REASON;
+	}
+	else
+	{
+		result = 0;
+
+		for (UINT8 i = 0; i < EVENT_GPR_COUNT; i++)
+		{
+			if ((strlen(REGISTER_NAMES[i]) == length) && (0 == strncmp(position, REGISTER_NAMES[i], length)))
+			{
+				predicate->operand = EVENT_OPERAND_GPR;
+				predicate->registerIndex = i;
+				result = 1;
+				break;
+			}
+		}
+	}
+
+	if (0 != result)
+	{
+		*text = position + length;
+	}
+
+	return result;
+}
+
+static inline int EventFilter_parseComparison(const char** text, PEVENT_PREDICATE predicate)
+{
+	int result = 1;
+	UINT64 value = 0;
+
+	if (0 != EventFilter_accept(text, "=="))
+	{
+		predicate->comparison = EVENT_COMPARE_EQUAL;
+		result = EventFilter_parseValue(text, &predicate->first);
+	}
+	else if (0 != EventFilter_accept(text, "!="))
+	{
+		predicate->comparison = EVENT_COMPARE_NOT_EQUAL;
+		result = EventFilter_parseValue(text, &predicate->first);
+	}
+	else if (0 != EventFilter_accept(text, "in"))
+	{
+		predicate->comparison = EVENT_COMPARE_IN_RANGE;
+		result = EventFilter_parseValue(text, &predicate->first) && EventFilter_accept(text, "..") &&
+			EventFilter_parseValue(text, &predicate->second);
+	}
+	else if (0 != EventFilter_accept(text, "!in"))
+	{
+		predicate->comparison = EVENT_COMPARE_NOT_IN_RANGE;
+		result = EventFilter_parseValue(text, &predicate->first) && EventFilter_accept(text, "..") &&
+			EventFilter_parseValue(text, &predicate->second);
+	}
+	else if (0 != EventFilter_accept(text, "&"))
+	{
+		predicate->comparison = EVENT_COMPARE_MASK;
+		result = EventFilter_parseValue(text, &predicate->second) && EventFilter_accept(text, "==") &&
+			EventFilter_parseValue(text, &predicate->first);
+	}
+	else if (0 != EventFilter_accept(text, "<="))
+	{
+		predicate->comparison = EVENT_COMPARE_IN_RANGE;
+		result = EventFilter_parseValue(text, &predicate->second);
+	}
+	else if (0 != EventFilter_accept(text, ">="))
+	{
+		predicate->comparison = EVENT_COMPARE_IN_RANGE;
+		predicate->second = ~(UINT64)0;
+		result = EventFilter_parseValue(text, &predicate->first);
+	}
+	else if (0 != EventFilter_accept(text, "<"))
+	{
+		/* The ordered comparisons are ranges, an empty range (first > second) never matches. */
+		predicate->comparison = EVENT_COMPARE_IN_RANGE;
+		result = EventFilter_parseValue(text, &value);
+		predicate->first = (0 == value) ? 1 : 0;
+		predicate->second = (0 == value) ? 0 : (value - 1);
+	}
+	else if (0 != EventFilter_accept(text, ">"))
+	{
+		predicate->comparison = EVENT_COMPARE_IN_RANGE;
+		result = EventFilter_parseValue(text, &value);
+		predicate->first = (~(UINT64)0 == value) ? 1 : (value + 1);
+		predicate->second = (~(UINT64)0 == value) ? 0 : ~(UINT64)0;
+	}
+	else
+	{
+		result = 0;
+	}
+
+	return result;
+}
+
+/* Compiles an expression into a filter. On failure errorOffset is set to where in the
+ * text the expression couldn't be parsed, returns non zero on success. */
+static inline int EventFilter_compile(const char* expression, PEVENT_FILTER filter, size_t* errorOffset)
+{
+	int result = 1;
+	const char* text = expression;
+
+	memset(filter, 0, sizeof(EVENT_FILTER));
+
+	/* An empty expression compiles to an empty filter, which records everything. */
+	if ('\0' != *EventFilter_skipSpaces(text))
+	{
+		for (;;)
+		{
+			PEVENT_PREDICATE predicate = &filter->predicates[filter->predicateCount];
+
+			if ((filter->predicateCount >= EVENT_FILTER_MAX_PREDICATES) ||
+				(0 == EventFilter_parseOperand(&text, predicate)) || (0 == EventFilter_parseComparison(&text, predicate)))
+			{
+				result = 0;
+				break;
+			}
+
+			filter->predicateCount++;
+
+			if (0 != EventFilter_accept(&text, "||"))
+			{
+				filter->predicates[filter->predicateCount - 1].flags |= EVENT_PREDICATE_FLAG_END_CLAUSE;
+			}
+			else if (0 == EventFilter_accept(&text, "&&"))
+			{
+				filter->predicates[filter->predicateCount - 1].flags |= EVENT_PREDICATE_FLAG_END_CLAUSE;
+				result = ('\0' == *EventFilter_skipSpaces(text));
+				break;
+			}
+		}
+	}
+
+	if ((0 == result) && (NULL != errorOffset))
+	{
+		*errorOffset = (size_t)(EventFilter_skipSpaces(text) - expression);
+	}
+
+	return result;
+}
+
+/* Size of the filter to pass to the hypervisor, only the predicates in use are copied. */
+static inline size_t EventFilter_size(const EVENT_FILTER* filter)
+{
+	return offsetof(EVENT_FILTER, predicates) + (filter->predicateCount * sizeof(EVENT_PREDICATE));
+}
+
+#ifdef _WIN32
+/* Installs the filter on every logical processor, an empty filter removes it. */
+static inline NTSTATUS EventFilter_set(PEVENT_FILTER filter)
+{
+	VMCALL_COMMAND command;
+	command.action = VMCALL_ACTION_SET_EVENT_FILTER;
+	command.buffer = filter;
+	command.bufferSize = EventFilter_size(filter);
+
+	return VMCALL_actionHost(VMCALL_KEY, &command);
+}
+#endif
+
+#ifdef __cplusplus
+}
+#endif
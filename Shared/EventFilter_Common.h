@@ -0,0 +1,74 @@
+#pragma once
+#include "EventLog_Common.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/******************** Public Defines ********************/
+
+/* Maximum number of predicates within a filter, which bounds the cost of evaluating it. */
+#define EVENT_FILTER_MAX_PREDICATES 32
+
+/* Exit reason of events that weren't recorded on a VM exit, it never matches a predicate on the exit reason. */
+#define EVENT_EXIT_REASON_NONE ((UINT32)0xFFFFFFFF)
+
+/* The predicate is the last of its clause. */
+#define EVENT_PREDICATE_FLAG_END_CLAUSE 0x01
+
+/******************** Public Typedefs ********************/
+
+typedef enum
+{
+	EVENT_OPERAND_PROC_INDEX = 0,
+	EVENT_OPERAND_CR3,			/* Compared without the PCID, as the table base only. */
+	EVENT_OPERAND_RIP,
+	EVENT_OPERAND_EXIT_REASON,
+	EVENT_OPERAND_GPR,			/* The register is given by registerIndex, an EVENT_GPR. */
+	EVENT_OPERAND_COUNT
+} EVENT_OPERAND;
+
+typedef enum
+{
+	EVENT_COMPARE_EQUAL = 0,	/* value == first */
+	EVENT_COMPARE_NOT_EQUAL,	/* value != first */
+	EVENT_COMPARE_IN_RANGE,		/* first <= value <= second */
+	EVENT_COMPARE_NOT_IN_RANGE,	/* value < first || value > second */
+	EVENT_COMPARE_MASK,			/* (value & second) == first */
+	EVENT_COMPARE_COUNT
+} EVENT_COMPARE;
+
+typedef struct _EVENT_PREDICATE
+{
+	UINT8 operand;			/* EVENT_OPERAND */
+	UINT8 registerIndex;	/* EVENT_GPR, for EVENT_OPERAND_GPR only. */
+	UINT8 comparison;		/* EVENT_COMPARE */
+	UINT8 flags;			/* EVENT_PREDICATE_FLAG_* */
+	UINT32 reserved;
+	UINT64 first;
+	UINT64 second;
+} EVENT_PREDICATE, *PEVENT_PREDICATE;
+
+/* A filter in disjunctive normal form. The predicates are split into clauses by
+ * EVENT_PREDICATE_FLAG_END_CLAUSE, an event is recorded when every predicate of any
+ * one clause holds. A filter without any predicates records everything.
+ *
+ * Installed with VMCALL_ACTION_SET_EVENT_FILTER, the buffer only needs to be
+ * large enough for the predicates in use. */
+typedef struct _EVENT_FILTER
+{
+	UINT32 predicateCount;
+	UINT32 reserved;
+	EVENT_PREDICATE predicates[EVENT_FILTER_MAX_PREDICATES];
+} EVENT_FILTER, *PEVENT_FILTER;
+
+/******************** Public Constants ********************/
+
+/******************** Public Variables ********************/
+
+/******************** Public Prototypes ********************/
+
+#ifdef __cplusplus
+}
+#endif
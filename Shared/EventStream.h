@@ -0,0 +1,157 @@
+#pragma once
+#include "VMCALL_Common.h"
+#include "EventLog_Common.h"
+
+/* User mode consumer of the event rings.
+ *
+ * The rings are mapped read only into the calling process by a single GATHER_EVENTS
+ * VMCALL, after that events are read in place straight from the rings. Nothing is
+ * copied and no VMCALLs are made until the stream is closed. */
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/******************** Public Defines ********************/
+
+/******************** Public Typedefs ********************/
+
+typedef struct _EVENT_STREAM
+{
+	const EVENT_RING* rings;
+	PEVENT_CURSORS cursors;
+	UINT32 ringCount;
+
+	/* Interned strings, which follow the last ring. */
+	const EVENT_STRING_TABLE* strings;
+
+	/* Position of the next record to hand out from each ring, the cursors
+	 * only catch up with these when the records are released. */
+	LONG positions[EVENT_MAX_RINGS];
+} EVENT_STREAM, *PEVENT_STREAM;
+
+/******************** Public Constants ********************/
+
+/******************** Public Variables ********************/
+
+/******************** Public Prototypes ********************/
+
+static inline NTSTATUS EventStream_control(EVENT_OPERATION operation, PVM_PARAM_GATHER_EVENTS params)
+{
+	VMCALL_STATUS_BLOCK statusBlock = { 0 };
+
+	params->operation = operation;
+	params->statusBlock = &statusBlock;
+
+	VMCALL_COMMAND command;
+	command.action = VMCALL_ACTION_GATHER_EVENTS;
+	command.buffer = params;
+	command.bufferSize = sizeof(VM_PARAM_GATHER_EVENTS);
+
+	NTSTATUS status = VMCALL_actionHost(VMCALL_KEY, &command);
+	if (STATUS_PENDING == status)
+	{
+		/* The mapping is done by a worker within the hypervisor driver. */
+		while (STATUS_PENDING == statusBlock.status)
+		{
+			SwitchToThread();
+		}
+
+		status = statusBlock.status;
+	}
+
+	params->statusBlock = NULL;
+	return status;
+}
+
+/* Maps the event rings into the calling process, only one process can have them mapped at a time. */
+static inline NTSTATUS EventStream_open(PEVENT_STREAM stream)
+{
+	VM_PARAM_GATHER_EVENTS params = { 0 };
+
+	NTSTATUS status = EventStream_control(EVENT_OPERATION_MAP, &params);
+	if (0 <= status)
+	{
+		stream->rings = (const EVENT_RING*)params.rings;
+		stream->cursors = (PEVENT_CURSORS)params.cursors;
+		stream->ringCount = params.ringCount;
+		stream->strings = (const EVENT_STRING_TABLE*)&stream->rings[stream->ringCount];
+
+		/* Carry on from wherever the previous consumer got to. */
+		for (UINT32 i = 0; i < stream->ringCount; i++)
+		{
+			stream->positions[i] = stream->cursors->cursors[i].tail;
+		}
+	}
+
+	return status;
+}
+
+/* Unmaps the rings, any records that haven't been released are handed back to the file writer. */
+static inline NTSTATUS EventStream_close(PEVENT_STREAM stream)
+{
+	VM_PARAM_GATHER_EVENTS params = { 0 };
+
+	NTSTATUS status = EventStream_control(EVENT_OPERATION_UNMAP, &params);
+	if (0 <= status)
+	{
+		stream->rings = NULL;
+		stream->cursors = NULL;
+		stream->ringCount = 0;
+		stream->strings = NULL;
+	}
+
+	return status;
+}
+
+/* Returns the oldest committed record across all of the rings in place, or NULL if there are none.
+ * The record stays valid until EventStream_release is called, EventDecoder_decodeRecord
+ * pulls out its fields. */
+static inline const EVENT_RECORD_HEADER* EventStream_next(PEVENT_STREAM stream)
+{
+	const EVENT_RECORD_HEADER* result = NULL;
+	UINT32 resultRing = 0;
+
+	for (UINT32 i = 0; i < stream->ringCount; i++)
+	{
+		/* Padding records are skipped over for good. */
+		const EVENT_RECORD_HEADER* record = EventLog_peekRecord(&stream->rings[i], &stream->positions[i]);
+		if ((NULL != record) &&
+			((NULL == result) || (EventLog_recordTimeStamp(record) < EventLog_recordTimeStamp(result))))
+		{
+			result = record;
+			resultRing = i;
+		}
+	}
+
+	if (NULL != result)
+	{
+		stream->positions[resultRing] += result->size;
+	}
+
+	return result;
+}
+
+/* Hands every record returned so far back to the producers. Releasing in batches
+ * keeps the cursor cache lines from bouncing between the producers and the consumer. */
+static inline void EventStream_release(PEVENT_STREAM stream)
+{
+	for (UINT32 i = 0; i < stream->ringCount; i++)
+	{
+		if (stream->positions[i] != stream->cursors->cursors[i].tail)
+		{
+			EventLog_releaseRecords(&stream->cursors->cursors[i], stream->positions[i]);
+		}
+	}
+}
+
+/* Characters of the string a record refers to by EVENT_FIELD_STRING_ID, or NULL if there isn't one. */
+static inline const CHAR* EventStream_lookupString(const EVENT_STREAM* stream, UINT32 id, PUINT16 length)
+{
+	return EventLog_lookupString(stream->strings, id, length);
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,235 @@
+#pragma once
+#include <stdlib.h>
+#include <string.h>
+#include "EventLog_Common.h"
+
+/* Portable conversion of event timestamps to a common timeline.
+ *
+ * Each processor has its own TSC, which needn't agree with any other. The writer records
+ * an EVENT_CALIBRATION when each session starts and periodically after that, giving the
+ * TSC of every processor at the same instant along with the system time. A timestamp is
+ * converted by interpolating between the two calibrations either side of it, so drift of
+ * the TSC rate between calibrations doesn't accumulate.
+ *
+ * Collect the calibrations returned by EventDecoder_next with EventTimeline_add, call
+ * EventTimeline_finish once they all are, then convert with EventTimeline_toNanoseconds. */
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/******************** Public Defines ********************/
+
+/* 100ns intervals between 1601 and 1970. */
+#define EVENT_TIMELINE_EPOCH_DIFFERENCE 116444736000000000ULL
+
+/******************** Public Typedefs ********************/
+
+typedef struct _EVENT_TIMELINE_POINT
+{
+	UINT32 session;
+	UINT32 reserved;
+	UINT64 timeStampFrequency;	/* Of the session, zero if it isn't known. */
+	EVENT_CALIBRATION calibration;
+} EVENT_TIMELINE_POINT, *PEVENT_TIMELINE_POINT;
+
+typedef struct _EVENT_TIMELINE
+{
+	PEVENT_TIMELINE_POINT points;
+	size_t count;
+	size_t capacity;
+} EVENT_TIMELINE, *PEVENT_TIMELINE;
+
+/******************** Public Constants ********************/
+
+/******************** Public Variables ********************/
+
+/******************** Public Prototypes ********************/
+
+static void EventTimeline_init(PEVENT_TIMELINE timeline)
+{
+	memset(timeline, 0, sizeof(EVENT_TIMELINE));
+}
+
+static void EventTimeline_free(PEVENT_TIMELINE timeline)
+{
+	free(timeline->points);
+	memset(timeline, 0, sizeof(EVENT_TIMELINE));
+}
+
+/* Adds a calibration of the session, returns non zero on success. */
+static int EventTimeline_add(PEVENT_TIMELINE timeline, UINT32 session, UINT64 timeStampFrequency, const EVENT_CALIBRATION* calibration)
+{
+	int result = 1;
+
+	if (timeline->count == timeline->capacity)
+	{
+		size_t capacity = (0 == timeline->capacity) ? 64 : (timeline->capacity * 2);
+		PEVENT_TIMELINE_POINT points = (PEVENT_TIMELINE_POINT)realloc(timeline->points, capacity * sizeof(EVENT_TIMELINE_POINT));
+
+		if (NULL == points)
+		{
+			result = 0;
+		}
+		else
+		{
+			timeline->points = points;
+			timeline->capacity = capacity;
+		}
+	}
+
+	if (0 != result)
+	{
+		PEVENT_TIMELINE_POINT point = &timeline->points[timeline->count++];
+
+		memset(point, 0, sizeof(EVENT_TIMELINE_POINT));
+		point->session = session;
+		point->timeStampFrequency = timeStampFrequency;
+		memcpy(&point->calibration, calibration, sizeof(EVENT_CALIBRATION));
+
+		if (point->calibration.processorCount > EVENT_MAX_RINGS)
+		{
+			point->calibration.processorCount = EVENT_MAX_RINGS;
+		}
+	}
+
+	return result;
+}
+
+static int EventTimeline_comparePoints(const void* first, const void* second)
+{
+	const EVENT_TIMELINE_POINT* a = (const EVENT_TIMELINE_POINT*)first;
+	const EVENT_TIMELINE_POINT* b = (const EVENT_TIMELINE_POINT*)second;
+	int result = 0;
+
+	if (a->session != b->session)
+	{
+		result = (a->session < b->session) ? -1 : 1;
+	}
+	else if (a->calibration.referenceTime != b->calibration.referenceTime)
+	{
+		result = (a->calibration.referenceTime < b->calibration.referenceTime) ? -1 : 1;
+	}
+
+	return result;
+}
+
+/* Orders the calibrations, they are written in order but the sessions of a file needn't be. */
+static void EventTimeline_finish(PEVENT_TIMELINE timeline)
+{
+	if (timeline->count > 1)
+	{
+		qsort(timeline->points, timeline->count, sizeof(EVENT_TIMELINE_POINT), EventTimeline_comparePoints);
+	}
+}
+
+/* TSC of the processor within a calibration. Processors it doesn't cover (or that didn't
+ * arrive in time) fall back to processor 0, which is always read. */
+static UINT64 EventTimeline_timeStampOf(const EVENT_TIMELINE_POINT* point, UINT32 procIndex)
+{
+	UINT64 timeStamp = point->calibration.timeStamps[0];
+
+	if ((procIndex < point->calibration.processorCount) && (0 != point->calibration.timeStamps[procIndex]))
+	{
+		timeStamp = point->calibration.timeStamps[procIndex];
+	}
+
+	return timeStamp;
+}
+
+static UINT64 EventTimeline_referenceNanoseconds(const EVENT_TIMELINE_POINT* point)
+{
+	return (point->calibration.referenceTime - EVENT_TIMELINE_EPOCH_DIFFERENCE) * 100;
+}
+
+/* Converts the timestamp of an event to nanoseconds since 1970 (UTC). Returns zero if the
+ * session doesn't have any calibration, in which case the timestamp can't be converted. */
+static int EventTimeline_toNanoseconds(const EVENT_TIMELINE* timeline, UINT32 session, UINT32 procIndex, UINT64 timeStamp,
+									   UINT64* nanoseconds)
+{
+	int result = 0;
+	size_t first = 0;
+	size_t last = timeline->count;
+
+	/* The calibrations of the session, [first, last). */
+	while (first < last)
+	{
+		size_t middle = first + ((last - first) / 2);
+
+		if (timeline->points[middle].session < session)
+		{
+			first = middle + 1;
+		}
+		else
+		{
+			last = middle;
+		}
+	}
+
+	last = first;
+	while ((last < timeline->count) && (session == timeline->points[last].session))
+	{
+		last++;
+	}
+
+	if (last > first)
+	{
+		const EVENT_TIMELINE_POINT* before = &timeline->points[first];
+		const EVENT_TIMELINE_POINT* after = NULL;
+		double nanosecondsPerTick = 0.0;
+
+		if ((last - first) > 1)
+		{
+			/* The segment holding the timestamp, or the nearest one to extrapolate from. */
+			size_t low = first + 1;
+			size_t high = last - 1;
+
+			while (low < high)
+			{
+				size_t middle = low + ((high - low) / 2);
+
+				if (EventTimeline_timeStampOf(&timeline->points[middle], procIndex) <= timeStamp)
+				{
+					low = middle + 1;
+				}
+				else
+				{
+					high = middle;
+				}
+			}
+
+			before = &timeline->points[low - 1];
+			after = &timeline->points[low];
+
+			UINT64 beforeTimeStamp = EventTimeline_timeStampOf(before, procIndex);
+			UINT64 afterTimeStamp = EventTimeline_timeStampOf(after, procIndex);
+
+			if ((afterTimeStamp > beforeTimeStamp) && (after->calibration.referenceTime > before->calibration.referenceTime))
+			{
+				nanosecondsPerTick = (double)(EventTimeline_referenceNanoseconds(after) - EventTimeline_referenceNanoseconds(before)) /
+					(double)(afterTimeStamp - beforeTimeStamp);
+			}
+		}
+
+		/* With a single calibration, or a segment that can't be used, rely on the frequency. */
+		if ((0.0 == nanosecondsPerTick) && (0 != before->timeStampFrequency))
+		{
+			nanosecondsPerTick = 1000000000.0 / (double)before->timeStampFrequency;
+		}
+
+		if (0.0 != nanosecondsPerTick)
+		{
+			LONG64 ticks = (LONG64)(timeStamp - EventTimeline_timeStampOf(before, procIndex));
+
+			*nanoseconds = EventTimeline_referenceNanoseconds(before) + (UINT64)(LONG64)((double)ticks * nanosecondsPerTick);
+			result = 1;
+		}
+	}
+
+	return result;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,67 @@
+#pragma once
+
+/* The layout is shared with the tool that reads recorders back out of crash dumps on
+ * other platforms, so outside of Windows only the fixed width types it relies on are defined. */
+#ifdef _WIN32
+#include "ia32.h"
+#else
+#include <stdint.h>
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+#endif
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/******************** Public Defines ********************/
+
+/* Identifies a recorder within a crash dump, "HVFLIGHT" when read as characters. */
+#define FLIGHT_RECORDER_SIGNATURE 0x544847494C465648ULL
+#define FLIGHT_RECORDER_VERSION 1
+
+/* Exits held by each logical processor, as many as fit in a page alongside the header.
+ * A recorder never straddles a page, so it is intact whatever order a dump holds its pages in. */
+#define FLIGHT_RECORDER_RECORDS 84
+
+/******************** Public Typedefs ********************/
+
+/* A single exit, written with plain stores by the processor that took it. */
+typedef struct _FLIGHT_RECORD
+{
+	UINT64 timeStamp;		/* TSC when the exit started being handled. */
+	UINT64 guestRIP;
+	UINT64 guestCR3;
+	UINT64 qualification;
+	UINT32 exitReason;		/* In full, including the VM-entry failure bit. */
+	UINT32 handlerCycles;	/* Zero whilst the exit is still being handled, saturates. */
+	UINT32 sequence;		/* Exit number on the processor (truncated), zero if never written. */
+	UINT32 reserved;
+} FLIGHT_RECORD, *PFLIGHT_RECORD;
+
+/* The last exits of a logical processor, records[next] is the oldest once the recorder has wrapped. */
+typedef struct _FLIGHT_RECORDER
+{
+	UINT64 signature;
+	UINT32 version;
+	UINT32 processorIndex;
+	UINT32 recordCount;
+	UINT32 recordSize;
+	UINT32 next;
+	UINT32 reserved0;
+	UINT64 exitCount;
+	UINT64 reserved1[3];
+
+	FLIGHT_RECORD records[FLIGHT_RECORDER_RECORDS];
+} FLIGHT_RECORDER, *PFLIGHT_RECORDER;
+
+/******************** Public Constants ********************/
+
+/******************** Public Variables ********************/
+
+/******************** Public Prototypes ********************/
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,6 +1,7 @@
 #pragma once
 #include <ntifs.h>
 #include "VMM.h"
+#include "VMCALL_Common.h"
 
 /******************** Public Typedefs ********************/
 
@@ -10,4 +11,5 @@
 
 /******************** Public Prototypes ********************/
 
-BOOLEAN VMCALL_handle(PVMM_DATA lpData);
\ No newline at end of file
+BOOLEAN VMCALL_handle(PVMM_DATA lpData);
+NTSTATUS VMCALL_dispatchCommand(PVMM_DATA lpData, CR3 guestCR3, PVMCALL_COMMAND command);
\ No newline at end of file
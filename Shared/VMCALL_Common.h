@@ -1,4 +1,7 @@
 #pragma once
+#include "Profiler_Common.h"
+#include "EventFilter_Common.h"
+#include "FlightRecorder_Common.h"
 
 #ifdef __cplusplus
 extern "C"
@@ -14,9 +17,45 @@ typedef enum
 	VMCALL_ACTION_RUN_AS_ROOT,
 	VMCALL_ACTION_SHADOW_IN_PROCESS,
 	VMCALL_ACTION_GATHER_EVENTS,
+	VMCALL_ACTION_PROFILER_CONTROL,
+	VMCALL_ACTION_BATCH,
+	VMCALL_ACTION_RING_CONTROL,
+	VMCALL_ACTION_SET_EVENT_FILTER,		/* The buffer is an EVENT_FILTER. */
+	VMCALL_ACTION_DUMP_FLIGHT_RECORDER,
 	VMCALL_ACTION_COUNT
 } VMCALL_ACTION;
 
+/* Actions of the register only fast path, these never touch guest memory. */
+typedef enum
+{
+	VMCALL_FAST_ACTION_CHECK_PRESENCE = 0,
+	VMCALL_FAST_ACTION_READ_COUNTER,
+	VMCALL_FAST_ACTION_PROFILER_START,
+	VMCALL_FAST_ACTION_PROFILER_STOP,
+	VMCALL_FAST_ACTION_RING_DOORBELL,
+	VMCALL_FAST_ACTION_COUNT
+} VMCALL_FAST_ACTION;
+
+/* Counters that can be read with VMCALL_FAST_ACTION_READ_COUNTER. */
+typedef enum
+{
+	VMCALL_COUNTER_EXIT_COUNT = 0,		/* Exits taken by the processor that handles the VMCALL. */
+	VMCALL_COUNTER_PROFILER_PENDING,	/* Samples waiting to be drained for a processor. */
+	VMCALL_COUNTER_PROFILER_DROPPED,	/* Samples dropped since the last drain for a processor. */
+	VMCALL_COUNTER_EVENTS_WRITTEN,		/* Event records written to disk for a processor. */
+	VMCALL_COUNTER_EVENTS_DROPPED,		/* Event records dropped due to a full ring for a processor. */
+	VMCALL_COUNTER_EVENTS_FILTERED,		/* Events not recorded as they didn't match the event filter, for a processor. */
+	VMCALL_COUNTER_EVENTS_TRUNCATED,	/* Event strings cut short at EVENT_STRING_MAX_LENGTH, for a processor. */
+	VMCALL_COUNTER_COUNT
+} VMCALL_COUNTER;
+
+/* Registers of the fast path, on entry these are the arguments (R8 - R11),
+ * on return they hold the results (RDX, R8 - R10). */
+typedef struct _VMCALL_FAST_REGISTERS
+{
+	UINT64 values[4];
+} VMCALL_FAST_REGISTERS, *PVMCALL_FAST_REGISTERS;
+
 typedef struct _VMCALL_COMMAND
 {
 	VMCALL_ACTION action;
@@ -30,23 +69,104 @@ typedef struct _VM_PARAM_RUN_AS_ROOT
 	PVOID parameter;
 } VM_PARAM_RUN_AS_ROOT, *PVM_PARAM_RUN_AS_ROOT;
 
+/* Completion of an asynchronous action, the status stays STATUS_PENDING until the
+ * action has finished. It must be aligned and stay resident until then. */
+typedef struct DECLSPEC_ALIGN(16) _VMCALL_STATUS_BLOCK
+{
+	volatile LONG status;
+	UINT32 reserved;
+	UINT64 information;
+} VMCALL_STATUS_BLOCK, *PVMCALL_STATUS_BLOCK;
+
+/* Completed asynchronously, the VMCALL returns STATUS_PENDING once it has been queued. */
 typedef struct _VM_PARAM_SHADOW_PROC
 {
-	DWORD32 procID;				/* IN */
-	PUINT8 userTargetVA;		/* IN */
-	PUINT8 kernelExecPageVA;	/* IN */
+	DWORD32 procID;						/* IN */
+	PUINT8 userTargetVA;				/* IN */
+	PUINT8 kernelExecPageVA;			/* IN */
+	PVMCALL_STATUS_BLOCK statusBlock;	/* OUT, optional. */
 } VM_PARAM_SHADOW_PROC, *PVM_PARAM_SHADOW_PROC;
 
+typedef enum
+{
+	EVENT_OPERATION_MAP = 0,
+	EVENT_OPERATION_UNMAP
+} EVENT_OPERATION;
+
+/* Completed asynchronously, the mapping is written back once the status block completes. */
 typedef struct _VM_PARAM_GATHER_EVENTS
 {
-	SIZE_T bufferSize;			/* IN */
-	PUINT8 buffer;				/* INOUT */
-	SIZE_T eventCount;			/* OUT */
+	EVENT_OPERATION operation;			/* IN, the rings are mapped into the calling process. */
+	PVOID rings;						/* OUT, map only, read only array of EVENT_RING. */
+	PVOID cursors;						/* OUT, map only, EVENT_CURSORS advanced by the caller. */
+	UINT32 ringCount;					/* OUT, map only. */
+	PVMCALL_STATUS_BLOCK statusBlock;	/* OUT, optional. */
 } VM_PARAM_GATHER_EVENTS, *PVM_PARAM_GATHER_EVENTS;
 
+typedef enum
+{
+	PROFILER_OPERATION_START = 0,
+	PROFILER_OPERATION_STOP,
+	PROFILER_OPERATION_DRAIN
+} PROFILER_OPERATION;
+
+typedef struct _VM_PARAM_PROFILER_CONTROL
+{
+	PROFILER_OPERATION operation;	/* IN */
+	UINT32 processorIndex;			/* IN, PROFILER_ALL_PROCESSORS is valid for start/stop. */
+	UINT64 periodCycles;			/* IN, start only, sampling period in TSC cycles. */
+	PPROFILER_SAMPLE samples;		/* INOUT, drain only. */
+	SIZE_T sampleCapacity;			/* IN, drain only, number of samples the buffer can hold. */
+	SIZE_T sampleCount;				/* OUT, drain only. */
+	UINT32 droppedCount;			/* OUT, drain only, samples lost since the previous drain. */
+} VM_PARAM_PROFILER_CONTROL, *PVM_PARAM_PROFILER_CONTROL;
+
+typedef struct _VM_PARAM_BATCH
+{
+	PVMCALL_COMMAND commands;	/* IN, executed in order. */
+	SIZE_T commandCount;		/* IN */
+	NTSTATUS* statuses;			/* OUT, one per command executed. */
+	UINT32 flags;				/* IN, VMCALL_BATCH_FLAG_* */
+	SIZE_T completedCount;		/* OUT, number of commands executed. */
+} VM_PARAM_BATCH, *PVM_PARAM_BATCH;
+
+typedef enum
+{
+	RING_OPERATION_REGISTER = 0,
+	RING_OPERATION_UNREGISTER
+} RING_OPERATION;
+
+typedef struct _VM_PARAM_RING_CONTROL
+{
+	RING_OPERATION operation;	/* IN */
+	UINT32 ringId;				/* INOUT, returned by register, passed to unregister and the doorbell. */
+	PVOID ring;					/* IN, register only, page aligned COMMAND_RING. */
+	SIZE_T ringSize;			/* IN, register only. */
+} VM_PARAM_RING_CONTROL, *PVM_PARAM_RING_CONTROL;
+
+/* Recorders are copied as they are, so the buffer can be saved to a file and read by the same
+ * parser as a crash dump. Fails with STATUS_BUFFER_TOO_SMALL if there are more processors than
+ * recorders, in which case the first recorderCapacity recorders have still been copied. */
+typedef struct _VM_PARAM_DUMP_FLIGHT_RECORDER
+{
+	PFLIGHT_RECORDER recorders;	/* OUT, one per virtualised logical processor. */
+	UINT32 recorderCapacity;	/* IN */
+	UINT32 recorderCount;		/* OUT */
+} VM_PARAM_DUMP_FLIGHT_RECORDER, *PVM_PARAM_DUMP_FLIGHT_RECORDER;
+
 /******************** Public Constants ********************/
 
 #define VMCALL_KEY	((UINT64)0xDEADDEAD)
+#define VMCALL_FAST_KEY	((UINT64)0xDEADFA57)
+
+/* Stop executing a batch as soon as one of its commands fails. */
+#define VMCALL_BATCH_FLAG_STOP_ON_ERROR	0x00000001
+
+/* Maximum number of commands that can be submitted in a single batch. */
+#define VMCALL_BATCH_MAX_COMMANDS	4096
+
+/* Returned in the first result register of a fast presence check. */
+#define VMCALL_FAST_SIGNATURE	((UINT64)0x564D49)
 
 /******************** Public Variables ********************/
 
@@ -55,6 +175,9 @@ typedef struct _VM_PARAM_GATHER_EVENTS
 /* Calling convention of the function for calling the host. */
 NTSTATUS VMCALL_actionHost(UINT64 key, PVMCALL_COMMAND command);
 
+/* Calling convention of the register only fast path, registers are both the input and output. */
+NTSTATUS VMCALL_fastActionHost(UINT64 key, VMCALL_FAST_ACTION action, PVMCALL_FAST_REGISTERS registers);
+
 #ifdef __cplusplus
 }
 #endif
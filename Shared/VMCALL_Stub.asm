@@ -1,3 +1,6 @@
+; Plain ml64 so that the stub can be assembled into the user mode tools as well as the
+; driver, ksamd64.inc is only available to kernel mode builds.
+
     .code
 
 	VMCALL_actionHost PROC
@@ -13,4 +16,36 @@
 
 	VMCALL_actionHost ENDP
 
+	; RBX is saved in a prologue of its own, so the stack can still be unwound should the
+	; guest fault on the registers block.
+	VMCALL_fastActionHost PROC FRAME
+
+	push rbx
+	.pushreg rbx
+	.endprolog
+
+	; RCX holds the fast key, RDX holds the action.
+	; R8 holds a pointer to VMCALL_FAST_REGISTERS, the arguments are loaded
+	; into R8 - R11 and the results are returned in RDX, R8 - R10.
+	mov rbx, r8
+
+	mov r8, [rbx]
+	mov r9, [rbx + 8]
+	mov r10, [rbx + 16]
+	mov r11, [rbx + 24]
+
+	vmcall
+
+	mov [rbx], rdx
+	mov [rbx + 8], r8
+	mov [rbx + 16], r9
+	mov [rbx + 24], r10
+
+	; RAX will contain the result NTSTATUS, set by the host.
+
+	pop rbx
+	ret
+
+	VMCALL_fastActionHost ENDP
+
     end
\ No newline at end of file
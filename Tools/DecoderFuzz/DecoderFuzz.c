@@ -0,0 +1,323 @@
+/* Fuzzes the instruction decoder the hooks use against the LLVM disassembler, then measures how
+ * long each takes per instruction.
+ *
+ * Inputs are random bytes, and random bytes behind a random run of prefixes and escapes so the
+ * less common maps get exercised as much as the one byte map. Each input is decoded by both and
+ * the lengths compared, any instruction they both accept but disagree on the length of is a
+ * failure, as that is what would leave a hook splitting an instruction. Instructions only one of
+ * them accepts are counted, the decoder doesn't check operands so it accepts some encodings LLVM
+ * rejects. Near branches with a 66 prefix are skipped, LLVM decodes them the AMD way with rel16
+ * whereas the decoder follows Intel, which ignores the prefix.
+ *
+ * The instructions both agree on are then laid end to end and decoded in a loop by each.
+ *
+ * Needs the LLVM C API, build with Hypervisor/ on the include path:
+ *
+ *	cc -O2 -std=gnu99 -I../../Hypervisor DecoderFuzz.c ../../Hypervisor/Decoder.c \
+ *		$(llvm-config --cflags --ldflags --libs) -o DecoderFuzz
+ *
+ * Usage: DecoderFuzz [iterations] [seed] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <llvm-c/Disassembler.h>
+#include <llvm-c/Target.h>
+#include "Decoder.h"
+
+/******************** External API ********************/
+
+
+/******************** Module Typedefs ********************/
+
+
+/******************** Module Constants ********************/
+
+#define DEFAULT_ITERATIONS 2000000
+
+/* Mismatches printed before the rest are only counted. */
+#define MAX_REPORTED 20
+
+/* Size of the stream of instructions decoded by the benchmark, and times it is decoded. */
+#define STREAM_SIZE (1024 * 1024)
+#define STREAM_PASSES 20
+
+#define FUZZ_ADDRESS 0x140001000ULL
+
+/* Bytes that can start an instruction, the prefixes and escapes are weighted towards. */
+static const unsigned char LEADING_BYTES[] =
+{
+	0x66, 0x67, 0xF0, 0xF2, 0xF3, 0x2E, 0x3E, 0x26, 0x64, 0x65, 0x36,
+	0x40, 0x41, 0x44, 0x48, 0x49, 0x4C, 0x4D, 0x4F,
+	0x0F, 0xC4, 0xC5, 0x62, 0x8F,
+};
+
+/* LLVM returns a prefix that doesn't apply to what follows it as an instruction of its own. */
+static const char* const PREFIX_MNEMONICS[] =
+{
+	"lock", "rep", "repne", "repe", "xacquire", "xrelease", "cs", "ds", "es", "fs", "gs", "ss", "data16", "data32", "addr32", "rex64", "rex",
+};
+
+/******************** Module Variables ********************/
+
+static unsigned long long randomState = 0;
+
+/******************** Module Prototypes ********************/
+static unsigned int nextRandom(void);
+static void generateInput(unsigned char* input);
+static int isSkipped(const DECODED_INSTRUCTION* decoded);
+static int isPrefixOnly(const char* text);
+static void printBytes(const unsigned char* bytes, unsigned int length);
+static double elapsedNanoseconds(const struct timespec* start, const struct timespec* end);
+
+/******************** Public Code ********************/
+
+int main(int argc, char** argv)
+{
+	int result = EXIT_FAILURE;
+
+	unsigned long iterations = (argc > 1) ? strtoul(argv[1], NULL, 0) : DEFAULT_ITERATIONS;
+	unsigned long long seed = (argc > 2) ? strtoull(argv[2], NULL, 0) : (unsigned long long)time(NULL);
+
+	LLVMDisasmContextRef disassembler = NULL;
+	unsigned char* stream = NULL;
+
+	LLVMInitializeX86TargetInfo();
+	LLVMInitializeX86TargetMC();
+	LLVMInitializeX86Disassembler();
+
+	if ((argc > 3) || (0 == iterations))
+	{
+		printf("Usage: %s [iterations] [seed]\n", argv[0]);
+	}
+	else if (NULL == (disassembler = LLVMCreateDisasm("x86_64-unknown-linux-gnu", NULL, 0, NULL, NULL)))
+	{
+		printf("Unable to create the LLVM disassembler.\n");
+	}
+	else if (NULL == (stream = (unsigned char*)malloc(STREAM_SIZE + DECODER_MAX_LENGTH)))
+	{
+		printf("Unable to allocate the instruction stream.\n");
+	}
+	else
+	{
+		unsigned long lengthMismatches = 0;
+		unsigned long decoderOnly = 0;
+		unsigned long referenceOnly = 0;
+		unsigned long agreed = 0;
+		unsigned long skipped = 0;
+		size_t streamSize = 0;
+		unsigned long streamCount = 0;
+
+		randomState = seed;
+		printf("Seed %llu, %lu iterations.\n", seed, iterations);
+
+		for (unsigned long i = 0; i < iterations; i++)
+		{
+			unsigned char input[DECODER_MAX_LENGTH];
+			char text[256];
+			DECODED_INSTRUCTION decoded;
+
+			generateInput(input);
+
+			unsigned int length = Decoder_decode(input, sizeof(input), FUZZ_ADDRESS, &decoded);
+			unsigned int referenceLength = (unsigned int)LLVMDisasmInstruction(disassembler, input, sizeof(input),
+																			   FUZZ_ADDRESS, text, sizeof(text));
+			if ((0 != referenceLength) && (0 != isPrefixOnly(text)))
+			{
+				referenceLength = 0;
+			}
+
+			if ((0 != length) && (0 != isSkipped(&decoded)))
+			{
+				skipped++;
+			}
+			else if ((0 != length) && (0 != referenceLength) && (length != referenceLength))
+			{
+				if (lengthMismatches < MAX_REPORTED)
+				{
+					printf("Length %u, LLVM %u:", length, referenceLength);
+					printBytes(input, sizeof(input));
+					printf("  %s\n", text);
+				}
+
+				lengthMismatches++;
+			}
+			else if ((0 == length) && (0 != referenceLength))
+			{
+				if (referenceOnly < MAX_REPORTED)
+				{
+					printf("Rejected, LLVM %u:", referenceLength);
+					printBytes(input, referenceLength);
+					printf("  %s\n", text);
+				}
+
+				referenceOnly++;
+			}
+			else if ((0 != length) && (0 == referenceLength))
+			{
+				decoderOnly++;
+			}
+			else if (0 != length)
+			{
+				agreed++;
+
+				if ((streamSize + length) <= STREAM_SIZE)
+				{
+					memcpy(stream + streamSize, input, length);
+					streamSize += length;
+					streamCount++;
+				}
+			}
+		}
+
+		printf("%lu agreed, %lu length mismatches, %lu only LLVM accepted, %lu only the decoder accepted, %lu skipped.\n",
+			   agreed, lengthMismatches, referenceOnly, decoderOnly, skipped);
+
+		if (0 != streamCount)
+		{
+			struct timespec start;
+			struct timespec end;
+			unsigned long long decodedCount = 0;
+			char text[256];
+
+			/* Padding so the last instruction can be read with the full length available. */
+			memset(stream + streamSize, 0x90, DECODER_MAX_LENGTH);
+
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			for (unsigned int pass = 0; pass < STREAM_PASSES; pass++)
+			{
+				for (size_t position = 0; position < streamSize; decodedCount++)
+				{
+					DECODED_INSTRUCTION decoded;
+					position += Decoder_decode(stream + position, DECODER_MAX_LENGTH, FUZZ_ADDRESS + position, &decoded);
+				}
+			}
+			clock_gettime(CLOCK_MONOTONIC, &end);
+
+			printf("Decoder: %.1f ns per instruction.\n", elapsedNanoseconds(&start, &end) / (double)decodedCount);
+
+			decodedCount = 0;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			for (size_t position = 0; position < streamSize; decodedCount++)
+			{
+				position += LLVMDisasmInstruction(disassembler, stream + position, DECODER_MAX_LENGTH,
+												  FUZZ_ADDRESS + position, text, sizeof(text));
+			}
+			clock_gettime(CLOCK_MONOTONIC, &end);
+
+			printf("LLVM: %.1f ns per instruction.\n", elapsedNanoseconds(&start, &end) / (double)decodedCount);
+		}
+
+		result = (0 == lengthMismatches) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	free(stream);
+
+	if (NULL != disassembler)
+	{
+		LLVMDisasmDispose(disassembler);
+	}
+
+	return result;
+}
+
+/******************** Module Code ********************/
+
+static unsigned int nextRandom(void)
+{
+	/* xorshift64*, the same sequence for the same seed on every platform. */
+	randomState ^= randomState >> 12;
+	randomState ^= randomState << 25;
+	randomState ^= randomState >> 27;
+
+	return (unsigned int)((randomState * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+static void generateInput(unsigned char* input)
+{
+	unsigned int leadingCount = 0;
+
+	for (unsigned int i = 0; i < DECODER_MAX_LENGTH; i++)
+	{
+		input[i] = (unsigned char)nextRandom();
+	}
+
+	/* Half are left entirely random, the rest start with up to four prefixes and escapes. */
+	if (0 != (nextRandom() & 1))
+	{
+		leadingCount = 1 + (nextRandom() % 4);
+	}
+
+	for (unsigned int i = 0; i < leadingCount; i++)
+	{
+		input[i] = LEADING_BYTES[nextRandom() % sizeof(LEADING_BYTES)];
+	}
+
+	/* Register forms are just as likely as memory ones in random bytes, bias some towards memory. */
+	if (0 != (nextRandom() % 3))
+	{
+		unsigned int position = leadingCount + (nextRandom() % 3) + 1;
+		if (position < DECODER_MAX_LENGTH)
+		{
+			input[position] &= 0x3F;
+		}
+	}
+}
+
+static int isSkipped(const DECODED_INSTRUCTION* decoded)
+{
+	return (0 != (decoded->flags & DECODER_FLAG_RELATIVE)) && (0 != (decoded->flags & DECODER_FLAG_OPERAND_SIZE)) &&
+		(4 == decoded->immediateSize);
+}
+
+static int isPrefixOnly(const char* text)
+{
+	int result = 1;
+
+	while ((0 != result) && ('\0' != *text))
+	{
+		size_t length = 0;
+
+		while (0 != isspace((unsigned char)*text))
+		{
+			text++;
+		}
+
+		while (('\0' != text[length]) && (0 == isspace((unsigned char)text[length])))
+		{
+			length++;
+		}
+
+		if (0 != length)
+		{
+			result = 0;
+
+			for (size_t i = 0; i < (sizeof(PREFIX_MNEMONICS) / sizeof(PREFIX_MNEMONICS[0])); i++)
+			{
+				if ((strlen(PREFIX_MNEMONICS[i]) == length) && (0 == strncmp(PREFIX_MNEMONICS[i], text, length)))
+				{
+					result = 1;
+				}
+			}
+		}
+
+		text += length;
+	}
+
+	return result;
+}
+
+static void printBytes(const unsigned char* bytes, unsigned int length)
+{
+	for (unsigned int i = 0; i < length; i++)
+	{
+		printf(" %02X", bytes[i]);
+	}
+}
+
+static double elapsedNanoseconds(const struct timespec* start, const struct timespec* end)
+{
+	return ((double)(end->tv_sec - start->tv_sec) * 1e9) + (double)(end->tv_nsec - start->tv_nsec);
+}
@@ -0,0 +1,913 @@
+/* Offline analyzer for event log files, both EventLog.hvt and the legacy EventLog.bin.
+ *
+ * The log is mapped rather than read, and a sidecar index (<log>.idx) is built on first
+ * use and whenever the log has changed since. The index holds one entry per record in
+ * time order, made by merging the streams of each logical processor, and two
+ * orderings of those entries: by processor then time, and by CR3 then time.
+ * Queries binary search whichever ordering suits them, so they only touch the records
+ * that match rather than scanning the whole log.
+ *
+ * Times are nanoseconds since 1970 (UTC), converted from the TSC of each processor with the
+ * calibrations of the log (Shared/EventTimeline.h). Sessions without any calibration, and
+ * legacy logs, keep their raw TSC values instead. Records are decoded with Shared/EventDecoder.h.
+ *
+ * Portable to any POSIX system, build with Shared/ on the include path:
+ *
+ *	cc -O2 -std=c99 -I../../Shared EventAnalyzer.c -o EventAnalyzer
+ *
+ * Usage: EventAnalyzer <log> <command> [options]
+ *
+ *	stats							Record counts and time span for each processor.
+ *	list							Prints the matching records in time order.
+ *	count [--by cpu|cr3]			Counts the matching records, optionally grouped.
+ *
+ *	--from <ns> --to <ns>			Inclusive range of times.
+ *	--cpu <index>					Only records from this logical processor.
+ *	--cr3 <value>					Only records with this CR3.
+ *	--limit <count>					Maximum number of records to list. */
+
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "EventDecoder.h"
+#include "EventTimeline.h"
+
+/******************** External API ********************/
+
+
+/******************** Module Typedefs ********************/
+
+/* A record of the log. The timestamp, processor and CR3 are held in full, so a
+ * delta encoded record can be decoded in isolation. */
+typedef struct _INDEX_ENTRY
+{
+	UINT64 time;		/* Nanoseconds since 1970, or the timestamp if the session isn't calibrated. */
+	UINT64 timeStamp;
+	UINT64 offset;		/* Of the record within the log. */
+	UINT64 cr3;			/* INDEX_NO_CR3 if the record doesn't have one. */
+	UINT64 string;		/* Offset of the length prefixed definition of its interned string, zero if none. */
+	UINT32 procIndex;
+	UINT32 session;
+} INDEX_ENTRY, *PINDEX_ENTRY;
+
+typedef struct _INDEX_HEADER
+{
+	UINT32 magic;
+	UINT32 version;
+
+	/* Identifies the log the index was built from. */
+	UINT64 logSize;
+	UINT64 logModified;		/* In nanoseconds. */
+
+	UINT64 entryCount;
+	UINT64 corruptOffset;	/* Where decoding stopped, the log size if it didn't. */
+} INDEX_HEADER, *PINDEX_HEADER;
+
+/* Following the header are the entries, then two arrays of entry numbers,
+ * ordered by processor then time and by CR3 then time. */
+typedef struct _EVENT_INDEX
+{
+	const INDEX_HEADER* header;
+	const INDEX_ENTRY* entries;
+	const UINT32* byProcessor;
+	const UINT32* byCR3;
+
+	void* mapping;
+	size_t mappingSize;
+} EVENT_INDEX, *PEVENT_INDEX;
+
+typedef enum
+{
+	ORDER_TIME = 0,
+	ORDER_PROCESSOR,
+	ORDER_CR3
+} ORDER;
+
+typedef struct _QUERY
+{
+	UINT64 from;
+	UINT64 to;
+	int haveProcessor;
+	UINT32 procIndex;
+	int haveCR3;
+	UINT64 cr3;
+	UINT64 limit;
+	const char* groupBy;
+} QUERY, *PQUERY;
+
+/* Position within the stream of a processor during the merge. */
+typedef struct _MERGE_CURSOR
+{
+	UINT64 next;
+	UINT64 end;
+} MERGE_CURSOR, *PMERGE_CURSOR;
+
+/******************** Module Constants ********************/
+
+#define INDEX_MAGIC 0x58494648
+#define INDEX_VERSION 3
+#define INDEX_NO_CR3 (~(UINT64)0)
+
+/******************** Module Variables ********************/
+
+/* The mapped log, and the entries being sorted whilst the index is built. */
+static const UINT8* logData = NULL;
+static size_t logSize = 0;
+static const INDEX_ENTRY* sortEntries = NULL;
+
+/******************** Module Prototypes ********************/
+static int mapFile(const char* fileName, void** mapping, size_t* size);
+static int loadIndex(const char* indexName, const struct stat* logStat, PEVENT_INDEX index);
+static int buildIndex(const char* indexName, const struct stat* logStat);
+static int readLog(PINDEX_ENTRY* entries, size_t* capacity, PINDEX_HEADER header, UINT64* processorCounts);
+static void mergeProcessors(const INDEX_ENTRY* byProcessor, const UINT64* processorStart, PINDEX_ENTRY entries,
+							UINT32* order);
+static int parseQuery(int argc, char** argv, PQUERY query);
+static UINT64 lowerBound(const EVENT_INDEX* index, ORDER order, UINT64 major, UINT64 time);
+static UINT64 upperBound(const EVENT_INDEX* index, ORDER order, UINT64 major, UINT64 time);
+static UINT64 entryAt(const EVENT_INDEX* index, ORDER order, UINT64 position);
+static UINT64 majorKey(const INDEX_ENTRY* entry, ORDER order);
+static void selectRange(const EVENT_INDEX* index, const QUERY* query, ORDER* order, UINT64* first, UINT64* last);
+static int matchesQuery(const INDEX_ENTRY* entry, const QUERY* query);
+static void decodeEntry(const INDEX_ENTRY* entry, PEVENT_DECODED decoded);
+static void commandStats(const EVENT_INDEX* index);
+static void commandList(const EVENT_INDEX* index, const QUERY* query);
+static void commandCount(const EVENT_INDEX* index, const QUERY* query);
+static int compareStream(const void* a, const void* b);
+static int compareCR3(const void* a, const void* b);
+static UINT64 modifiedTime(const struct stat* fileStat);
+static double elapsedMilliseconds(const struct timespec* start);
+
+/******************** Public Code ********************/
+
+int main(int argc, char** argv)
+{
+	int result = EXIT_FAILURE;
+
+	const char* logName = (argc > 1) ? argv[1] : "";
+	const char* command = (argc > 2) ? argv[2] : "";
+
+	char indexName[4096];
+	snprintf(indexName, sizeof(indexName), "%s.idx", logName);
+
+	QUERY query;
+	struct stat logStat;
+	void* logMapping = NULL;
+	EVENT_INDEX index = { 0 };
+
+	if ((argc < 3) || (0 == parseQuery(argc - 3, argv + 3, &query)))
+	{
+		printf("Usage: %s <log> stats|list|count [--from ns] [--to ns] [--cpu index] [--cr3 value] "
+			   "[--limit count] [--by cpu|cr3]\n", argv[0]);
+	}
+	else if ((0 != stat(logName, &logStat)) || (0 == mapFile(logName, &logMapping, &logSize)))
+	{
+		printf("Unable to map %s.\n", logName);
+	}
+	else
+	{
+		logData = (const UINT8*)logMapping;
+
+		/* The index is only rebuilt when it doesn't describe the log as it is now. */
+		if (0 == loadIndex(indexName, &logStat, &index))
+		{
+			struct timespec start;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+
+			if ((0 != buildIndex(indexName, &logStat)) && (0 != loadIndex(indexName, &logStat, &index)))
+			{
+				fprintf(stderr, "Indexed %llu records in %.1f ms.\n", (unsigned long long)index.header->entryCount,
+						elapsedMilliseconds(&start));
+			}
+		}
+
+		if (NULL == index.header)
+		{
+			printf("Unable to index %s.\n", logName);
+		}
+		else
+		{
+			struct timespec start;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+
+			if (index.header->corruptOffset != index.header->logSize)
+			{
+				fprintf(stderr, "Log is corrupt from offset %llu, the rest of it is ignored.\n",
+						(unsigned long long)index.header->corruptOffset);
+			}
+
+			result = EXIT_SUCCESS;
+
+			if (0 == strcmp(command, "stats"))
+			{
+				commandStats(&index);
+			}
+			else if (0 == strcmp(command, "list"))
+			{
+				commandList(&index, &query);
+			}
+			else if (0 == strcmp(command, "count"))
+			{
+				commandCount(&index, &query);
+			}
+			else
+			{
+				printf("Unknown command %s.\n", command);
+				result = EXIT_FAILURE;
+			}
+
+			fprintf(stderr, "Query took %.3f ms.\n", elapsedMilliseconds(&start));
+			munmap(index.mapping, index.mappingSize);
+		}
+
+		munmap(logMapping, logSize);
+	}
+
+	return result;
+}
+
+/******************** Module Code ********************/
+
+static int mapFile(const char* fileName, void** mapping, size_t* size)
+{
+	int result = 0;
+
+	int file = open(fileName, O_RDONLY);
+	if (file >= 0)
+	{
+		struct stat fileStat;
+		if ((0 == fstat(file, &fileStat)) && (fileStat.st_size > 0))
+		{
+			*size = (size_t)fileStat.st_size;
+			*mapping = mmap(NULL, *size, PROT_READ, MAP_SHARED, file, 0);
+			result = (MAP_FAILED != *mapping);
+		}
+
+		close(file);
+	}
+
+	return result;
+}
+
+static int loadIndex(const char* indexName, const struct stat* logStat, PEVENT_INDEX index)
+{
+	int result = 0;
+
+	void* mapping;
+	size_t size;
+
+	if (0 != mapFile(indexName, &mapping, &size))
+	{
+		const INDEX_HEADER* header = (const INDEX_HEADER*)mapping;
+
+		if ((size >= sizeof(INDEX_HEADER)) && (INDEX_MAGIC == header->magic) && (INDEX_VERSION == header->version) &&
+			((UINT64)logStat->st_size == header->logSize) && (modifiedTime(logStat) == header->logModified) &&
+			(size == (sizeof(INDEX_HEADER) + (header->entryCount * (sizeof(INDEX_ENTRY) + (2 * sizeof(UINT32)))))))
+		{
+			index->header = header;
+			index->entries = (const INDEX_ENTRY*)(header + 1);
+			index->byProcessor = (const UINT32*)(index->entries + header->entryCount);
+			index->byCR3 = index->byProcessor + header->entryCount;
+			index->mapping = mapping;
+			index->mappingSize = size;
+			result = 1;
+		}
+		else
+		{
+			munmap(mapping, size);
+		}
+	}
+
+	return result;
+}
+
+static int buildIndex(const char* indexName, const struct stat* logStat)
+{
+	int result = 0;
+
+	INDEX_HEADER header = { 0 };
+	header.magic = INDEX_MAGIC;
+	header.version = INDEX_VERSION;
+	header.logSize = logSize;
+	header.logModified = modifiedTime(logStat);
+
+	UINT64 processorCounts[EVENT_MAX_RINGS] = { 0 };
+	UINT64 processorStart[EVENT_MAX_RINGS + 1] = { 0 };
+
+	/* Records are at least 16 bytes, start off assuming they are around the size of the default capture. */
+	size_t capacity = (logSize / 256) + 1024;
+	PINDEX_ENTRY fileOrder = (PINDEX_ENTRY)malloc(capacity * sizeof(INDEX_ENTRY));
+
+	if (NULL != fileOrder)
+	{
+		int complete = readLog(&fileOrder, &capacity, &header, processorCounts);
+
+		for (UINT32 i = 0; i < EVENT_MAX_RINGS; i++)
+		{
+			processorStart[i + 1] = processorStart[i] + processorCounts[i];
+		}
+
+		size_t entrySize = header.entryCount * sizeof(INDEX_ENTRY);
+		size_t orderSize = header.entryCount * sizeof(UINT32);
+
+		PINDEX_ENTRY byProcessor = (PINDEX_ENTRY)malloc(entrySize + 1);
+		PINDEX_ENTRY entries = (PINDEX_ENTRY)malloc(entrySize + 1);
+		UINT32* processorOrder = (UINT32*)malloc(orderSize + 1);
+		UINT32* cr3Order = (UINT32*)malloc(orderSize + 1);
+
+		if ((0 != complete) && (header.entryCount <= UINT32_MAX) && (NULL != byProcessor) && (NULL != entries) &&
+			(NULL != processorOrder) && (NULL != cr3Order))
+		{
+			/* Split the records into the stream of each processor, keeping their order within the file. */
+			UINT64 positions[EVENT_MAX_RINGS];
+			memcpy(positions, processorStart, sizeof(positions));
+
+			for (UINT64 i = 0; i < header.entryCount; i++)
+			{
+				byProcessor[positions[fileOrder[i].procIndex]++] = fileOrder[i];
+			}
+
+			/* Each stream is almost in order already, producers on the same processor
+			 * can only be out of order when one interrupted another, or the log holds
+			 * more than one session. */
+			for (UINT32 i = 0; i < EVENT_MAX_RINGS; i++)
+			{
+				qsort(&byProcessor[processorStart[i]], processorCounts[i], sizeof(INDEX_ENTRY), compareStream);
+			}
+
+			mergeProcessors(byProcessor, processorStart, entries, processorOrder);
+
+			/* Entries are in time order, so ordering by CR3 then entry number keeps them in time order. */
+			for (UINT64 i = 0; i < header.entryCount; i++)
+			{
+				cr3Order[i] = (UINT32)i;
+			}
+
+			sortEntries = entries;
+			qsort(cr3Order, header.entryCount, sizeof(UINT32), compareCR3);
+			sortEntries = NULL;
+
+			FILE* indexFile = fopen(indexName, "wb");
+			if (NULL != indexFile)
+			{
+				result = (1 == fwrite(&header, sizeof(header), 1, indexFile)) &&
+					(header.entryCount == fwrite(entries, sizeof(INDEX_ENTRY), header.entryCount, indexFile)) &&
+					(header.entryCount == fwrite(processorOrder, sizeof(UINT32), header.entryCount, indexFile)) &&
+					(header.entryCount == fwrite(cr3Order, sizeof(UINT32), header.entryCount, indexFile));
+
+				result &= (0 == fclose(indexFile));
+			}
+		}
+
+		free(byProcessor);
+		free(entries);
+		free(processorOrder);
+		free(cr3Order);
+	}
+
+	free(fileOrder);
+	return result;
+}
+
+/* Decodes every record of the log into an entry, in file order. Times are converted once the
+ * whole log has been read, as a record is interpolated between the calibrations either side. */
+static int readLog(PINDEX_ENTRY* entries, size_t* capacity, PINDEX_HEADER header, UINT64* processorCounts)
+{
+	int result = 1;
+
+	EVENT_DECODER decoder;
+	EVENT_DECODED decoded;
+	EVENT_DECODE_RESULT decodeResult;
+	EVENT_TIMELINE timeline;
+	size_t corruptOffset;
+
+	EventDecoder_open(&decoder, logData, logSize);
+	EventTimeline_init(&timeline);
+	header->corruptOffset = logSize;
+
+	for (;;)
+	{
+		corruptOffset = decoder.offset;
+
+		decodeResult = EventDecoder_next(&decoder, &decoded);
+		if (EVENT_DECODE_CALIBRATION == decodeResult)
+		{
+			if (0 == EventTimeline_add(&timeline, decoder.session, decoder.timeStampFrequency, &decoder.calibration))
+			{
+				result = 0;
+				break;
+			}
+
+			continue;
+		}
+
+		if (EVENT_DECODE_STRING == decodeResult)
+		{
+			continue;
+		}
+
+		if (EVENT_DECODE_OK != decodeResult)
+		{
+			break;
+		}
+
+		if (header->entryCount == *capacity)
+		{
+			PINDEX_ENTRY newEntries = (PINDEX_ENTRY)realloc(*entries, *capacity * 2 * sizeof(INDEX_ENTRY));
+			if (NULL == newEntries)
+			{
+				result = 0;
+				break;
+			}
+
+			*entries = newEntries;
+			*capacity *= 2;
+		}
+
+		/* Records of processors beyond what the hypervisor supports can't be genuine. */
+		if (decoded.procIndex >= EVENT_MAX_RINGS)
+		{
+			decodeResult = EVENT_DECODE_CORRUPT;
+			break;
+		}
+
+		PINDEX_ENTRY entry = &(*entries)[header->entryCount++];
+		entry->time = decoded.timeStamp;
+		entry->timeStamp = decoded.timeStamp;
+		entry->offset = decoder.recordOffset;
+		entry->cr3 = (0 != (decoded.fields & EVENT_FIELD_CR3)) ? decoded.cr3 : INDEX_NO_CR3;
+		entry->string = 0;
+		entry->procIndex = decoded.procIndex;
+
+		/* The definition is somewhere before the record, decoding the record alone can't find it. */
+		if ((0 != (decoded.fields & EVENT_FIELD_STRING_ID)) && (0 != (decoded.fields & EVENT_FIELD_STRING)))
+		{
+			entry->string = (UINT64)(((const UINT8*)decoded.string - sizeof(UINT16)) - logData);
+		}
+		entry->session = decoder.session;
+
+		processorCounts[decoded.procIndex]++;
+	}
+
+	/* Decoding gives up on the rest of the log at the first corrupt record. */
+	if (EVENT_DECODE_CORRUPT == decodeResult)
+	{
+		header->corruptOffset = corruptOffset;
+	}
+
+	EventTimeline_finish(&timeline);
+
+	for (UINT64 i = 0; (0 != result) && (i < header->entryCount); i++)
+	{
+		PINDEX_ENTRY entry = &(*entries)[i];
+		EventTimeline_toNanoseconds(&timeline, entry->session, entry->procIndex, entry->timeStamp, &entry->time);
+	}
+
+	EventTimeline_free(&timeline);
+	return result;
+}
+
+static void mergeProcessors(const INDEX_ENTRY* byProcessor, const UINT64* processorStart, PINDEX_ENTRY entries,
+							UINT32* order)
+{
+	/* K-way merge of the streams with a binary heap of the processors, keyed by the time
+	 * of their next record. As byProcessor is ordered by processor then timestamp, noting where
+	 * each record ends up gives the by processor ordering of the merged entries. */
+	MERGE_CURSOR cursors[EVENT_MAX_RINGS];
+	UINT32 heap[EVENT_MAX_RINGS];
+	UINT32 heapCount = 0;
+
+	for (UINT32 i = 0; i < EVENT_MAX_RINGS; i++)
+	{
+		cursors[i].next = processorStart[i];
+		cursors[i].end = processorStart[i + 1];
+
+		if (cursors[i].next != cursors[i].end)
+		{
+			/* Sift up. */
+			UINT32 child = heapCount++;
+			while ((child > 0) && (byProcessor[cursors[heap[(child - 1) / 2]].next].time > byProcessor[cursors[i].next].time))
+			{
+				heap[child] = heap[(child - 1) / 2];
+				child = (child - 1) / 2;
+			}
+
+			heap[child] = i;
+		}
+	}
+
+	for (UINT64 output = 0; 0 != heapCount; output++)
+	{
+		UINT32 processor = heap[0];
+		PMERGE_CURSOR cursor = &cursors[processor];
+
+		entries[output] = byProcessor[cursor->next];
+		order[cursor->next] = (UINT32)output;
+		cursor->next++;
+
+		/* Replace the root with the same processor, or the last of the heap once it has run out. */
+		if (cursor->next == cursor->end)
+		{
+			processor = heap[--heapCount];
+		}
+
+		UINT32 parent = 0;
+		for (;;)
+		{
+			UINT32 child = (2 * parent) + 1;
+			if (child >= heapCount)
+			{
+				break;
+			}
+
+			if (((child + 1) < heapCount) &&
+				(byProcessor[cursors[heap[child + 1]].next].time < byProcessor[cursors[heap[child]].next].time))
+			{
+				child++;
+			}
+
+			if (byProcessor[cursors[heap[child]].next].time >= byProcessor[cursors[processor].next].time)
+			{
+				break;
+			}
+
+			heap[parent] = heap[child];
+			parent = child;
+		}
+
+		if (0 != heapCount)
+		{
+			heap[parent] = processor;
+		}
+	}
+}
+
+static int parseQuery(int argc, char** argv, PQUERY query)
+{
+	int result = 1;
+
+	memset(query, 0, sizeof(QUERY));
+	query->to = ~(UINT64)0;
+	query->limit = ~(UINT64)0;
+
+	for (int i = 0; (0 != result) && (i < argc); i += 2)
+	{
+		const char* value = ((i + 1) < argc) ? argv[i + 1] : NULL;
+
+		if (NULL == value)
+		{
+			result = 0;
+		}
+		else if (0 == strcmp(argv[i], "--from"))
+		{
+			query->from = strtoull(value, NULL, 0);
+		}
+		else if (0 == strcmp(argv[i], "--to"))
+		{
+			query->to = strtoull(value, NULL, 0);
+		}
+		else if (0 == strcmp(argv[i], "--cpu"))
+		{
+			query->haveProcessor = 1;
+			query->procIndex = (UINT32)strtoul(value, NULL, 0);
+		}
+		else if (0 == strcmp(argv[i], "--cr3"))
+		{
+			query->haveCR3 = 1;
+			query->cr3 = strtoull(value, NULL, 0);
+		}
+		else if (0 == strcmp(argv[i], "--limit"))
+		{
+			query->limit = strtoull(value, NULL, 0);
+		}
+		else if (0 == strcmp(argv[i], "--by"))
+		{
+			query->groupBy = value;
+			result = (0 == strcmp(value, "cpu")) || (0 == strcmp(value, "cr3"));
+		}
+		else
+		{
+			result = 0;
+		}
+	}
+
+	return result;
+}
+
+/* Position of the first entry of the ordering at or after the key, within the ordering by time the major key is ignored. */
+static UINT64 lowerBound(const EVENT_INDEX* index, ORDER order, UINT64 major, UINT64 time)
+{
+	UINT64 low = 0;
+	UINT64 high = index->header->entryCount;
+
+	while (low < high)
+	{
+		UINT64 middle = low + ((high - low) / 2);
+		const INDEX_ENTRY* entry = &index->entries[entryAt(index, order, middle)];
+		UINT64 entryMajor = majorKey(entry, order);
+
+		if ((entryMajor < major) || ((entryMajor == major) && (entry->time < time)))
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+
+	return low;
+}
+
+/* Position after the last entry of the ordering at or before the key. */
+static UINT64 upperBound(const EVENT_INDEX* index, ORDER order, UINT64 major, UINT64 time)
+{
+	UINT64 result = index->header->entryCount;
+
+	if (~(UINT64)0 != time)
+	{
+		result = lowerBound(index, order, major, time + 1);
+	}
+	else if (~(UINT64)0 != major)
+	{
+		result = lowerBound(index, order, major + 1, 0);
+	}
+
+	return result;
+}
+
+static UINT64 entryAt(const EVENT_INDEX* index, ORDER order, UINT64 position)
+{
+	UINT64 result = position;
+
+	if (ORDER_PROCESSOR == order)
+	{
+		result = index->byProcessor[position];
+	}
+	else if (ORDER_CR3 == order)
+	{
+		result = index->byCR3[position];
+	}
+
+	return result;
+}
+
+static UINT64 majorKey(const INDEX_ENTRY* entry, ORDER order)
+{
+	UINT64 result = 0;
+
+	if (ORDER_PROCESSOR == order)
+	{
+		result = entry->procIndex;
+	}
+	else if (ORDER_CR3 == order)
+	{
+		result = entry->cr3;
+	}
+
+	return result;
+}
+
+/* Picks the ordering that narrows the query down the most, and the positions within it to scan. */
+static void selectRange(const EVENT_INDEX* index, const QUERY* query, ORDER* order, UINT64* first, UINT64* last)
+{
+	UINT64 major = 0;
+
+	if (0 != query->haveCR3)
+	{
+		*order = ORDER_CR3;
+		major = query->cr3;
+	}
+	else if (0 != query->haveProcessor)
+	{
+		*order = ORDER_PROCESSOR;
+		major = query->procIndex;
+	}
+	else
+	{
+		*order = ORDER_TIME;
+	}
+
+	*first = lowerBound(index, *order, major, query->from);
+	*last = upperBound(index, *order, major, query->to);
+}
+
+static int matchesQuery(const INDEX_ENTRY* entry, const QUERY* query)
+{
+	return (entry->time >= query->from) && (entry->time <= query->to) &&
+		((0 == query->haveProcessor) || (entry->procIndex == query->procIndex)) &&
+		((0 == query->haveCR3) || (entry->cr3 == query->cr3));
+}
+
+static void decodeEntry(const INDEX_ENTRY* entry, PEVENT_DECODED decoded)
+{
+	/* Prime the decoder as if the previous record had the same processor and CR3, so an
+	 * omitted processor or a repeated CR3 resolve to the values held by the index. */
+	EVENT_DECODER decoder;
+	EventDecoder_open(&decoder, logData, logSize);
+
+	decoder.offset = (size_t)entry->offset;
+	decoder.havePrevious = 1;
+	decoder.previousTimeStamp = 0;
+	decoder.previousProcIndex = entry->procIndex;
+	decoder.havePreviousCR3 = (INDEX_NO_CR3 != entry->cr3);
+	decoder.previousCR3 = entry->cr3;
+
+	if (EVENT_DECODE_OK != EventDecoder_next(&decoder, decoded))
+	{
+		memset(decoded, 0, sizeof(EVENT_DECODED));
+	}
+
+	if ((0 != (decoded->fields & EVENT_FIELD_STRING_ID)) && (0 == (decoded->fields & EVENT_FIELD_STRING)) &&
+		(0 != entry->string))
+	{
+		memcpy(&decoded->stringLength, logData + entry->string, sizeof(UINT16));
+		decoded->string = (const CHAR*)(logData + entry->string + sizeof(UINT16));
+		decoded->fields |= EVENT_FIELD_STRING;
+	}
+
+	/* A delta encoded timestamp is relative to a record that wasn't decoded, the index has it in full. */
+	decoded->timeStamp = entry->timeStamp;
+	decoded->procIndex = entry->procIndex;
+}
+
+static void commandStats(const EVENT_INDEX* index)
+{
+	UINT64 counts[EVENT_MAX_RINGS] = { 0 };
+	UINT64 firstTimes[EVENT_MAX_RINGS] = { 0 };
+	UINT64 lastTimes[EVENT_MAX_RINGS] = { 0 };
+
+	for (UINT32 i = 0; i < EVENT_MAX_RINGS; i++)
+	{
+		UINT64 first = lowerBound(index, ORDER_PROCESSOR, i, 0);
+		UINT64 last = upperBound(index, ORDER_PROCESSOR, i, ~(UINT64)0);
+
+		counts[i] = last - first;
+		if (0 != counts[i])
+		{
+			firstTimes[i] = index->entries[index->byProcessor[first]].time;
+			lastTimes[i] = index->entries[index->byProcessor[last - 1]].time;
+		}
+	}
+
+	printf("%llu records, %llu bytes.\n\n", (unsigned long long)index->header->entryCount,
+		   (unsigned long long)index->header->logSize);
+	printf("%-4s %12s %20s %20s\n", "CPU", "Records", "First", "Last");
+
+	for (UINT32 i = 0; i < EVENT_MAX_RINGS; i++)
+	{
+		if (0 != counts[i])
+		{
+			printf("%-4u %12llu %20llu %20llu\n", i, (unsigned long long)counts[i],
+				   (unsigned long long)firstTimes[i], (unsigned long long)lastTimes[i]);
+		}
+	}
+}
+
+static void commandList(const EVENT_INDEX* index, const QUERY* query)
+{
+	ORDER order;
+	UINT64 first;
+	UINT64 last;
+	UINT64 listed = 0;
+
+	selectRange(index, query, &order, &first, &last);
+
+	for (UINT64 i = first; (i < last) && (listed < query->limit); i++)
+	{
+		const INDEX_ENTRY* entry = &index->entries[entryAt(index, order, i)];
+
+		if (0 != matchesQuery(entry, query))
+		{
+			EVENT_DECODED decoded;
+			decodeEntry(entry, &decoded);
+
+			printf("%20llu tsc %20llu cpu %-3u cr3 %016llx rip %016llx %.*s\n", (unsigned long long)entry->time,
+				   (unsigned long long)decoded.timeStamp, decoded.procIndex, (unsigned long long)decoded.cr3,
+				   (unsigned long long)decoded.gprs.registers[EVENT_GPR_RIP], (int)decoded.stringLength,
+				   (NULL != decoded.string) ? decoded.string : "");
+
+			listed++;
+		}
+	}
+}
+
+static void commandCount(const EVENT_INDEX* index, const QUERY* query)
+{
+	ORDER order;
+	UINT64 first;
+	UINT64 last;
+
+	if (NULL == query->groupBy)
+	{
+		UINT64 count = 0;
+
+		selectRange(index, query, &order, &first, &last);
+
+		/* Only the time range has to be checked when the ordering already selects the rest. */
+		for (UINT64 i = first; i < last; i++)
+		{
+			count += matchesQuery(&index->entries[entryAt(index, order, i)], query);
+		}
+
+		printf("%llu\n", (unsigned long long)count);
+	}
+	else
+	{
+		/* Walk the groups of the ordering, each one only needs a pair of binary searches. */
+		order = (0 == strcmp(query->groupBy, "cpu")) ? ORDER_PROCESSOR : ORDER_CR3;
+
+		UINT64 position = 0;
+		while (position < index->header->entryCount)
+		{
+			UINT64 major = majorKey(&index->entries[entryAt(index, order, position)], order);
+			UINT64 groupEnd = upperBound(index, order, major, ~(UINT64)0);
+
+			int selected = ((ORDER_PROCESSOR != order) || (0 == query->haveProcessor) || (major == query->procIndex)) &&
+				((ORDER_CR3 != order) || (0 == query->haveCR3) || (major == query->cr3));
+
+			UINT64 count = 0;
+			if (0 != selected)
+			{
+				first = lowerBound(index, order, major, query->from);
+				last = upperBound(index, order, major, query->to);
+
+				for (UINT64 i = first; i < last; i++)
+				{
+					count += matchesQuery(&index->entries[entryAt(index, order, i)], query);
+				}
+			}
+
+			if (0 != count)
+			{
+				if (ORDER_PROCESSOR == order)
+				{
+					printf("cpu %-3llu %12llu\n", (unsigned long long)major, (unsigned long long)count);
+				}
+				else
+				{
+					printf("cr3 %016llx %12llu\n", (unsigned long long)major, (unsigned long long)count);
+				}
+			}
+
+			position = groupEnd;
+		}
+	}
+}
+
+static int compareStream(const void* a, const void* b)
+{
+	const INDEX_ENTRY* first = (const INDEX_ENTRY*)a;
+	const INDEX_ENTRY* second = (const INDEX_ENTRY*)b;
+	int result = 0;
+
+	/* The offset keeps records with the same time in file order. */
+	if (first->time != second->time)
+	{
+		result = (first->time < second->time) ? -1 : 1;
+	}
+	else if (first->offset != second->offset)
+	{
+		result = (first->offset < second->offset) ? -1 : 1;
+	}
+
+	return result;
+}
+
+static int compareCR3(const void* a, const void* b)
+{
+	UINT32 first = *(const UINT32*)a;
+	UINT32 second = *(const UINT32*)b;
+	int result = 0;
+
+	if (sortEntries[first].cr3 != sortEntries[second].cr3)
+	{
+		result = (sortEntries[first].cr3 < sortEntries[second].cr3) ? -1 : 1;
+	}
+	else if (first != second)
+	{
+		result = (first < second) ? -1 : 1;
+	}
+
+	return result;
+}
+
+static double elapsedMilliseconds(const struct timespec* start)
+{
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return ((double)(end.tv_sec - start->tv_sec) * 1000.0) + ((double)(end.tv_nsec - start->tv_nsec) / 1000000.0);
+}
+
+static UINT64 modifiedTime(const struct stat* fileStat)
+{
+	return ((UINT64)fileStat->st_mtim.tv_sec * 1000000000ULL) + (UINT64)fileStat->st_mtim.tv_nsec;
+}
@@ -0,0 +1,212 @@
+/* Prints the VM-exit flight recorders found in a crash dump, or in a file holding the
+ * output of VMCALL_ACTION_DUMP_FLIGHT_RECORDER.
+ *
+ * Each recorder fills exactly one page and starts with a signature, so the file is just
+ * scanned for them, which works for full and kernel memory dumps (their pages are stored
+ * whole) without having to understand the dump format. A dump can hold more than one copy
+ * of a recorder, such as a buffer it was dumped into, so each is reported with its offset.
+ *
+ * Only standard C is used, build with Shared/ on the include path:
+ *
+ *	cc -O2 -std=c99 -I../../Shared FlightRecorderParser.c -o FlightRecorderParser
+ *
+ * Usage: FlightRecorderParser <file> [processor] */
+
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "FlightRecorder_Common.h"
+
+/******************** External API ********************/
+
+
+/******************** Module Typedefs ********************/
+
+
+/******************** Module Constants ********************/
+
+/* Read at a time whilst scanning, the buffer also holds the start of a recorder split across reads. */
+#define SCAN_CHUNK_SIZE (1024 * 1024)
+
+/* Recorders are 8 byte aligned wherever they are, in the image or a dump buffer. */
+#define SCAN_ALIGNMENT 8
+
+#define EXIT_REASON_ENTRY_FAILURE 0x80000000
+
+/* Basic exit reasons, from the Intel SDM appendix C. */
+static const char* const EXIT_REASON_NAMES[] =
+{
+	"EXCEPTION_OR_NMI", "EXTERNAL_INTERRUPT", "TRIPLE_FAULT", "INIT", "SIPI", "IO_SMI", "OTHER_SMI",
+	"INTERRUPT_WINDOW", "NMI_WINDOW", "TASK_SWITCH", "CPUID", "GETSEC", "HLT", "INVD", "INVLPG", "RDPMC",
+	"RDTSC", "RSM", "VMCALL", "VMCLEAR", "VMLAUNCH", "VMPTRLD", "VMPTRST", "VMREAD", "VMRESUME", "VMWRITE",
+	"VMXOFF", "VMXON", "MOV_CR", "MOV_DR", "IO_INSTRUCTION", "RDMSR", "WRMSR", "INVALID_GUEST_STATE",
+	"MSR_LOADING", "RESERVED_35", "MWAIT", "MONITOR_TRAP_FLAG", "RESERVED_38", "MONITOR", "PAUSE",
+	"MACHINE_CHECK", "RESERVED_42", "TPR_BELOW_THRESHOLD", "APIC_ACCESS", "VIRTUALIZED_EOI",
+	"GDTR_IDTR_ACCESS", "LDTR_TR_ACCESS", "EPT_VIOLATION", "EPT_MISCONFIGURATION", "INVEPT", "RDTSCP",
+	"PREEMPTION_TIMER", "INVVPID", "WBINVD", "XSETBV", "APIC_WRITE", "RDRAND", "INVPCID", "VMFUNC",
+	"ENCLS", "RDSEED", "PML_FULL", "XSAVES", "XRSTORS", "PCONFIG", "SPP_EVENT", "UMWAIT", "TPAUSE",
+};
+
+/******************** Module Variables ********************/
+
+
+/******************** Module Prototypes ********************/
+static int isRecorder(const FLIGHT_RECORDER* recorder);
+static void printRecorder(const FLIGHT_RECORDER* recorder, unsigned long long offset);
+static void printExitReason(UINT32 exitReason);
+
+/******************** Public Code ********************/
+
+int main(int argc, char** argv)
+{
+	int result = EXIT_FAILURE;
+
+	const char* fileName = (argc > 1) ? argv[1] : "";
+	long processorIndex = (argc > 2) ? strtol(argv[2], NULL, 0) : -1;
+	FILE* file = NULL;
+
+	unsigned char* buffer = NULL;
+
+	if ((argc < 2) || (argc > 3))
+	{
+		printf("Usage: %s <file> [processor]\n", argv[0]);
+	}
+	else if (NULL == (file = fopen(fileName, "rb")))
+	{
+		printf("Unable to open %s.\n", fileName);
+	}
+	else if (NULL == (buffer = (unsigned char*)malloc(SCAN_CHUNK_SIZE + sizeof(FLIGHT_RECORDER))))
+	{
+		printf("Unable to allocate the scan buffer.\n");
+	}
+	else
+	{
+		/* File offset of the start of the buffer, which is always aligned. */
+		unsigned long long base = 0;
+		size_t filled = 0;
+		size_t readSize;
+		unsigned long foundCount = 0;
+
+		do
+		{
+			readSize = fread(buffer + filled, 1, SCAN_CHUNK_SIZE + sizeof(FLIGHT_RECORDER) - filled, file);
+			filled += readSize;
+
+			size_t position = 0;
+
+			while ((position + sizeof(FLIGHT_RECORDER)) <= filled)
+			{
+				FLIGHT_RECORDER recorder;
+				UINT64 signature;
+
+				memcpy(&signature, buffer + position, sizeof(signature));
+
+				if (FLIGHT_RECORDER_SIGNATURE == signature)
+				{
+					memcpy(&recorder, buffer + position, sizeof(recorder));
+
+					if ((0 != isRecorder(&recorder)) && ((processorIndex < 0) || ((UINT32)processorIndex == recorder.processorIndex)))
+					{
+						printRecorder(&recorder, base + position);
+						foundCount++;
+					}
+				}
+
+				position += SCAN_ALIGNMENT;
+			}
+
+			/* Keep whatever might be the start of a recorder for the next read. */
+			memmove(buffer, buffer + position, filled - position);
+			filled -= position;
+			base += position;
+		} while (0 != readSize);
+
+		if (0 != ferror(file))
+		{
+			printf("Unable to read %s.\n", fileName);
+		}
+		else
+		{
+			printf("%lu flight recorder(s) found.\n", foundCount);
+			result = EXIT_SUCCESS;
+		}
+	}
+
+	free(buffer);
+
+	if (NULL != file)
+	{
+		fclose(file);
+	}
+
+	return result;
+}
+
+/******************** Module Code ********************/
+
+static int isRecorder(const FLIGHT_RECORDER* recorder)
+{
+	/* The signature alone could turn up by chance, the rest of the header has to agree too. */
+	return (FLIGHT_RECORDER_VERSION == recorder->version) && (FLIGHT_RECORDER_RECORDS == recorder->recordCount) &&
+		(sizeof(FLIGHT_RECORD) == recorder->recordSize) && (recorder->next < FLIGHT_RECORDER_RECORDS);
+}
+
+static void printRecorder(const FLIGHT_RECORDER* recorder, unsigned long long offset)
+{
+	printf("Processor %u at offset 0x%llx, %llu exits:\n", recorder->processorIndex, offset,
+		   (unsigned long long)recorder->exitCount);
+
+	/* Oldest first, records[next] is the one the next exit would have overwritten. */
+	const FLIGHT_RECORD* previous = NULL;
+
+	for (UINT32 i = 0; i < FLIGHT_RECORDER_RECORDS; i++)
+	{
+		const FLIGHT_RECORD* record = &recorder->records[(recorder->next + i) % FLIGHT_RECORDER_RECORDS];
+
+		if (0 != record->sequence)
+		{
+			printf("  %10u  tsc %llu", record->sequence, (unsigned long long)record->timeStamp);
+
+			if ((NULL != previous) && (record->timeStamp >= previous->timeStamp))
+			{
+				printf(" (+%llu)", (unsigned long long)(record->timeStamp - previous->timeStamp));
+			}
+
+			printf("  ");
+			printExitReason(record->exitReason);
+			printf("  qual 0x%llx  rip 0x%016llx  cr3 0x%llx  ", (unsigned long long)record->qualification,
+				   (unsigned long long)record->guestRIP, (unsigned long long)record->guestCR3);
+
+			if (0 == record->handlerCycles)
+			{
+				printf("in progress\n");
+			}
+			else
+			{
+				printf("%u cycles\n", record->handlerCycles);
+			}
+
+			previous = record;
+		}
+	}
+}
+
+static void printExitReason(UINT32 exitReason)
+{
+	UINT32 basicReason = exitReason & 0xFFFF;
+
+	if (basicReason < (sizeof(EXIT_REASON_NAMES) / sizeof(EXIT_REASON_NAMES[0])))
+	{
+		printf("%s", EXIT_REASON_NAMES[basicReason]);
+	}
+	else
+	{
+		printf("REASON_%u", basicReason);
+	}
+
+	if (0 != (exitReason & EXIT_REASON_ENTRY_FAILURE))
+	{
+		printf(" (entry failure)");
+	}
+}
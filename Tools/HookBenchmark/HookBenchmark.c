@@ -0,0 +1,258 @@
+/* Measures the overhead of a hooked call with each of the jumps VMHook can write.
+ *
+ * A hooked call is laid out in executable memory the way VMHook leaves it: the target starts
+ * with the detour to the hook, the hook calls the original through the trampoline, and the
+ * trampoline jumps back into the body of the target. The same call is timed with the detour and
+ * trampoline jumps written as the old PUSH/XCHG/RET sequence, as JMP [RIP+0] and as JMP rel32,
+ * along with the target called directly. Every sample is a batch of calls bracketed by RDTSCP,
+ * the minimum and median cycles per call are reported.
+ *
+ * The RET of the PUSH/XCHG/RET sequence has no matching CALL, so it and every RET after
+ * it in the call chain mispredict, which is what the comparison shows.
+ *
+ * Everything here is in RWX memory, so the JMP [RIP+0] figure is for a detour that can read
+ * its own bytes. VMHook can't use it as a detour: the shadow page is execute only, and the
+ * read of the address swaps the original page back in, so the jump never completes. VMHook
+ * only writes JMP [RIP+0] within trampolines, a detour out of reach of a JMP rel32 goes
+ * through one of those instead, or through R11 when no trampoline is within reach either.
+ *
+ * Only needs an x64 C compiler, builds on Windows or Linux:
+ *
+ *	cl /O2 HookBenchmark.c
+ *	cc -O2 -std=gnu99 HookBenchmark.c -o HookBenchmark
+ *
+ * Usage: HookBenchmark [samples] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <intrin.h>
+#else
+#include <sys/mman.h>
+#include <x86intrin.h>
+#endif
+
+/******************** External API ********************/
+
+
+/******************** Module Typedefs ********************/
+
+typedef int(*fnTarget)(void);
+
+typedef enum
+{
+	JUMP_PUSH_RETURN = 0,	/* PUSH RAX; MOV RAX, imm64; XCHG [RSP], RAX; RET */
+	JUMP_RIP_INDIRECT,		/* JMP [RIP+0] followed by the address */
+	JUMP_REL32				/* JMP rel32 */
+} JUMP_STYLE;
+
+/******************** Module Constants ********************/
+
+#define DEFAULT_SAMPLES 2000
+#define CALLS_PER_SAMPLE 1000
+#define WARMUP_SAMPLES 100
+
+/* Layout of the code page. */
+#define CODE_SIZE 4096
+#define HOOK_OFFSET 0x000
+#define TARGET_OFFSET 0x100
+#define TARGET_BODY_OFFSET 0x110	/* Start of the instructions the detour doesn't cover. */
+#define TRAMPOLINE_OFFSET 0x200
+
+#define PUSH_RETURN_SIZE 16
+#define RIP_INDIRECT_SIZE 14
+#define REL32_SIZE 5
+
+/******************** Module Variables ********************/
+
+static uint8_t* code = NULL;
+
+/******************** Module Prototypes ********************/
+static uint8_t* allocateCode(void);
+static void layoutDirect(void);
+static size_t layoutHooked(JUMP_STYLE style);
+static size_t writeJump(uint8_t* buffer, uint8_t* targetAddress, JUMP_STYLE style);
+static void runBenchmark(uint64_t* timings, size_t samples);
+static int compareTimings(const void* a, const void* b);
+
+/******************** Public Code ********************/
+
+int main(int argc, char** argv)
+{
+	static const struct
+	{
+		const char* name;
+		JUMP_STYLE style;
+	} STYLES[] =
+	{
+		{ "hooked, PUSH/XCHG/RET", JUMP_PUSH_RETURN },
+		{ "hooked, JMP [RIP+0]", JUMP_RIP_INDIRECT },
+		{ "hooked, JMP rel32", JUMP_REL32 },
+	};
+
+	size_t samples = (argc > 1) ? strtoull(argv[1], NULL, 0) : DEFAULT_SAMPLES;
+
+	uint64_t* timings = (0 != samples) ? malloc(samples * sizeof(uint64_t)) : NULL;
+	if (NULL == timings)
+	{
+		printf("Invalid sample count.\n");
+		return EXIT_FAILURE;
+	}
+
+	code = allocateCode();
+	if (NULL == code)
+	{
+		printf("Unable to allocate executable memory.\n");
+		free(timings);
+		return EXIT_FAILURE;
+	}
+
+	printf("%-26s %6s %12s %12s\n", "Call", "Patch", "Min", "Median");
+
+	layoutDirect();
+	printf("%-26s %6s", "direct", "-");
+	runBenchmark(timings, samples);
+
+	for (size_t i = 0; i < (sizeof(STYLES) / sizeof(STYLES[0])); i++)
+	{
+		size_t patchSize = layoutHooked(STYLES[i].style);
+		printf("%-26s %6zu", STYLES[i].name, patchSize);
+		runBenchmark(timings, samples);
+	}
+
+	free(timings);
+	return EXIT_SUCCESS;
+}
+
+/******************** Module Code ********************/
+
+static uint8_t* allocateCode(void)
+{
+	uint8_t* result;
+
+#ifdef _WIN32
+	result = (uint8_t*)VirtualAlloc(NULL, CODE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+#else
+	result = (uint8_t*)mmap(NULL, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == result)
+	{
+		result = NULL;
+	}
+#endif
+
+	return result;
+}
+
+static void layoutDirect(void)
+{
+	/* The target on its own, XOR EAX, EAX; RET */
+	static const uint8_t TARGET[] = { 0x31, 0xC0, 0xC3 };
+
+	memset(code, 0xCC, CODE_SIZE);
+	memcpy(&code[TARGET_OFFSET], TARGET, sizeof(TARGET));
+}
+
+static size_t layoutHooked(JUMP_STYLE style)
+{
+	/* Hook: CALL trampoline; RET, standing in for a hook that calls the original. */
+	uint8_t* hook = &code[HOOK_OFFSET];
+	int32_t displacement = (int32_t)(&code[TRAMPOLINE_OFFSET] - (hook + 5));
+
+	memset(code, 0xCC, CODE_SIZE);
+
+	hook[0] = 0xE8;
+	memcpy(&hook[1], &displacement, sizeof(displacement));
+	hook[5] = 0xC3;
+
+	/* Target: the detour, then the rest of the body, XOR EAX, EAX; RET */
+	size_t patchSize = writeJump(&code[TARGET_OFFSET], hook, style);
+	code[TARGET_BODY_OFFSET] = 0x31;
+	code[TARGET_BODY_OFFSET + 1] = 0xC0;
+	code[TARGET_BODY_OFFSET + 2] = 0xC3;
+
+	/* Trampoline: a NOP in place of the instructions the detour covered, then the jump back. */
+	code[TRAMPOLINE_OFFSET] = 0x90;
+	writeJump(&code[TRAMPOLINE_OFFSET + 1], &code[TARGET_BODY_OFFSET], style);
+
+	return patchSize;
+}
+
+static size_t writeJump(uint8_t* buffer, uint8_t* targetAddress, JUMP_STYLE style)
+{
+	/* The same encodings as VMHook, returns the size written. */
+	size_t result;
+	uint64_t address = (uint64_t)(uintptr_t)targetAddress;
+
+	if (JUMP_REL32 == style)
+	{
+		int32_t displacement = (int32_t)(targetAddress - (buffer + REL32_SIZE));
+
+		buffer[0] = 0xE9;
+		memcpy(&buffer[1], &displacement, sizeof(displacement));
+		result = REL32_SIZE;
+	}
+	else if (JUMP_RIP_INDIRECT == style)
+	{
+		static const uint8_t JMP_RIP[] = { 0xFF, 0x25, 0x00, 0x00, 0x00, 0x00 };
+
+		memcpy(buffer, JMP_RIP, sizeof(JMP_RIP));
+		memcpy(&buffer[sizeof(JMP_RIP)], &address, sizeof(address));
+		result = RIP_INDIRECT_SIZE;
+	}
+	else
+	{
+		buffer[0] = 0x50;
+		buffer[1] = 0x48;
+		buffer[2] = 0xB8;
+		memcpy(&buffer[3], &address, sizeof(address));
+		buffer[11] = 0x48;
+		buffer[12] = 0x87;
+		buffer[13] = 0x04;
+		buffer[14] = 0x24;
+		buffer[15] = 0xC3;
+		result = PUSH_RETURN_SIZE;
+	}
+
+	return result;
+}
+
+static void runBenchmark(uint64_t* timings, size_t samples)
+{
+	fnTarget target = (fnTarget)(void*)&code[TARGET_OFFSET];
+	unsigned int aux;
+	int total = 0;
+
+	for (size_t i = 0; i < WARMUP_SAMPLES * CALLS_PER_SAMPLE; i++)
+	{
+		total += target();
+	}
+
+	for (size_t i = 0; i < samples; i++)
+	{
+		uint64_t start = __rdtscp(&aux);
+
+		for (size_t j = 0; j < CALLS_PER_SAMPLE; j++)
+		{
+			total += target();
+		}
+
+		timings[i] = __rdtscp(&aux) - start;
+	}
+
+	qsort(timings, samples, sizeof(uint64_t), compareTimings);
+
+	/* The target returns zero, the total only stops the calls being optimised out. */
+	printf(" %12.2f %12.2f%s\n", (double)timings[0] / CALLS_PER_SAMPLE, (double)timings[samples / 2] / CALLS_PER_SAMPLE,
+		   (0 != total) ? " (bad result)" : "");
+}
+
+static int compareTimings(const void* a, const void* b)
+{
+	uint64_t timingA = *(const uint64_t*)a;
+	uint64_t timingB = *(const uint64_t*)b;
+
+	return (timingA > timingB) - (timingA < timingB);
+}
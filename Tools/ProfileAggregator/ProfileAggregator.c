@@ -0,0 +1,589 @@
+/* User-mode aggregator for the preemption timer sampling profiler.
+ *
+ * Starts the profiler on every logical processor, periodically drains the
+ * per-processor sample rings, then folds the samples into per-module and
+ * per-function hotspot tables.
+ *
+ * Kernel samples are attributed to the loaded kernel modules, functions are
+ * resolved to the nearest preceding export of the module image on disk.
+ * User samples are grouped by their CR3, as there is no guest agent to
+ * provide the module list of each process.
+ *
+ * Build as an x64 console application with Shared/ on the include path,
+ * and Shared/VMCALL_Stub.asm assembled alongside it.
+ *
+ * Usage: ProfileAggregator [seconds] [period cycles] [top count] */
+
+#include <windows.h>
+#include <winternl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "VMCALL_Common.h"
+
+/******************** External API ********************/
+
+
+/******************** Module Typedefs ********************/
+
+/* Same layout as RTL_PROCESS_MODULE(S) in Process.h, which can't be included in user-mode
+ * as it depends on the kernel headers. The PE structures used below come from winnt.h,
+ * which are identical to the definitions in Process.h. */
+typedef struct _RTL_PROCESS_MODULE_INFORMATION
+{
+	HANDLE Section;
+	PVOID MappedBase;
+	PVOID ImageBase;
+	ULONG ImageSize;
+	ULONG Flags;
+	USHORT LoadOrderIndex;
+	USHORT InitOrderIndex;
+	USHORT LoadCount;
+	USHORT OffsetToFileName;
+	UCHAR  FullPathName[256];
+} RTL_PROCESS_MODULE_INFORMATION, *PRTL_PROCESS_MODULE_INFORMATION;
+
+typedef struct _RTL_PROCESS_MODULES
+{
+	ULONG NumberOfModules;
+	RTL_PROCESS_MODULE_INFORMATION Modules[1];
+} RTL_PROCESS_MODULES, *PRTL_PROCESS_MODULES;
+
+typedef NTSTATUS(NTAPI* fnNtQuerySystemInformation)(ULONG, PVOID, ULONG, PULONG);
+
+/* An exported function of a module, sorted by RVA. */
+typedef struct _EXPORT_SYMBOL
+{
+	DWORD rva;
+	CHAR name[96];
+} EXPORT_SYMBOL, *PEXPORT_SYMBOL;
+
+typedef struct _MODULE_ENTRY
+{
+	UINT64 base;
+	UINT64 size;
+	CHAR name[64];
+	CHAR path[MAX_PATH];
+
+	/* Exports are only loaded for modules that were actually sampled. */
+	BOOLEAN exportsLoaded;
+	PEXPORT_SYMBOL exports;
+	SIZE_T exportCount;
+} MODULE_ENTRY, *PMODULE_ENTRY;
+
+/* Key that is used to fold samples, a module and a function within it. */
+typedef struct _HOTSPOT
+{
+	UINT64 group;
+	INT64 function;
+	SIZE_T count;
+} HOTSPOT, *PHOTSPOT;
+
+/******************** Module Constants ********************/
+
+#define DEFAULT_SECONDS 5
+#define DEFAULT_PERIOD_CYCLES 1000000ULL
+#define DEFAULT_TOP_COUNT 25
+#define DRAIN_INTERVAL_MS 50
+#define SYSTEM_MODULE_INFORMATION 11
+
+/* Groups that don't correspond to a kernel module index. */
+#define GROUP_UNKNOWN_KERNEL 0xFFFFFFFFULL
+#define GROUP_USER_FLAG (1ULL << 63)
+
+/******************** Module Variables ********************/
+
+static PPROFILER_SAMPLE samples = NULL;
+static SIZE_T sampleCount = 0;
+static SIZE_T sampleCapacity = 0;
+static UINT64 droppedTotal = 0;
+
+static PMODULE_ENTRY modules = NULL;
+static SIZE_T moduleCount = 0;
+
+/******************** Module Prototypes ********************/
+static NTSTATUS profilerControl(PVM_PARAM_PROFILER_CONTROL params);
+static BOOLEAN drainAll(UINT32 processorCount);
+static BOOLEAN loadKernelModules(void);
+static void loadExports(PMODULE_ENTRY module);
+static PMODULE_ENTRY findModule(UINT64 address);
+static INT64 findExport(PMODULE_ENTRY module, UINT64 address);
+static void printHotspots(SIZE_T topCount);
+static int compareModules(const void* a, const void* b);
+static int compareExports(const void* a, const void* b);
+static int compareHotspotKeys(const void* a, const void* b);
+static int compareHotspotCounts(const void* a, const void* b);
+
+/******************** Public Code ********************/
+
+int main(int argc, char** argv)
+{
+	int result = EXIT_FAILURE;
+
+	DWORD seconds = (argc > 1) ? strtoul(argv[1], NULL, 0) : DEFAULT_SECONDS;
+	UINT64 periodCycles = (argc > 2) ? strtoull(argv[2], NULL, 0) : DEFAULT_PERIOD_CYCLES;
+	SIZE_T topCount = (argc > 3) ? strtoull(argv[3], NULL, 0) : DEFAULT_TOP_COUNT;
+
+	UINT32 processorCount = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+
+	VM_PARAM_PROFILER_CONTROL params = { 0 };
+	params.operation = PROFILER_OPERATION_START;
+	params.processorIndex = PROFILER_ALL_PROCESSORS;
+	params.periodCycles = periodCycles;
+
+	NTSTATUS status = profilerControl(&params);
+	if (0 <= status)
+	{
+		printf("Profiling %u processors for %lu seconds, period %llu cycles.\n", processorCount, seconds, periodCycles);
+
+		/* Keep draining so the rings inside the hypervisor don't overflow. */
+		ULONGLONG endTime = GetTickCount64() + (seconds * 1000ULL);
+		BOOLEAN drained = TRUE;
+
+		while ((TRUE == drained) && (GetTickCount64() < endTime))
+		{
+			Sleep(DRAIN_INTERVAL_MS);
+			drained = drainAll(processorCount);
+		}
+
+		params.operation = PROFILER_OPERATION_STOP;
+		profilerControl(&params);
+
+		/* Collect what was recorded between the last drain and stopping. */
+		if ((TRUE == drained) && (TRUE == drainAll(processorCount)))
+		{
+			printf("Collected %Iu samples, %llu dropped.\n\n", sampleCount, droppedTotal);
+
+			if (TRUE == loadKernelModules())
+			{
+				printHotspots(topCount);
+				result = EXIT_SUCCESS;
+			}
+			else
+			{
+				printf("Unable to query the loaded kernel modules.\n");
+			}
+		}
+		else
+		{
+			printf("Unable to drain the profiler samples.\n");
+		}
+	}
+	else
+	{
+		printf("Unable to start the profiler (0x%08X), is the hypervisor running?\n", status);
+	}
+
+	free(samples);
+	return result;
+}
+
+/******************** Module Code ********************/
+
+static NTSTATUS profilerControl(PVM_PARAM_PROFILER_CONTROL params)
+{
+	VMCALL_COMMAND command = { 0 };
+	command.action = VMCALL_ACTION_PROFILER_CONTROL;
+	command.buffer = params;
+	command.bufferSize = sizeof(*params);
+
+	return VMCALL_actionHost(VMCALL_KEY, &command);
+}
+
+static BOOLEAN drainAll(UINT32 processorCount)
+{
+	BOOLEAN result = TRUE;
+
+	for (UINT32 i = 0; (i < processorCount) && (TRUE == result); i++)
+	{
+		SIZE_T drainedCount;
+
+		do
+		{
+			/* Always leave room for an entire ring. */
+			if ((sampleCapacity - sampleCount) < PROFILER_RING_SAMPLES)
+			{
+				SIZE_T newCapacity = (0 == sampleCapacity) ? (PROFILER_RING_SAMPLES * 16) : (sampleCapacity * 2);
+				PPROFILER_SAMPLE newSamples = realloc(samples, newCapacity * sizeof(PROFILER_SAMPLE));
+
+				if (NULL == newSamples)
+				{
+					result = FALSE;
+					break;
+				}
+
+				samples = newSamples;
+				sampleCapacity = newCapacity;
+			}
+
+			VM_PARAM_PROFILER_CONTROL params = { 0 };
+			params.operation = PROFILER_OPERATION_DRAIN;
+			params.processorIndex = i;
+			params.samples = &samples[sampleCount];
+			params.sampleCapacity = PROFILER_RING_SAMPLES;
+
+			/* Make sure the buffer is paged in, the hypervisor can't handle a page fault. */
+			VirtualLock(params.samples, PROFILER_RING_SAMPLES * sizeof(PROFILER_SAMPLE));
+
+			NTSTATUS status = profilerControl(&params);
+			if (0 > status)
+			{
+				result = FALSE;
+				break;
+			}
+
+			sampleCount += params.sampleCount;
+			droppedTotal += params.droppedCount;
+			drainedCount = params.sampleCount;
+
+		} while (PROFILER_RING_SAMPLES == drainedCount);
+	}
+
+	return result;
+}
+
+static BOOLEAN loadKernelModules(void)
+{
+	BOOLEAN result = FALSE;
+
+	fnNtQuerySystemInformation queryInformation =
+		(fnNtQuerySystemInformation)GetProcAddress(GetModuleHandleA("ntdll.dll"), "NtQuerySystemInformation");
+
+	ULONG length = 0;
+	if (NULL != queryInformation)
+	{
+		queryInformation(SYSTEM_MODULE_INFORMATION, NULL, 0, &length);
+	}
+
+	PRTL_PROCESS_MODULES moduleInfo = (0 != length) ? malloc(length) : NULL;
+
+	if ((NULL != moduleInfo) && (0 <= queryInformation(SYSTEM_MODULE_INFORMATION, moduleInfo, length, &length)))
+	{
+		modules = calloc(moduleInfo->NumberOfModules, sizeof(MODULE_ENTRY));
+		if (NULL != modules)
+		{
+			CHAR windowsDirectory[MAX_PATH];
+			GetWindowsDirectoryA(windowsDirectory, sizeof(windowsDirectory));
+
+			for (ULONG i = 0; i < moduleInfo->NumberOfModules; i++)
+			{
+				PRTL_PROCESS_MODULE_INFORMATION info = &moduleInfo->Modules[i];
+				PMODULE_ENTRY module = &modules[moduleCount];
+
+				module->base = (UINT64)info->ImageBase;
+				module->size = info->ImageSize;
+				strncpy_s(module->name, sizeof(module->name), (PCSTR)&info->FullPathName[info->OffsetToFileName], _TRUNCATE);
+
+				/* Convert the NT path of the image into one that can be opened from user-mode. */
+				PCSTR fullPath = (PCSTR)info->FullPathName;
+				if (0 == _strnicmp(fullPath, "\\SystemRoot\\", 12))
+				{
+					sprintf_s(module->path, sizeof(module->path), "%s\\%s", windowsDirectory, fullPath + 12);
+				}
+				else if (0 == strncmp(fullPath, "\\??\\", 4))
+				{
+					strncpy_s(module->path, sizeof(module->path), fullPath + 4, _TRUNCATE);
+				}
+				else
+				{
+					strncpy_s(module->path, sizeof(module->path), fullPath, _TRUNCATE);
+				}
+
+				/* Without sufficient privileges the image bases are hidden. */
+				if (0 != module->base)
+				{
+					moduleCount++;
+				}
+			}
+
+			qsort(modules, moduleCount, sizeof(MODULE_ENTRY), compareModules);
+			result = TRUE;
+		}
+	}
+
+	free(moduleInfo);
+	return result;
+}
+
+static void loadExports(PMODULE_ENTRY module)
+{
+	module->exportsLoaded = TRUE;
+
+	/* Map the image with its sections at their RVAs, without running any of its code. */
+	HMODULE imageHandle = LoadLibraryExA(module->path, NULL, LOAD_LIBRARY_AS_IMAGE_RESOURCE | LOAD_LIBRARY_AS_DATAFILE);
+	if (NULL != imageHandle)
+	{
+		PUINT8 imageBase = (PUINT8)((ULONG_PTR)imageHandle & ~(ULONG_PTR)3);
+
+		PIMAGE_DOS_HEADER dosHeader = (PIMAGE_DOS_HEADER)imageBase;
+		PIMAGE_NT_HEADERS64 ntHeaders = (PIMAGE_NT_HEADERS64)(imageBase + dosHeader->e_lfanew);
+
+		if ((IMAGE_DOS_SIGNATURE == dosHeader->e_magic) &&
+			(IMAGE_NT_SIGNATURE == ntHeaders->Signature) &&
+			(IMAGE_NT_OPTIONAL_HDR64_MAGIC == ntHeaders->OptionalHeader.Magic))
+		{
+			IMAGE_DATA_DIRECTORY exportData = ntHeaders->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXPORT];
+
+			if (0 != exportData.VirtualAddress)
+			{
+				PIMAGE_EXPORT_DIRECTORY exportDirectory = (PIMAGE_EXPORT_DIRECTORY)(imageBase + exportData.VirtualAddress);
+
+				PDWORD functions = (PDWORD)(imageBase + exportDirectory->AddressOfFunctions);
+				PDWORD names = (PDWORD)(imageBase + exportDirectory->AddressOfNames);
+				PWORD nameOrdinals = (PWORD)(imageBase + exportDirectory->AddressOfNameOrdinals);
+
+				module->exports = calloc(exportDirectory->NumberOfNames, sizeof(EXPORT_SYMBOL));
+				if (NULL != module->exports)
+				{
+					for (DWORD i = 0; i < exportDirectory->NumberOfNames; i++)
+					{
+						DWORD rva = functions[nameOrdinals[i]];
+
+						/* Forwarded exports point inside the export directory, they aren't code. */
+						if ((rva >= exportData.VirtualAddress) && (rva < (exportData.VirtualAddress + exportData.Size)))
+						{
+							continue;
+						}
+
+						PEXPORT_SYMBOL symbol = &module->exports[module->exportCount++];
+						symbol->rva = rva;
+						strncpy_s(symbol->name, sizeof(symbol->name), (PCSTR)(imageBase + names[i]), _TRUNCATE);
+					}
+
+					qsort(module->exports, module->exportCount, sizeof(EXPORT_SYMBOL), compareExports);
+				}
+			}
+		}
+
+		FreeLibrary(imageHandle);
+	}
+}
+
+static PMODULE_ENTRY findModule(UINT64 address)
+{
+	PMODULE_ENTRY result = NULL;
+
+	/* Modules are sorted by base, find the last one starting at or below the address. */
+	SIZE_T low = 0;
+	SIZE_T high = moduleCount;
+
+	while (low < high)
+	{
+		SIZE_T middle = low + ((high - low) / 2);
+
+		if (modules[middle].base <= address)
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+
+	if ((0 != low) && (address < (modules[low - 1].base + modules[low - 1].size)))
+	{
+		result = &modules[low - 1];
+	}
+
+	return result;
+}
+
+static INT64 findExport(PMODULE_ENTRY module, UINT64 address)
+{
+	if (FALSE == module->exportsLoaded)
+	{
+		loadExports(module);
+	}
+
+	DWORD rva = (DWORD)(address - module->base);
+
+	SIZE_T low = 0;
+	SIZE_T high = module->exportCount;
+
+	while (low < high)
+	{
+		SIZE_T middle = low + ((high - low) / 2);
+
+		if (module->exports[middle].rva <= rva)
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+
+	/* -1 indicates the address is before the first export of the module. */
+	return (INT64)low - 1;
+}
+
+static void printHotspots(SIZE_T topCount)
+{
+	PHOTSPOT hotspots = calloc((0 != sampleCount) ? sampleCount : 1, sizeof(HOTSPOT));
+	if (NULL == hotspots)
+	{
+		return;
+	}
+
+	/* Give each sample a (group, function) key. */
+	for (SIZE_T i = 0; i < sampleCount; i++)
+	{
+		PPROFILER_SAMPLE sample = &samples[i];
+		PHOTSPOT hotspot = &hotspots[i];
+
+		hotspot->count = 1;
+		hotspot->function = -1;
+
+		if (0 == sample->guestCPL)
+		{
+			PMODULE_ENTRY module = findModule(sample->guestRIP);
+
+			if (NULL != module)
+			{
+				hotspot->group = (UINT64)(module - modules);
+				hotspot->function = findExport(module, sample->guestRIP);
+			}
+			else
+			{
+				hotspot->group = GROUP_UNKNOWN_KERNEL;
+			}
+		}
+		else
+		{
+			hotspot->group = GROUP_USER_FLAG | (sample->guestCR3 & ~0xFFFULL);
+		}
+	}
+
+	/* Fold identical keys together, then order by the number of hits. */
+	qsort(hotspots, sampleCount, sizeof(HOTSPOT), compareHotspotKeys);
+
+	SIZE_T functionCount = 0;
+	for (SIZE_T i = 0; i < sampleCount; i++)
+	{
+		if ((0 != functionCount) &&
+			(hotspots[functionCount - 1].group == hotspots[i].group) &&
+			(hotspots[functionCount - 1].function == hotspots[i].function))
+		{
+			hotspots[functionCount - 1].count++;
+		}
+		else
+		{
+			hotspots[functionCount++] = hotspots[i];
+		}
+	}
+
+	/* Module totals are the sums of the function entries, which are still grouped together. */
+	PHOTSPOT moduleHotspots = calloc((0 != functionCount) ? functionCount : 1, sizeof(HOTSPOT));
+	SIZE_T groupCount = 0;
+
+	if (NULL != moduleHotspots)
+	{
+		for (SIZE_T i = 0; i < functionCount; i++)
+		{
+			if ((0 != groupCount) && (moduleHotspots[groupCount - 1].group == hotspots[i].group))
+			{
+				moduleHotspots[groupCount - 1].count += hotspots[i].count;
+			}
+			else
+			{
+				moduleHotspots[groupCount] = hotspots[i];
+				moduleHotspots[groupCount].function = -1;
+				groupCount++;
+			}
+		}
+
+		qsort(moduleHotspots, groupCount, sizeof(HOTSPOT), compareHotspotCounts);
+	}
+
+	qsort(hotspots, functionCount, sizeof(HOTSPOT), compareHotspotCounts);
+
+	printf("%-8s %-7s %s\n", "Samples", "Percent", "Module");
+	for (SIZE_T i = 0; (i < groupCount) && (i < topCount); i++)
+	{
+		PHOTSPOT hotspot = &moduleHotspots[i];
+		double percent = (100.0 * hotspot->count) / sampleCount;
+
+		if (0 != (hotspot->group & GROUP_USER_FLAG))
+		{
+			printf("%-8Iu %6.2f%% [user cr3=%llX]\n", hotspot->count, percent, hotspot->group & ~GROUP_USER_FLAG);
+		}
+		else if (GROUP_UNKNOWN_KERNEL == hotspot->group)
+		{
+			printf("%-8Iu %6.2f%% [unknown kernel]\n", hotspot->count, percent);
+		}
+		else
+		{
+			printf("%-8Iu %6.2f%% %s\n", hotspot->count, percent, modules[hotspot->group].name);
+		}
+	}
+
+	printf("\n%-8s %-7s %s\n", "Samples", "Percent", "Function");
+	for (SIZE_T i = 0, printed = 0; (i < functionCount) && (printed < topCount); i++)
+	{
+		PHOTSPOT hotspot = &hotspots[i];
+
+		/* Functions are only resolved for kernel modules. */
+		if ((0 != (hotspot->group & GROUP_USER_FLAG)) || (GROUP_UNKNOWN_KERNEL == hotspot->group))
+		{
+			continue;
+		}
+
+		PMODULE_ENTRY module = &modules[hotspot->group];
+		double percent = (100.0 * hotspot->count) / sampleCount;
+
+		if (hotspot->function >= 0)
+		{
+			printf("%-8Iu %6.2f%% %s!%s\n", hotspot->count, percent, module->name, module->exports[hotspot->function].name);
+		}
+		else
+		{
+			printf("%-8Iu %6.2f%% %s!<no export>\n", hotspot->count, percent, module->name);
+		}
+
+		printed++;
+	}
+
+	free(moduleHotspots);
+	free(hotspots);
+}
+
+static int compareModules(const void* a, const void* b)
+{
+	UINT64 baseA = ((const MODULE_ENTRY*)a)->base;
+	UINT64 baseB = ((const MODULE_ENTRY*)b)->base;
+
+	return (baseA > baseB) - (baseA < baseB);
+}
+
+static int compareExports(const void* a, const void* b)
+{
+	DWORD rvaA = ((const EXPORT_SYMBOL*)a)->rva;
+	DWORD rvaB = ((const EXPORT_SYMBOL*)b)->rva;
+
+	return (rvaA > rvaB) - (rvaA < rvaB);
+}
+
+static int compareHotspotKeys(const void* a, const void* b)
+{
+	const HOTSPOT* hotspotA = a;
+	const HOTSPOT* hotspotB = b;
+
+	int result = (hotspotA->group > hotspotB->group) - (hotspotA->group < hotspotB->group);
+	if (0 == result)
+	{
+		result = (hotspotA->function > hotspotB->function) - (hotspotA->function < hotspotB->function);
+	}
+
+	return result;
+}
+
+static int compareHotspotCounts(const void* a, const void* b)
+{
+	SIZE_T countA = ((const HOTSPOT*)a)->count;
+	SIZE_T countB = ((const HOTSPOT*)b)->count;
+
+	/* Descending order. */
+	return (countA < countB) - (countA > countB);
+}
@@ -0,0 +1,446 @@
+/* Converts an event log, EventLog.hvt or the legacy EventLog.bin, to the Chrome trace
+ * event JSON format read by chrome://tracing, Perfetto (ui.perfetto.dev) and most other
+ * trace viewers, so hypervisor events can be lined up with other system traces.
+ *
+ * Each record becomes an instant event named after its annotation string, on two tracks:
+ * the logical processor it was recorded on ("Processors") and its CR3 ("Address spaces").
+ * A change of CR3 on a processor is also marked on the processor's track.
+ *
+ * Times are converted to a common timeline with the calibrations of the log, as done by
+ * EventAnalyzer, and are relative to the earliest calibration (given in otherData as
+ * nanoseconds since 1970). Sessions without calibrations keep their raw TSC values.
+ *
+ * The log is mapped and read front to back twice, first for the calibrations only, then
+ * to write the events as they are decoded. Nothing is held per record, so memory use only
+ * depends on the number of calibrations and distinct CR3s, not the size of the log.
+ *
+ * Portable to any POSIX system, build with Shared/ on the include path:
+ *
+ *	cc -O2 -std=c99 -I../../Shared TraceExporter.c -o TraceExporter
+ *
+ * Usage: TraceExporter <log> <output.json> */
+
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "EventDecoder.h"
+#include "EventTimeline.h"
+
+/******************** External API ********************/
+
+
+/******************** Module Typedefs ********************/
+
+/* Track number of a CR3, assigned in the order they are first seen. */
+typedef struct _CR3_TRACK
+{
+	UINT64 cr3;
+	UINT32 track;	/* Zero for an unused slot. */
+	UINT32 reserved;
+} CR3_TRACK, *PCR3_TRACK;
+
+typedef struct _CR3_TRACKS
+{
+	PCR3_TRACK slots;
+	size_t capacity;	/* A power of two. */
+	size_t count;
+} CR3_TRACKS, *PCR3_TRACKS;
+
+/* What was last written for a processor, to spot changes of CR3. */
+typedef struct _PROCESSOR_STATE
+{
+	int named;
+	int haveCR3;
+	UINT32 session;
+	UINT64 cr3;
+} PROCESSOR_STATE, *PPROCESSOR_STATE;
+
+/******************** Module Constants ********************/
+
+/* Process ids of the two groups of tracks. */
+#define TRACE_PID_PROCESSORS 1
+#define TRACE_PID_ADDRESS_SPACES 2
+
+#define TRACE_OUTPUT_BUFFER_SIZE (1024 * 1024)
+
+/******************** Module Variables ********************/
+
+static const UINT8* logData = NULL;
+static size_t logSize = 0;
+
+/* Events written so far, all but the first are preceded by a separator. */
+static UINT64 eventCount = 0;
+
+/******************** Module Prototypes ********************/
+static int mapFile(const char* fileName, void** mapping, size_t* size);
+static int readCalibrations(PEVENT_TIMELINE timeline);
+static int writeTrace(FILE* output, const EVENT_TIMELINE* timeline, UINT64 baseTime);
+static void writeEvent(FILE* output, const EVENT_DECODED* decoded, UINT64 time, UINT32 pid, UINT32 tid);
+static void writeName(FILE* output, const char* kind, UINT32 pid, UINT32 tid, const char* name);
+static void writeString(FILE* output, const CHAR* text, size_t length);
+static void writeTime(FILE* output, UINT64 time);
+static void beginEvent(FILE* output);
+static UINT32 findTrack(PCR3_TRACKS tracks, UINT64 cr3, int* added);
+
+/******************** Public Code ********************/
+
+int main(int argc, char** argv)
+{
+	int result = EXIT_FAILURE;
+
+	void* logMapping = NULL;
+	EVENT_TIMELINE timeline;
+	EventTimeline_init(&timeline);
+
+	if (3 != argc)
+	{
+		printf("Usage: %s <log> <output.json>\n", argv[0]);
+	}
+	else if (0 == mapFile(argv[1], &logMapping, &logSize))
+	{
+		printf("Unable to map %s.\n", argv[1]);
+	}
+	else
+	{
+		logData = (const UINT8*)logMapping;
+		posix_madvise(logMapping, logSize, POSIX_MADV_SEQUENTIAL);
+
+		FILE* output = fopen(argv[2], "wb");
+		if (NULL == output)
+		{
+			printf("Unable to create %s.\n", argv[2]);
+		}
+		else if (0 == readCalibrations(&timeline))
+		{
+			printf("Not enough memory for the calibrations of %s.\n", argv[1]);
+			fclose(output);
+		}
+		else
+		{
+			/* Times are written relative to the earliest calibration, as viewers hold them as
+			 * doubles in microseconds which can't keep nanoseconds since 1970. */
+			UINT64 baseTime = ~(UINT64)0;
+			for (size_t i = 0; i < timeline.count; i++)
+			{
+				UINT64 referenceTime = EventTimeline_referenceNanoseconds(&timeline.points[i]);
+				baseTime = (referenceTime < baseTime) ? referenceTime : baseTime;
+			}
+
+			baseTime = (0 == timeline.count) ? 0 : baseTime;
+
+			setvbuf(output, NULL, _IOFBF, TRACE_OUTPUT_BUFFER_SIZE);
+
+			int written = writeTrace(output, &timeline, baseTime);
+			written &= (0 == fclose(output));
+
+			if (0 != written)
+			{
+				result = EXIT_SUCCESS;
+			}
+			else
+			{
+				printf("Unable to write %s.\n", argv[2]);
+			}
+		}
+
+		munmap(logMapping, logSize);
+	}
+
+	EventTimeline_free(&timeline);
+	return result;
+}
+
+/******************** Module Code ********************/
+
+static int mapFile(const char* fileName, void** mapping, size_t* size)
+{
+	int result = 0;
+
+	int file = open(fileName, O_RDONLY);
+	if (file >= 0)
+	{
+		struct stat fileStat;
+		if ((0 == fstat(file, &fileStat)) && (fileStat.st_size > 0))
+		{
+			*size = (size_t)fileStat.st_size;
+			*mapping = mmap(NULL, *size, PROT_READ, MAP_SHARED, file, 0);
+			result = (MAP_FAILED != *mapping);
+		}
+
+		close(file);
+	}
+
+	return result;
+}
+
+static int readCalibrations(PEVENT_TIMELINE timeline)
+{
+	int result = 1;
+
+	EVENT_DECODER decoder;
+	EVENT_DECODED decoded;
+	EVENT_DECODE_RESULT decodeResult;
+
+	EventDecoder_open(&decoder, logData, logSize);
+
+	do
+	{
+		decodeResult = EventDecoder_next(&decoder, &decoded);
+
+		if (EVENT_DECODE_CALIBRATION == decodeResult)
+		{
+			result = EventTimeline_add(timeline, decoder.session, decoder.timeStampFrequency, &decoder.calibration);
+		}
+	} while ((0 != result) && ((EVENT_DECODE_OK == decodeResult) || (EVENT_DECODE_CALIBRATION == decodeResult) ||
+							   (EVENT_DECODE_STRING == decodeResult)));
+
+	EventTimeline_finish(timeline);
+	return result;
+}
+
+static int writeTrace(FILE* output, const EVENT_TIMELINE* timeline, UINT64 baseTime)
+{
+	int result = 1;
+
+	EVENT_DECODER decoder;
+	EVENT_DECODED decoded;
+	EVENT_DECODE_RESULT decodeResult;
+	size_t corruptOffset = 0;
+
+	PROCESSOR_STATE processors[EVENT_MAX_RINGS] = { 0 };
+	CR3_TRACKS tracks = { 0 };
+
+	fprintf(output, "{\"displayTimeUnit\":\"ns\",\"otherData\":{\"baseTime\":\"%llu\"},\"traceEvents\":[\n",
+			(unsigned long long)baseTime);
+
+	writeName(output, "process_name", TRACE_PID_PROCESSORS, 0, "Processors");
+	writeName(output, "process_name", TRACE_PID_ADDRESS_SPACES, 0, "Address spaces");
+
+	EventDecoder_open(&decoder, logData, logSize);
+
+	for (;;)
+	{
+		corruptOffset = decoder.offset;
+
+		/* Interned strings are resolved by the decoder, so their definitions can be passed over. */
+		decodeResult = EventDecoder_next(&decoder, &decoded);
+		if ((EVENT_DECODE_CALIBRATION == decodeResult) || (EVENT_DECODE_STRING == decodeResult))
+		{
+			continue;
+		}
+
+		if ((EVENT_DECODE_OK != decodeResult) || (decoded.procIndex >= EVENT_MAX_RINGS))
+		{
+			break;
+		}
+
+		UINT64 time = decoded.timeStamp;
+		EventTimeline_toNanoseconds(timeline, decoder.session, decoded.procIndex, decoded.timeStamp, &time);
+		time = (time > baseTime) ? (time - baseTime) : 0;
+
+		PPROCESSOR_STATE processor = &processors[decoded.procIndex];
+		if (0 == processor->named)
+		{
+			char name[32];
+			snprintf(name, sizeof(name), "CPU %u", decoded.procIndex);
+			writeName(output, "thread_name", TRACE_PID_PROCESSORS, decoded.procIndex, name);
+			processor->named = 1;
+		}
+
+		writeEvent(output, &decoded, time, TRACE_PID_PROCESSORS, decoded.procIndex);
+
+		if (0 != (decoded.fields & EVENT_FIELD_CR3))
+		{
+			int added = 0;
+			UINT32 track = findTrack(&tracks, decoded.cr3, &added);
+
+			if (0 == track)
+			{
+				result = 0;
+				break;
+			}
+
+			if (0 != added)
+			{
+				char name[32];
+				snprintf(name, sizeof(name), "CR3 %016llx", (unsigned long long)decoded.cr3);
+				writeName(output, "thread_name", TRACE_PID_ADDRESS_SPACES, track, name);
+			}
+
+			writeEvent(output, &decoded, time, TRACE_PID_ADDRESS_SPACES, track);
+
+			if ((0 != processor->haveCR3) && (processor->session == decoder.session) && (processor->cr3 != decoded.cr3))
+			{
+				beginEvent(output);
+				fprintf(output, "{\"name\":\"CR3 switch\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%u,\"tid\":%u,\"ts\":",
+						TRACE_PID_PROCESSORS, decoded.procIndex);
+				writeTime(output, time);
+				fprintf(output, ",\"args\":{\"from\":\"%016llx\",\"to\":\"%016llx\"}}\n", (unsigned long long)processor->cr3,
+						(unsigned long long)decoded.cr3);
+			}
+
+			processor->haveCR3 = 1;
+			processor->session = decoder.session;
+			processor->cr3 = decoded.cr3;
+		}
+	}
+
+	if (EVENT_DECODE_CORRUPT == decodeResult)
+	{
+		fprintf(stderr, "Log is corrupt from offset %llu, the rest of it is ignored.\n", (unsigned long long)corruptOffset);
+	}
+
+	fprintf(output, "]}\n");
+	free(tracks.slots);
+
+	return result && (0 == ferror(output));
+}
+
+static void writeEvent(FILE* output, const EVENT_DECODED* decoded, UINT64 time, UINT32 pid, UINT32 tid)
+{
+	beginEvent(output);
+	fputs("{\"name\":", output);
+
+	if ((NULL != decoded->string) && (0 != decoded->stringLength))
+	{
+		writeString(output, decoded->string, decoded->stringLength);
+	}
+	else if (0 != (decoded->fields & EVENT_FIELD_STRING_ID))
+	{
+		/* The definition was lost along with the rest of a corrupt session. */
+		fprintf(output, "\"string %u\"", decoded->stringId);
+	}
+	else
+	{
+		fputs("\"event\"", output);
+	}
+
+	fprintf(output, ",\"ph\":\"i\",\"s\":\"t\",\"pid\":%u,\"tid\":%u,\"ts\":", pid, tid);
+	writeTime(output, time);
+	fprintf(output, ",\"args\":{\"cpu\":%u,\"tsc\":\"%llu\"", decoded->procIndex, (unsigned long long)decoded->timeStamp);
+
+	if (0 != (decoded->fields & EVENT_FIELD_CR3))
+	{
+		fprintf(output, ",\"cr3\":\"%016llx\"", (unsigned long long)decoded->cr3);
+	}
+
+	if (0 != (decoded->fields & EVENT_FIELD_GPRS))
+	{
+		fprintf(output, ",\"rip\":\"%016llx\",\"rsp\":\"%016llx\",\"rax\":\"%016llx\"",
+				(unsigned long long)decoded->gprs.registers[EVENT_GPR_RIP],
+				(unsigned long long)decoded->gprs.registers[EVENT_GPR_RSP],
+				(unsigned long long)decoded->gprs.registers[EVENT_GPR_RAX]);
+	}
+
+	fputs("}}\n", output);
+}
+
+static void writeName(FILE* output, const char* kind, UINT32 pid, UINT32 tid, const char* name)
+{
+	beginEvent(output);
+	fprintf(output, "{\"name\":\"%s\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,\"args\":{\"name\":", kind, pid, tid);
+	writeString(output, name, strlen(name));
+	fputs("}}\n", output);
+}
+
+static void writeString(FILE* output, const CHAR* text, size_t length)
+{
+	/* Annotations are arbitrary bytes, anything that isn't printable ASCII is escaped so the
+	 * output is always valid JSON (and valid UTF-8). */
+	fputc('"', output);
+
+	for (size_t i = 0; i < length; i++)
+	{
+		UINT8 character = (UINT8)text[i];
+
+		if (('"' == character) || ('\\' == character))
+		{
+			fputc('\\', output);
+			fputc(character, output);
+		}
+		else if ((character < 0x20) || (character > 0x7E))
+		{
+			fprintf(output, "\\u%04x", character);
+		}
+		else
+		{
+			fputc(character, output);
+		}
+	}
+
+	fputc('"', output);
+}
+
+static void writeTime(FILE* output, UINT64 time)
+{
+	/* Microseconds, written from integers to keep every digit. */
+	fprintf(output, "%llu.%03llu", (unsigned long long)(time / 1000), (unsigned long long)(time % 1000));
+}
+
+static void beginEvent(FILE* output)
+{
+	if (0 != eventCount++)
+	{
+		fputc(',', output);
+	}
+}
+
+/* Track of the CR3, adding one if it hasn't been seen before. Returns zero when out of memory. */
+static UINT32 findTrack(PCR3_TRACKS tracks, UINT64 cr3, int* added)
+{
+	UINT32 result = 0;
+
+	/* Keep the table at most half full, growing it by rehashing every track into a new one. */
+	if ((tracks->count * 2) >= tracks->capacity)
+	{
+		size_t capacity = (0 == tracks->capacity) ? 256 : (tracks->capacity * 2);
+		PCR3_TRACK slots = (PCR3_TRACK)calloc(capacity, sizeof(CR3_TRACK));
+
+		for (size_t i = 0; (NULL != slots) && (i < tracks->capacity); i++)
+		{
+			if (0 != tracks->slots[i].track)
+			{
+				size_t slot = (size_t)((tracks->slots[i].cr3 * 0x9E3779B97F4A7C15ULL) >> 32) & (capacity - 1);
+				while (0 != slots[slot].track)
+				{
+					slot = (slot + 1) & (capacity - 1);
+				}
+
+				slots[slot] = tracks->slots[i];
+			}
+		}
+
+		if (NULL != slots)
+		{
+			free(tracks->slots);
+			tracks->slots = slots;
+			tracks->capacity = capacity;
+		}
+	}
+
+	if ((tracks->count * 2) < tracks->capacity)
+	{
+		size_t slot = (size_t)((cr3 * 0x9E3779B97F4A7C15ULL) >> 32) & (tracks->capacity - 1);
+		while ((0 != tracks->slots[slot].track) && (cr3 != tracks->slots[slot].cr3))
+		{
+			slot = (slot + 1) & (tracks->capacity - 1);
+		}
+
+		*added = (0 == tracks->slots[slot].track);
+		if (0 != *added)
+		{
+			tracks->slots[slot].cr3 = cr3;
+			tracks->slots[slot].track = (UINT32)++tracks->count;
+		}
+
+		result = tracks->slots[slot].track;
+	}
+
+	return result;
+}
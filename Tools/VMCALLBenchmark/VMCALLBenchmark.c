@@ -0,0 +1,187 @@
+/* Measures the round-trip latency of the memory based and register only VMCALL paths.
+ *
+ * Every measurement is a single VMCALL bracketed by RDTSCP, the thread is pinned to one
+ * logical processor so that the TSC readings are comparable. The minimum, median, mean
+ * and 99th percentile are reported in TSC cycles.
+ *
+ * Build as an x64 console application with Shared/ on the include path,
+ * and Shared/VMCALL_Stub.asm assembled alongside it.
+ *
+ * Usage: VMCALLBenchmark [iterations] */
+
+#include <windows.h>
+#include <winternl.h>
+#include <intrin.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "VMCALL_Common.h"
+
+/******************** External API ********************/
+
+
+/******************** Module Typedefs ********************/
+
+typedef NTSTATUS(*fnBenchmarkCall)(void);
+
+typedef struct _BENCHMARK
+{
+	const char* name;
+	fnBenchmarkCall call;
+} BENCHMARK, *PBENCHMARK;
+
+/******************** Module Constants ********************/
+
+#define DEFAULT_ITERATIONS 100000
+#define WARMUP_ITERATIONS 1000
+
+/******************** Module Variables ********************/
+
+static VMCALL_COMMAND presenceCommand = { VMCALL_ACTION_CHECK_PRESENCE, NULL, 0 };
+
+static VM_PARAM_PROFILER_CONTROL stopParams = { PROFILER_OPERATION_STOP, PROFILER_ALL_PROCESSORS };
+static VMCALL_COMMAND stopCommand = { VMCALL_ACTION_PROFILER_CONTROL, &stopParams, sizeof(stopParams) };
+
+/******************** Module Prototypes ********************/
+static NTSTATUS memoryPresence(void);
+static NTSTATUS memoryProfilerStop(void);
+static NTSTATUS fastPresence(void);
+static NTSTATUS fastReadCounter(void);
+static NTSTATUS fastProfilerStop(void);
+static void runBenchmark(PBENCHMARK benchmark, PUINT64 timings, SIZE_T iterations);
+static int compareTimings(const void* a, const void* b);
+
+/******************** Public Code ********************/
+
+int main(int argc, char** argv)
+{
+	static BENCHMARK BENCHMARKS[] =
+	{
+		{ "memory  CHECK_PRESENCE", memoryPresence },
+		{ "memory  PROFILER_CONTROL (stop)", memoryProfilerStop },
+		{ "fast    CHECK_PRESENCE", fastPresence },
+		{ "fast    READ_COUNTER", fastReadCounter },
+		{ "fast    PROFILER_STOP", fastProfilerStop },
+	};
+
+	SIZE_T iterations = (argc > 1) ? strtoull(argv[1], NULL, 0) : DEFAULT_ITERATIONS;
+
+	PUINT64 timings = (0 != iterations) ? malloc(iterations * sizeof(UINT64)) : NULL;
+	if (NULL == timings)
+	{
+		printf("Invalid iteration count.\n");
+		return EXIT_FAILURE;
+	}
+
+	/* Keep to one processor, and make sure the parameter blocks are resident, as the
+	 * hypervisor walks the guest page tables and can't resolve a page fault. */
+	SetThreadAffinityMask(GetCurrentThread(), 1);
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+	VirtualLock(&presenceCommand, sizeof(presenceCommand));
+	VirtualLock(&stopCommand, sizeof(stopCommand));
+	VirtualLock(&stopParams, sizeof(stopParams));
+
+	if (0 > fastPresence())
+	{
+		printf("Hypervisor is not present.\n");
+		free(timings);
+		return EXIT_FAILURE;
+	}
+
+	printf("%-34s %10s %10s %10s %10s\n", "Path", "Min", "Median", "Mean", "P99");
+
+	for (SIZE_T i = 0; i < ARRAYSIZE(BENCHMARKS); i++)
+	{
+		runBenchmark(&BENCHMARKS[i], timings, iterations);
+	}
+
+	free(timings);
+	return EXIT_SUCCESS;
+}
+
+/******************** Module Code ********************/
+
+static NTSTATUS memoryPresence(void)
+{
+	return VMCALL_actionHost(VMCALL_KEY, &presenceCommand);
+}
+
+static NTSTATUS memoryProfilerStop(void)
+{
+	return VMCALL_actionHost(VMCALL_KEY, &stopCommand);
+}
+
+static NTSTATUS fastPresence(void)
+{
+	VMCALL_FAST_REGISTERS registers = { 0 };
+	NTSTATUS status = VMCALL_fastActionHost(VMCALL_FAST_KEY, VMCALL_FAST_ACTION_CHECK_PRESENCE, &registers);
+
+	if ((0 <= status) && (VMCALL_FAST_SIGNATURE != registers.values[0]))
+	{
+		status = (NTSTATUS)0xC0000001L;
+	}
+
+	return status;
+}
+
+static NTSTATUS fastReadCounter(void)
+{
+	VMCALL_FAST_REGISTERS registers = { 0 };
+	registers.values[0] = VMCALL_COUNTER_EXIT_COUNT;
+
+	return VMCALL_fastActionHost(VMCALL_FAST_KEY, VMCALL_FAST_ACTION_READ_COUNTER, &registers);
+}
+
+static NTSTATUS fastProfilerStop(void)
+{
+	VMCALL_FAST_REGISTERS registers = { 0 };
+	registers.values[0] = PROFILER_ALL_PROCESSORS;
+
+	return VMCALL_fastActionHost(VMCALL_FAST_KEY, VMCALL_FAST_ACTION_PROFILER_STOP, &registers);
+}
+
+static void runBenchmark(PBENCHMARK benchmark, PUINT64 timings, SIZE_T iterations)
+{
+	UINT32 aux;
+	NTSTATUS status = 0;
+
+	for (SIZE_T i = 0; (i < WARMUP_ITERATIONS) && (0 <= status); i++)
+	{
+		status = benchmark->call();
+	}
+
+	for (SIZE_T i = 0; (i < iterations) && (0 <= status); i++)
+	{
+		UINT64 start = __rdtscp(&aux);
+		status = benchmark->call();
+		timings[i] = __rdtscp(&aux) - start;
+	}
+
+	if (0 > status)
+	{
+		printf("%-34s failed with 0x%08X\n", benchmark->name, status);
+		return;
+	}
+
+	qsort(timings, iterations, sizeof(UINT64), compareTimings);
+
+	UINT64 total = 0;
+	for (SIZE_T i = 0; i < iterations; i++)
+	{
+		total += timings[i];
+	}
+
+	printf("%-34s %10llu %10llu %10llu %10llu\n",
+		   benchmark->name,
+		   timings[0],
+		   timings[iterations / 2],
+		   total / iterations,
+		   timings[(iterations * 99) / 100]);
+}
+
+static int compareTimings(const void* a, const void* b)
+{
+	UINT64 timingA = *(const UINT64*)a;
+	UINT64 timingB = *(const UINT64*)b;
+
+	return (timingA > timingB) - (timingA < timingB);
+}